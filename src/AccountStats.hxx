@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "TopKSketch.hxx"
+#include "event/Chrono.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+struct AccountCounters {
+	uint_least64_t n_queries = 0;
+	uint_least64_t n_query_errors = 0;
+
+	/**
+	 * The number of bytes received from servers.
+	 */
+	uint_least64_t n_bytes = 0;
+
+	Event::Duration query_wait{};
+
+	void Add(const AccountCounters &src) noexcept {
+		n_queries += src.n_queries;
+		n_query_errors += src.n_query_errors;
+		n_bytes += src.n_bytes;
+		query_wait += src.query_wait;
+	}
+};
+
+/**
+ * Traffic counters for the accounts (see `client.account`) with
+ * the most queries.  The weight of an item is its (estimated)
+ * number of queries.
+ */
+class AccountStats : public TopKSketch<AccountCounters> {
+public:
+	static constexpr std::size_t CAPACITY = 1024;
+
+	/**
+	 * The number of accounts reported by the Prometheus exporter
+	 * and the `STATS` control command.
+	 */
+	static constexpr std::size_t REPORT_SIZE = 32;
+
+	AccountStats() noexcept
+		:TopKSketch(CAPACITY) {}
+
+	void Update(std::string_view account,
+		    const AccountCounters &counters) noexcept {
+		TopKSketch::Update(account, counters, counters.n_queries);
+	}
+};
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "BackendPool.hxx"
+#include "Stats.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "event/SocketEvent.hxx"
+
+#include <cassert>
+
+/**
+ * Idle connections are closed after this duration.  This should be
+ * well below the server's "wait_timeout".
+ */
+static constexpr Event::Duration idle_timeout = std::chrono::minutes{1};
+
+struct BackendPool::Item final
+	: IntrusiveListHook<IntrusiveHookMode::NORMAL>
+{
+	BackendPool &pool;
+
+	const BucketMap::iterator bucket;
+
+	NodeStats &stats;
+
+	SocketEvent event;
+
+	CoarseTimerEvent idle_timer;
+
+	std::string server_version;
+
+	const uint_least32_t capabilities;
+
+	const bool clean;
+
+	StatementCache statements;
+
+	Item(BackendPool &_pool, BucketMap::iterator _bucket,
+	     NodeStats &_stats, Lease &&lease) noexcept
+		:pool(_pool), bucket(_bucket), stats(_stats),
+		 event(pool.event_loop, BIND_THIS_METHOD(OnSocketReady),
+		       lease.fd.Release()),
+		 idle_timer(pool.event_loop, BIND_THIS_METHOD(OnIdleTimeout)),
+		 server_version(std::move(lease.server_version)),
+		 capabilities(lease.capabilities),
+		 clean(lease.clean),
+		 statements(std::move(lease.statements))
+	{
+		++stats.n_pool_idle;
+
+		event.ScheduleRead();
+		idle_timer.Schedule(idle_timeout);
+	}
+
+	~Item() noexcept {
+		assert(stats.n_pool_idle > 0);
+		--stats.n_pool_idle;
+
+		if (event.IsDefined())
+			event.Close();
+	}
+
+	Item(const Item &) = delete;
+	Item &operator=(const Item &) = delete;
+
+	Lease Release() noexcept {
+		return {
+			.fd = UniqueSocketDescriptor{AdoptTag{}, event.ReleaseSocket()},
+			.server_version = std::move(server_version),
+			.capabilities = capabilities,
+			.clean = clean,
+			.statements = std::move(statements),
+		};
+	}
+
+private:
+	void OnSocketReady(unsigned) noexcept {
+		/* the server is not supposed to send anything on an
+		   idle connection; this is either EOF (because the
+		   server has closed it, e.g. due to "wait_timeout")
+		   or an asynchronous error packet - either way, this
+		   connection is unusable */
+		pool.Remove(bucket, *this);
+	}
+
+	void OnIdleTimeout() noexcept {
+		pool.Remove(bucket, *this);
+	}
+};
+
+static void
+AppendKeyString(std::string &dest, std::string_view src) noexcept
+{
+	/* length-prefixed to avoid ambiguities */
+	const std::size_t size = src.size();
+	dest.append(reinterpret_cast<const char *>(&size), sizeof(size));
+	dest.append(src);
+}
+
+[[gnu::pure]]
+static std::string
+ToString(const BackendPool::Key &key) noexcept
+{
+	const auto address = key.address.GetSteadyPart();
+
+	std::string result;
+	AppendKeyString(result, {reinterpret_cast<const char *>(address.data()), address.size()});
+	AppendKeyString(result, key.user);
+	AppendKeyString(result, key.password);
+	AppendKeyString(result, key.password_sha1);
+	AppendKeyString(result, key.database);
+	result.append(reinterpret_cast<const char *>(&key.capabilities),
+		      sizeof(key.capabilities));
+	return result;
+}
+
+BackendPool::BackendPool(EventLoop &_event_loop) noexcept
+	:event_loop(_event_loop) {}
+
+BackendPool::~BackendPool() noexcept
+{
+	Clear();
+}
+
+void
+BackendPool::Clear() noexcept
+{
+	for (auto &[key, bucket] : buckets)
+		bucket.items.clear_and_dispose([](Item *item){
+			delete item;
+		});
+
+	buckets.clear();
+}
+
+inline void
+BackendPool::Remove(BucketMap::iterator bucket, Item &item) noexcept
+{
+	assert(bucket->second.n_items > 0);
+
+	bucket->second.items.erase(bucket->second.items.iterator_to(item));
+	--bucket->second.n_items;
+	delete &item;
+
+	if (bucket->second.n_items == 0)
+		buckets.erase(bucket);
+}
+
+std::optional<BackendPool::Lease>
+BackendPool::Get(const Key &key, NodeStats &stats) noexcept
+{
+	const auto bucket = buckets.find(ToString(key));
+	if (bucket == buckets.end()) {
+		++stats.n_pool_misses;
+		return std::nullopt;
+	}
+
+	assert(!bucket->second.items.empty());
+
+	auto &item = bucket->second.items.front();
+	auto lease = item.Release();
+	Remove(bucket, item);
+
+	++stats.n_pool_hits;
+	return lease;
+}
+
+void
+BackendPool::Put(const Key &key, NodeStats &stats, Lease &&lease) noexcept
+{
+	assert(lease.fd.IsDefined());
+
+	const auto bucket = buckets.try_emplace(ToString(key)).first;
+
+	if (bucket->second.n_items >= MAX_IDLE_PER_KEY)
+		/* discard the least recently used connection */
+		Remove(bucket, bucket->second.items.back());
+
+	auto *item = new Item(*this, bucket, stats, std::move(lease));
+	bucket->second.items.push_front(*item);
+	++bucket->second.n_items;
+}
+
+std::size_t
+BackendPool::Count(const Key &key) const noexcept
+{
+	const auto bucket = buckets.find(ToString(key));
+	return bucket != buckets.end() ? bucket->second.n_items : 0;
+}
@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "StatementCache.hxx"
+#include "net/SocketAddress.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+
+struct NodeStats;
+class EventLoop;
+
+/**
+ * A pool of idle connections to MySQL servers which have already
+ * completed the handshake and authentication.  Connections are
+ * identified by a key containing everything that was sent to the
+ * server in the HandshakeResponse, therefore a connection can only
+ * be reused by a client that would have logged in exactly the same
+ * way.
+ *
+ * The session state is not cleaned up when a connection is put into
+ * the pool; this is the job of the new owner (by sending
+ * `COM_RESET_CONNECTION`) unless Lease::clean is set.
+ */
+class BackendPool {
+	EventLoop &event_loop;
+
+	struct Item;
+
+	struct Bucket {
+		/**
+		 * The front of this list is the most recently used
+		 * connection.
+		 */
+		IntrusiveList<Item> items;
+
+		std::size_t n_items = 0;
+	};
+
+	using BucketMap = std::map<std::string, Bucket, std::less<>>;
+
+	/**
+	 * All idle connections, grouped by their key.
+	 */
+	BucketMap buckets;
+
+public:
+	/**
+	 * How many idle connections may be kept per key?
+	 */
+	static constexpr std::size_t MAX_IDLE_PER_KEY = 16;
+
+	struct Key {
+		SocketAddress address;
+
+		std::string_view user, password, password_sha1, database;
+
+		/**
+		 * The capabilities announced to the server in the
+		 * HandshakeResponse.
+		 */
+		uint_least32_t capabilities;
+	};
+
+	/**
+	 * Information about a server connection which needs to be
+	 * preserved while it is idle.
+	 */
+	struct Lease {
+		UniqueSocketDescriptor fd;
+
+		std::string server_version;
+
+		/**
+		 * The negotiated capabilities.
+		 */
+		uint_least32_t capabilities;
+
+		/**
+		 * Is the session state known to be clean, i.e. can
+		 * this connection be used without
+		 * `COM_RESET_CONNECTION`?
+		 */
+		bool clean = false;
+
+		/**
+		 * Idle prepared statements which can be reused
+		 * (#ConnectOptions::statement_cache).  Only
+		 * preserved if #clean is set, because
+		 * `COM_RESET_CONNECTION` deallocates all statements.
+		 */
+		StatementCache statements;
+	};
+
+	explicit BackendPool(EventLoop &_event_loop) noexcept;
+	~BackendPool() noexcept;
+
+	BackendPool(const BackendPool &) = delete;
+	BackendPool &operator=(const BackendPool &) = delete;
+
+	/**
+	 * Close all idle connections.
+	 */
+	void Clear() noexcept;
+
+	/**
+	 * Look up an idle connection for the given key and remove it
+	 * from the pool.  Updates the hit/miss counters in #stats.
+	 */
+	std::optional<Lease> Get(const Key &key, NodeStats &stats) noexcept;
+
+	/**
+	 * Add an idle connection to the pool.
+	 */
+	void Put(const Key &key, NodeStats &stats, Lease &&lease) noexcept;
+
+	/**
+	 * Count the idle connections for the given key.
+	 */
+	[[gnu::pure]]
+	std::size_t Count(const Key &key) const noexcept;
+
+private:
+	void Remove(BucketMap::iterator bucket, Item &item) noexcept;
+};
@@ -285,7 +285,7 @@ MysqlCheck::OnTextResultsetEnd()
 {
 	assert(options.no_read_only);
 
-	if (!peer->Send(Mysql::MakeQuit(1)))
+	if (!peer->Send(Mysql::MakeQuit(1)) || !peer->Uncork())
 		return;
 
 	peer->GetSocket().Shutdown();
@@ -302,8 +302,13 @@ MysqlCheck::OnTextResultsetEnd()
 MysqlHandler::Result
 MysqlCheck::OnMysqlPacket(unsigned number,
 			  std::span<const std::byte> payload,
-			  [[maybe_unused]] bool complete) noexcept
+			  bool complete) noexcept
 try {
+	if (!complete)
+		/* none of the packets we expect can be this
+		   large */
+		throw SocketProtocolError{"Packet from server too large"};
+
 	if (!peer->handshake) {
 		peer->handshake = true;
 
@@ -4,19 +4,37 @@
 
 #include "Cluster.hxx"
 #include "Check.hxx"
+#include "ClusterMonitor.hxx"
+#include "WarmConnect.hxx"
 #include "NodeObserver.hxx"
+#include "NodeQueue.hxx"
 #include "Stats.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "lib/fmt/SocketAddressFormatter.hxx"
 #include "lib/sodium/GenericHash.hxx"
 #include "lua/Class.hxx"
 #include "event/CoarseTimerEvent.hxx"
 #include "net/AllocatedSocketAddress.hxx"
+#include "time/Cast.hxx"
 #include "util/djb_hash.hxx"
 #include "util/SpanCast.hxx"
 #include "util/Cancellable.hxx"
 
-#include <algorithm> // for std::sort()
+#include <algorithm> // for std::find_if()
 #include <cstdint>
 
+/**
+ * Stop keeping idle connections for a #Cluster::WarmTarget if no
+ * client has logged in with its key for this duration.
+ */
+static constexpr Event::Duration warm_target_expiry = std::chrono::minutes{5};
+
+/**
+ * How often shall Cluster::RefillWarm() be invoked even if nothing
+ * has happened?  This is also the delay after a failed attempt.
+ */
+static constexpr Event::Duration warm_interval = std::chrono::seconds{10};
+
 constexpr const char *
 Cluster::ToString(NodeState state) noexcept
 {
@@ -40,27 +58,66 @@ Cluster::ToString(NodeState state) noexcept
 	return nullptr;
 }
 
+/**
+ * Calculate a 64 bit hash with libsodium's "generichash" (BLAKE2b).
+ * This is only done once per node and once per Pick() call; its
+ * result is then combined by RendezvousHash().
+ */
+template<typename T>
 [[gnu::pure]]
-static std::size_t
-RendezvousHash(SocketAddress address, std::string_view account) noexcept
+static uint_least64_t
+GenericHash64(const T &src) noexcept
 {
-	/* use libsodium's "generichash" (BLAKE2b) which is good
-	   enough for rendezvous hashing */
 	union {
 		std::array<std::byte, crypto_generichash_BYTES_MIN> hash;
-		std::size_t result;
+		uint_least64_t result;
 	} u;
 
 	static_assert(sizeof(u.hash) >= sizeof(u.result));
 
 	GenericHashState state{sizeof(u.hash)};
-	state.Update(address.GetSteadyPart());
-	state.Update(account);
+	state.Update(src);
 	state.Final(u.hash);
 
 	return u.result;
 }
 
+/**
+ * Combine the hashes of a node address and of an account for
+ * Rendezvous Hashing.  This is the finalizer of MurmurHash3 which
+ * mixes all bits well enough and is much cheaper than hashing the
+ * account again for each node.
+ */
+static constexpr uint_least64_t
+RendezvousHash(uint_least64_t address_hash, uint_least64_t account_hash) noexcept
+{
+	uint_least64_t h = address_hash ^ account_hash;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
+	return h;
+}
+
+/**
+ * Estimate the load of a node for
+ * ClusterOptions::Strategy::LEAST_LOADED: the expected wait time of
+ * a new command if each pending one takes about as long as the
+ * recent ones.
+ */
+[[gnu::pure]]
+static double
+GetLoad(const NodeStats &stats, Event::TimePoint now) noexcept
+{
+	/* a small constant so the number of pending commands
+	   matters even if there are no recent latency samples */
+	constexpr double min_latency = 1e-4;
+
+	return (ToFloatSeconds(stats.query_latency.Get(now)) + min_latency) *
+		static_cast<double>(stats.n_pending_commands + 1);
+}
+
 struct Cluster::Node final : CheckServerHandler {
 	Cluster &cluster;
 
@@ -74,22 +131,32 @@ struct Cluster::Node final : CheckServerHandler {
 
 	CancellablePointer check_cancel;
 
+	NodeQueue queue;
+
 	IntrusiveList<ClusterNodeObserver,
 		      IntrusiveListBaseHookTraits<ClusterNodeObserver, Cluster>> observers;
 
 	using State = Cluster::NodeState;
 	State state = State::UNKNOWN;
 
+	/**
+	 * @param check run health checks (if
+	 * ClusterOptions::monitoring is enabled)?  If not, they are
+	 * run by another thread which delivers the results with
+	 * SetState().
+	 */
 	Node(Cluster &_cluster, EventLoop &event_loop,
 	     AllocatedSocketAddress &&_address,
 	     NodeStats &_stats,
-	     const ClusterOptions &options) noexcept
+	     const ClusterOptions &options, bool check) noexcept
 		:cluster(_cluster), address(std::move(_address)),
 		 stats(_stats),
 		 check_options(options.check),
-		 check_timer(event_loop, BIND_THIS_METHOD(OnCheckTimer))
+		 check_timer(event_loop, BIND_THIS_METHOD(OnCheckTimer)),
+		 queue(event_loop, stats, options.max_queries,
+		       options.queue_timeout)
 	{
-		if (options.monitoring)
+		if (options.monitoring && check)
 			check_timer.Schedule(Event::Duration{});
 	}
 
@@ -110,17 +177,8 @@ struct Cluster::Node final : CheckServerHandler {
 		});
 	}
 
-private:
-	void OnCheckTimer() noexcept {
-		CheckServer(GetEventLoop(), address, check_options,
-			    *this, check_cancel);
-	}
-
-	// virtual methods from CheckServerHandler
-	void OnCheckServer(CheckServerResult result) noexcept override {
-		assert(check_cancel);
-		check_cancel = nullptr;
-
+	void SetState(CheckServerResult result) noexcept {
+		const auto old_state = state;
 		bool ready = false;
 
 		if (state == State::UNKNOWN) {
@@ -159,7 +217,9 @@ private:
 			break;
 		}
 
-		check_timer.Schedule(std::chrono::seconds{20});
+		if (state != old_state)
+			/* the cached picks may be wrong now */
+			cluster.ClearPickCache();
 
 		if (ready)
 			cluster.InvokeReady();
@@ -180,28 +240,187 @@ private:
 			   reconnect to this one */
 			cluster.InvokeUnavailableWorse(state);
 	}
+
+private:
+	void OnCheckTimer() noexcept {
+		CheckServer(GetEventLoop(), address, check_options,
+			    *this, check_cancel);
+	}
+
+	// virtual methods from CheckServerHandler
+	void OnCheckServer(CheckServerResult result) noexcept override {
+		assert(check_cancel);
+		check_cancel = nullptr;
+
+		check_timer.Schedule(std::chrono::seconds{20});
+
+		SetState(result);
+
+		if (cluster.monitor != nullptr)
+			cluster.monitor->OnClusterNodeChecked(cluster, address,
+							      result);
+	}
+};
+
+struct Cluster::CachedPick final
+	: IntrusiveListHook<IntrusiveHookMode::NORMAL>
+{
+	/**
+	 * Points to the key of this item in #pick_cache.
+	 */
+	std::string_view account;
+
+	const TopNodes top;
+
+	explicit CachedPick(const TopNodes &_top) noexcept
+		:top(_top) {}
+
+	CachedPick(const CachedPick &) = delete;
+	CachedPick &operator=(const CachedPick &) = delete;
+};
+
+struct Cluster::WarmTarget final
+	: IntrusiveListHook<IntrusiveHookMode::NORMAL>, WarmConnectHandler
+{
+	Cluster &cluster;
+
+	Node &node;
+
+	const std::string user, password, password_sha1, database;
+
+	const uint_least32_t capabilities;
+
+	/**
+	 * When did a client log in with this key for the last time?
+	 */
+	Event::TimePoint last_used;
+
+	/**
+	 * Don't try to connect again before this time (after an
+	 * error).
+	 */
+	Event::TimePoint retry_after{};
+
+	CancellablePointer cancel_ptr;
+
+	WarmTarget(Cluster &_cluster, Node &_node,
+		   const BackendPool::Key &key, Event::TimePoint now) noexcept
+		:cluster(_cluster), node(_node),
+		 user(key.user), password(key.password),
+		 password_sha1(key.password_sha1), database(key.database),
+		 capabilities(key.capabilities),
+		 last_used(now) {}
+
+	~WarmTarget() noexcept {
+		if (cancel_ptr)
+			cancel_ptr.Cancel();
+	}
+
+	WarmTarget(const WarmTarget &) = delete;
+	WarmTarget &operator=(const WarmTarget &) = delete;
+
+	BackendPool::Key GetKey() const noexcept {
+		return {
+			.address = node.address,
+			.user = user,
+			.password = password,
+			.password_sha1 = password_sha1,
+			.database = database,
+			.capabilities = capabilities,
+		};
+	}
+
+	[[gnu::pure]]
+	bool Match(const Node &_node, const BackendPool::Key &key) const noexcept {
+		return &node == &_node &&
+			key.user == user &&
+			key.password == password &&
+			key.password_sha1 == password_sha1 &&
+			key.database == database &&
+			key.capabilities == capabilities;
+	}
+
+	bool IsPending() const noexcept {
+		return static_cast<bool>(cancel_ptr);
+	}
+
+	/**
+	 * Is it possible to connect to the node now?
+	 */
+	bool CanConnect(Event::TimePoint now) const noexcept {
+		return node.state >= NodeState::UNKNOWN && now >= retry_after;
+	}
+
+	void Start() noexcept {
+		assert(!cancel_ptr);
+
+		WarmConnect(node.GetEventLoop(), GetKey(), *this, cancel_ptr);
+	}
+
+private:
+	// virtual methods from WarmConnectHandler
+	void OnWarmConnect(BackendPool::Lease &&lease) noexcept override {
+		assert(cancel_ptr);
+		cancel_ptr = nullptr;
+
+		cluster.backend_pool.Put(GetKey(), node.stats, std::move(lease));
+
+		/* continue with the next one */
+		cluster.warm_defer.Schedule();
+	}
+
+	void OnWarmConnectError(std::exception_ptr e) noexcept override {
+		assert(cancel_ptr);
+		cancel_ptr = nullptr;
+
+		fmt::print(stderr, "[warm/{}] {}\n", node.address, e);
+
+		/* try again with a later warm_timer tick */
+		retry_after = node.GetEventLoop().SteadyNow() + warm_interval;
+	}
 };
 
 Cluster::Cluster(EventLoop &event_loop, Stats &stats,
+		 BackendPool &_backend_pool,
 		 std::forward_list<AllocatedSocketAddress> &&_nodes,
-		 ClusterOptions &&_options) noexcept
-	:options(std::move(_options))
+		 ClusterOptions &&_options,
+		 ClusterMonitor *_monitor) noexcept
+	:options(std::move(_options)),
+	 backend_pool(_backend_pool),
+	 monitor(_monitor),
+	 warm_defer(event_loop, BIND_THIS_METHOD(RefillWarm)),
+	 warm_timer(event_loop, BIND_THIS_METHOD(RefillWarm))
 {
+	const bool check = monitor == nullptr ||
+		monitor->OnClusterCreated(*this);
+
 	for (auto &&i : _nodes) {
 		auto &node_stats = stats.GetNode(i);
 		node_list.emplace_front(*this, event_loop,
 					std::move(i), node_stats,
-					options);
+					options, check);
 	}
 
 	for (auto &i : node_list)
-		rendezvous_nodes.emplace_back(i);
+		rendezvous_nodes.push_back({
+			.node = &i,
+			.address_hash = GenericHash64(i.address.GetSteadyPart()),
+		});
 
 	n_unknown = rendezvous_nodes.size();
 }
 
 Cluster::~Cluster() noexcept
 {
+	if (monitor != nullptr)
+		monitor->OnClusterDestroyed(*this);
+
+	ClearPickCache();
+
+	warm_targets.clear_and_dispose([](WarmTarget *target){
+		delete target;
+	});
+
 	// at this point, all tasks must have been canceled
 	assert(ready_tasks.empty());
 }
@@ -209,7 +428,7 @@ Cluster::~Cluster() noexcept
 template<bool read_only>
 [[gnu::always_inline]]
 constexpr bool
-Cluster::CompareNodes<read_only>::operator()(const RendezvousNode &a, const RendezvousNode &b) noexcept
+Cluster::CompareNodes<read_only>::operator()(const Candidate &a, const Candidate &b) const noexcept
 {
 	/* prefer nodes that are alive */
 	if (a.node->state != b.node->state) {
@@ -227,32 +446,254 @@ Cluster::CompareNodes<read_only>::operator()(const RendezvousNode &a, const Rend
 	return a.hash < b.hash;
 }
 
-std::pair<SocketAddress, NodeStats &>
+template<bool read_only>
+inline Cluster::TopNodes
+Cluster::FindTopNodes(uint_least64_t account_hash) const noexcept
+{
+	constexpr CompareNodes<read_only> compare{};
+
+	TopNodes top;
+
+	for (const auto &i : rendezvous_nodes) {
+		const Candidate c{
+			.node = i.node,
+			.hash = RendezvousHash(i.address_hash, account_hash),
+		};
+
+		if (top.first.node == nullptr || compare(c, top.first)) {
+			top.second = top.first;
+			top.first = c;
+		} else if (top.second.node == nullptr || compare(c, top.second))
+			top.second = c;
+	}
+
+	return top;
+}
+
+inline void
+Cluster::RemoveCachedPick(CachedPick &item) noexcept
+{
+	pick_cache_lru.erase(pick_cache_lru.iterator_to(item));
+
+	const auto i = pick_cache.find(item.account);
+	assert(i != pick_cache.end());
+	pick_cache.erase(i);
+}
+
+void
+Cluster::ClearPickCache() noexcept
+{
+	pick_cache_lru.clear();
+	pick_cache.clear();
+}
+
+inline Cluster::TopNodes
+Cluster::FindTopNodesCached(std::string_view account,
+			    uint_least64_t account_hash) noexcept
+{
+	if (const auto i = pick_cache.find(account); i != pick_cache.end()) {
+		auto &item = i->second;
+
+		/* move to the front of the LRU list */
+		pick_cache_lru.erase(pick_cache_lru.iterator_to(item));
+		pick_cache_lru.push_front(item);
+
+		return item.top;
+	}
+
+	const auto top = FindTopNodes<false>(account_hash);
+
+	if (pick_cache.size() >= options.pick_cache)
+		RemoveCachedPick(pick_cache_lru.back());
+
+	const auto [i, inserted] = pick_cache.try_emplace(std::string{account}, top);
+	assert(inserted);
+
+	auto &item = i->second;
+	item.account = i->first;
+	pick_cache_lru.push_front(item);
+
+	return top;
+}
+
+Cluster::PickResult
 Cluster::Pick(std::string_view account,
 	      const ConnectOptions &connect_options,
 	      ClusterNodeObserver *observer) noexcept
 {
-	for (auto &i : rendezvous_nodes)
-		i.hash = RendezvousHash(i.node->address, account);
+	assert(!rendezvous_nodes.empty());
+
+	const auto account_hash = GenericHash64(account);
 
-	/* sort the list for Rendezvous Hashing */
+	TopNodes top;
 	if (connect_options.read_only) [[unlikely]]
-		std::sort(rendezvous_nodes.begin(), rendezvous_nodes.end(),
-			  CompareNodes<true>{});
+		top = FindTopNodes<true>(account_hash);
+	else if (options.pick_cache > 0)
+		top = FindTopNodesCached(account, account_hash);
 	else
-		std::sort(rendezvous_nodes.begin(), rendezvous_nodes.end(),
-			  CompareNodes<false>{});
-
-	auto &node = *rendezvous_nodes.front().node;
+		top = FindTopNodes<false>(account_hash);
+
+	auto *node = top.first.node;
+
+	if (options.strategy == ClusterOptions::Strategy::LEAST_LOADED &&
+	    top.second.node != nullptr) {
+		/* "power of two choices": the second best node gets
+		   the client if it has less load */
+		auto *second = top.second.node;
+		const auto now = warm_timer.GetEventLoop().SteadyNow();
+		if (second->state == node->state &&
+		    GetLoad(second->stats, now) < GetLoad(node->stats, now))
+			node = second;
+	} else if (options.strategy == ClusterOptions::Strategy::BOUNDED_LOAD)
+		node = &PickBoundedLoad(node->state, account_hash);
 
 	if (observer != nullptr && options.disconnect_unavailable) {
 		/* register the observer only if option
 		   "disconnect_unavailable" is enabled */
 		assert(!observer->is_linked());
-		node.observers.push_front(*observer);
+		node->observers.push_front(*observer);
+	}
+
+	return {
+		.address = node->address,
+		.stats = node->stats,
+		.queue = node->queue.IsEnabled() ? &node->queue : nullptr,
+	};
+}
+
+Cluster::Node &
+Cluster::PickBoundedLoad(NodeState state,
+			 uint_least64_t account_hash) const noexcept
+{
+	std::size_t n_nodes = 0, n_clients = 0;
+	for (const auto &i : rendezvous_nodes) {
+		if (i.node->state == state) {
+			++n_nodes;
+			n_clients += i.node->stats.n_clients;
+		}
+	}
+
+	assert(n_nodes > 0);
+
+	/* the average number of clients including the new one,
+	   plus the configured margin, rounded up; at least one
+	   node is always below this bound */
+	const std::size_t bound =
+		((n_clients + 1) * (100 + options.load_bound) + n_nodes * 100 - 1) /
+		(n_nodes * 100);
+
+	/* the first of these nodes in Rendezvous order (see
+	   CompareNodes) which is below the bound */
+	Candidate best;
+	for (const auto &i : rendezvous_nodes) {
+		if (i.node->state != state || i.node->stats.n_clients >= bound)
+			continue;
+
+		const Candidate c{
+			.node = i.node,
+			.hash = RendezvousHash(i.address_hash, account_hash),
+		};
+
+		if (best.node == nullptr || c.hash < best.hash)
+			best = c;
+	}
+
+	assert(best.node != nullptr);
+	return *best.node;
+}
+
+void
+Cluster::Warm(const BackendPool::Key &key, NodeStats &stats) noexcept
+{
+	if (options.warm == 0)
+		return;
+
+	const auto node = std::find_if(node_list.begin(), node_list.end(),
+				       [&stats](const Node &i){
+					       return &i.stats == &stats;
+				       });
+	assert(node != node_list.end());
+
+	const auto now = warm_timer.GetEventLoop().SteadyNow();
+
+	for (auto &i : warm_targets) {
+		if (i.Match(*node, key)) {
+			i.last_used = now;
+
+			/* move to the front of the list */
+			warm_targets.erase(warm_targets.iterator_to(i));
+			warm_targets.push_front(i);
+
+			/* this client is probably about to take
+			   one of the idle connections; replace
+			   it */
+			warm_defer.Schedule();
+			return;
+		}
 	}
 
-	return {node.address, node.stats};
+	if (n_warm_targets >= options.warm_budget)
+		/* each target needs at least one connection from
+		   the budget; discard the least recently used
+		   one */
+		DisposeWarmTarget(warm_targets.back());
+
+	auto *target = new WarmTarget(*this, *node, key, now);
+	warm_targets.push_front(*target);
+	++n_warm_targets;
+
+	warm_defer.Schedule();
+}
+
+inline void
+Cluster::DisposeWarmTarget(WarmTarget &target) noexcept
+{
+	assert(n_warm_targets > 0);
+
+	warm_targets.erase(warm_targets.iterator_to(target));
+	--n_warm_targets;
+	delete &target;
+}
+
+void
+Cluster::RefillWarm() noexcept
+{
+	const auto now = warm_timer.GetEventLoop().SteadyNow();
+
+	/* discard expired targets and count the connections which
+	   are already charged to the budget */
+	std::size_t n = 0;
+	for (auto i = warm_targets.begin(); i != warm_targets.end();) {
+		auto &target = *i++;
+
+		if (now - target.last_used >= warm_target_expiry) {
+			DisposeWarmTarget(target);
+			continue;
+		}
+
+		n += backend_pool.Count(target.GetKey());
+		if (target.IsPending())
+			++n;
+	}
+
+	/* start one connection per target which needs more; the
+	   most recently used targets get the budget first */
+	for (auto &target : warm_targets) {
+		if (n >= options.warm_budget)
+			break;
+
+		if (target.IsPending() || !target.CanConnect(now) ||
+		    backend_pool.Count(target.GetKey()) >= options.warm)
+			continue;
+
+		++n;
+		target.Start();
+	}
+
+	if (warm_targets.empty())
+		warm_timer.Cancel();
+	else
+		warm_timer.Schedule(warm_interval);
 }
 
 static constexpr char lua_cluster_class[] = "myproxy.cluster";
@@ -268,11 +709,14 @@ Cluster::Register(lua_State *L)
 Cluster *
 Cluster::New(lua_State *L,
 	     EventLoop &event_loop, Stats &stats,
+	     BackendPool &backend_pool,
+	     ClusterMonitor &monitor,
 	     std::forward_list<AllocatedSocketAddress> &&nodes,
 	     ClusterOptions &&options)
 {
-	return LuaCluster::New(L, event_loop, stats,
-			       std::move(nodes), std::move(options));
+	return LuaCluster::New(L, event_loop, stats, backend_pool,
+			       std::move(nodes), std::move(options),
+			       &monitor);
 }
 
 Cluster *
@@ -287,6 +731,18 @@ Cluster::Cast(lua_State *L, int idx) noexcept
 	return LuaCluster::Cast(L, idx);
 }
 
+void
+Cluster::SetNodeState(SocketAddress address,
+		      CheckServerResult result) noexcept
+{
+	for (auto &node : node_list) {
+		if (node.address == address) {
+			node.SetState(result);
+			return;
+		}
+	}
+}
+
 void
 Cluster::InvokeReady() noexcept
 {
@@ -5,23 +5,30 @@
 #pragma once
 
 #include "Options.hxx"
+#include "BackendPool.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "event/DeferEvent.hxx"
+#include "net/SocketAddress.hxx"
 #include "util/IntrusiveList.hxx"
 
 #include <coroutine>
 #include <cstdint>
 #include <forward_list>
+#include <map>
+#include <string>
 #include <string_view>
-#include <utility> // for std::pair
 #include <vector>
 
 struct lua_State;
 struct Stats;
 struct NodeStats;
 struct ConnectOptions;
-class SocketAddress;
 class AllocatedSocketAddress;
+class NodeQueue;
 class EventLoop;
 class ClusterNodeObserver;
+class ClusterMonitor;
+enum class CheckServerResult : uint_least8_t;
 
 class Cluster {
 	const ClusterOptions options;
@@ -39,10 +46,28 @@ class Cluster {
 
 	struct RendezvousNode {
 		Node *node;
-		std::size_t hash;
 
-		explicit constexpr RendezvousNode(Node &_node) noexcept
-			:node(&_node) {}
+		/**
+		 * A hash of the node address which is combined with
+		 * the hash of the account in each Pick() call.
+		 */
+		uint_least64_t address_hash;
+	};
+
+	/**
+	 * A node and its Rendezvous hash for a certain account.
+	 */
+	struct Candidate {
+		Node *node = nullptr;
+		uint_least64_t hash = 0;
+	};
+
+	/**
+	 * The best two nodes for an account.  #second is empty if
+	 * the cluster has only one node.
+	 */
+	struct TopNodes {
+		Candidate first, second;
 	};
 
 	/**
@@ -54,15 +79,64 @@ class Cluster {
 	 */
 	template<bool read_only>
 	struct CompareNodes {
-		constexpr bool operator()(const RendezvousNode &a, const RendezvousNode &b) noexcept;
+		constexpr bool operator()(const Candidate &a, const Candidate &b) const noexcept;
 	};
 
 	/**
-	 * This is a copy of #node_list with precalculated hash for
-	 * Rendezvous Hashing.  It will be sorted in each Pick() call.
+	 * This is a copy of #node_list with precalculated address
+	 * hashes for Rendezvous Hashing.  Pick() iterates over it,
+	 * which is faster than iterating over the linked list.
 	 */
 	std::vector<RendezvousNode> rendezvous_nodes;
 
+	/**
+	 * The result of FindTopNodes() for recently seen accounts
+	 * (#ClusterOptions::pick_cache).  It is cleared whenever a
+	 * node changes its state.
+	 */
+	struct CachedPick;
+	std::map<std::string, CachedPick, std::less<>> pick_cache;
+
+	/**
+	 * All items of #pick_cache; the front of this list is the
+	 * most recently used one.
+	 */
+	IntrusiveList<CachedPick> pick_cache_lru;
+
+	BackendPool &backend_pool;
+
+	/**
+	 * Shares health check results with other threads (or
+	 * nullptr).
+	 */
+	ClusterMonitor *const monitor;
+
+	/**
+	 * A node/login combination for which idle connections are
+	 * kept ready (option "warm").
+	 */
+	struct WarmTarget;
+
+	/**
+	 * The front of this list is the most recently used target.
+	 */
+	IntrusiveList<WarmTarget> warm_targets;
+
+	std::size_t n_warm_targets = 0;
+
+	/**
+	 * Refills the #BackendPool for #warm_targets right after
+	 * something has changed.
+	 */
+	DeferEvent warm_defer;
+
+	/**
+	 * Refills the #BackendPool for #warm_targets periodically
+	 * (e.g. after failed attempts or after idle connections have
+	 * expired).
+	 */
+	CoarseTimerEvent warm_timer;
+
 	class ReadyTask : public IntrusiveListHook<IntrusiveHookMode::AUTO_UNLINK> {
 		friend class Cluster;
 
@@ -100,14 +174,23 @@ class Cluster {
 	bool found_alive = false;
 
 public:
+	/**
+	 * @param _monitor if set, then it decides whether this
+	 * object checks its nodes itself, and it receives the
+	 * results
+	 */
 	Cluster(EventLoop &event_loop, Stats &stats,
+		BackendPool &_backend_pool,
 		std::forward_list<AllocatedSocketAddress> &&_nodes,
-		ClusterOptions &&_options) noexcept;
+		ClusterOptions &&_options,
+		ClusterMonitor *_monitor=nullptr) noexcept;
 	~Cluster() noexcept;
 
 	static void Register(lua_State *L);
 	static Cluster *New(lua_State *L,
 			    EventLoop &event_loop, Stats &stats,
+			    BackendPool &backend_pool,
+			    ClusterMonitor &monitor,
 			    std::forward_list<AllocatedSocketAddress> &&nodes,
 			    ClusterOptions &&options);
 
@@ -131,16 +214,85 @@ public:
 		return ReadyTask{*this};
 	}
 
-	[[nodiscard]] [[gnu::pure]]
-	std::pair<SocketAddress, NodeStats &> Pick(std::string_view account,
-						   const ConnectOptions &connect_options,
-						   ClusterNodeObserver *observer=nullptr) noexcept;
+	struct PickResult {
+		SocketAddress address;
+
+		NodeStats &stats;
+
+		/**
+		 * The admission control of this node or nullptr if
+		 * disabled (#ClusterOptions::max_queries).
+		 */
+		NodeQueue *queue;
+	};
+
+	[[nodiscard]]
+	PickResult Pick(std::string_view account,
+			const ConnectOptions &connect_options,
+			ClusterNodeObserver *observer=nullptr) noexcept;
+
+	/**
+	 * A client has been assigned to a node (by Pick()) and wants
+	 * to log in with the given credentials using the
+	 * #BackendPool.  If option "warm" is enabled, this
+	 * schedules the creation of idle connections for future
+	 * clients with the same key.
+	 *
+	 * @param stats the #NodeStats returned by Pick()
+	 */
+	void Warm(const BackendPool::Key &key, NodeStats &stats) noexcept;
+
+	/**
+	 * Apply the result of a health check which was performed
+	 * by another thread (see #ClusterMonitor).  Unknown
+	 * addresses are ignored.
+	 */
+	void SetNodeState(SocketAddress address,
+			  CheckServerResult result) noexcept;
 
 private:
 	static constexpr const char *ToString(NodeState state) noexcept;
 
+	void DisposeWarmTarget(WarmTarget &target) noexcept;
+
+	/**
+	 * Start connecting to nodes whose #warm_targets have fewer
+	 * idle connections than configured, as far as
+	 * ClusterOptions::warm_budget allows.
+	 */
+	void RefillWarm() noexcept;
+
 	void InvokeReady() noexcept;
 
+	/**
+	 * Find the best two nodes for an account in one pass over
+	 * #rendezvous_nodes.
+	 */
+	template<bool read_only>
+	[[gnu::pure]]
+	TopNodes FindTopNodes(uint_least64_t account_hash) const noexcept;
+
+	/**
+	 * Like FindTopNodes<false>(), but look up the account in
+	 * #pick_cache first and store the result there.
+	 */
+	TopNodes FindTopNodesCached(std::string_view account,
+				    uint_least64_t account_hash) noexcept;
+
+	void RemoveCachedPick(CachedPick &item) noexcept;
+	void ClearPickCache() noexcept;
+
+	/**
+	 * Implementation of ClusterOptions::Strategy::BOUNDED_LOAD:
+	 * find the first node in Rendezvous order which has the
+	 * given state and which has not yet reached the load bound.
+	 *
+	 * @param state the best state of all nodes
+	 */
+	[[gnu::pure]]
+	Node &PickBoundedLoad(NodeState state,
+			      uint_least64_t account_hash) const noexcept;
+
 	/**
 	 * Does a node with a state better than this one exist?
 	 */
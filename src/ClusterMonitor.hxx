@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstdint>
+
+enum class CheckServerResult : uint_least8_t;
+class Cluster;
+class SocketAddress;
+
+/**
+ * Shares the health check results of #Cluster nodes between the
+ * main instance and its #Worker threads, so each node is checked
+ * only once per process and all threads agree on its state.
+ */
+class ClusterMonitor {
+public:
+	/**
+	 * A #Cluster has been created.
+	 *
+	 * @return true if the cluster shall check its nodes itself;
+	 * false if the results are delivered with
+	 * Cluster::SetNodeState()
+	 */
+	virtual bool OnClusterCreated(Cluster &cluster) noexcept = 0;
+
+	virtual void OnClusterDestroyed(Cluster &cluster) noexcept = 0;
+
+	/**
+	 * A health check of a node of a #Cluster which checks its
+	 * nodes itself has finished.
+	 */
+	virtual void OnClusterNodeChecked(const Cluster &cluster,
+					  SocketAddress address,
+					  CheckServerResult result) noexcept = 0;
+};
@@ -19,6 +19,9 @@
 #include "auth/Factory.hxx"
 #include "auth/Handler.hxx"
 #include "Policy.hxx"
+#include "QueryDigest.hxx"
+#include "QueryClassifier.hxx"
+#include "SplicePipe.hxx"
 #include "lib/fmt/ExceptionFormatter.hxx"
 #include "lib/fmt/SocketAddressFormatter.hxx"
 #include "lib/fmt/RuntimeError.hxx"
@@ -32,10 +35,14 @@
 #include "util/ScopeExit.hxx"
 #include "util/SpanCast.hxx"
 
+#include <array>
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
 
+#include <errno.h>
+#include <sys/socket.h> // for AF_INET*
+
 using std::string_view_literals::operator""sv;
 
 /**
@@ -67,12 +74,14 @@ Connection::SafeDelete() noexcept
 {
 	UnregisterClusterNodeObserver();
 	defer_start_handler.Cancel();
+	defer_release.Cancel();
 	incoming.Close();
 
 	if (connect.IsPending())
 		connect.Cancel();
 
 	defer_delete.Schedule();
+	queue_ticket.Release();
 	outgoing.reset();
 }
 
@@ -132,6 +141,15 @@ Connection::Outgoing::OnPeerWrite()
 void
 Connection::Outgoing::OnPeerClosed() noexcept
 {
+	if (sending_reset)
+		/* handled by Connection::SendPooledReset() */
+		return;
+
+	if (pooled && !peer.command_phase) {
+		connection.OnPooledResetError();
+		return;
+	}
+
 	connection.OnOutgoingError("Server closed the connection"sv);
 }
 
@@ -139,6 +157,16 @@ void
 Connection::Outgoing::OnPeerError(std::exception_ptr e) noexcept
 {
 	fmt::print(stderr, "[{}] {}\n", connection.GetName(), e);
+
+	if (sending_reset)
+		/* handled by Connection::SendPooledReset() */
+		return;
+
+	if (pooled && !peer.command_phase) {
+		connection.OnPooledResetError();
+		return;
+	}
+
 	connection.OnOutgoingError("Error on connection to server"sv);
 }
 
@@ -149,9 +177,24 @@ Connection::OnClusterNodeUnavailable() noexcept
 	OnOutgoingError("Node is unavailable"sv);
 }
 
+void
+Connection::OnNodeQueueReady() noexcept
+{
+	/* resume the command which was blocked in OnMysqlPacket() */
+	incoming.DeferRead();
+}
+
+void
+Connection::OnNodeQueueTimeout() noexcept
+{
+	queue_timeout = true;
+	incoming.DeferRead();
+}
+
 void
 Connection::OnPeerClosed() noexcept
 {
+	ReleaseOutgoing();
 	SafeDelete();
 }
 
@@ -163,10 +206,14 @@ Connection::OnPeerWrite()
 	if (!incoming.handshake) {
 		static constexpr std::array<std::byte, 0x15> auth_plugin_data{};
 
-		incoming.capabilities = handshake_capabilities;
+		uint_least32_t capabilities = handshake_capabilities;
+		if (tls_context)
+			capabilities |= Mysql::CLIENT_SSL;
+
+		incoming.capabilities = capabilities;
 
 		auto s = Mysql::MakeHandshakeV10(lua_client_ptr->GetServerVersion(),
-						 handshake_capabilities,
+						 capabilities,
 						 "mysql_clear_password"sv,
 						 auth_plugin_data);
 		if (!incoming.Send(s.Finish()))
@@ -176,6 +223,17 @@ Connection::OnPeerWrite()
 		return WriteResult::DONE;
 	}
 
+	switch (FlushSplicePipe()) {
+	case WriteResult::DONE:
+		break;
+
+	case WriteResult::MORE:
+		return WriteResult::MORE;
+
+	case WriteResult::CLOSED:
+		return WriteResult::CLOSED;
+	}
+
 	if (!outgoing)
 		return WriteResult::DONE;
 
@@ -193,6 +251,15 @@ Connection::OnPeerWrite()
 		return WriteResult::CLOSED;
 	}
 
+	if (CanMultiplex())
+		/* the response may have been forwarded completely
+		   now */
+		defer_release.Schedule();
+
+	if (queue_timeout)
+		/* OnMysqlPacket() has been waiting for this */
+		incoming.DeferRead();
+
 	got_raw_from_outgoing = false;
 
 	switch (outgoing->peer.Read()) {
@@ -241,12 +308,21 @@ void
 Connection::OnSocketConnectError(std::exception_ptr e) noexcept
 {
 	assert(!outgoing);
+
+	++outgoing_stats->n_connect_errors;
+
+	if (incoming.command_phase) {
+		/* this connection attempt was started by
+		   Reattach() */
+		fmt::print(stderr, "[{}] {}\n", GetName(), e);
+		OnOutgoingError("Connection error"sv);
+		return;
+	}
+
 	assert(incoming.handshake);
 	assert(incoming.handshake_response);
 	assert(!incoming.command_phase);
 
-	++outgoing_stats->n_connect_errors;
-
 	fmt::print(stderr, "[{}] {}\n", GetName(), e);
 
 	AbortErr(incoming_handshake_response_sequence_id + 1,
@@ -254,6 +330,26 @@ Connection::OnSocketConnectError(std::exception_ptr e) noexcept
 		 "Connection error"sv);
 }
 
+inline MysqlHandler::Result
+Connection::OnSslRequest()
+{
+	assert(incoming.handshake);
+	assert(!incoming.handshake_response);
+
+#ifdef HAVE_TLS
+	if (tls_context && !incoming.IsTlsHandshaking()) {
+		incoming.StartTls(*tls_context);
+		++stats.n_client_tls_connections;
+
+		/* the HandshakeResponse follows after the TLS
+		   handshake */
+		return Result::IGNORE;
+	}
+#endif
+
+	throw SocketProtocolError{"Unexpected SSLRequest"};
+}
+
 inline MysqlHandler::Result
 Connection::OnHandshakeResponse(uint_least8_t sequence_id,
 				std::span<const std::byte> payload)
@@ -276,7 +372,10 @@ Connection::OnHandshakeResponse(uint_least8_t sequence_id,
 		_password.remove_suffix(1);
 	}
 
-	incoming.capabilities &= packet.capabilities;
+	/* TLS is terminated here; CLIENT_SSL does not affect the
+	   packet format and must not be passed on to the server (or
+	   be part of #BackendPool and #QueryCache keys) */
+	incoming.capabilities &= packet.capabilities & ~Mysql::CLIENT_SSL;
 
 	fmt::print("[{}] login user={:?} database={:?}\n", GetName(), packet.user, packet.database);
 
@@ -300,10 +399,14 @@ Connection::OnInitDb(uint_least8_t sequence_id,
 
 	const auto packet = Mysql::ParseInitDb(payload);
 
-	if (packet.database == database) {
-		/* no-op */
+	if (packet.database == database &&
+	    pending_commands.size() == 1) {
+		/* no-op (does not pin the session); this shortcut
+		   is only possible if the client is not waiting for
+		   responses to earlier (pipelined) commands, i.e.
+		   this command is the front of the queue */
 
-		FinishServerResponse();
+		(void)FinishCommand();
 
 		return incoming.SendOk(sequence_id + 1)
 			? Result::IGNORE
@@ -315,6 +418,9 @@ Connection::OnInitDb(uint_least8_t sequence_id,
 		return Result::IGNORE;
 	}
 
+	outgoing->response_tracker.OnCommand(Mysql::Command::INIT_DB);
+	pinned = true;
+	login_changed = true;
 	return Result::FORWARD;
 }
 
@@ -335,24 +441,384 @@ Connection::OnChangeUser(uint_least8_t sequence_id,
 		if (!outgoing->peer.Send(s.Finish()))
 			return Result::CLOSED;
 
-		FinishServerResponse();
+		outgoing->response_tracker.OnCommand(Mysql::Command::RESET_CONNECTION);
+		pinned = false;
 		return Result::IGNORE;
 	}
 
+	outgoing->response_tracker.OnCommand(Mysql::Command::CHANGE_USER);
+	pinned = true;
+	login_changed = true;
 	return Result::FORWARD;
 }
 
+inline Connection::CommandInfo
+Connection::ClassifyCommand(Mysql::Command cmd,
+			    std::span<const std::byte> payload,
+			    bool complete) const noexcept
+try {
+	std::string_view query;
+
+	switch (cmd) {
+	case Mysql::Command::QUERY:
+		query = Mysql::ParseQuery(payload, incoming.capabilities).query;
+		break;
+
+	case Mysql::Command::STMT_PREPARE:
+		query = Mysql::ParseStmtPrepare(payload).query;
+		break;
+
+	default:
+		return {};
+	}
+
+	return {
+		.query = query,
+		.classification = complete
+		? ClassifyQuery(query)
+		: QueryClassification::Unknown(),
+	};
+} catch (Mysql::MalformedPacket) {
+	/* not our problem; the server will reject it */
+	return {};
+}
+
+inline void
+Connection::UpdatePinned(Mysql::Command cmd, const CommandInfo &info) noexcept
+{
+	switch (cmd) {
+	case Mysql::Command::QUERY:
+		if (info.classification.pins_session)
+			pinned = true;
+		break;
+
+	case Mysql::Command::STMT_PREPARE:
+		/* the statement itself keeps the server connection
+		   (see #statements), but if its text changes the
+		   session state, executing it will */
+		if (info.classification.pins_session)
+			pinned = true;
+		break;
+
+	case Mysql::Command::RESET_CONNECTION:
+		pinned = false;
+		break;
+
+	case Mysql::Command::QUIT:
+	case Mysql::Command::PING:
+	case Mysql::Command::STMT_EXECUTE:
+	case Mysql::Command::STMT_SEND_LONG_DATA:
+	case Mysql::Command::STMT_CLOSE:
+	case Mysql::Command::STMT_RESET:
+		break;
+
+	case Mysql::Command::INIT_DB:
+	case Mysql::Command::CHANGE_USER:
+		/* handled by OnInitDb() and OnChangeUser() */
+		break;
+
+	default:
+		/* we don't know what this command does, so assume
+		   the worst */
+		pinned = true;
+		break;
+	}
+}
+
+inline bool
+Connection::IsReadOnlyCommand(Mysql::Command cmd,
+			      std::span<const std::byte> payload,
+			      const CommandInfo &info) const
+{
+	switch (cmd) {
+	case Mysql::Command::QUERY:
+	case Mysql::Command::STMT_PREPARE:
+		return info.classification.read_only;
+
+	case Mysql::Command::STMT_EXECUTE:
+		if (const auto i = statements.find(Mysql::ParseStmt(payload).statement_id);
+		    i != statements.end())
+			return i->second.read_only;
+		return false;
+
+	default:
+		return false;
+	}
+}
+
+inline void
+Connection::UpdateSessionChanged(Mysql::Command cmd,
+				 const CommandInfo &info) noexcept
+{
+	switch (cmd) {
+	case Mysql::Command::QUERY:
+	case Mysql::Command::STMT_PREPARE:
+		if (info.classification.pins_session)
+			session_changed = true;
+		break;
+
+	case Mysql::Command::QUIT:
+	case Mysql::Command::PING:
+	case Mysql::Command::RESET_CONNECTION:
+	case Mysql::Command::STMT_EXECUTE:
+	case Mysql::Command::STMT_SEND_LONG_DATA:
+	case Mysql::Command::STMT_CLOSE:
+	case Mysql::Command::STMT_RESET:
+	case Mysql::Command::STMT_FETCH:
+		/* executing a statement has been checked when it
+		   was prepared */
+		break;
+
+	default:
+		/* INIT_DB, CHANGE_USER or something we don't know:
+		   the cache key may not describe the session
+		   anymore */
+		session_changed = true;
+		break;
+	}
+}
+
+std::string
+Connection::MakeQueryCacheKey(std::string_view query) const noexcept
+{
+	assert(connect_action);
+
+	return QueryCache::MakeKey({
+		/* with "read_write_split", cacheable statements
+		   are executed on the read-only node */
+		.address = read_stats != nullptr ? read_address : outgoing_address,
+		.user = connect_action->user,
+		.database = connect_action->database,
+		.capabilities = incoming.capabilities,
+		.query = query,
+	});
+}
+
+inline std::optional<MysqlHandler::Result>
+Connection::LookupQueryCache(const CommandInfo &info, bool capture)
+{
+	assert(connect_action);
+
+	if (connect_action->options.query_cache == 0 ||
+	    session_changed || !query_cache.IsEnabled() ||
+	    !info.classification.cacheable)
+		return std::nullopt;
+
+	auto key = MakeQueryCacheKey(info.query);
+
+	if (const auto response = query_cache.Get(key, GetEventLoop().SteadyNow());
+	    !response.empty()) {
+		/* the cached response begins with sequence_id 1,
+		   just like the server's response would */
+		++stats.n_client_queries;
+		return incoming.Send(response)
+			? Result::IGNORE
+			: Result::CLOSED;
+	}
+
+	if (capture)
+		query_cache_capture.emplace(QueryCacheCapture{
+			.key = std::move(key),
+			.ttl = std::chrono::seconds{connect_action->options.query_cache},
+		});
+
+	return std::nullopt;
+}
+
+inline void
+Connection::CaptureQueryCache(uint_least8_t number,
+			      std::span<const std::byte> payload,
+			      bool complete) noexcept
+{
+	assert(query_cache_capture);
+
+	if (!complete || outgoing->response_tracker.IsUnknown() ||
+	    /* another resultset follows (multi-statement query or
+	       stored procedure); these are never stored */
+	    (outgoing->response_tracker.GetStatusFlags() & Mysql::SERVER_MORE_RESULTS_EXIST) != 0 ||
+	    !query_cache_capture->Append(number, payload,
+					 query_cache.GetMaxItemSize()))
+		/* packets which are forwarded in raw/direct mode
+		   cannot be captured */
+		query_cache_capture.reset();
+}
+
+inline void
+Connection::StoreQueryCache(Mysql::Command cmd,
+			    uint_least16_t status_flags) noexcept
+{
+	assert(query_cache_capture);
+	assert(connect_action);
+
+	/* only successful single result sets (terminated by EOF or
+	   its CLIENT_DEPRECATE_EOF replacement) are stored; a
+	   transaction may have been started by a concurrent
+	   pipelined command */
+	if (cmd == Mysql::Command::EOF_ &&
+	    (status_flags & (Mysql::SERVER_STATUS_IN_TRANS|Mysql::SERVER_MORE_RESULTS_EXIST)) == 0 &&
+	    !session_changed)
+		query_cache.Put(std::move(query_cache_capture->key),
+				connect_action->database,
+				std::move(query_cache_capture->response),
+				GetEventLoop().SteadyNow() + query_cache_capture->ttl);
+
+	query_cache_capture.reset();
+}
+
+inline std::optional<MysqlHandler::Result>
+Connection::OnStmtPrepare(const CommandInfo &info, bool complete)
+{
+	assert(connect_action);
+	assert(outgoing);
+
+	if (connect_action->options.statement_cache == 0 ||
+	    session_changed || !complete ||
+	    /* the response must not overtake the responses to
+	       pipelined commands, and only the oldest one can be
+	       captured */
+	    !pending_commands.empty() ||
+	    !outgoing->response_tracker.IsIdle())
+		return std::nullopt;
+
+	const auto query = info.query;
+
+	if (!outgoing->peer.IsForwarding()) {
+		if (const auto statement = outgoing->statement_cache.Acquire(query);
+		    statement.id != 0) {
+			statements.emplace(statement.id, ClientStatement{
+				.cached = true,
+				.read_only = info.classification.read_only,
+			});
+			++outgoing_stats->n_statement_cache_hits;
+
+			/* the recorded response begins with
+			   sequence_id 1, just like the server's
+			   response would */
+			return incoming.Send(statement.response)
+				? Result::IGNORE
+				: Result::CLOSED;
+		}
+	}
+
+	++outgoing_stats->n_statement_cache_misses;
+
+	statement_capture.emplace(StatementCacheCapture{
+		.query = std::string{query},
+	});
+
+	return std::nullopt;
+}
+
+inline bool
+Connection::OnStmtClose(std::span<const std::byte> payload)
+{
+	assert(connect_action);
+	assert(outgoing);
+
+	const auto id = Mysql::ParseStmt(payload).statement_id;
+	const auto i = statements.find(id);
+	if (i == statements.end())
+		/* unknown to us; let the server deal with it */
+		return true;
+
+	const auto statement = i->second;
+	statements.erase(i);
+
+	bool forward = true;
+
+	if (statement.cached) {
+		if (statement.dirty)
+			outgoing->statement_cache.Remove(id);
+		else if (outgoing->statement_cache.Release(id, connect_action->options.statement_cache))
+			forward = false;
+	}
+
+	if (CanMultiplex())
+		/* there will be no response which would trigger
+		   OnResponseComplete() */
+		defer_release.Schedule();
+
+	return forward;
+}
+
+inline void
+Connection::ForgetStatements() noexcept
+{
+	statements.clear();
+	statement_capture.reset();
+
+	if (outgoing)
+		outgoing->statement_cache.Clear();
+}
+
+inline void
+Connection::OnPrepareResponse(uint_least8_t number,
+			      std::span<const std::byte> payload,
+			      bool complete, bool response_complete)
+{
+	assert(!pending_commands.empty());
+	assert(pending_commands.front().command == Mysql::Command::STMT_PREPARE);
+
+	if (!pending_commands.front().responding &&
+	    static_cast<Mysql::Command>(payload.front()) == Mysql::Command::OK) {
+		/* the new statement's id */
+		const auto id = Mysql::ParsePrepareOk(payload).statement_id;
+		statements.try_emplace(id, ClientStatement{
+			.read_only = pending_commands.front().read_only,
+		});
+
+		if (statement_capture)
+			statement_capture->statement_id = id;
+	}
+
+	if (!statement_capture)
+		return;
+
+	if (!complete || !statement_capture->Append(number, payload)) {
+		/* packets which are forwarded in raw/direct mode
+		   cannot be captured */
+		statement_capture.reset();
+		return;
+	}
+
+	if (!response_complete)
+		return;
+
+	if (const auto id = statement_capture->statement_id;
+	    id != 0 && !session_changed) {
+		if (auto i = statements.find(id); i != statements.end()) {
+			outgoing->statement_cache.Add(id, statement_capture->query,
+						      std::move(statement_capture->response));
+			i->second.cached = true;
+		}
+	}
+
+	statement_capture.reset();
+}
+
 MysqlHandler::Result
 Connection::OnMysqlPacket(unsigned number, std::span<const std::byte> payload,
-			  [[maybe_unused]] bool complete) noexcept
+			  bool complete) noexcept
 try {
 	++stats.n_client_packets_received;
 
 	if (!incoming.handshake)
 		throw SocketProtocolError{"Unexpected client data before handshake"};
 
-	if (!incoming.handshake_response)
+	if (!incoming.handshake_response) {
+		if (incoming.IsTlsHandshaking())
+			/* this is the beginning of the TLS handshake,
+			   not a packet; the #Peer takes care of it */
+			return Result::BLOCKING;
+
+		if (!complete)
+			throw SocketProtocolError{"Handshake response too large"};
+
+		if (Mysql::IsSslRequest(payload))
+			return OnSslRequest();
+
 		return OnHandshakeResponse(number, payload);
+	}
 
 	if (IsDelayed())
 		/* do not process further packets from the client
@@ -362,6 +828,63 @@ try {
 		   canceling the old one */
 		return Result::BLOCKING;
 
+	if (incoming.command_phase && number == 0 &&
+	    /* a client which wants to quit is not held back; it
+	       frees resources instead of using them */
+	    (payload.empty() ||
+	     static_cast<Mysql::Command>(payload.front()) != Mysql::Command::QUIT) &&
+	    CheckPolicy())
+		/* this user has exhausted the budget; this packet
+		   will be delivered again when the delay is over */
+		return Result::BLOCKING;
+
+	if (queue_timeout) [[unlikely]] {
+		/* this command has waited too long for its turn in
+		   the #NodeQueue */
+
+		if (outgoing && outgoing->peer.IsForwarding())
+			/* the error must not overtake response data
+			   which has not yet been forwarded; continue
+			   in OnPeerWrite() */
+			return Result::BLOCKING;
+
+		queue_timeout = false;
+		return incoming.SendErr(number + 1,
+					Mysql::ErrorCode::QUERY_TIMEOUT, "HY000"sv,
+					"Server is overloaded"sv)
+			? Result::IGNORE
+			: Result::CLOSED;
+	}
+
+	if (!outgoing && incoming.command_phase && !connect.IsPending()) {
+		/* the server connection has been released after the
+		   previous command (ConnectOptions::multiplex) */
+		if (payload.empty())
+			throw Mysql::MalformedPacket{};
+
+		const auto cmd = static_cast<Mysql::Command>(payload.front());
+		if (cmd == Mysql::Command::QUIT) {
+			SafeDelete();
+			return Result::CLOSED;
+		}
+
+		const auto info = ClassifyCommand(cmd, payload, complete);
+
+		/* a cache hit does not need a server connection */
+		if (cmd == Mysql::Command::QUERY && number == 0 && complete)
+			if (const auto result = LookupQueryCache(info, false))
+				return *result;
+
+		if (read_stats != nullptr)
+			SelectNode(IsReadCommand(number, cmd, info));
+
+		/* this packet will be delivered again after the
+		   server connection has been reattached */
+		return Reattach()
+			? Result::BLOCKING
+			: Result::CLOSED;
+	}
+
 	if (!outgoing || !outgoing->peer.command_phase)
 		return Result::BLOCKING;
 
@@ -370,13 +893,134 @@ try {
 	if (payload.empty())
 		throw Mysql::MalformedPacket{};
 
-	ExpectServerResponse(number);
-
 	const auto cmd = static_cast<Mysql::Command>(payload.front());
 
+	if (number == 0 && pending_commands.full())
+		/* too many pipelined commands; wait until the server
+		   has responded to some of them */
+		return Result::BLOCKING;
+
+	auto info = ClassifyCommand(cmd, payload, complete);
+
+	if (cmd == Mysql::Command::QUERY && number == 0 && complete &&
+	    pending_commands.empty() && !query_cache_capture &&
+	    /* a hit must not overtake response data which has not
+	       yet been forwarded */
+	    !outgoing->peer.IsForwarding() &&
+	    (outgoing->response_tracker.GetStatusFlags() & Mysql::SERVER_STATUS_IN_TRANS) == 0)
+		if (const auto result = LookupQueryCache(info, true))
+			return *result;
+
+	if (read_stats != nullptr && number == 0 &&
+	    cmd != Mysql::Command::QUIT && CanMultiplex()) {
+		const bool read = IsReadCommand(number, cmd, info);
+		if (read != IsOnReadNode()) {
+			/* this command belongs to the other node */
+			if (ReleaseOutgoing()) {
+				SelectNode(read);
+				return Reattach()
+					? Result::BLOCKING
+					: Result::CLOSED;
+			}
+
+			if (!read && !pending_commands.empty())
+				/* wait until the read-only node has
+				   responded to all pipelined commands
+				   and has been released (see
+				   OnDeferredRelease()) */
+				return Result::BLOCKING;
+
+			/* the connection cannot be released right
+			   now; a read can be executed on the
+			   writable node as well (and a write will be
+			   rejected by the read-only node) */
+		}
+	}
+
+	if (cmd == Mysql::Command::QUIT && ReleaseOutgoing()) {
+		/* the server connection has been moved to the pool
+		   and must not receive this QUIT packet */
+		SafeDelete();
+		return Result::CLOSED;
+	}
+
+	if (outgoing_queue != nullptr && number == 0 && complete &&
+	    pending_commands.empty() && !queue_ticket.IsRunning() &&
+	    /* the server does not respond to these */
+	    cmd != Mysql::Command::QUIT &&
+	    cmd != Mysql::Command::STMT_CLOSE &&
+	    cmd != Mysql::Command::STMT_SEND_LONG_DATA &&
+	    !queue_ticket.Acquire(*outgoing_queue))
+		/* the node is busy; this packet will be delivered
+		   again by OnNodeQueueReady() or
+		   OnNodeQueueTimeout() */
+		return Result::BLOCKING;
+
+	if (number == 0) {
+		switch (cmd) {
+		case Mysql::Command::STMT_PREPARE:
+			if (const auto result = OnStmtPrepare(info, complete)) {
+				if (pending_commands.empty())
+					/* answered from the cache,
+					   the node is not needed */
+					queue_ticket.Release();
+				return *result;
+			}
+			break;
+
+		case Mysql::Command::STMT_CLOSE:
+			if (!OnStmtClose(payload))
+				return Result::IGNORE;
+			break;
+
+		case Mysql::Command::RESET_CONNECTION:
+		case Mysql::Command::CHANGE_USER:
+			/* the server deallocates all prepared
+			   statements */
+			ForgetStatements();
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	/* the digest of an incomplete query (which does not fit
+	   into the input buffer) is not calculated */
+	std::array<char, MAX_QUERY_DIGEST> digest_buffer;
+	if (cmd == Mysql::Command::QUERY && number == 0 && complete)
+		info.digest = MakeQueryDigest(info.query, digest_buffer);
+
+	/* a command which may have modified data clears the query
+	   cache (of this worker thread), no matter whether this
+	   client uses it: the tables and databases it has touched
+	   are not known */
+	const bool read_only = number == 0 && query_cache.IsEnabled() &&
+		IsReadOnlyCommand(cmd, payload, info);
+
+	ExpectServerResponse(number, cmd,
+			     cmd == Mysql::Command::QUERY ||
+			     cmd == Mysql::Command::STMT_EXECUTE
+			     ? GetEventLoop().SteadyNow()
+			     : Event::TimePoint{},
+			     info.digest, read_only);
+
+	if (connect_action->options.multiplex)
+		UpdatePinned(cmd, info);
+
+	if (connect_action->options.pool &&
+	    cmd == Mysql::Command::QUERY && number == 0 &&
+	    info.classification.changes_database)
+		login_changed = true;
+
+	if (connect_action->options.query_cache > 0 ||
+	    connect_action->options.statement_cache > 0)
+		UpdateSessionChanged(cmd, info);
+
 	switch (cmd) {
 	case Mysql::Command::OK:
 	case Mysql::Command::QUIT:
+	case Mysql::Command::PING:
 	case Mysql::Command::EOF_:
 	case Mysql::Command::ERR:
 	case Mysql::Command::RESET_CONNECTION:
@@ -384,17 +1028,65 @@ try {
 
 	case Mysql::Command::QUERY:
 		++stats.n_client_queries;
-		if (request_time == Event::TimePoint{})
-			request_time = GetEventLoop().SteadyNow();
+		break;
+
+	case Mysql::Command::STMT_PREPARE:
+		outgoing->response_tracker.OnCommand(cmd);
+		if (outgoing->response_tracker.IsUnknown())
+			/* the new statement's id cannot be obtained
+			   from the response; keep this server
+			   connection */
+			pinned = true;
+		return Result::FORWARD;
+
+	case Mysql::Command::STMT_EXECUTE:
+		++stats.n_client_queries;
+
+		if (number == 0) {
+			const auto packet = Mysql::ParseStmt(payload);
+			if (packet.flags != Mysql::CURSOR_TYPE_NO_CURSOR) {
+				/* the response to a cursor is not
+				   understood by the ResponseTracker,
+				   and fetching from the cursor requires
+				   this server connection */
+				if (auto i = statements.find(packet.statement_id);
+				    i != statements.end())
+					i->second.dirty = true;
+
+				outgoing->response_tracker.OnUnknownCommand();
+				pinned = true;
+				return Result::FORWARD;
+			}
+		}
+
+		break;
+
+	case Mysql::Command::STMT_SEND_LONG_DATA:
+		if (number == 0)
+			if (auto i = statements.find(Mysql::ParseStmt(payload).statement_id);
+			    i != statements.end())
+				i->second.dirty = true;
+		break;
+
+	case Mysql::Command::STMT_CLOSE:
+	case Mysql::Command::STMT_RESET:
+	case Mysql::Command::STMT_FETCH:
 		break;
 
 	case Mysql::Command::INIT_DB:
+		if (!complete)
+			throw Mysql::MalformedPacket{};
+
 		return OnInitDb(number, payload);
 
 	case Mysql::Command::CHANGE_USER:
+		if (!complete)
+			throw Mysql::MalformedPacket{};
+
 		return OnChangeUser(number, payload);
 	}
 
+	outgoing->response_tracker.OnCommand(cmd);
 	return Result::FORWARD;
 } catch (Mysql::MalformedPacket) {
 	++stats.n_client_malformed_packets;
@@ -435,10 +1127,26 @@ Connection::OnMysqlRaw(std::span<const std::byte> src) noexcept
 }
 
 inline Event::Duration
-Connection::MaybeFinishQuery() noexcept
+Connection::FinishCommand() noexcept
 {
-	return request_time != Event::TimePoint{}
-	       ? GetEventLoop().SteadyNow() - std::exchange(request_time, Event::TimePoint{})
+	if (pending_commands.empty())
+		return Event::Duration{-1};
+
+	if (pending_commands.full())
+		/* OnMysqlPacket() has stopped reading commands from
+		   the client; resume now */
+		incoming.DeferRead();
+
+	const auto start = pending_commands.front().start;
+	pending_commands.pop_front();
+	--outgoing_stats->n_pending_commands;
+
+	if (pending_commands.empty())
+		/* give the node to the next client */
+		queue_ticket.Release();
+
+	return start != Event::TimePoint{}
+	       ? GetEventLoop().SteadyNow() - start
 	       : Event::Duration{-1};
 }
 
@@ -446,8 +1154,6 @@ inline MysqlHandler::Result
 Connection::Outgoing::OnHandshake(uint_least8_t sequence_id,
 				  std::span<const std::byte> payload)
 {
-	assert(!connection.incoming.command_phase);
-
 	if (!payload.empty() && static_cast<Mysql::Command>(payload.front()) == Mysql::Command::ERR) {
 		const auto err = Mysql::ParseErr(payload, peer.capabilities);
 		throw FmtRuntimeError("Connection rejected by server: {}",
@@ -458,7 +1164,13 @@ Connection::Outgoing::OnHandshake(uint_least8_t sequence_id,
 
 	connection.lua_client_ptr->SetServerVersion(packet.server_version);
 
-	peer.capabilities = packet.capabilities & connection.incoming.capabilities;
+	uint_least32_t capabilities = connection.GetOutgoingCapabilities();
+	if ((packet.capabilities & Mysql::CLIENT_COMPRESS) == 0)
+		/* don't ask for compression if the server doesn't
+		   support it */
+		capabilities &= ~Mysql::CLIENT_COMPRESS;
+
+	peer.capabilities = packet.capabilities & capabilities;
 
 	fmt::print("[{}] handshake server_version={:?}\n",
 		   connection.GetName(), packet.server_version);
@@ -475,7 +1187,7 @@ Connection::Outgoing::OnHandshake(uint_least8_t sequence_id,
 					       AsBytes(packet.auth_plugin_data2));
 
 	auto s = Mysql::MakeHandshakeResponse41(sequence_id + 1,
-						connection.incoming.capabilities,
+						capabilities,
 						action.user,
 						ToStringView(response),
 						action.database,
@@ -491,8 +1203,6 @@ inline MysqlHandler::Result
 Connection::Outgoing::OnAuthSwitchRequest(uint_least8_t sequence_id,
 					  std::span<const std::byte> payload)
 {
-	assert(!connection.incoming.command_phase);
-
 	const auto packet = Mysql::ParseAuthSwitchRequest(payload);
 
 	auth_handler = Mysql::MakeAuthHandler(packet.auth_plugin_name, true);
@@ -516,7 +1226,8 @@ Connection::Outgoing::OnAuthSwitchRequest(uint_least8_t sequence_id,
 
 inline void
 Connection::Outgoing::OnQueryOk(const Mysql::OkPacket &packet,
-				Event::Duration duration) noexcept
+				Event::Duration duration,
+				std::string_view digest) noexcept
 {
 	++stats.n_queries;
 	stats.n_query_warnings += packet.warnings;
@@ -532,24 +1243,72 @@ Connection::Outgoing::OnQueryOk(const Mysql::OkPacket &packet,
 
 	stats.n_affected_rows += packet.affected_rows;
 	stats.query_wait += duration;
-
-	policy_duration(connection.user.c_str(), duration);
+	stats.query_durations.Record(duration);
+	stats.query_latency.Record(duration, connection.GetEventLoop().SteadyNow());
+
+	connection.UpdateAccountStats({
+		.n_queries = 1,
+		.query_wait = duration,
+	});
+
+	if (!digest.empty())
+		connection.stats.digests.Update(digest, {
+			.n_queries = 1,
+			.n_affected_rows = packet.affected_rows,
+			.query_wait = duration,
+			.max_query_wait = duration,
+		});
+
+	if (auto &slow_queries = connection.stats.slow_queries;
+	    slow_queries.IsSlow(duration, packet.status_flags)) [[unlikely]]
+		slow_queries.Record(duration, digest,
+				    connection.lua_client_ptr->GetAccount(),
+				    connection.outgoing_address,
+				    packet.status_flags, false);
+
+	connection.policy.OnDuration(connection.user, duration,
+				     connection.GetEventLoop().SteadyNow());
 }
 
 inline void
-Connection::Outgoing::OnQueryErr(Event::Duration duration) noexcept
+Connection::Outgoing::OnQueryErr(Event::Duration duration,
+				 std::string_view digest) noexcept
 {
 	++stats.n_queries;
 	++stats.n_query_errors;
 	stats.query_wait += duration;
-
-	policy_duration(connection.user.c_str(), duration);
+	stats.query_durations.Record(duration);
+	stats.query_latency.Record(duration, connection.GetEventLoop().SteadyNow());
+
+	connection.UpdateAccountStats({
+		.n_queries = 1,
+		.n_query_errors = 1,
+		.query_wait = duration,
+	});
+
+	if (!digest.empty())
+		connection.stats.digests.Update(digest, {
+			.n_queries = 1,
+			.n_query_errors = 1,
+			.query_wait = duration,
+			.max_query_wait = duration,
+		});
+
+	if (auto &slow_queries = connection.stats.slow_queries;
+	    slow_queries.IsSlow(duration, 0)) [[unlikely]]
+		slow_queries.Record(duration, digest,
+				    connection.lua_client_ptr->GetAccount(),
+				    connection.outgoing_address,
+				    0, true);
+
+	connection.policy.OnDuration(connection.user, duration,
+				     connection.GetEventLoop().SteadyNow());
 }
 
 MysqlHandler::Result
 Connection::Outgoing::OnMysqlPacket(unsigned number,
 				    std::span<const std::byte> payload,
-				    [[maybe_unused]] bool complete) noexcept
+				    bool complete) noexcept
 try {
 	auto &c = connection;
 	assert(c.incoming.handshake);
@@ -569,7 +1328,8 @@ try {
 	const auto cmd = static_cast<Mysql::Command>(payload.front());
 
 	if (!peer.command_phase) {
-		assert(!c.incoming.command_phase);
+		if (!complete)
+			throw SocketProtocolError{"Packet from server too large"};
 
 		if (auth_handler) {
 			if (const auto new_payload = auth_handler->HandlePacket(payload);
@@ -587,11 +1347,28 @@ try {
 
 		switch (cmd) {
 		case Mysql::Command::OK:
+			peer.command_phase = true;
+			auth_handler.reset();
+
+#ifdef HAVE_ZLIB
+			if (peer.capabilities & Mysql::CLIENT_COMPRESS)
+				/* all packets after this OK are
+				   compressed */
+				peer.EnableCompression(stats);
+#endif
+
+			if (c.incoming.command_phase) {
+				/* this connection was obtained by
+				   Reattach(); the client is already
+				   logged in, so resume processing its
+				   pending command */
+				c.incoming.DeferRead();
+				return Result::IGNORE;
+			}
+
 			++connection.stats.n_client_auth_ok;
 
-			peer.command_phase = true;
 			c.incoming.command_phase = true;
-			auth_handler.reset();
 
 			c.StartCoroutine(c.InvokeLuaCommandPhase());
 
@@ -605,6 +1382,19 @@ try {
 			return OnAuthSwitchRequest(number, payload);
 
 		case Mysql::Command::ERR:
+			if (pooled) {
+				/* resetting the pooled connection
+				   has failed */
+				c.OnPooledResetError();
+				return Result::CLOSED;
+			}
+
+			if (c.incoming.command_phase) {
+				/* Reattach() has failed to log in */
+				c.OnOutgoingError(Mysql::ParseErr(payload, peer.capabilities).error_message);
+				return Result::CLOSED;
+			}
+
 			++connection.stats.n_client_auth_err;
 
 			if (c.incoming.Send(Mysql::MakeErr(c.incoming_handshake_response_sequence_id + 1,
@@ -621,37 +1411,75 @@ try {
 		}
 	}
 
-	c.FinishServerResponse();
+	const bool response_complete =
+		response_tracker.OnResponse(payload, complete, peer.capabilities);
 
-	switch (cmd) {
-	case Mysql::Command::EOF_:
-		if (const auto duration = c.MaybeFinishQuery(); duration.count() >= 0)
-			OnQueryOk(Mysql::ParseEof(payload, peer.capabilities),
-				  duration);
+	if (c.query_cache_capture)
+		c.CaptureQueryCache(number, payload, complete);
 
-		break;
+	if (!c.pending_commands.empty() && !response_tracker.IsUnknown() &&
+	    c.pending_commands.front().command == Mysql::Command::STMT_PREPARE)
+		c.OnPrepareResponse(number, payload, complete, response_complete);
 
-	case Mysql::Command::OK:
-		if (const auto duration = c.MaybeFinishQuery(); duration.count() >= 0)
-			OnQueryOk(Mysql::ParseOk(payload, peer.capabilities),
-				  duration);
+	c.OnServerResponse();
 
-		break;
+	if (!response_complete)
+		/* more packets belonging to this response will
+		   follow (or a large row which does not fit into the
+		   input buffer) */
+		return Result::FORWARD;
 
-	case Mysql::Command::ERR:
-		if (const auto duration = c.MaybeFinishQuery(); duration.count() >= 0)
-			OnQueryErr(duration);
+	/* this packet completes the response to the oldest pending
+	   command; with pipelining, each command is timed
+	   separately */
+	if (c.query_cache_capture)
+		c.StoreQueryCache(cmd, response_tracker.GetStatusFlags());
 
-		break;
+	/* the popped command remains valid until the next
+	   push_back() */
+	const std::string_view digest = c.pending_commands.empty()
+		? std::string_view{}
+		: std::string_view{c.pending_commands.front().digest};
 
-	case Mysql::Command::QUIT:
-	case Mysql::Command::QUERY:
-	case Mysql::Command::INIT_DB:
-	case Mysql::Command::CHANGE_USER:
-	case Mysql::Command::RESET_CONNECTION:
-		break;
+	/* after an ERR, too: a multi-statement query may have
+	   modified data before it failed */
+	if (!c.pending_commands.empty() &&
+	    c.pending_commands.front().MayModifyData())
+		c.query_cache.Clear();
+
+	if (const auto duration = c.FinishCommand(); duration.count() >= 0) {
+		switch (cmd) {
+		case Mysql::Command::EOF_:
+			OnQueryOk(Mysql::ParseEof(payload, peer.capabilities),
+				  duration, digest);
+			break;
+
+		case Mysql::Command::OK:
+			OnQueryOk(Mysql::ParseOk(payload, peer.capabilities),
+				  duration, digest);
+			break;
+
+		case Mysql::Command::ERR:
+			OnQueryErr(duration, digest);
+			break;
+
+		case Mysql::Command::QUIT:
+		case Mysql::Command::QUERY:
+		case Mysql::Command::PING:
+		case Mysql::Command::INIT_DB:
+		case Mysql::Command::CHANGE_USER:
+		case Mysql::Command::RESET_CONNECTION:
+		case Mysql::Command::STMT_PREPARE:
+		case Mysql::Command::STMT_EXECUTE:
+		case Mysql::Command::STMT_SEND_LONG_DATA:
+		case Mysql::Command::STMT_CLOSE:
+		case Mysql::Command::STMT_RESET:
+		case Mysql::Command::STMT_FETCH:
+			break;
+		}
 	}
 
+	c.OnResponseComplete();
 
 	return Result::FORWARD;
 } catch (Mysql::MalformedPacket) {
@@ -674,6 +1502,18 @@ try {
 std::pair<MysqlHandler::RawResult, std::size_t>
 Connection::Outgoing::OnMysqlRaw(std::span<const std::byte> src) noexcept
 {
+	switch (connection.FlushSplicePipe()) {
+	case WriteResult::DONE:
+		break;
+
+	case WriteResult::MORE:
+		/* the client must receive the spliced data first */
+		return {RawResult::OK, 0U};
+
+	case WriteResult::CLOSED:
+		return {RawResult::CLOSED, 0U};
+	}
+
 	connection.got_raw_from_outgoing = true;
 
 	const auto result = connection.incoming.SendSome(src);
@@ -682,6 +1522,7 @@ Connection::Outgoing::OnMysqlRaw(std::span<const std::byte> src) noexcept
 			connection.incoming.ScheduleWrite();
 
 		stats.n_bytes_received += result;
+		connection.pending_account_bytes += result;
 		return {RawResult::OK, static_cast<std::size_t>(result)};
 	}
 
@@ -691,6 +1532,67 @@ Connection::Outgoing::OnMysqlRaw(std::span<const std::byte> src) noexcept
 	return {RawResult::CLOSED, 0U};
 }
 
+std::pair<MysqlHandler::DirectResult, std::size_t>
+Connection::Outgoing::OnMysqlDirect(SocketDescriptor fd, std::size_t max) noexcept
+{
+	auto &pipe = connection.splice_pipe;
+
+	if (!pipe.IsDefined()) {
+		try {
+			pipe.Create();
+		} catch (...) {
+			/* fall back to copying through the input
+			   buffer */
+			fmt::print(stderr, "[{}] {}\n",
+				   connection.GetName(), std::current_exception());
+			peer.DisableDirect();
+			return {DirectResult::EMPTY, 0U};
+		}
+	}
+
+	switch (connection.FlushSplicePipe()) {
+	case WriteResult::DONE:
+		break;
+
+	case WriteResult::MORE:
+		return {DirectResult::BLOCKING, 0U};
+
+	case WriteResult::CLOSED:
+		return {DirectResult::CLOSED, 0U};
+	}
+
+	const auto nbytes = pipe.Fill(fd, max);
+	if (nbytes <= 0) {
+		if (nbytes == 0)
+			return {DirectResult::END, 0U};
+
+		if (errno == EAGAIN)
+			return {DirectResult::EMPTY, 0U};
+
+		return {DirectResult::ERRNO, 0U};
+	}
+
+	connection.got_raw_from_outgoing = true;
+	stats.n_bytes_received += nbytes;
+	stats.n_bytes_spliced += nbytes;
+	connection.pending_account_bytes += nbytes;
+
+	/* the data has been consumed from the server socket, even if
+	   it cannot be sent to the client right now; it will then
+	   remain in the pipe until the client becomes writable */
+	if (connection.FlushSplicePipe() == WriteResult::CLOSED)
+		return {DirectResult::CLOSED, 0U};
+
+	return {DirectResult::OK, static_cast<std::size_t>(nbytes)};
+}
+
+/**
+ * Packets with at least this number of bytes remaining (after the
+ * header and the part which fits into the input buffer) are
+ * forwarded from the server to the client with splice().
+ */
+static constexpr std::size_t splice_threshold = 16 * 1024;
+
 Connection::Outgoing::Outgoing(Connection &_connection,
 			       NodeStats &_stats,
 			       UniqueSocketDescriptor fd) noexcept
@@ -698,18 +1600,37 @@ Connection::Outgoing::Outgoing(Connection &_connection,
 	 stats(_stats),
 	 peer(connection.GetEventLoop(), std::move(fd), *this, *this)
 {
+	peer.EnableDirect(splice_threshold);
+}
+
+[[gnu::pure]]
+static bool
+IsTcp(SocketAddress address) noexcept
+{
+	return address.GetFamily() == AF_INET ||
+		address.GetFamily() == AF_INET6;
 }
 
 Connection::Connection(EventLoop &event_loop, Stats &_stats,
+		       BackendPool &_backend_pool,
+		       QueryCache &_query_cache,
+		       Policy &_policy,
 		       std::shared_ptr<LuaHandler> _handler,
+		       std::shared_ptr<TlsContext> _tls_context,
 		       UniqueSocketDescriptor fd,
 		       SocketAddress address)
 	:stats(_stats),
+	 backend_pool(_backend_pool),
+	 query_cache(_query_cache),
+	 policy(_policy),
 	 handler(std::move(_handler)),
+	 tls_context(IsTcp(address) ? std::move(_tls_context) : nullptr),
 	 auto_close(handler->GetState()),
 	 lua_client(handler->GetState()),
 	 defer_start_handler(event_loop, BIND_THIS_METHOD(OnDeferredStartHandler)),
 	 defer_delete(event_loop, BIND_THIS_METHOD(OnDeferredDelete)),
+	 defer_release(event_loop, BIND_THIS_METHOD(OnDeferredRelease)),
+	 delay_timer(event_loop, BIND_THIS_METHOD(OnDelayTimer)),
 	 incoming(event_loop, std::move(fd), *this, *this),
 	 connect(event_loop, *this)
 {
@@ -724,7 +1645,16 @@ Connection::Connection(EventLoop &event_loop, Stats &_stats,
 	StartCoroutine(InvokeLuaConnect());
 }
 
-Connection::~Connection() noexcept = default;
+Connection::~Connection() noexcept
+{
+	UpdateAccountStats({});
+
+	if (!pending_commands.empty())
+		outgoing_stats->n_pending_commands -= pending_commands.size();
+
+	if (cluster_stats != nullptr)
+		--cluster_stats->n_clients;
+}
 
 std::string_view
 Connection::GetName() const noexcept
@@ -738,11 +1668,54 @@ Connection::IsAccount(std::string_view account) const noexcept
 	return account == lua_client_ptr->GetAccount();
 }
 
+void
+Connection::UpdateAccountStats(AccountCounters counters) noexcept
+{
+	const auto account = lua_client_ptr->GetAccount();
+	if (account.empty())
+		return;
+
+	counters.n_bytes += std::exchange(pending_account_bytes, 0);
+	if (counters.n_bytes == 0 && counters.n_queries == 0)
+		return;
+
+	stats.accounts.Update(account, counters);
+}
+
+void
+Connection::Delay(Event::Duration delay) noexcept
+{
+	++stats.n_delayed_commands;
+	stats.delay_wait += delay;
+
+	delay_timer.Schedule(delay);
+}
+
+bool
+Connection::CheckPolicy() noexcept
+{
+	if (!policy.IsEnabled())
+		return false;
+
+	const auto delay = policy.GetDelay(user, GetEventLoop().SteadyNow());
+	if (delay <= Event::Duration{})
+		return false;
+
+	Delay(delay);
+	return true;
+}
+
+inline void
+Connection::OnDelayTimer() noexcept
+{
+	incoming.DeferRead();
+}
+
 void
 Connection::OnOutgoingError(std::string_view msg) noexcept
 {
 	AbortErr(incoming.command_phase
-		 ? pending_response_sequence_id
+		 ? GetPendingResponseSequenceId()
 		 : incoming_handshake_response_sequence_id + 1,
 		 incoming.command_phase
 		 ? Mysql::ErrorCode::UNKNOWN_COM_ERROR
@@ -750,22 +1723,316 @@ Connection::OnOutgoingError(std::string_view msg) noexcept
 		 msg);
 }
 
+inline bool
+Connection::Connect() noexcept
+{
+	fmt::print("[{}] connecting to {}\n", GetName(), outgoing_address);
+	return connect.Connect(outgoing_address, std::chrono::seconds{30});
+}
+
+PeerHandler::WriteResult
+Connection::FlushSplicePipe() noexcept
+{
+	if (splice_pipe.IsEmpty())
+		return WriteResult::DONE;
+
+	if (incoming.SpliceFrom(splice_pipe) < 0)
+		return WriteResult::CLOSED;
+
+	if (!splice_pipe.IsEmpty()) {
+		incoming.ScheduleWrite();
+		return WriteResult::MORE;
+	}
+
+	return WriteResult::DONE;
+}
+
+uint_least32_t
+Connection::GetOutgoingCapabilities() const noexcept
+{
+	assert(connect_action);
+
+	uint_least32_t capabilities = incoming.capabilities;
+
+#ifdef HAVE_ZLIB
+	if (connect_action->options.compress)
+		capabilities |= Mysql::CLIENT_COMPRESS;
+#endif
+
+	return capabilities;
+}
+
+BackendPool::Key
+Connection::MakeBackendPoolKey() const noexcept
+{
+	assert(connect_action);
+
+	return {
+		.address = outgoing_address,
+		.user = connect_action->user,
+		.password = connect_action->password,
+		.password_sha1 = connect_action->password_sha1,
+		.database = connect_action->database,
+		.capabilities = GetOutgoingCapabilities(),
+	};
+}
+
+inline bool
+Connection::ConnectPooled() noexcept
+{
+	assert(connect_action);
+	assert(!outgoing);
+
+	if (!connect_action->options.pool)
+		return false;
+
+	auto lease = backend_pool.Get(MakeBackendPoolKey(), *outgoing_stats);
+	if (!lease)
+		return false;
+
+	fmt::print("[{}] reusing connection to {}\n", GetName(), outgoing_address);
+
+	lua_client_ptr->SetServerVersion(lease->server_version);
+
+	EmplaceOutgoing(std::move(*lease));
+
+	/* the server's OK will be handled just like the response to
+	   our HandshakeResponse, i.e. it completes the client's
+	   login */
+	return SendPooledReset();
+}
+
+void
+Connection::EmplaceOutgoing(BackendPool::Lease &&lease) noexcept
+{
+	assert(!outgoing);
+
+	outgoing.emplace(*this, *outgoing_stats, std::move(lease.fd));
+
+	auto &peer = outgoing->peer;
+	peer.capabilities = lease.capabilities;
+	peer.handshake = peer.handshake_response = true;
+
+#ifdef HAVE_ZLIB
+	if (peer.capabilities & Mysql::CLIENT_COMPRESS)
+		peer.EnableCompression(*outgoing_stats);
+#endif
+}
+
+bool
+Connection::SendPooledReset() noexcept
+{
+	assert(outgoing);
+	assert(!outgoing->peer.command_phase);
+
+	outgoing->pooled = true;
+
+	outgoing->sending_reset = true;
+	const bool success = outgoing->peer.Send(Mysql::MakeResetConnection(0));
+	if (!success) {
+		fmt::print(stderr, "[{}] failed to reuse pooled connection\n", GetName());
+		outgoing.reset();
+		return false;
+	}
+
+	outgoing->sending_reset = false;
+	return true;
+}
+
+inline bool
+Connection::Reattach() noexcept
+{
+	assert(connect_action);
+	assert(!outgoing);
+	assert(incoming.command_phase);
+
+	auto lease = backend_pool.Get(MakeBackendPoolKey(), *outgoing_stats);
+	if (!lease)
+		return Connect();
+
+	const bool clean = lease->clean;
+	EmplaceOutgoing(std::move(*lease));
+
+	if (clean) {
+		outgoing->statement_cache = std::move(lease->statements);
+		outgoing->peer.command_phase = true;
+		incoming.DeferRead();
+		return true;
+	} else {
+		if (!SendPooledReset())
+			return Connect();
+
+		return true;
+	}
+}
+
+bool
+Connection::OnPooledResetError() noexcept
+{
+	assert(outgoing);
+	assert(outgoing->pooled);
+
+	fmt::print(stderr, "[{}] failed to reuse pooled connection\n", GetName());
+
+	outgoing.reset();
+	return Connect();
+}
+
+bool
+Connection::ReleaseOutgoing() noexcept
+{
+	if (!outgoing || !connect_action || !connect_action->options.pool)
+		return false;
+
+	if (login_changed)
+		/* COM_RESET_CONNECTION would not restore the user
+		   and the default database; the next client with
+		   this key would get the wrong ones, so keep the
+		   server connection (and close it together with the
+		   client connection) */
+		return false;
+
+	if (!outgoing->peer.command_phase ||
+	    !outgoing->response_tracker.IsIdle() ||
+	    !pending_commands.empty() ||
+	    /* a client which is delayed by #delay_timer or
+	       #queue_ticket does not need the server
+	       connection */
+	    coroutine ||
+	    incoming.IsForwarding() ||
+	    !outgoing->peer.IsIdle())
+		/* the server connection is busy; it cannot be reused
+		   safely */
+		return false;
+
+	const bool clean = CanMultiplex();
+
+	backend_pool.Put(MakeBackendPoolKey(), *outgoing_stats, {
+			.fd = outgoing->peer.Release(),
+			.server_version = std::string{lua_client_ptr->GetServerVersion()},
+			.capabilities = outgoing->peer.capabilities,
+			.clean = clean,
+			/* COM_RESET_CONNECTION would deallocate the
+			   statements */
+			.statements = clean
+				? std::move(outgoing->statement_cache)
+				: StatementCache{},
+		});
+
+	outgoing.reset();
+	return true;
+}
+
+bool
+Connection::CanMultiplex() const noexcept
+{
+	return connect_action && connect_action->options.multiplex &&
+		!pinned && statements.empty() && outgoing &&
+		(outgoing->response_tracker.GetStatusFlags() & Mysql::SERVER_STATUS_IN_TRANS) == 0;
+}
+
+inline void
+Connection::OnResponseComplete() noexcept
+{
+	assert(connect_action);
+	assert(outgoing);
+
+	if (!connect_action->options.multiplex)
+		return;
+
+	if (outgoing->response_tracker.GetStatusFlags() & Mysql::SERVER_SESSION_STATE_CHANGED)
+		/* the server says the session state has changed
+		   (requires "session_track_state_change") */
+		pinned = true;
+
+	if (CanMultiplex())
+		/* release the server connection as soon as the
+		   response has been forwarded to the client */
+		defer_release.Schedule();
+}
+
+void
+Connection::OnDeferredRelease() noexcept
+{
+	if (CanMultiplex() && ReleaseOutgoing() && read_stats != nullptr)
+		/* a command may be waiting for the other node (see
+		   OnMysqlPacket()) */
+		incoming.DeferRead();
+}
+
 inline void
-Connection::ExpectServerResponse(uint_least8_t request_sequence_id) noexcept
+Connection::ExpectServerResponse(uint_least8_t request_sequence_id,
+				 Mysql::Command cmd,
+				 Event::TimePoint start,
+				 std::string_view digest,
+				 bool read_only) noexcept
 {
-	if (pending_response_sequence_id > 0 && request_sequence_id == 0)
-		/* a new command starts at sequence_id 0; if another
-		   command is already waiting for a response, keep the
-		   older one */
+	if (request_sequence_id == 0 &&
+	    (cmd == Mysql::Command::STMT_SEND_LONG_DATA ||
+	     cmd == Mysql::Command::STMT_CLOSE))
+		/* the server does not respond to these */
 		return;
 
-	pending_response_sequence_id = request_sequence_id + 1;
+	if (request_sequence_id > 0 && !pending_commands.empty()) {
+		/* a new command starts at sequence_id 0; this is
+		   another packet belonging to the most recent command
+		   (e.g. an auth switch response) which the server
+		   will respond to */
+		auto &command = pending_commands.back();
+		command.response_sequence_id = request_sequence_id + 1;
+		command.responding = false;
+		return;
+	}
+
+	/* the caller has checked this for new commands; a
+	   continuation of a command (sequence_id > 0) is only added
+	   to an empty queue */
+	assert(!pending_commands.full());
+
+	++outgoing_stats->n_pending_commands;
+	pending_commands.push_back({
+		.start = start,
+		.command = cmd,
+		.response_sequence_id = static_cast<uint_least8_t>(request_sequence_id + 1),
+		.responding = false,
+		.read_only = read_only,
+	});
+
+	/* assign in place to reuse the buffer of this slot */
+	pending_commands.back().digest = digest;
 }
 
 inline void
-Connection::FinishServerResponse() noexcept
+Connection::OnServerResponse() noexcept
+{
+	if (pending_commands.empty())
+		return;
+
+	if (outgoing->response_tracker.IsUnknown()) {
+		/* we can't tell where one response ends and the next
+		   one begins; forget all pending commands as soon as
+		   the server starts responding */
+		if (pending_commands.full())
+			incoming.DeferRead();
+
+		outgoing_stats->n_pending_commands -= pending_commands.size();
+		pending_commands.clear();
+		queue_ticket.Release();
+		return;
+	}
+
+	pending_commands.front().responding = true;
+}
+
+uint_least8_t
+Connection::GetPendingResponseSequenceId() const noexcept
 {
-	pending_response_sequence_id = 0;
+	if (pending_commands.empty())
+		/* the response to the next command */
+		return 1;
+
+	const auto &command = pending_commands.front();
+	return command.responding ? 0 : command.response_sequence_id;
 }
 
 inline void
@@ -918,6 +2185,7 @@ try {
 		connect_action = std::move(*c);
 
 		SocketAddress address = connect_action->address;
+		Cluster *warm_cluster = nullptr;
 		if (connect_action->cluster) {
 			connect_action->cluster->Push(L);
 			AtScopeExit(L) { lua_pop(L, 1); };
@@ -938,19 +2206,51 @@ try {
 
 			const auto p = cluster.Pick(lua_client_ptr->GetAccount(), connect_action->options,
 						    observer);
-			address = p.first;
-			outgoing_stats = &p.second;
+			address = p.address;
+			outgoing_stats = &p.stats;
+			outgoing_queue = p.queue;
+
+			cluster_stats = &p.stats;
+			++cluster_stats->n_clients;
+
+			if (connect_action->options.read_write_split) {
+				auto read_options = connect_action->options;
+				read_options.read_only = true;
+
+				const auto r = cluster.Pick(lua_client_ptr->GetAccount(),
+							    read_options);
+				if (&r.stats != outgoing_stats) {
+					/* the login is performed on
+					   the writable node; reads
+					   will be moved to the
+					   read-only node on demand */
+					write_address = address;
+					write_stats = outgoing_stats;
+					write_queue = outgoing_queue;
+					read_address = r.address;
+					read_stats = &r.stats;
+					read_queue = r.queue;
+				}
+			}
+
+			if (connect_action->options.pool)
+				warm_cluster = &cluster;
 		} else {
 			outgoing_stats = &stats.GetNode(address);
 		}
 
 		incoming_handshake_response_sequence_id = sequence_id;
+		outgoing_address = address;
+
+		if (warm_cluster != nullptr)
+			/* keep idle connections with these
+			   credentials ready for the next clients
+			   (if the cluster has option "warm") */
+			warm_cluster->Warm(MakeBackendPoolKey(), *outgoing_stats);
 
-		/* connect to the outgoing server and perform the
-		   handshake to it */
-		fmt::print("[{}] connecting to {}\n", GetName(), address);
-		if (!connect.Connect(address,
-				     std::chrono::seconds{30}))
+		/* connect to the outgoing server (or reuse a pooled
+		   connection) and perform the handshake to it */
+		if (!ConnectPooled() && !Connect())
 			co_return;
 	} else
 		throw std::invalid_argument{"Bad return value"};
@@ -1002,6 +2302,10 @@ try {
 			co_return;
 		}
 
+		outgoing->response_tracker.OnCommand(Mysql::Command::INIT_DB);
+		pinned = true;
+		login_changed = true;
+
 		database = init_db->database;
 		co_return;
 	} else
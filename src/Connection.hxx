@@ -5,24 +5,38 @@
 #pragma once
 
 #include "Action.hxx"
+#include "BackendPool.hxx"
 #include "Peer.hxx"
 #include "MysqlHandler.hxx"
+#include "MysqlResponseTracker.hxx"
 #include "NodeObserver.hxx"
+#include "NodeQueue.hxx"
+#include "PendingCommandQueue.hxx"
+#include "QueryCache.hxx"
+#include "QueryClassifier.hxx"
+#include "SplicePipe.hxx"
+#include "StatementCache.hxx"
 #include "lua/AutoCloseList.hxx"
 #include "lua/Value.hxx"
 #include "co/InvokeTask.hxx"
+#include "event/CoarseTimerEvent.hxx"
 #include "event/DeferEvent.hxx"
 #include "event/net/ConnectSocket.hxx"
+#include "net/SocketAddress.hxx"
 #include "util/IntrusiveList.hxx"
 
+#include <map>
 #include <memory>
 #include <optional>
 #include <string>
 
 struct Stats;
 struct NodeStats;
+struct AccountCounters;
+class Policy;
 class LuaHandler;
 class LClient;
+class TlsContext;
 
 namespace Mysql {
 class AuthHandler;
@@ -34,7 +48,7 @@ struct OkPacket;
  */
 class Connection final
 	: public IntrusiveListHook<IntrusiveHookMode::AUTO_UNLINK>,
-	  ClusterNodeObserver,
+	  ClusterNodeObserver, NodeQueueHandler,
 	  PeerHandler, MysqlHandler,
 	  ConnectSocketHandler
 {
@@ -47,8 +61,20 @@ class Connection final
 	Stats &stats;
 	NodeStats *outgoing_stats;
 
+	BackendPool &backend_pool;
+
+	QueryCache &query_cache;
+
+	Policy &policy;
+
 	const std::shared_ptr<LuaHandler> handler;
 
+	/**
+	 * If set, then TLS is offered to the client (see
+	 * #ListenOptions::tls_cert).  Only for TCP connections.
+	 */
+	const std::shared_ptr<TlsContext> tls_context;
+
 	Lua::AutoCloseList auto_close;
 
 	Lua::Value lua_client;
@@ -70,12 +96,26 @@ class Connection final
 	 */
 	DeferEvent defer_delete;
 
-	std::string user, password, database;
+	/**
+	 * Releases the server connection to the #BackendPool after a
+	 * response has been forwarded (#ConnectOptions::multiplex).
+	 */
+	DeferEvent defer_release;
+
+	/**
+	 * While this timer is pending, no commands are read from the
+	 * client (see Delay()).
+	 */
+	CoarseTimerEvent delay_timer;
 
 	/**
-	 * The time stamp of the last request packet [us].
+	 * Used to forward large packets from the server to the
+	 * client with splice().  Created on demand.  Data in this
+	 * pipe must be sent to the client before anything else.
 	 */
-	Event::TimePoint request_time;
+	SplicePipe splice_pipe;
+
+	std::string user, password, database;
 
 	/**
 	 * The connection to the client.
@@ -84,6 +124,48 @@ class Connection final
 
 	std::optional<ConnectAction> connect_action;
 
+	/**
+	 * The address of the server picked for #connect_action.
+	 */
+	SocketAddress outgoing_address;
+
+	/**
+	 * The admission control of the node at #outgoing_address
+	 * (#ClusterOptions::max_queries); nullptr if disabled.
+	 */
+	NodeQueue *outgoing_queue = nullptr;
+
+	/**
+	 * Our slot in #outgoing_queue.  It is held while commands
+	 * are pending.
+	 */
+	NodeQueue::Ticket queue_ticket{*this};
+
+	/**
+	 * The writable node (#ConnectOptions::read_write_split).
+	 * Only set if #read_stats is set.
+	 */
+	SocketAddress write_address;
+	NodeStats *write_stats;
+	NodeQueue *write_queue;
+
+	/**
+	 * The read-only node (#ConnectOptions::read_write_split).
+	 * If #read_stats is nullptr, then there is no such node and
+	 * all statements go to #outgoing_address.
+	 */
+	SocketAddress read_address;
+	NodeStats *read_stats = nullptr;
+	NodeQueue *read_queue;
+
+	/**
+	 * The node this client has been assigned to by
+	 * Cluster::Pick(); its NodeStats::n_clients counts this
+	 * connection.  nullptr if the client has not connected to a
+	 * cluster.
+	 */
+	NodeStats *cluster_stats = nullptr;
+
 	ConnectSocket connect;
 
 	/**
@@ -97,6 +179,30 @@ class Connection final
 	public:
 		Peer peer;
 
+		Mysql::ResponseTracker response_tracker;
+
+		/**
+		 * Was this connection obtained from the #BackendPool?
+		 * This flag is only meaningful until the command
+		 * phase begins, i.e. while the `COM_RESET_CONNECTION`
+		 * response is pending.
+		 */
+		bool pooled = false;
+
+		/**
+		 * Is Connection::SendPooledReset() currently sending
+		 * `COM_RESET_CONNECTION`?  Errors are then left to
+		 * the caller instead of calling
+		 * Connection::OnPooledResetError().
+		 */
+		bool sending_reset = false;
+
+		/**
+		 * Prepared statements on this connection which can be
+		 * reused (#ConnectOptions::statement_cache).
+		 */
+		StatementCache statement_cache;
+
 	private:
 		std::unique_ptr<Mysql::AuthHandler> auth_handler;
 
@@ -113,10 +219,16 @@ class Connection final
 		Result OnAuthSwitchRequest(uint_least8_t sequence_id,
 					   std::span<const std::byte> payload);
 
+		/**
+		 * @param digest the query digest (see
+		 * MakeQueryDigest()) or an empty string
+		 */
 		void OnQueryOk(const Mysql::OkPacket &packet,
-			       Event::Duration duration) noexcept;
+			       Event::Duration duration,
+			       std::string_view digest) noexcept;
 
-		void OnQueryErr(Event::Duration duration) noexcept;
+		void OnQueryErr(Event::Duration duration,
+				std::string_view digest) noexcept;
 
 		/* virtual methods from PeerSocketHandler */
 		void OnPeerClosed() noexcept override;
@@ -127,6 +239,8 @@ class Connection final
 		Result OnMysqlPacket(unsigned number, std::span<const std::byte> payload,
 				     bool complete) noexcept override;
 		std::pair<RawResult, std::size_t> OnMysqlRaw(std::span<const std::byte> src) noexcept override;
+		std::pair<DirectResult, std::size_t> OnMysqlDirect(SocketDescriptor fd,
+								   std::size_t max) noexcept override;
 	};
 
 	std::optional<Outgoing> outgoing;
@@ -139,17 +253,110 @@ class Connection final
 	uint_least8_t incoming_handshake_response_sequence_id;
 
 	/**
-	 * If a client command is waiting for its first server
-	 * response packet, this is the sequence_id that response must
-	 * use.  Zero means there is no pending response.
+	 * Client commands which have been forwarded to the server and
+	 * whose response is not yet complete.  If the
+	 * #ResponseTracker has lost track, this contains at most one
+	 * command and it is removed as soon as the first response
+	 * packet arrives.
 	 */
-	uint_least8_t pending_response_sequence_id = 0;
+	PendingCommandQueue pending_commands;
+
+	/**
+	 * The number of bytes forwarded from the server (like
+	 * #NodeStats::n_bytes_received) which have not yet been
+	 * added to #Stats::accounts.  They are added together with
+	 * the next query (see UpdateAccountStats()) to avoid a
+	 * lookup for each packet.
+	 */
+	uint_least64_t pending_account_bytes = 0;
 
 	bool got_raw_from_incoming, got_raw_from_outgoing;
 
+	/**
+	 * Has the client created session state (e.g. user variables
+	 * or temporary tables) which ties it to the current server
+	 * connection?  If yes, then the server connection will not
+	 * be released by #ConnectOptions::multiplex.
+	 */
+	bool pinned = false;
+
+	/**
+	 * Has the client possibly changed the session (e.g. the
+	 * default database or user variables) in a way which may
+	 * influence query results?  If yes, then the #QueryCache and
+	 * the #StatementCache are not used for this connection
+	 * anymore.
+	 */
+	bool session_changed = false;
+
+	/**
+	 * Has the client switched to another user or default
+	 * database (`COM_CHANGE_USER`, `COM_INIT_DB` or `USE`)?
+	 * `COM_RESET_CONNECTION` does not undo this, so the server
+	 * connection does not match its #BackendPool key anymore
+	 * and must not be put back into the pool.
+	 */
+	bool login_changed = false;
+
+	/**
+	 * Has #queue_ticket timed out?  If yes, the command which
+	 * was waiting for it is answered with an error.
+	 */
+	bool queue_timeout = false;
+
+	/**
+	 * Collects the response to the oldest pending command for
+	 * the #QueryCache.
+	 */
+	std::optional<QueryCacheCapture> query_cache_capture;
+
+	struct ClientStatement {
+		/**
+		 * Is this statement managed by the #StatementCache of
+		 * the server connection?
+		 */
+		bool cached = false;
+
+		/**
+		 * Has the client changed the server-side state of this
+		 * statement beyond its parameter types (by sending
+		 * long data or by opening a cursor)?  Such a statement
+		 * must not be handed to another client.
+		 */
+		bool dirty = false;
+
+		/**
+		 * Does this statement only read data?  Executing
+		 * other statements clears the #QueryCache.
+		 */
+		bool read_only = false;
+	};
+
+	/**
+	 * The prepared statements of the client which have not yet
+	 * been closed, indexed by statement id.  The server
+	 * connection cannot be released while there are any
+	 * (#ConnectOptions::multiplex).
+	 *
+	 * The client sees the server's statement ids: a server
+	 * connection with open statements is never replaced, so no
+	 * translation is necessary.
+	 */
+	std::map<uint_least32_t, ClientStatement> statements;
+
+	/**
+	 * Collects the response to the oldest pending
+	 * `COM_STMT_PREPARE` for the #StatementCache.
+	 */
+	std::optional<StatementCacheCapture> statement_capture;
+
 public:
 	Connection(EventLoop &event_loop, Stats &_stats,
+		   BackendPool &_backend_pool,
+		   QueryCache &_query_cache,
+		   Policy &_policy,
 		   std::shared_ptr<LuaHandler> _handler,
+		   std::shared_ptr<TlsContext> _tls_context,
 		   UniqueSocketDescriptor fd,
 		   SocketAddress address);
 	~Connection() noexcept;
@@ -171,6 +378,12 @@ public:
 	bool IsAccount(std::string_view account) const noexcept;
 
 private:
+	/**
+	 * Add the given values and #pending_account_bytes to the
+	 * #Stats::accounts entry of this client's account (if any).
+	 */
+	void UpdateAccountStats(AccountCounters counters) noexcept;
+
 	bool IsStale() const noexcept {
 		return defer_delete.IsPending();
 	}
@@ -197,18 +410,309 @@ private:
 	 */
 	void OnOutgoingError(std::string_view msg) noexcept;
 
-	void ExpectServerResponse(uint_least8_t request_sequence_id) noexcept;
-	void FinishServerResponse() noexcept;
+	/**
+	 * Establish a new connection to #outgoing_address.
+	 *
+	 * @return false if this object has been destroyed
+	 */
+	bool Connect() noexcept;
+
+	/**
+	 * The capabilities to be announced to the server: those of
+	 * the client plus #Mysql::CLIENT_COMPRESS if enabled by
+	 * #ConnectOptions::compress.
+	 */
+	[[gnu::pure]]
+	uint_least32_t GetOutgoingCapabilities() const noexcept;
+
+	[[gnu::pure]]
+	BackendPool::Key MakeBackendPoolKey() const noexcept;
+
+	/**
+	 * Attempt to obtain an idle server connection from the
+	 * #BackendPool (if enabled by #ConnectOptions::pool).
+	 *
+	 * @return true if a pooled connection is being used; false
+	 * if there is none (or it has failed), and the caller shall
+	 * call Connect() (this object is still alive in any case)
+	 */
+	bool ConnectPooled() noexcept;
+
+	/**
+	 * Create #outgoing from a #BackendPool lease.
+	 */
+	void EmplaceOutgoing(BackendPool::Lease &&lease) noexcept;
+
+	/**
+	 * Send `COM_RESET_CONNECTION` on a connection which was
+	 * just created by EmplaceOutgoing() to discard the session
+	 * state left behind by the previous client.
+	 *
+	 * @return false if sending has failed; #outgoing has been
+	 * discarded, but this object is still alive
+	 */
+	bool SendPooledReset() noexcept;
+
+	/**
+	 * The server connection has been released by
+	 * #ConnectOptions::multiplex, but the client has sent
+	 * another command: obtain a server connection (from the
+	 * #BackendPool or a new one) and resume processing the
+	 * command as soon as it is ready.
+	 *
+	 * @return false if this object has been destroyed (the
+	 * caller must not use it anymore); if it is still alive, the
+	 * command will be resumed after connecting
+	 */
+	bool Reattach() noexcept;
+
+	/**
+	 * Resetting a pooled connection has failed; discard it and
+	 * establish a new one.
+	 *
+	 * @return false if this object has been destroyed
+	 */
+	bool OnPooledResetError() noexcept;
+
+	/**
+	 * Move the outgoing connection to the #BackendPool (if
+	 * enabled by #ConnectOptions::pool, the connection is idle
+	 * and #login_changed is not set).
+	 *
+	 * @return true if the outgoing connection has been released
+	 */
+	bool ReleaseOutgoing() noexcept;
+
+	/**
+	 * Send pending data from #splice_pipe to the client.
+	 */
+	WriteResult FlushSplicePipe() noexcept;
+
+	/**
+	 * May the server connection be released to the #BackendPool
+	 * without resetting it?
+	 */
+	[[gnu::pure]]
+	bool CanMultiplex() const noexcept;
+
+	/**
+	 * What is known about the statement in a `COM_QUERY` or
+	 * `COM_STMT_PREPARE` packet.  It is obtained once per packet
+	 * by ClassifyCommand() and passed to all methods which look
+	 * at the statement.
+	 */
+	struct CommandInfo {
+		/**
+		 * The statement; empty for other commands.
+		 */
+		std::string_view query{};
+
+		/**
+		 * QueryClassification::Unknown() for other commands
+		 * and for statements which do not fit into the input
+		 * buffer.
+		 */
+		QueryClassification classification = QueryClassification::Unknown();
+
+		/**
+		 * The digest of a `COM_QUERY` (see
+		 * MakeQueryDigest()); empty otherwise.  Only
+		 * calculated for packets which are forwarded to the
+		 * server.
+		 */
+		std::string_view digest{};
+	};
+
+	[[gnu::pure]]
+	CommandInfo ClassifyCommand(Mysql::Command cmd,
+				    std::span<const std::byte> payload,
+				    bool complete) const noexcept;
+
+	/**
+	 * Update #pinned for a command received from the client
+	 * (#ConnectOptions::multiplex).
+	 */
+	void UpdatePinned(Mysql::Command cmd, const CommandInfo &info) noexcept;
+
+	/**
+	 * Shall this command be executed on the read-only node
+	 * (#ConnectOptions::read_write_split)?
+	 */
+	static bool IsReadCommand(unsigned number, Mysql::Command cmd,
+				  const CommandInfo &info) noexcept {
+		return number == 0 && cmd == Mysql::Command::QUERY &&
+			info.classification.read_only;
+	}
+
+	/**
+	 * Is this command (the first packet) known to only read
+	 * data?  See PendingCommandQueue::Command::read_only.
+	 */
+	bool IsReadOnlyCommand(Mysql::Command cmd,
+			       std::span<const std::byte> payload,
+			       const CommandInfo &info) const;
+
+	/**
+	 * Is the current (or most recent) server connection on the
+	 * read-only node?
+	 */
+	bool IsOnReadNode() const noexcept {
+		return read_stats != nullptr && outgoing_stats == read_stats;
+	}
+
+	/**
+	 * Choose the node for the next server connection
+	 * (#ConnectOptions::read_write_split).
+	 */
+	void SelectNode(bool read) noexcept {
+		assert(read_stats != nullptr);
+
+		outgoing_address = read ? read_address : write_address;
+		outgoing_stats = read ? read_stats : write_stats;
+		outgoing_queue = read ? read_queue : write_queue;
+	}
+
+	/**
+	 * Update #session_changed for a command received from the
+	 * client.
+	 */
+	void UpdateSessionChanged(Mysql::Command cmd,
+				  const CommandInfo &info) noexcept;
+
+	[[gnu::pure]]
+	std::string MakeQueryCacheKey(std::string_view query) const noexcept;
+
+	/**
+	 * Attempt to answer a `COM_QUERY` packet from the
+	 * #QueryCache.  On a miss, prepare #query_cache_capture (if
+	 * the response shall be stored).
+	 *
+	 * @param capture start capturing the response on a miss?
+	 * @return the result for OnMysqlPacket() on a hit, nullopt
+	 * on a miss
+	 */
+	std::optional<Result> LookupQueryCache(const CommandInfo &info,
+					       bool capture);
+
+	/**
+	 * A response packet for the oldest pending command has been
+	 * received; append it to #query_cache_capture.
+	 */
+	void CaptureQueryCache(uint_least8_t number,
+			       std::span<const std::byte> payload,
+			       bool complete) noexcept;
+
+	/**
+	 * The response captured in #query_cache_capture is complete;
+	 * store it if it is a successful result set.
+	 */
+	void StoreQueryCache(Mysql::Command cmd,
+			     uint_least16_t status_flags) noexcept;
+
+	/**
+	 * Handle a `COM_STMT_PREPARE` packet from the client: answer
+	 * it from the #StatementCache if possible, or else prepare
+	 * #statement_capture.
+	 *
+	 * @return the result for OnMysqlPacket() on a hit, nullopt
+	 * if the packet shall be forwarded
+	 */
+	std::optional<Result> OnStmtPrepare(const CommandInfo &info,
+					    bool complete);
+
+	/**
+	 * Handle a `COM_STMT_CLOSE` packet from the client.
+	 *
+	 * @return true if the packet shall be forwarded to the
+	 * server, false if the statement is kept prepared by the
+	 * #StatementCache
+	 */
+	bool OnStmtClose(std::span<const std::byte> payload);
+
+	/**
+	 * The client has sent a command which deallocates all
+	 * prepared statements (`COM_RESET_CONNECTION` or
+	 * `COM_CHANGE_USER`).
+	 */
+	void ForgetStatements() noexcept;
+
+	/**
+	 * A response packet for a pending `COM_STMT_PREPARE` has been
+	 * received; register the new statement and append the packet
+	 * to #statement_capture.
+	 */
+	void OnPrepareResponse(uint_least8_t number,
+			       std::span<const std::byte> payload,
+			       bool complete, bool response_complete);
+
+	/**
+	 * The server's response to a command is complete.
+	 */
+	void OnResponseComplete() noexcept;
+
+	void OnDeferredRelease() noexcept;
+
+	/**
+	 * A command packet is being forwarded to the server.
+	 *
+	 * @param cmd the command code (only used if this is the
+	 * first packet of a command)
+	 * @param start the time stamp if the duration of this command
+	 * shall be measured; zero otherwise
+	 * @param digest the digest of a `COM_QUERY` (see
+	 * MakeQueryDigest()) or an empty string
+	 * @param read_only see PendingCommandQueue::Command::read_only
+	 */
+	void ExpectServerResponse(uint_least8_t request_sequence_id,
+				  Mysql::Command cmd,
+				  Event::TimePoint start={},
+				  std::string_view digest={},
+				  bool read_only=false) noexcept;
+
+	/**
+	 * A packet has been received from the server.
+	 */
+	void OnServerResponse() noexcept;
+
+	/**
+	 * The sequence_id for an error packet sent to the client
+	 * instead of the pending response.
+	 */
+	[[gnu::pure]]
+	uint_least8_t GetPendingResponseSequenceId() const noexcept;
 
 	bool IsDelayed() const noexcept {
-		return coroutine;
+		return coroutine || delay_timer.IsPending() ||
+			queue_ticket.IsWaiting();
 	}
 
+	/**
+	 * Delay forwarding client input for the specified duration.
+	 * Used to throttle the connection (see #Policy).
+	 */
+	void Delay(Event::Duration delay) noexcept;
+
+	/**
+	 * Ask the #Policy whether the next command shall be delayed
+	 * and if yes, do it.
+	 *
+	 * @return true if the command has been delayed
+	 */
+	bool CheckPolicy() noexcept;
+
+	void OnDelayTimer() noexcept;
+
 	Co::InvokeTask InvokeLuaConnect();
 	Co::InvokeTask InvokeLuaHandshakeResponse(uint_least8_t sequence_id) noexcept;
 	Co::InvokeTask InvokeLuaCommandPhase();
 	Co::InvokeTask InvokeLuaInitDb(uint_least8_t sequence_id, std::string_view db_name) noexcept;
 
+	/**
+	 * The client has sent `SSLRequest`; begin the TLS
+	 * handshake.
+	 */
+	Result OnSslRequest();
+
 	Result OnHandshakeResponse(uint_least8_t sequence_id,
 				   std::span<const std::byte> payload);
 
@@ -228,15 +732,20 @@ private:
 	void StartCoroutine(Co::InvokeTask &&_coroutine) noexcept;
 
 	/**
-	 * Finish the stopwatch for the current query and return its
-	 * duration.  If no query was in progress, return a negative
+	 * The response to the oldest pending command is complete.
+	 * Remove it from #pending_commands and return its duration.
+	 * If its duration is not measured, return a negative
 	 * duration.
 	 */
-	Event::Duration MaybeFinishQuery() noexcept;
+	Event::Duration FinishCommand() noexcept;
 
 	/* virtual methods from ClusterNodeObserver */
 	void OnClusterNodeUnavailable() noexcept override;
 
+	/* virtual methods from NodeQueueHandler */
+	void OnNodeQueueReady() noexcept override;
+	void OnNodeQueueTimeout() noexcept override;
+
 	/* virtual methods from PeerSocketHandler */
 	void OnPeerClosed() noexcept override;
 	WriteResult OnPeerWrite() override;
@@ -252,10 +761,3 @@ private:
 	void OnSocketConnectSuccess(UniqueSocketDescriptor fd) noexcept override;
 	void OnSocketConnectError(std::exception_ptr e) noexcept override;
 };
-
-/**
- * Delay forwarding client input for the specified duration.  Can be
- * used to throttle the connection.
- */
-void
-connection_delay(Connection *c, unsigned delay_ms);
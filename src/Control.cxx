@@ -6,14 +6,24 @@
 #include "event/net/control/Server.hxx"
 #include "net/SocketAddress.hxx"
 #include "net/SocketConfig.hxx"
+#include "time/Cast.hxx"
 #include "util/PrintException.hxx"
 #include "util/SpanCast.hxx"
 
 #include <fmt/core.h>
 
+#include <algorithm> // for std::count_if()
+
+using std::string_view_literals::operator""sv;
+
 void
 Instance::AddControlListener(const SocketConfig &config)
 {
+	if (IsWorker())
+		/* control packets are received by the main instance
+		   and passed on to all workers */
+		return;
+
 	BengControl::Handler &handler = *this;
 	control_listeners.emplace_front(event_loop, config.Create(SOCK_DGRAM),
 					handler);
@@ -33,12 +43,62 @@ Instance::DisconnectDatabase(std::string_view account) noexcept
 		fmt::print(stderr, "Closed {} connections for account {:?}\n", n, account);
 }
 
+/**
+ * Is this a valid MySQL database name?  It must not be empty, must
+ * not be longer than 64 (UTF-8) characters, must not end with a space
+ * and must not contain a slash, a backslash, a dot or a null byte.
+ */
+[[gnu::pure]]
+static bool
+IsValidDatabaseName(std::string_view name) noexcept
+{
+	/* count all bytes except UTF-8 continuation bytes */
+	const auto n_characters = std::count_if(name.begin(), name.end(), [](char ch){
+		return (static_cast<unsigned char>(ch) & 0xc0) != 0x80;
+	});
+
+	return !name.empty() && n_characters <= 64 &&
+		name.back() != ' ' &&
+		name.find_first_of("/\\.\0"sv) == name.npos;
+}
+
+inline void
+Instance::FlushQueryCache(std::string_view database) noexcept
+{
+	if (database.empty())
+		query_cache.Clear();
+	else
+		query_cache.Invalidate(database);
+}
+
+inline void
+Instance::LogTopStats() const noexcept
+{
+	const auto total = CollectStats();
+
+	for (const auto *item : total.accounts.GetTop(AccountStats::REPORT_SIZE))
+		fmt::print(stderr, "Account {:?}: {} queries (+{}), {} errors, {} bytes, {:.3f}s wait\n",
+			   item->key,
+			   item->weight, item->error,
+			   item->counters.n_query_errors,
+			   item->counters.n_bytes,
+			   ToFloatSeconds(item->counters.query_wait));
+
+	for (const auto *item : total.digests.GetTop(DigestStats::REPORT_SIZE))
+		fmt::print(stderr, "Digest {:?}: {:.3f}s wait (+{:.3f}s), {:.3f}s max, {} queries, {} errors, {} rows\n",
+			   item->key,
+			   item->weight * 1e-9, item->error * 1e-9,
+			   ToFloatSeconds(item->counters.max_query_wait),
+			   item->counters.n_queries,
+			   item->counters.n_query_errors,
+			   item->counters.n_affected_rows);
+
+	fmt::print(stderr, "{}", total.slow_queries.Format());
+}
+
 void
-Instance::OnControlPacket(BengControl::Command command,
-			  std::span<const std::byte> payload,
-			  [[maybe_unused]] std::span<UniqueFileDescriptor> fds,
-			  [[maybe_unused]] SocketAddress address,
-			  [[maybe_unused]] int uid)
+Instance::HandleControlPacket(BengControl::Command command,
+			      std::span<const std::byte> payload) noexcept
 {
 	using namespace BengControl;
 
@@ -52,7 +112,6 @@ Instance::OnControlPacket(BengControl::Command command,
 	case Command::ENABLE_NODE:
 	case Command::FADE_NODE:
 	case Command::NODE_STATUS:
-	case Command::STATS:
 	case Command::VERBOSE:
 	case Command::FADE_CHILDREN:
 	case Command::DISABLE_ZEROCONF:
@@ -61,7 +120,6 @@ Instance::OnControlPacket(BengControl::Command command,
 	case Command::FLUSH_FILTER_CACHE:
 	case Command::STOPWATCH_PIPE:
 	case Command::DISCARD_SESSION:
-	case Command::FLUSH_HTTP_CACHE:
 	case Command::ENABLE_QUEUE:
 	case Command::DISABLE_QUEUE:
 	case Command::RELOAD_STATE:
@@ -78,9 +136,43 @@ Instance::OnControlPacket(BengControl::Command command,
 		if (!payload.empty())
 			DisconnectDatabase(ToStringView(payload));
 		break;
+
+	case Command::FLUSH_HTTP_CACHE:
+		/* myproxy has no HTTP cache; this command (which
+		   existing beng-proxy control clients can send)
+		   flushes the query cache */
+		if (const auto database = ToStringView(payload);
+		    database.empty() || IsValidDatabaseName(database))
+			FlushQueryCache(database);
+		else if (!IsWorker())
+			fmt::print(stderr, "Ignoring FLUSH_HTTP_CACHE with malformed database name {:?}\n",
+				   database);
+		break;
+
+	case Command::STATS:
+		/* the main instance collects the statistics of all
+		   workers */
+		if (!IsWorker())
+			LogTopStats();
+		break;
 	}
 }
 
+void
+Instance::OnControlPacket(BengControl::Command command,
+			  std::span<const std::byte> payload,
+			  [[maybe_unused]] std::span<UniqueFileDescriptor> fds,
+			  [[maybe_unused]] SocketAddress address,
+			  [[maybe_unused]] int uid)
+{
+	HandleControlPacket(command, payload);
+
+	for (auto &worker : workers)
+		worker.Post([command, payload=std::vector<std::byte>{payload.begin(), payload.end()}](Instance &instance){
+			instance.HandleControlPacket(command, payload);
+		});
+}
+
 void
 Instance::OnControlError(std::exception_ptr &&error) noexcept
 {
@@ -7,23 +7,107 @@
 #include "memory/SliceFifoBuffer.hxx"
 #include "memory/fb_pool.hxx"
 
+#include <cstdint>
+
 /**
  * A frontend for #SliceFifoBuffer which allows to replace it with a
  * simple heap-allocated buffer when some client code gets copied to
  * another project.
+ *
+ * The buffer size adapts to the traffic: if the buffer is found full
+ * repeatedly when data gets consumed (i.e. each receive fills it
+ * completely, for example while a large result set is being
+ * streamed), the next allocation uses a larger size class (see
+ * fb_class_size()).  If the data fits into the next smaller class
+ * for a while, the buffer shrinks again.  The new size takes effect
+ * the next time the buffer is empty.
  */
 class DefaultFifoBuffer : public SliceFifoBuffer {
+	/**
+	 * Grow after the buffer was found full this many times in a
+	 * row.
+	 */
+	static constexpr uint_least8_t GROW_THRESHOLD = 4;
+
+	/**
+	 * Shrink after the data fit into the next smaller class this
+	 * many times in a row.
+	 */
+	static constexpr uint_least8_t SHRINK_THRESHOLD = 16;
+
+	/**
+	 * The size class for the next allocation; see fb_pool_get().
+	 */
+	uint_least8_t size_class = 0;
+
+	uint_least8_t n_full = 0, n_small = 0;
+
+	/**
+	 * Has the fill level been sampled since the last
+	 * AllocateIfNull() call?
+	 */
+	bool sampled = false;
+
 public:
 	void Allocate() noexcept {
-		SliceFifoBuffer::Allocate(fb_pool_get());
+		SliceFifoBuffer::Allocate(fb_pool_get(size_class));
 	}
 
+	/**
+	 * This is called before receiving more data into the buffer.
+	 */
 	void AllocateIfNull() noexcept {
-		SliceFifoBuffer::AllocateIfNull(fb_pool_get());
+		sampled = false;
+
+		if (!IsNull() && empty() &&
+		    GetCapacity() != fb_class_size(size_class))
+			/* the size class has changed; switch to a
+			   new buffer while we don't need to copy
+			   anything */
+			Free();
+
+		if (IsNull())
+			Allocate();
 	}
 
 	void CycleIfEmpty() noexcept {
-		SliceFifoBuffer::CycleIfEmpty(fb_pool_get());
+		SliceFifoBuffer::CycleIfEmpty(fb_pool_get(size_class));
+	}
+
+	void Consume(std::size_t n) noexcept {
+		if (!sampled) {
+			sampled = true;
+			Sample();
+		}
+
+		SliceFifoBuffer::Consume(n);
+	}
+
+private:
+	/**
+	 * Inspect the fill level after data has been received and
+	 * adjust #size_class.
+	 */
+	void Sample() noexcept {
+		if (IsFull()) {
+			n_small = 0;
+
+			if (size_class + 1U < FB_N_CLASSES &&
+			    ++n_full >= GROW_THRESHOLD) {
+				++size_class;
+				n_full = 0;
+			}
+		} else {
+			n_full = 0;
+
+			if (size_class == 0 ||
+			    GetAvailable() > fb_class_size(size_class - 1))
+				n_small = 0;
+			else if (++n_small >= SHRINK_THRESHOLD) {
+				--size_class;
+				n_small = 0;
+			}
+		}
 	}
 };
 
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "TopKSketch.hxx"
+#include "event/Chrono.hxx"
+
+#include <algorithm> // for std::max()
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+struct DigestCounters {
+	uint_least64_t n_queries = 0;
+	uint_least64_t n_query_errors = 0;
+	uint_least64_t n_affected_rows = 0;
+
+	Event::Duration query_wait{}, max_query_wait{};
+
+	void Add(const DigestCounters &src) noexcept {
+		n_queries += src.n_queries;
+		n_query_errors += src.n_query_errors;
+		n_affected_rows += src.n_affected_rows;
+		query_wait += src.query_wait;
+		max_query_wait = std::max(max_query_wait, src.max_query_wait);
+	}
+};
+
+/**
+ * Counters for the query digests (see MakeQueryDigest()) which
+ * cost the most server time.  The weight of an item is its
+ * (estimated) total wait time in nanoseconds.
+ */
+class DigestStats : public TopKSketch<DigestCounters> {
+public:
+	static constexpr std::size_t CAPACITY = 1024;
+
+	/**
+	 * The number of digests reported by the Prometheus exporter
+	 * and the `STATS` control command.
+	 */
+	static constexpr std::size_t REPORT_SIZE = 32;
+
+	DigestStats() noexcept
+		:TopKSketch(CAPACITY) {}
+
+	void Update(std::string_view digest,
+		    const DigestCounters &counters) noexcept {
+		const auto weight = std::chrono::duration_cast<std::chrono::nanoseconds>(counters.query_wait);
+		TopKSketch::Update(digest, counters,
+				   static_cast<uint_least64_t>(weight.count()));
+	}
+};
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "DefaultFifoBuffer.hxx"
+#include "event/net/BufferedSocket.hxx"
+
+#include <cstddef>
+#include <span>
+
+/**
+ * The decoded input of a connection whose raw socket data needs to be
+ * transformed before it can be parsed, i.e. decompressed (see
+ * #MysqlCompression) or decrypted (see #TlsSession).  It implements
+ * the subset of the #BufferedSocket API used by #MysqlReader.
+ */
+class FilteredInput {
+	BufferedSocket &socket;
+
+	DefaultFifoBuffer buffer;
+
+public:
+	explicit FilteredInput(BufferedSocket &_socket) noexcept
+		:socket(_socket) {}
+
+	~FilteredInput() noexcept {
+		if (!buffer.IsNull())
+			buffer.Free();
+	}
+
+	FilteredInput(const FilteredInput &) = delete;
+	FilteredInput &operator=(const FilteredInput &) = delete;
+
+	/**
+	 * The buffer which receives decoded data.
+	 */
+	DefaultFifoBuffer &GetBuffer() noexcept {
+		return buffer;
+	}
+
+	bool IsEmpty() const noexcept {
+		return buffer.empty();
+	}
+
+	bool IsFull() const noexcept {
+		return buffer.IsFull();
+	}
+
+	std::span<const std::byte> ReadBuffer() const noexcept {
+		return buffer.Read();
+	}
+
+	void DisposeConsumed(std::size_t nbytes) noexcept {
+		buffer.Consume(nbytes);
+	}
+
+	/**
+	 * More decoded data is needed; this means more data must be
+	 * received from the socket.
+	 */
+	void ScheduleRead() noexcept {
+		socket.ScheduleRead();
+	}
+};
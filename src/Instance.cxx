@@ -3,11 +3,15 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Instance.hxx"
+#include "Check.hxx"
+#include "Cluster.hxx"
 #include "Config.hxx"
 #include "Connection.hxx"
 #include "event/net/PrometheusExporterListener.hxx"
+#include "net/AllocatedSocketAddress.hxx"
 #include "net/SocketConfig.hxx"
 #include "system/Error.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
 
 #ifdef ENABLE_CONTROL
 #include "event/net/control/Server.hxx"
@@ -22,15 +26,28 @@ extern "C" {
 #include <systemd/sd-daemon.h>
 #endif
 
+#include <fmt/core.h>
+
+#include <algorithm> // for std::find()
+#include <cassert>
 #include <cstddef>
 
 #include <signal.h>
 #include <sys/socket.h>
 
-Instance::Instance()
-	:sighup_event(event_loop, SIGHUP, BIND_THIS_METHOD(OnReload)),
+Instance::Instance(const Instance *_main_instance)
+	:main_instance(_main_instance),
+	 sighup_event(event_loop, SIGHUP, BIND_THIS_METHOD(OnReload)),
 	 lua_state(luaL_newstate())
 {
+	if (IsWorker()) {
+		/* signals are handled by the main instance */
+#ifdef HAVE_LIBSYSTEMD
+		systemd_watchdog.Disable();
+#endif // HAVE_LIBSYSTEMD
+		return;
+	}
+
 	shutdown_listener.Enable();
 	sighup_event.Enable();
 }
@@ -39,9 +56,12 @@ Instance::~Instance() noexcept = default;
 
 inline void
 Instance::AddListener(UniqueSocketDescriptor &&fd,
-		      std::shared_ptr<LuaHandler> &&handler) noexcept
+		      std::shared_ptr<LuaHandler> &&handler,
+		      std::shared_ptr<TlsContext> tls_context) noexcept
 {
-	listeners.emplace_front(event_loop, event_loop, stats, std::move(handler));
+	listeners.emplace_front(event_loop, event_loop, stats, backend_pool,
+				query_cache, policy, std::move(handler),
+				std::move(tls_context));
 	listeners.front().Listen(std::move(fd));
 }
 
@@ -62,18 +82,53 @@ MakeListener(SocketAddress address)
 	return config.Create(socktype);
 }
 
+void
+Instance::AddSharedListeners(std::shared_ptr<LuaHandler> &&handler,
+			     const std::shared_ptr<TlsContext> &tls_context)
+{
+	assert(IsWorker());
+
+	if (n_shared_listener_groups >= main_instance->listener_groups.size())
+		throw std::runtime_error{"Worker configuration has more listeners than the main configuration"};
+
+	for (const auto fd : main_instance->listener_groups[n_shared_listener_groups++]) {
+		auto dup = fd.Duplicate();
+		if (!dup.IsDefined())
+			throw MakeErrno("Failed to duplicate listener socket");
+
+		AddListener(std::move(dup), std::shared_ptr<LuaHandler>{handler},
+			    tls_context);
+	}
+}
+
 void
 Instance::AddListener(SocketAddress address,
-		      std::shared_ptr<LuaHandler> handler)
+		      std::shared_ptr<LuaHandler> handler,
+		      std::shared_ptr<TlsContext> tls_context)
 {
-	AddListener(MakeListener(address), std::move(handler));
+	if (IsWorker()) {
+		AddSharedListeners(std::move(handler), tls_context);
+		return;
+	}
+
+	auto fd = MakeListener(address);
+	listener_groups.emplace_back().emplace_back(fd);
+	AddListener(std::move(fd), std::move(handler), std::move(tls_context));
 }
 
 #ifdef HAVE_LIBSYSTEMD
 
 void
-Instance::AddSystemdListener(std::shared_ptr<LuaHandler> handler)
+Instance::AddSystemdListener(std::shared_ptr<LuaHandler> handler,
+			     std::shared_ptr<TlsContext> tls_context)
 {
+	if (IsWorker()) {
+		/* the environment variables have already been
+		   cleared by the main instance */
+		AddSharedListeners(std::move(handler), tls_context);
+		return;
+	}
+
 	int n = sd_listen_fds(true);
 	if (n < 0)
 		throw MakeErrno("sd_listen_fds() failed");
@@ -81,15 +136,20 @@ Instance::AddSystemdListener(std::shared_ptr<LuaHandler> handler)
 	if (n == 0)
 		throw std::runtime_error{"No systemd socket"};
 
-	for (unsigned i = 0; i < unsigned(n); ++i)
-		AddListener(UniqueSocketDescriptor(AdoptTag{}, SD_LISTEN_FDS_START + i),
-			    std::shared_ptr<LuaHandler>{handler});
+	auto &group = listener_groups.emplace_back();
+
+	for (unsigned i = 0; i < unsigned(n); ++i) {
+		UniqueSocketDescriptor fd(AdoptTag{}, SD_LISTEN_FDS_START + i);
+		group.emplace_back(fd);
+		AddListener(std::move(fd), std::shared_ptr<LuaHandler>{handler},
+			    tls_context);
+	}
 }
 
 #endif // HAVE_LIBSYSTEMD
 
-void
-Instance::AddPrometheusListener(SocketAddress address)
+static UniqueSocketDescriptor
+CreateExporterSocket(SocketAddress address)
 {
 	const SocketConfig config{
 		.bind_address = AllocatedSocketAddress{address},
@@ -99,12 +159,34 @@ Instance::AddPrometheusListener(SocketAddress address)
 		.tcp_no_delay = true,
 	};
 
+	return config.Create(SOCK_STREAM);
+}
+
+void
+Instance::AddPrometheusListener(SocketAddress address)
+{
+	if (IsWorker())
+		/* only the main instance exports (aggregated)
+		   statistics */
+		return;
+
 	PrometheusExporterHandler &handler = *this;
 	prometheus_exporters.emplace_front(event_loop,
-					   config.Create(SOCK_STREAM),
+					   CreateExporterSocket(address),
 					   handler);
 }
 
+void
+Instance::AddSlowQueryListener(SocketAddress address)
+{
+	if (IsWorker())
+		return;
+
+	slow_query_exporters.emplace_front(event_loop,
+					   CreateExporterSocket(address),
+					   slow_query_exporter);
+}
+
 void
 Instance::Check()
 {
@@ -113,13 +195,45 @@ Instance::Check()
 }
 
 void
-Instance::OnShutdown() noexcept
+Instance::EnableUring() noexcept
 {
-	shutdown_listener.Disable();
-	sighup_event.Disable();
+#ifdef HAVE_URING
+	try {
+		event_loop.EnableUring(1024, 0);
+	} catch (...) {
+		fmt::print(stderr, "Failed to initialize io_uring, falling back to epoll: {}\n",
+			   std::current_exception());
+	}
+#else
+	fmt::print(stderr, "io_uring support is not compiled in, using epoll\n");
+#endif
+}
 
+void
+Instance::AddWorker(const Worker::SetupFunction &setup)
+{
+	assert(!IsWorker());
+
+	workers.emplace_front(*this, setup);
+}
+
+Stats
+Instance::CollectStats() const noexcept
+{
+	Stats total = stats;
+	total.CollectIoBuffers();
+	for (const auto &worker : workers)
+		worker.AddStats(total);
+	return total;
+}
+
+void
+Instance::Shutdown() noexcept
+{
 	listeners.clear();
 	prometheus_exporters.clear();
+	slow_query_exporters.clear();
+	backend_pool.Clear();
 
 #ifdef HAVE_LIBSYSTEMD
 	systemd_watchdog.Disable();
@@ -130,8 +244,74 @@ Instance::OnShutdown() noexcept
 	event_loop.Break();
 }
 
+void
+Instance::OnShutdown() noexcept
+{
+	shutdown_listener.Disable();
+	sighup_event.Disable();
+
+	/* this waits for all worker threads to exit */
+	workers.clear();
+
+	Shutdown();
+}
+
 void
 Instance::OnReload(int) noexcept
 {
-	reload.Start();
+	Reload();
+
+	for (auto &worker : workers)
+		worker.Post([](Instance &instance){
+			instance.Reload();
+		});
+}
+
+void
+Instance::SetClusterNodeState(std::size_t cluster_index,
+			      SocketAddress address,
+			      CheckServerResult result) noexcept
+{
+	assert(IsWorker());
+
+	if (cluster_index < clusters.size() &&
+	    clusters[cluster_index] != nullptr)
+		clusters[cluster_index]->SetNodeState(address, result);
+}
+
+bool
+Instance::OnClusterCreated(Cluster &cluster) noexcept
+{
+	clusters.push_back(&cluster);
+
+	/* only the main instance checks the nodes; it passes the
+	   results on to all workers */
+	return !IsWorker();
+}
+
+void
+Instance::OnClusterDestroyed(Cluster &cluster) noexcept
+{
+	if (auto i = std::find(clusters.begin(), clusters.end(), &cluster);
+	    i != clusters.end())
+		*i = nullptr;
+}
+
+void
+Instance::OnClusterNodeChecked(const Cluster &cluster,
+			       SocketAddress address,
+			       CheckServerResult result) noexcept
+{
+	assert(!IsWorker());
+
+	const auto i = std::find(clusters.begin(), clusters.end(), &cluster);
+	if (i == clusters.end())
+		return;
+
+	const std::size_t cluster_index = std::distance(clusters.begin(), i);
+
+	for (auto &worker : workers)
+		worker.Post([cluster_index, address=AllocatedSocketAddress{address}, result](Instance &instance){
+			instance.SetClusterNodeState(cluster_index, address, result);
+		});
 }
@@ -4,8 +4,13 @@
 
 #pragma once
 
+#include "BackendPool.hxx"
+#include "ClusterMonitor.hxx"
 #include "Listener.hxx"
+#include "Policy.hxx"
+#include "QueryCache.hxx"
 #include "Stats.hxx"
+#include "Worker.hxx"
 #include "lua/ReloadRunner.hxx"
 #include "lua/State.hxx"
 #include "event/Loop.hxx"
@@ -25,17 +30,25 @@
 #endif
 
 #include <forward_list>
+#include <vector>
 
 struct SocketConfig;
+class Cluster;
 class PrometheusExporterListener;
 namespace BengControl { class Server; }
 
 class Instance final
-	: PrometheusExporterHandler
+	: PrometheusExporterHandler, ClusterMonitor
 #ifdef ENABLE_CONTROL
 	, BengControl::Handler
 #endif
 {
+	/**
+	 * The main instance if this is a #Worker; nullptr if this is
+	 * the main instance.
+	 */
+	const Instance *const main_instance;
+
 	EventLoop event_loop;
 
 	ShutdownListener shutdown_listener{event_loop, BIND_THIS_METHOD(OnShutdown)};
@@ -46,22 +59,80 @@ class Instance final
 	Systemd::Watchdog systemd_watchdog{event_loop};
 #endif // HAVE_LIBSYSTEMD
 
+	/**
+	 * All #Cluster objects created by the configuration in the
+	 * order of their creation (destroyed ones are nullptr).  The
+	 * main instance and all workers load the same configuration,
+	 * so an index refers to the same cluster in all threads.
+	 *
+	 * This must be declared before #lua_state because the
+	 * #Cluster destructor accesses it.
+	 */
+	std::vector<Cluster *> clusters;
+
 	Lua::State lua_state;
 
 	Lua::ReloadRunner reload{lua_state.get()};
 
 	std::forward_list<MyProxyListener> listeners;
 
+	/**
+	 * The listener sockets of the main instance, one group per
+	 * mysql_listen() call.  Workers share these sockets instead
+	 * of creating their own.
+	 */
+	std::vector<std::vector<SocketDescriptor>> listener_groups;
+
+	/**
+	 * Only used by workers: the number of mysql_listen() calls
+	 * so far, i.e. the index of the next #listener_groups item
+	 * of the main instance.
+	 */
+	std::size_t n_shared_listener_groups = 0;
+
 #ifdef ENABLE_CONTROL
 	std::forward_list<BengControl::Server> control_listeners;
 #endif
 
 	std::forward_list<PrometheusExporterListener> prometheus_exporters;
 
+	/**
+	 * Serves the #SlowQueryLog via HTTP (see
+	 * AddSlowQueryListener()).
+	 */
+	class SlowQueryExporter final : public PrometheusExporterHandler {
+		const Instance &instance;
+
+	public:
+		explicit SlowQueryExporter(const Instance &_instance) noexcept
+			:instance(_instance) {}
+
+		/* virtual methods from class PrometheusExporterHandler */
+		std::string OnPrometheusExporterRequest() override;
+		void OnPrometheusExporterError(std::exception_ptr error) noexcept override;
+	} slow_query_exporter{*this};
+
+	std::forward_list<PrometheusExporterListener> slow_query_exporters;
+
 	Stats stats;
 
+	BackendPool backend_pool{event_loop};
+
+	QueryCache query_cache{stats};
+
+	Policy policy;
+
+	/**
+	 * Only used by the main instance.
+	 */
+	std::forward_list<Worker> workers;
+
 public:
-	explicit Instance();
+	/**
+	 * @param _main_instance the main instance if this is a
+	 * #Worker
+	 */
+	explicit Instance(const Instance *_main_instance=nullptr);
 	~Instance() noexcept;
 
 	auto &GetEventLoop() noexcept {
@@ -76,32 +147,118 @@ public:
 		return stats;
 	}
 
+	/**
+	 * Sum up the statistics of this instance and all worker
+	 * threads.
+	 */
+	Stats CollectStats() const noexcept;
+
+	auto &GetBackendPool() noexcept {
+		return backend_pool;
+	}
+
+	auto &GetQueryCache() noexcept {
+		return query_cache;
+	}
+
+	auto &GetPolicy() noexcept {
+		return policy;
+	}
+
+	ClusterMonitor &GetClusterMonitor() noexcept {
+		return *this;
+	}
+
+	/**
+	 * Apply the result of a health check performed by the main
+	 * instance (see #ClusterMonitor).
+	 *
+	 * @param cluster_index an index into #clusters
+	 */
+	void SetClusterNodeState(std::size_t cluster_index,
+				 SocketAddress address,
+				 CheckServerResult result) noexcept;
+
+	/**
+	 * @param tls_context if set, then TLS is offered to
+	 * clients connecting via TCP
+	 */
 	void AddListener(UniqueSocketDescriptor &&fd,
-			 std::shared_ptr<LuaHandler> &&handler) noexcept;
+			 std::shared_ptr<LuaHandler> &&handler,
+			 std::shared_ptr<TlsContext> tls_context) noexcept;
 
 	void AddListener(SocketAddress address,
-			 std::shared_ptr<LuaHandler> handler);
+			 std::shared_ptr<LuaHandler> handler,
+			 std::shared_ptr<TlsContext> tls_context);
 
 	void AddControlListener(const SocketConfig &config);
 
 	void AddPrometheusListener(SocketAddress address);
 
+	/**
+	 * Create a HTTP listener which serves the #SlowQueryLog as
+	 * plain text.
+	 */
+	void AddSlowQueryListener(SocketAddress address);
+
+	/**
+	 * Try to enable io_uring for this instance's #EventLoop.  On
+	 * failure (e.g. because the kernel does not support it),
+	 * this logs a warning and the instance continues to use
+	 * epoll.
+	 */
+	void EnableUring() noexcept;
+
+	/**
+	 * Start a #Worker thread and wait until it has loaded its
+	 * configuration.  Throws on error.
+	 */
+	void AddWorker(const Worker::SetupFunction &setup);
+
+	/**
+	 * Close all listeners and stop the #EventLoop.
+	 */
+	void Shutdown() noexcept;
+
+	void Reload() noexcept {
+		reload.Start();
+	}
+
+#ifdef ENABLE_CONTROL
+	void HandleControlPacket(BengControl::Command command,
+				 std::span<const std::byte> payload) noexcept;
+#endif
+
 	/**
 	 * Listen for incoming connections on sockets passed by systemd
 	 * (systemd socket activation).
 	 */
 #ifdef HAVE_LIBSYSTEMD
-	void AddSystemdListener(std::shared_ptr<LuaHandler> handler);
+	void AddSystemdListener(std::shared_ptr<LuaHandler> handler,
+				std::shared_ptr<TlsContext> tls_context);
 #endif
 
 	void Check();
 
 private:
+	bool IsWorker() const noexcept {
+		return main_instance != nullptr;
+	}
+
+	/**
+	 * Duplicate the next listener group of the main instance
+	 * (for a #Worker).
+	 */
+	void AddSharedListeners(std::shared_ptr<LuaHandler> &&handler,
+				const std::shared_ptr<TlsContext> &tls_context);
+
 	void OnShutdown() noexcept;
 	void OnReload(int) noexcept;
 
 #ifdef ENABLE_CONTROL
 	void DisconnectDatabase(std::string_view account) noexcept;
+	void FlushQueryCache(std::string_view database) noexcept;
+	void LogTopStats() const noexcept;
 
 	/* virtual methods from class ControlHandler */
 	void OnControlPacket(BengControl::Command command,
@@ -115,4 +272,11 @@ private:
 	/* virtual methods from class PrometheusExporterHandler */
 	std::string OnPrometheusExporterRequest() override;
 	void OnPrometheusExporterError(std::exception_ptr error) noexcept override;
+
+	/* virtual methods from class ClusterMonitor */
+	bool OnClusterCreated(Cluster &cluster) noexcept override;
+	void OnClusterDestroyed(Cluster &cluster) noexcept override;
+	void OnClusterNodeChecked(const Cluster &cluster,
+				  SocketAddress address,
+				  CheckServerResult result) noexcept override;
 };
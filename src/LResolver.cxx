@@ -31,6 +31,8 @@ l_mysql_cluster(lua_State *L)
 try {
 	auto &event_loop = *(EventLoop *)lua_touserdata(L, lua_upvalueindex(1));
 	auto &stats = *(Stats *)lua_touserdata(L, lua_upvalueindex(2));
+	auto &backend_pool = *(BackendPool *)lua_touserdata(L, lua_upvalueindex(3));
+	auto &cluster_monitor = *(ClusterMonitor *)lua_touserdata(L, lua_upvalueindex(4));
 
 	if (lua_gettop(L) < 1)
 		return luaL_error(L, "Not enough parameters");
@@ -56,7 +58,7 @@ try {
 
 	luaL_argcheck(L, !nodes.empty(), 1, "Cluster is empty");
 
-	Cluster::New(L, event_loop, stats,
+	Cluster::New(L, event_loop, stats, backend_pool, cluster_monitor,
 		     std::move(nodes), std::move(options));
 	return 1;
 } catch (...) {
@@ -64,7 +66,9 @@ try {
 }
 
 void
-RegisterLuaResolver(lua_State *L, EventLoop &event_loop, Stats &stats)
+RegisterLuaResolver(lua_State *L, EventLoop &event_loop, Stats &stats,
+		    BackendPool &backend_pool,
+		    ClusterMonitor &cluster_monitor)
 {
 	Cluster::Register(L);
 
@@ -79,7 +83,9 @@ RegisterLuaResolver(lua_State *L, EventLoop &event_loop, Stats &stats)
 	Lua::SetGlobal(L, "mysql_cluster",
 		       Lua::MakeCClosure(l_mysql_cluster,
 					 Lua::LightUserData{&event_loop},
-					 Lua::LightUserData{&stats}));
+					 Lua::LightUserData{&stats},
+					 Lua::LightUserData{&backend_pool},
+					 Lua::LightUserData{&cluster_monitor}));
 
 #ifdef ENABLE_CONTROL
 	static constexpr struct addrinfo control_hints{
@@ -7,10 +7,13 @@
 struct lua_State;
 struct Stats;
 class EventLoop;
+class BackendPool;
+class ClusterMonitor;
 
 void
 RegisterLuaResolver(lua_State *L, EventLoop &event_loop,
-		    Stats &stats);
+		    Stats &stats, BackendPool &backend_pool,
+		    ClusterMonitor &cluster_monitor);
 
 void
 UnregisterLuaResolver(lua_State *L);
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/Chrono.hxx"
+
+#include <chrono>
+#include <cmath> // for std::exp()
+
+/**
+ * An exponentially weighted moving average of durations.  The
+ * weight of old samples decays with time (not with the number of
+ * samples), so busy and idle servers are comparable.
+ *
+ * The average also decays while there are no new samples: a server
+ * which receives no queries (e.g. because it was found to be slow)
+ * appears to become faster over time, which gives it a chance to
+ * prove that it has recovered.
+ */
+class LatencyEwma {
+	using Duration = std::chrono::duration<double>;
+
+	Duration value{};
+
+	Event::TimePoint last_update{};
+
+public:
+	/**
+	 * The time constant: after this duration, the weight of old
+	 * samples has decayed to 1/e.
+	 */
+	static constexpr Duration TAU = std::chrono::seconds{1};
+
+	void Record(Event::Duration sample, Event::TimePoint now) noexcept {
+		const double w = GetDecay(now);
+		value = value * w + Duration{sample} * (1 - w);
+		last_update = now;
+	}
+
+	[[gnu::pure]]
+	Event::Duration Get(Event::TimePoint now) const noexcept {
+		return std::chrono::duration_cast<Event::Duration>(value * GetDecay(now));
+	}
+
+	/**
+	 * Merge the value of another instance (e.g. from another
+	 * worker thread).  There is no meaningful sum of averages, so
+	 * this keeps the more recent one.
+	 */
+	void Add(const LatencyEwma &src) noexcept {
+		if (src.last_update > last_update)
+			*this = src;
+	}
+
+private:
+	[[gnu::pure]]
+	double GetDecay(Event::TimePoint now) const noexcept {
+		return std::exp(-Duration{now - last_update} / TAU);
+	}
+};
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/Chrono.hxx"
+
+#include <algorithm> // for std::upper_bound()
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * A histogram of durations with fixed bucket boundaries.  Each
+ * worker thread records into its own instance (without locking or
+ * atomics); the per-thread copies are merged with Add() when
+ * statistics are collected.
+ *
+ * The counters are not cumulative; the Prometheus exporter sums
+ * them up.
+ */
+class LatencyHistogram {
+	using Duration = std::chrono::microseconds;
+
+public:
+	/**
+	 * The (inclusive) upper bounds of the buckets, except for the
+	 * last bucket which has no upper bound.
+	 */
+	static constexpr std::array BOUNDS{
+		Duration{100},
+		Duration{250},
+		Duration{500},
+		Duration{1000},
+		Duration{2500},
+		Duration{5000},
+		Duration{10000},
+		Duration{25000},
+		Duration{50000},
+		Duration{100000},
+		Duration{250000},
+		Duration{500000},
+		Duration{1000000},
+		Duration{2500000},
+		Duration{5000000},
+		Duration{10000000},
+	};
+
+	static constexpr std::size_t N_BUCKETS = BOUNDS.size() + 1;
+
+private:
+	std::array<uint_least64_t, N_BUCKETS> buckets{};
+
+public:
+	void Record(Event::Duration d) noexcept {
+		/* find the first bound which is not smaller; rounding
+		   up to whole microseconds means a duration never
+		   ends up in a bucket whose bound is lower */
+		const auto i = std::lower_bound(BOUNDS.begin(), BOUNDS.end(),
+						std::chrono::ceil<Duration>(d));
+		++buckets[static_cast<std::size_t>(i - BOUNDS.begin())];
+	}
+
+	/**
+	 * Returns the number of durations in the given bucket (not
+	 * cumulative).
+	 */
+	uint_least64_t operator[](std::size_t i) const noexcept {
+		return buckets[i];
+	}
+
+	/**
+	 * Add the values of another instance (e.g. from another
+	 * worker thread).
+	 */
+	void Add(const LatencyHistogram &src) noexcept {
+		for (std::size_t i = 0; i < N_BUCKETS; ++i)
+			buckets[i] += src.buckets[i];
+	}
+};
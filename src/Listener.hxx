@@ -11,7 +11,12 @@
 #include <memory>
 
 struct Stats;
+class BackendPool;
+class QueryCache;
+class Policy;
+class TlsContext;
 
 using MyProxyListener =
-	TemplateServerSocket<Connection, EventLoop &, Stats &,
-			     std::shared_ptr<LuaHandler>>;
+	TemplateServerSocket<Connection, EventLoop &, Stats &, BackendPool &,
+			     QueryCache &, Policy &, std::shared_ptr<LuaHandler>,
+			     std::shared_ptr<TlsContext>>;
@@ -7,9 +7,9 @@
 #include "CommandLine.hxx"
 #include "LHandler.hxx"
 #include "LResolver.hxx"
-#include "Policy.hxx"
 #include "LClient.hxx"
 #include "LAction.hxx"
+#include "Options.hxx"
 #include "lua/Error.hxx"
 #include "lua/PushCClosure.hxx"
 #include "lua/RunFile.hxx"
@@ -54,6 +54,10 @@
 #include "lua/pg/Init.hxx"
 #endif
 
+#ifdef HAVE_TLS
+#include "TlsContext.hxx"
+#endif
+
 extern "C" {
 #include <lauxlib.h>
 #include <lualib.h>
@@ -63,7 +67,9 @@ extern "C" {
 #include <systemd/sd-daemon.h>
 #endif
 
+#include <algorithm> // for std::max(), std::min()
 #include <stdexcept>
+#include <thread> // for std::thread::hardware_concurrency()
 #include <utility> // for std::unreachable()
 
 #include <stddef.h>
@@ -99,6 +105,31 @@ GetGlobalBool(lua_State *L, const char *name)
 	return lua_toboolean(L, -1);
 }
 
+/**
+ * @return the value of a global variable which must be a
+ * non-negative integer, or the specified default value if it is
+ * not set
+ */
+static unsigned
+GetGlobalUnsigned(lua_State *L, const char *name, unsigned default_value,
+		  unsigned max_value=1024)
+{
+	lua_getglobal(L, name);
+	AtScopeExit(L) { lua_pop(L, 1); };
+
+	if (lua_isnil(L, -1))
+		return default_value;
+
+	if (!lua_isnumber(L, -1))
+		throw FmtRuntimeError("Bad value for '{}'", name);
+
+	const auto value = lua_tonumber(L, -1);
+	if (value < 0 || value > max_value || value != static_cast<unsigned>(value))
+		throw FmtRuntimeError("Bad value for '{}'", name);
+
+	return static_cast<unsigned>(value);
+}
+
 static auto
 ParameterToLuaHandler(lua_State *L, int idx)
 try {
@@ -113,18 +144,36 @@ l_mysql_listen(lua_State *L)
 try {
 	auto &instance = *(Instance *)lua_touserdata(L, lua_upvalueindex(1));
 
-	if (lua_gettop(L) != 2)
-		return luaL_error(L, "Invalid parameter count");
+	if (lua_gettop(L) < 2)
+		return luaL_error(L, "Not enough parameters");
+	if (lua_gettop(L) > 3)
+		return luaL_error(L, "Too many parameters");
 
 	auto handler = ParameterToLuaHandler(L, 2);
 
+	ListenOptions options;
+	if (lua_gettop(L) >= 3)
+		options.ApplyLuaTable(L, 3);
+
+	std::shared_ptr<TlsContext> tls_context;
+	if (!options.tls_cert.empty()) {
+#ifdef HAVE_TLS
+		tls_context = std::make_shared<TlsContext>(options.tls_cert.c_str(),
+							   options.tls_key.c_str());
+#else
+		luaL_argerror(L, 3, "myproxy was built without TLS support");
+#endif
+	}
+
 	if (lua_isstring(L, 1)) {
 		const auto address_string = Lua::ToStringView(L, 1);
 
-		instance.AddListener(LocalSocketAddress{address_string}, std::move(handler));
+		instance.AddListener(LocalSocketAddress{address_string}, std::move(handler),
+				     std::move(tls_context));
 #ifdef HAVE_LIBSYSTEMD
 	} else if (IsSystemdMagic(L, 1)) {
-		instance.AddSystemdListener(std::move(handler));
+		instance.AddSystemdListener(std::move(handler),
+					    std::move(tls_context));
 #endif // HAVE_LIBSYSTEMD
 	} else
 		luaL_argerror(L, 1, "path expected");
@@ -197,6 +246,24 @@ try {
 	Lua::RaiseCurrent(L);
 }
 
+static int
+l_slow_query_listen(lua_State *L)
+try {
+	auto &instance = *(Instance *)lua_touserdata(L, lua_upvalueindex(1));
+
+	if (lua_gettop(L) != 1)
+		return luaL_error(L, "Invalid parameter count");
+
+	if (lua_isstring(L, 1)) {
+		instance.AddSlowQueryListener(ParseSocketAddress(lua_tostring(L, 1), 9100, true));
+	} else
+		luaL_argerror(L, 1, "path expected");
+
+	return 0;
+} catch (...) {
+	Lua::RaiseCurrent(L);
+}
+
 static void
 SetupConfigState(lua_State *L, Instance &instance)
 {
@@ -224,7 +291,9 @@ SetupConfigState(lua_State *L, Instance &instance)
 #ifdef ENABLE_CONTROL
 	Lua::InitControlClient(L);
 #endif
-	RegisterLuaResolver(L, instance.GetEventLoop(), instance.GetStats());
+	RegisterLuaResolver(L, instance.GetEventLoop(), instance.GetStats(),
+			    instance.GetBackendPool(),
+			    instance.GetClusterMonitor());
 
 #ifdef HAVE_LIBSYSTEMD
 	Lua::SetGlobal(L, "systemd", Lua::LightUserData(&systemd_magic));
@@ -243,6 +312,10 @@ SetupConfigState(lua_State *L, Instance &instance)
 	Lua::SetGlobal(L, "prometheus_listen",
 		       Lua::MakeCClosure(l_prometheus_listen,
 					 Lua::LightUserData(&instance)));
+
+	Lua::SetGlobal(L, "slow_query_listen",
+		       Lua::MakeCClosure(l_slow_query_listen,
+					 Lua::LightUserData(&instance)));
 }
 
 static void
@@ -275,6 +348,7 @@ SetupRuntimeState(lua_State *L)
 	Lua::SetGlobal(L, "control_listen", nullptr);
 #endif // ENABLE_CONTROL
 	Lua::SetGlobal(L, "prometheus_listen", nullptr);
+	Lua::SetGlobal(L, "slow_query_listen", nullptr);
 
 	Lua::InitXattrTable(L);
 
@@ -284,6 +358,77 @@ SetupRuntimeState(lua_State *L)
 	RegisterLuaAction(L);
 }
 
+/**
+ * Apply the global variable "query_cache_size" (in megabytes per
+ * thread) to the #QueryCache.
+ */
+static void
+SetupQueryCache(Instance &instance, lua_State *L)
+{
+	const std::size_t size_mb =
+		GetGlobalUnsigned(L, "query_cache_size", 16, 65536);
+	instance.GetQueryCache().SetMaxSize(size_mb * 1024 * 1024);
+}
+
+/**
+ * Apply the global variable "slow_query_threshold" (in
+ * milliseconds) to the #SlowQueryLog.
+ */
+static void
+SetupSlowQueryLog(Instance &instance, lua_State *L)
+{
+	const unsigned threshold_ms =
+		GetGlobalUnsigned(L, "slow_query_threshold", 0, 3600 * 1000);
+	instance.GetStats().slow_queries.SetThreshold(std::chrono::milliseconds{threshold_ms});
+}
+
+/**
+ * Apply the global variables "user_query_time" (in milliseconds
+ * per second) and "user_query_time_burst" (in milliseconds) to the
+ * #Policy.
+ */
+static void
+SetupPolicy(Instance &instance, lua_State *L)
+{
+	const unsigned rate_ms =
+		GetGlobalUnsigned(L, "user_query_time", 0, 1000 * 1000);
+	const unsigned burst_ms =
+		GetGlobalUnsigned(L, "user_query_time_burst",
+				  std::min(10 * rate_ms, 3600U * 1000U),
+				  3600 * 1000);
+	instance.GetPolicy().Configure(std::chrono::milliseconds{rate_ms},
+				       std::chrono::milliseconds{burst_ms});
+}
+
+/**
+ * Load the configuration file into the #Instance of a #Worker
+ * thread.
+ */
+static void
+SetupWorker(Instance &instance, const Config &config)
+{
+	lua_State *const L = instance.GetLuaState();
+
+	SetupConfigState(L, instance);
+	LoadConfigFile(L, config.config_path);
+	instance.Check();
+	SetupQueryCache(instance, L);
+	SetupSlowQueryLog(instance, L);
+	SetupPolicy(instance, L);
+
+	if (GetGlobalBool(L, "populate_io_buffers"))
+		fb_pool_get().Populate();
+
+	if (GetGlobalBool(L, "io_uring"))
+		instance.EnableUring();
+
+	SetupRuntimeState(L);
+
+#ifdef HAVE_LIBSYSTEMD
+	InitAsyncResolver(instance.GetEventLoop(), L);
+#endif
+}
+
 int
 main(int argc, char **argv) noexcept
 try {
@@ -308,10 +453,19 @@ try {
 	Instance instance;
 	SetupConfigState(instance.GetLuaState(), instance);
 
+	unsigned n_workers;
+
 	try {
 		LoadConfigFile(instance.GetLuaState(), config.config_path);
 
 		instance.Check();
+		SetupQueryCache(instance, instance.GetLuaState());
+		SetupSlowQueryLog(instance, instance.GetLuaState());
+		SetupPolicy(instance, instance.GetLuaState());
+
+		n_workers = GetGlobalUnsigned(instance.GetLuaState(), "workers", 1);
+		if (n_workers == 0)
+			n_workers = std::max(std::thread::hardware_concurrency(), 1U);
 	} catch (...) {
 		PrintException(std::current_exception());
 		return EX_CONFIG;
@@ -320,6 +474,9 @@ try {
 	if (GetGlobalBool(instance.GetLuaState(), "populate_io_buffers"))
 		fb_pool_get().Populate();
 
+	if (GetGlobalBool(instance.GetLuaState(), "io_uring"))
+		instance.EnableUring();
+
 	SetupRuntimeState(instance.GetLuaState());
 
 #ifdef HAVE_LIBSYSTEMD
@@ -327,7 +484,18 @@ try {
 			  instance.GetLuaState());
 #endif
 
-	policy_init();
+	try {
+		/* the main thread is the first worker; the others
+		   are started one after another because loading the
+		   configuration file changes the working directory */
+		for (unsigned i = 1; i < n_workers; ++i)
+			instance.AddWorker([&config](Instance &worker){
+				SetupWorker(worker, config);
+			});
+	} catch (...) {
+		PrintException(std::current_exception());
+		return EX_CONFIG;
+	}
 
 #ifdef HAVE_LIBSYSTEMD
 	/* tell systemd we're ready */
@@ -336,8 +504,6 @@ try {
 
 	instance.GetEventLoop().Run();
 
-	policy_deinit();
-
 	return EXIT_SUCCESS;
 } catch (...) {
 	PrintException(std::current_exception());
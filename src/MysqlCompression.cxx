@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#define ZLIB_CONST
+
+#include "MysqlCompression.hxx"
+#include "MysqlProtocol.hxx"
+#include "Stats.hxx"
+#include "event/net/BufferedSocket.hxx"
+#include "net/SocketProtocolError.hxx"
+
+#include <zlib.h>
+
+#include <algorithm> // for std::copy_n(), std::min()
+#include <chrono>
+#include <new> // for std::bad_alloc
+
+static constexpr std::size_t COMPRESSED_HEADER_SIZE =
+	sizeof(Mysql::CompressedPacketHeader);
+
+MysqlCompression::MysqlCompression(BufferedSocket &socket, NodeStats &_stats)
+	:stats(_stats),
+	 inflater(std::make_unique<z_stream>()),
+	 deflater(std::make_unique<z_stream>()),
+	 input(socket)
+{
+	/* with valid parameters, zlib can only fail due to a lack
+	   of memory */
+
+	if (inflateInit(inflater.get()) != Z_OK)
+		throw std::bad_alloc{};
+
+	if (deflateInit(deflater.get(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+		inflateEnd(inflater.get());
+		throw std::bad_alloc{};
+	}
+}
+
+MysqlCompression::~MysqlCompression() noexcept
+{
+	deflateEnd(deflater.get());
+	inflateEnd(inflater.get());
+}
+
+bool
+MysqlCompression::Decompress(BufferedSocket &socket)
+{
+	const auto start_time = std::chrono::steady_clock::now();
+
+	auto &buffer = input.GetBuffer();
+	buffer.AllocateIfNull();
+
+	bool progress = false;
+
+	while (true) {
+		auto src = socket.ReadBuffer();
+
+		if (input_remaining == 0 && !inflating) {
+			/* begin a new compressed packet */
+			if (src.size() < COMPRESSED_HEADER_SIZE)
+				break;
+
+			const auto &header = *reinterpret_cast<const Mysql::CompressedPacketHeader *>(src.data());
+			input_remaining = header.compressed_length;
+			input_stored = header.uncompressed_length == 0;
+
+			/* the next packet we send continues this
+			   sequence */
+			sequence_id = header.number + 1;
+
+			if (!input_stored) {
+				inflateReset(inflater.get());
+				inflating = true;
+			}
+
+			socket.DisposeConsumed(COMPRESSED_HEADER_SIZE);
+			stats.n_compressed_bytes_received += COMPRESSED_HEADER_SIZE + input_remaining;
+			progress = true;
+			continue;
+		}
+
+		const auto w = buffer.Write();
+		if (w.empty())
+			/* the decompressed input must be consumed
+			   first */
+			break;
+
+		src = src.first(std::min(src.size(), input_remaining));
+
+		std::size_t consumed, produced;
+
+		if (input_stored) {
+			if (src.empty())
+				break;
+
+			consumed = produced = std::min(src.size(), w.size());
+			std::copy_n(src.begin(), produced, w.begin());
+		} else {
+			auto &z = *inflater;
+			z.next_in = reinterpret_cast<const Bytef *>(src.data());
+			z.avail_in = src.size();
+			z.next_out = reinterpret_cast<Bytef *>(w.data());
+			z.avail_out = w.size();
+
+			const int result = inflate(&z, Z_NO_FLUSH);
+			consumed = src.size() - z.avail_in;
+			produced = w.size() - z.avail_out;
+
+			if (result == Z_STREAM_END) {
+				if (input_remaining > consumed)
+					/* garbage after the zlib
+					   stream */
+					throw SocketProtocolError{"Malformed compressed packet"};
+
+				inflating = false;
+			} else if (result == Z_BUF_ERROR) {
+				if (input_remaining == 0)
+					throw SocketProtocolError{"Truncated compressed packet"};
+
+				/* need more data from the socket */
+				break;
+			} else if (result != Z_OK)
+				throw SocketProtocolError{"Malformed compressed packet"};
+
+			if (consumed == 0 && produced == 0 && inflating)
+				break;
+		}
+
+		socket.DisposeConsumed(consumed);
+		input_remaining -= consumed;
+		buffer.Append(produced);
+		stats.n_decompressed_bytes_received += produced;
+		progress = true;
+	}
+
+	stats.compression_time += std::chrono::steady_clock::now() - start_time;
+	return progress;
+}
+
+inline std::size_t
+MysqlCompression::CollectHeader(std::span<const std::byte> src) noexcept
+{
+	const std::size_t n = std::min(src.size(),
+				       sizeof(output_header) - output_header_size);
+	std::copy_n(src.begin(), n, output_header + output_header_size);
+	output_header_size += n;
+
+	if (output_header_size == sizeof(output_header)) {
+		const auto &header = *reinterpret_cast<const Mysql::PacketHeader *>(output_header);
+		output_remaining = header.GetLength();
+
+		if (header.number == 0)
+			/* a new command begins; this restarts the
+			   sequence of compressed packets */
+			sequence_id = 0;
+	}
+
+	return n;
+}
+
+inline std::size_t
+MysqlCompression::FindChunkSize(std::span<const std::byte> src,
+				std::size_t max_size) noexcept
+{
+	std::size_t n = 0;
+
+	while (n < src.size() && n < max_size) {
+		if (output_remaining > 0) {
+			const std::size_t size = std::min({output_remaining,
+							   src.size() - n,
+							   max_size - n});
+			n += size;
+			output_remaining -= size;
+			continue;
+		}
+
+		/* the next packet may be added to this compressed
+		   packet only if it belongs to the same command; if
+		   its header is not complete, it starts the next
+		   compressed packet */
+		if (src.size() - n < sizeof(Mysql::PacketHeader) ||
+		    max_size - n < sizeof(Mysql::PacketHeader))
+			break;
+
+		const auto &header = *reinterpret_cast<const Mysql::PacketHeader *>(src.data() + n);
+		if (header.number == 0)
+			break;
+
+		n += sizeof(header);
+		output_remaining = header.GetLength();
+	}
+
+	return n;
+}
+
+std::pair<std::size_t, std::size_t>
+MysqlCompression::Compress(std::span<const std::byte> src,
+			   std::span<std::byte> dest) noexcept
+{
+	std::size_t consumed = 0;
+
+	if (output_remaining == 0 && output_header_size < sizeof(output_header)) {
+		consumed = CollectHeader(src);
+		src = src.subspan(consumed);
+
+		if (output_header_size < sizeof(output_header))
+			/* the header is incomplete */
+			return {consumed, 0};
+	}
+
+	/* leave room for the zlib overhead (see compressBound()) */
+	static constexpr std::size_t MIN_DEST_SIZE = 256;
+	if (dest.size() < COMPRESSED_HEADER_SIZE + MIN_DEST_SIZE)
+		return {consumed, 0};
+
+	auto &header = *reinterpret_cast<Mysql::CompressedPacketHeader *>(dest.data());
+	const auto payload = dest.subspan(COMPRESSED_HEADER_SIZE);
+
+	const std::size_t max_size =
+		std::min(payload.size() - payload.size() / 1024 - 64,
+			 Mysql::MAX_PAYLOAD_LENGTH);
+
+	const std::size_t header_size = output_header_size;
+	const std::size_t n = FindChunkSize(src, max_size - header_size);
+	const std::size_t uncompressed_size = header_size + n;
+	if (uncompressed_size == 0)
+		return {consumed, 0};
+
+	std::size_t compressed_size = 0;
+
+	if (uncompressed_size >= Mysql::MIN_COMPRESS_LENGTH) {
+		const auto start_time = std::chrono::steady_clock::now();
+
+		auto &z = *deflater;
+		deflateReset(&z);
+		z.next_out = reinterpret_cast<Bytef *>(payload.data());
+		z.avail_out = payload.size();
+
+		if (header_size > 0) {
+			z.next_in = reinterpret_cast<const Bytef *>(output_header);
+			z.avail_in = header_size;
+			deflate(&z, Z_NO_FLUSH);
+		}
+
+		z.next_in = reinterpret_cast<const Bytef *>(src.data());
+		z.avail_in = n;
+
+		if (deflate(&z, Z_FINISH) == Z_STREAM_END &&
+		    z.total_out < uncompressed_size)
+			compressed_size = z.total_out;
+
+		stats.compression_time += std::chrono::steady_clock::now() - start_time;
+	}
+
+	if (compressed_size > 0) {
+		header.compressed_length = compressed_size;
+		header.uncompressed_length = uncompressed_size;
+	} else {
+		/* too small or not compressible: store the payload
+		   as-is */
+		auto w = std::copy_n(output_header, header_size, payload.begin());
+		std::copy_n(src.begin(), n, w);
+
+		compressed_size = uncompressed_size;
+		header.compressed_length = compressed_size;
+		header.uncompressed_length = 0;
+	}
+
+	header.number = sequence_id++;
+	output_header_size = 0;
+
+	stats.n_uncompressed_bytes_sent += uncompressed_size;
+	stats.n_compressed_bytes_sent += COMPRESSED_HEADER_SIZE + compressed_size;
+
+	return {consumed + n, COMPRESSED_HEADER_SIZE + compressed_size};
+}
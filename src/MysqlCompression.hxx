@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "FilteredInput.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <utility> // for std::pair
+
+struct z_stream_s;
+struct NodeStats;
+class BufferedSocket;
+
+/**
+ * Implements the compressed protocol (#Mysql::CLIENT_COMPRESS,
+ * zlib) on a server connection.  Received data is decompressed into
+ * #input (which is then parsed by #MysqlReader just like the
+ * socket's input buffer), and data to be sent is compressed by
+ * Compress().
+ *
+ * Each compressed packet is a separate zlib stream.  Decompression
+ * is streaming, i.e. a compressed packet does not need to fit into
+ * a buffer.
+ */
+class MysqlCompression {
+	NodeStats &stats;
+
+	const std::unique_ptr<z_stream_s> inflater, deflater;
+
+	/**
+	 * The number of payload bytes of the current received
+	 * compressed packet which have not yet been consumed.
+	 */
+	std::size_t input_remaining = 0;
+
+	/**
+	 * Is the payload of the current received compressed packet
+	 * stored without compression?
+	 */
+	bool input_stored;
+
+	/**
+	 * Has #inflater not yet finished the current compressed
+	 * packet?  It may have more output even if all of its input
+	 * has been consumed.
+	 */
+	bool inflating = false;
+
+	/**
+	 * The number of payload bytes of the current (uncompressed)
+	 * packet to be sent which have not yet been passed to
+	 * Compress().  This is used to find the beginning of new
+	 * commands.
+	 */
+	std::size_t output_remaining = 0;
+
+	/**
+	 * The header of the next (uncompressed) packet to be sent;
+	 * it may be split across Compress() calls.
+	 */
+	std::byte output_header[4];
+	std::size_t output_header_size = 0;
+
+	/**
+	 * The sequence_id of the next compressed packet to be sent.
+	 * It is reset at the beginning of each command and
+	 * continues the sequence of received compressed packets.
+	 */
+	uint_least8_t sequence_id = 0;
+
+public:
+	FilteredInput input;
+
+	/**
+	 * Throws std::bad_alloc if zlib fails to initialize.
+	 */
+	MysqlCompression(BufferedSocket &socket, NodeStats &_stats);
+	~MysqlCompression() noexcept;
+
+	MysqlCompression(const MysqlCompression &) = delete;
+	MysqlCompression &operator=(const MysqlCompression &) = delete;
+
+	/**
+	 * Is there no partially received compressed packet and no
+	 * pending decompressed input?
+	 */
+	bool IsIdle() const noexcept {
+		return input_remaining == 0 && !inflating && input.IsEmpty();
+	}
+
+	/**
+	 * Decompress data from the socket's input buffer into #input
+	 * (as much as fits).  Throws on error.
+	 *
+	 * @return true if data has been consumed from the socket's
+	 * input buffer or has been added to #input
+	 */
+	bool Decompress(BufferedSocket &socket);
+
+	/**
+	 * Compress data into one compressed packet.  A compressed
+	 * packet never contains data of more than one command.
+	 *
+	 * @param src raw data (a stream of regular packets)
+	 * @param dest a buffer for the compressed packet
+	 * @return the number of bytes consumed from #src and the
+	 * number of bytes written to #dest (may be zero if #dest is
+	 * too small or if only a part of a packet header was
+	 * consumed)
+	 */
+	std::pair<std::size_t, std::size_t> Compress(std::span<const std::byte> src,
+						     std::span<std::byte> dest) noexcept;
+
+private:
+	/**
+	 * Collect the header of the next packet to be sent in
+	 * #output_header.
+	 *
+	 * @return the number of bytes consumed from #src
+	 */
+	std::size_t CollectHeader(std::span<const std::byte> src) noexcept;
+
+	/**
+	 * Determine how many bytes of #src can be added to the
+	 * current compressed packet without mixing commands.
+	 */
+	std::size_t FindChunkSize(std::span<const std::byte> src,
+				  std::size_t max_size) noexcept;
+};
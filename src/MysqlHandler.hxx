@@ -4,8 +4,11 @@
 
 #pragma once
 
+#include "net/SocketDescriptor.hxx"
+
 #include <cstddef>
 #include <span>
+#include <utility> // for std::unreachable()
 
 class MysqlHandler {
 public:
@@ -64,4 +67,51 @@ public:
 	 * been consumed
 	 */
 	virtual std::pair<RawResult, std::size_t> OnMysqlRaw(std::span<const std::byte> src) noexcept = 0;
+
+	enum class DirectResult {
+		/**
+		 * Some data has been forwarded.
+		 */
+		OK,
+
+		/**
+		 * The handler cannot consume data currently.
+		 */
+		BLOCKING,
+
+		/**
+		 * The socket has no data currently.
+		 */
+		EMPTY,
+
+		/**
+		 * The peer has closed the socket.
+		 */
+		END,
+
+		/**
+		 * The #MysqlReader has been closed.
+		 */
+		CLOSED,
+
+		/**
+		 * Receiving from the socket has failed; errno
+		 * contains the error code.
+		 */
+		ERRNO,
+	};
+
+	/**
+	 * Like OnMysqlRaw(), but the handler shall receive the raw
+	 * data directly from the socket, e.g. with splice().  This is
+	 * only used after MysqlReader::EnableDirect().
+	 *
+	 * @param max the maximum number of bytes to be consumed
+	 * @return a #DirectResult code and the number of bytes that
+	 * have been consumed
+	 */
+	virtual std::pair<DirectResult, std::size_t> OnMysqlDirect([[maybe_unused]] SocketDescriptor fd,
+								   [[maybe_unused]] std::size_t max) noexcept {
+		std::unreachable();
+	}
 };
@@ -59,7 +59,6 @@ MakeHandshakeResponse41(uint_least8_t sequence_id, uint_least32_t client_flag,
 		   MariaDB */
 		CLIENT_SECURE_CONNECTION;
 	client_flag &= ~(CLIENT_CONNECT_WITH_DB|
-			 CLIENT_COMPRESS|
 			 CLIENT_SSL|
 			 CLIENT_PLUGIN_AUTH|CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA|
 			 CLIENT_CONNECT_ATTRS);
@@ -180,4 +179,18 @@ MakeInitDb(uint_least8_t sequence_id, std::string_view database)
 	return s;
 }
 
+void
+AppendPacket(std::vector<std::byte> &dest, uint_least8_t sequence_id,
+	     std::span<const std::byte> payload) noexcept
+{
+	const PacketHeader header{
+		.length = static_cast<uint_least32_t>(payload.size()),
+		.number = sequence_id,
+	};
+
+	const auto *h = reinterpret_cast<const std::byte *>(&header);
+	dest.insert(dest.end(), h, h + sizeof(header));
+	dest.insert(dest.end(), payload.begin(), payload.end());
+}
+
 } // namespace Mysql
@@ -8,6 +8,7 @@
 #include <cstdint>
 #include <span>
 #include <string_view>
+#include <vector>
 
 namespace Mysql {
 
@@ -52,4 +53,12 @@ MakeQuery(uint_least8_t sequence_id, std::string_view query);
 PacketSerializer
 MakeInitDb(uint_least8_t sequence_id, std::string_view database);
 
+/**
+ * Append a packet (header and payload) to a buffer, e.g. to replay
+ * a recorded response later.
+ */
+void
+AppendPacket(std::vector<std::byte> &dest, uint_least8_t sequence_id,
+	     std::span<const std::byte> payload) noexcept;
+
 } // namespace Mysql
@@ -111,6 +111,20 @@ ParseHandshakeResponse(std::span<const std::byte> payload)
 	return packet;
 }
 
+bool
+IsSslRequest(std::span<const std::byte> payload) noexcept
+{
+	/* https://dev.mysql.com/doc/dev/mysql-server/latest/page_protocol_connection_phase_packets_protocol_ssl_request.html */
+
+	if (payload.size() != 32)
+		return false;
+
+	PacketDeserializer d{payload};
+	const uint_least32_t capabilities = d.ReadInt4();
+	return (capabilities & CLIENT_PROTOCOL_41) != 0 &&
+		(capabilities & CLIENT_SSL) != 0;
+}
+
 AuthSwitchRequest
 ParseAuthSwitchRequest(std::span<const std::byte> payload)
 {
@@ -294,6 +308,60 @@ ParseQuery(std::span<const std::byte> payload, uint_least32_t capabilities)
 	return packet;
 }
 
+QueryPacket
+ParseStmtPrepare(std::span<const std::byte> payload)
+{
+	assert(!payload.empty());
+	assert(payload.front() == static_cast<std::byte>(Command::STMT_PREPARE));
+
+	PacketDeserializer d{payload};
+	QueryPacket packet{};
+
+	d.ReadInt1(); // command
+	packet.query = d.ReadRestOfPacketString();
+
+	return packet;
+}
+
+StmtPacket
+ParseStmt(std::span<const std::byte> payload)
+{
+	assert(!payload.empty());
+
+	PacketDeserializer d{payload};
+	StmtPacket packet{};
+
+	const auto command = static_cast<Command>(d.ReadInt1());
+	packet.statement_id = d.ReadInt4();
+
+	if (command == Command::STMT_EXECUTE)
+		packet.flags = d.ReadInt1();
+
+	return packet;
+}
+
+PrepareOkPacket
+ParsePrepareOk(std::span<const std::byte> payload)
+{
+	assert(!payload.empty());
+	assert(payload.front() == static_cast<std::byte>(Command::OK));
+
+	PacketDeserializer d{payload};
+	PrepareOkPacket packet{};
+
+	d.ReadInt1(); // status
+	packet.statement_id = d.ReadInt4();
+	packet.num_columns = d.ReadInt2();
+	packet.num_params = d.ReadInt2();
+
+	if (!d.empty()) {
+		d.ReadInt1(); // reserved_1
+		packet.warnings = d.ReadInt2();
+	}
+
+	return packet;
+}
+
 QueryMetadataPacket
 ParseQueryMetadata(std::span<const std::byte> payload)
 {
@@ -47,6 +47,15 @@ struct HandshakeResponsePacket {
 HandshakeResponsePacket
 ParseHandshakeResponse(std::span<const std::byte> payload);
 
+/**
+ * Is this an `SSLRequest` packet, i.e. a truncated
+ * HandshakeResponse41 asking the server to switch to TLS before
+ * the real HandshakeResponse is sent?
+ */
+[[gnu::pure]]
+bool
+IsSslRequest(std::span<const std::byte> payload) noexcept;
+
 struct AuthSwitchRequest {
 	std::string_view auth_plugin_name;
 	std::string_view auth_plugin_data;
@@ -104,6 +113,42 @@ struct QueryPacket {
 QueryPacket
 ParseQuery(std::span<const std::byte> payload, uint_least32_t capabilities);
 
+/**
+ * Parse a `COM_STMT_PREPARE` packet.
+ */
+QueryPacket
+ParseStmtPrepare(std::span<const std::byte> payload);
+
+/**
+ * The common part of the `COM_STMT_*` packets which refer to a
+ * prepared statement.
+ */
+struct StmtPacket {
+	uint_least32_t statement_id;
+
+	/**
+	 * The cursor flags (`COM_STMT_EXECUTE` only, zero for all
+	 * other commands).
+	 */
+	uint_least8_t flags;
+};
+
+StmtPacket
+ParseStmt(std::span<const std::byte> payload);
+
+/**
+ * The first packet of a successful response to
+ * `COM_STMT_PREPARE`.
+ */
+struct PrepareOkPacket {
+	uint_least32_t statement_id;
+	uint_least16_t num_columns, num_params;
+	uint_least16_t warnings;
+};
+
+PrepareOkPacket
+ParsePrepareOk(std::span<const std::byte> payload);
+
 struct QueryMetadataPacket {
 	unsigned column_count;
 };
@@ -21,7 +21,14 @@ enum class Command : uint_least8_t {
 	QUIT = 0x01,
 	INIT_DB = 0x02,
 	QUERY = 0x03,
+	PING = 0x0e,
 	CHANGE_USER = 0x11,
+	STMT_PREPARE = 0x16,
+	STMT_EXECUTE = 0x17,
+	STMT_SEND_LONG_DATA = 0x18,
+	STMT_CLOSE = 0x19,
+	STMT_RESET = 0x1a,
+	STMT_FETCH = 0x1c,
 	RESET_CONNECTION = 0x1f,
 	EOF_ = 0xfe,
 	ERR = 0xff,
@@ -31,6 +38,7 @@ enum class ErrorCode : uint_least16_t {
 	HANDSHAKE_ERROR = 1043,
 	DBACCESS_DENIED_ERROR = 1044,
 	UNKNOWN_COM_ERROR = 1047,
+	QUERY_TIMEOUT = 3024,
 };
 
 static constexpr uint_least32_t CLIENT_MYSQL = 1;
@@ -83,6 +91,9 @@ static constexpr uint_least16_t SERVER_STATUS_IN_TRANS_READONLY = 8192;
 static constexpr uint_least16_t SERVER_SESSION_STATE_CHANGED = 16384;
 static constexpr uint_least16_t SERVER_STATUS_ANSI_QUOTES = 32768;
 
+// for COM_STMT_EXECUTE.flags
+static constexpr uint_least8_t CURSOR_TYPE_NO_CURSOR = 0;
+
 struct Int2 {
 	uint8_t data[2];
 
@@ -178,6 +189,14 @@ public:
 	}
 };
 
+/**
+ * The maximum payload length of a single packet.  A packet with
+ * exactly this length is followed by another packet which continues
+ * the payload; the sequence ends with a shorter (possibly empty)
+ * packet.
+ */
+static constexpr std::size_t MAX_PAYLOAD_LENGTH = 0xffffff;
+
 struct PacketHeader {
 	Int3 length;
 	uint8_t number;
@@ -187,4 +206,26 @@ struct PacketHeader {
 	}
 };
 
+/**
+ * Payloads shorter than this are not compressed by the compressed
+ * protocol (#CLIENT_COMPRESS).
+ */
+static constexpr std::size_t MIN_COMPRESS_LENGTH = 50;
+
+/**
+ * The header of a packet of the compressed protocol
+ * (#CLIENT_COMPRESS).  Its payload contains one or more regular
+ * packets (or parts of them).
+ */
+struct CompressedPacketHeader {
+	Int3 compressed_length;
+	uint8_t number;
+
+	/**
+	 * The length of the payload after decompression; 0 means the
+	 * payload is not compressed.
+	 */
+	Int3 uncompressed_length;
+};
+
 } // namespace Mysql
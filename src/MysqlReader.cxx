@@ -3,14 +3,16 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "MysqlReader.hxx"
-#include "MysqlHandler.hxx"
 #include "MysqlProtocol.hxx"
+#include "FilteredInput.hxx"
 #include "event/net/BufferedSocket.hxx"
 
 #include <cassert>
+#include <type_traits> // for std::is_same_v
 
+template<typename Input>
 MysqlReader::ProcessResult
-MysqlReader::Process(BufferedSocket &socket) noexcept
+MysqlReader::Process(Input &socket) noexcept
 {
 	while (true) {
 		if (ignore_remaining > 0) {
@@ -55,6 +57,21 @@ MysqlReader::Process(BufferedSocket &socket) noexcept
 		auto payload = src.subspan(sizeof(header));
 
 		const std::size_t total_payload_size = header.GetLength();
+		const std::size_t total_packet_size = sizeof(header) + total_payload_size;
+
+		if (continuation != Continuation::NONE) {
+			/* this packet continues the payload of the
+			   previous one; no need to look at it */
+			const auto action = continuation;
+			if (total_payload_size < Mysql::MAX_PAYLOAD_LENGTH)
+				continuation = Continuation::NONE;
+
+			if (action == Continuation::FORWARD)
+				forward_remaining += total_packet_size;
+			else
+				ignore_remaining = total_packet_size;
+			continue;
+		}
 
 		bool complete = true;
 		if (payload.size() < total_payload_size)
@@ -67,11 +84,13 @@ MysqlReader::Process(BufferedSocket &socket) noexcept
 			   hold more */
 			return ProcessResult::MORE;
 
-		const std::size_t total_packet_size = sizeof(header) + total_payload_size;
+		const bool continued = total_payload_size == Mysql::MAX_PAYLOAD_LENGTH;
 
 		switch (handler.OnMysqlPacket(header.number, payload, complete)) {
 		case MysqlHandler::Result::FORWARD:
 			forward_remaining += total_packet_size;
+			if (continued)
+				continuation = Continuation::FORWARD;
 			break;
 
 		case MysqlHandler::Result::BLOCKING:
@@ -79,6 +98,8 @@ MysqlReader::Process(BufferedSocket &socket) noexcept
 
 		case MysqlHandler::Result::IGNORE:
 			ignore_remaining = total_packet_size;
+			if (continued)
+				continuation = Continuation::IGNORE;
 			break;
 
 		case MysqlHandler::Result::CLOSED:
@@ -87,8 +108,9 @@ MysqlReader::Process(BufferedSocket &socket) noexcept
 	}
 }
 
+template<typename Input>
 MysqlReader::FlushResult
-MysqlReader::Flush(BufferedSocket &socket) noexcept
+MysqlReader::Flush(Input &socket) noexcept
 {
 	if (forward_remaining > 0) {
 		switch (auto result = FlushForward(socket)) {
@@ -113,8 +135,9 @@ MysqlReader::Flush(BufferedSocket &socket) noexcept
 	return FlushResult::MORE;
 }
 
+template<typename Input>
 inline MysqlReader::FlushResult
-MysqlReader::FlushForward(BufferedSocket &socket) noexcept
+MysqlReader::FlushForward(Input &socket) noexcept
 {
 	assert(forward_remaining > 0);
 
@@ -132,6 +155,17 @@ MysqlReader::FlushForward(BufferedSocket &socket) noexcept
 
 		forward_remaining -= consumed;
 		socket.DisposeConsumed(consumed);
+
+		if constexpr (std::is_same_v<Input, BufferedSocket>) {
+			if (direct_threshold > 0 &&
+			    forward_remaining >= direct_threshold &&
+			    socket.IsEmpty())
+				/* the rest of this packet is large;
+				   let the handler receive it directly
+				   from the socket, bypassing our input
+				   buffer */
+				socket.SetDirect(true);
+		}
 		break;
 
 	case MysqlHandler::RawResult::CLOSED:
@@ -142,8 +176,41 @@ MysqlReader::FlushForward(BufferedSocket &socket) noexcept
 	return forward_remaining == 0 ? FlushResult::DRAINED : FlushResult::MORE;
 }
 
+void
+MysqlReader::DisableDirect(BufferedSocket &socket) noexcept
+{
+	direct_threshold = 0;
+	socket.SetDirect(false);
+}
+
+MysqlHandler::DirectResult
+MysqlReader::Direct(BufferedSocket &socket, SocketDescriptor fd) noexcept
+{
+	assert(socket.IsEmpty());
+
+	if (forward_remaining == 0) {
+		/* the packet is finished; the next header must go
+		   through the input buffer */
+		socket.SetDirect(false);
+		return MysqlHandler::DirectResult::EMPTY;
+	}
+
+	const auto [result, consumed] = handler.OnMysqlDirect(fd, forward_remaining);
+	if (result == MysqlHandler::DirectResult::OK) {
+		assert(consumed > 0);
+		assert(consumed <= forward_remaining);
+
+		forward_remaining -= consumed;
+		if (forward_remaining == 0)
+			socket.SetDirect(false);
+	}
+
+	return result;
+}
+
+template<typename Input>
 inline bool
-MysqlReader::FlushIgnore(BufferedSocket &socket) noexcept
+MysqlReader::FlushIgnore(Input &socket) noexcept
 {
 	assert(forward_remaining == 0);
 
@@ -164,3 +231,8 @@ MysqlReader::FlushIgnore(BufferedSocket &socket) noexcept
 		return false;
 	}
 }
+
+template MysqlReader::ProcessResult MysqlReader::Process(BufferedSocket &) noexcept;
+template MysqlReader::ProcessResult MysqlReader::Process(FilteredInput &) noexcept;
+template MysqlReader::FlushResult MysqlReader::Flush(BufferedSocket &) noexcept;
+template MysqlReader::FlushResult MysqlReader::Flush(FilteredInput &) noexcept;
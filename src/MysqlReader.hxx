@@ -4,11 +4,14 @@
 
 #pragma once
 
+#include "MysqlHandler.hxx"
+
 #include <cstddef>
+#include <cstdint>
 #include <span>
 
-class MysqlHandler;
 class BufferedSocket;
+class SocketDescriptor;
 
 class MysqlReader {
 	MysqlHandler &handler;
@@ -24,10 +27,38 @@ class MysqlReader {
 	 */
 	std::size_t ignore_remaining = 0;
 
+	/**
+	 * If non-zero, then forwarded raw data bypasses the input
+	 * buffer (MysqlHandler::OnMysqlDirect()) while at least this
+	 * number of bytes remains to be forwarded.
+	 */
+	std::size_t direct_threshold = 0;
+
+	/**
+	 * What to do with the next packet if the previous one had
+	 * #Mysql::MAX_PAYLOAD_LENGTH, i.e. its payload is continued
+	 * in the next packet.  Continuation packets are not passed
+	 * to MysqlHandler::OnMysqlPacket(); they share the fate of
+	 * the first packet.
+	 */
+	enum class Continuation : uint_least8_t {
+		NONE,
+		FORWARD,
+		IGNORE,
+	} continuation = Continuation::NONE;
+
 public:
 	explicit constexpr MysqlReader(MysqlHandler &_handler) noexcept
 		:handler(_handler) {}
 
+	/**
+	 * Is a packet currently being forwarded, i.e. was a packet
+	 * submitted to MysqlHandler::OnMysqlRaw() only partially?
+	 */
+	constexpr bool IsForwarding() const noexcept {
+		return forward_remaining > 0;
+	}
+
 	enum class ProcessResult {
 		/**
 		 * The Process() method has finished successfully.
@@ -51,10 +82,12 @@ public:
 	};
 
 	/**
-	 * Process data from a #BufferedSocket.  It will invoke
-	 * #MysqlReader.
+	 * Process data from a #BufferedSocket (or from a
+	 * #FilteredInput which implements the same methods).  It
+	 * will invoke #MysqlHandler.
 	 */
-	ProcessResult Process(BufferedSocket &socket) noexcept;
+	template<typename Input>
+	ProcessResult Process(Input &input) noexcept;
 
 	enum class FlushResult {
 		/**
@@ -83,13 +116,33 @@ public:
 	 * #MysqlHandler::Result::OK) or discard raw data (for
 	 * #MysqlHandler::Result::IGNORE).
 	 */
-	FlushResult Flush(BufferedSocket &socket) noexcept;
+	template<typename Input>
+	FlushResult Flush(Input &input) noexcept;
+
+	/**
+	 * Enable "direct" mode: the payload of large forwarded
+	 * packets is passed to MysqlHandler::OnMysqlDirect() instead
+	 * of going through the input buffer and OnMysqlRaw().
+	 */
+	void EnableDirect(std::size_t threshold) noexcept {
+		direct_threshold = threshold;
+	}
+
+	void DisableDirect(BufferedSocket &socket) noexcept;
+
+	/**
+	 * To be called by BufferedSocketHandler::OnBufferedDirect().
+	 */
+	MysqlHandler::DirectResult Direct(BufferedSocket &socket,
+					  SocketDescriptor fd) noexcept;
 
 private:
-	FlushResult FlushForward(BufferedSocket &socket) noexcept;
+	template<typename Input>
+	FlushResult FlushForward(Input &input) noexcept;
 
 	/**
 	 * @return true if ignore==0
 	 */
-	bool FlushIgnore(BufferedSocket &socket) noexcept;
+	template<typename Input>
+	bool FlushIgnore(Input &input) noexcept;
 };
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "MysqlResponseTracker.hxx"
+#include "MysqlDeserializer.hxx"
+#include "MysqlParser.hxx"
+#include "MysqlProtocol.hxx"
+
+#include <cassert>
+#include <utility> // for std::unreachable()
+
+namespace Mysql {
+
+/**
+ * Extract the status flags from an OK packet.  Unlike ParseOk(), this
+ * accepts both the 0x00 and the 0xfe header (the latter is used to
+ * terminate a resultset with #CLIENT_DEPRECATE_EOF).
+ */
+static uint_least16_t
+ReadOkStatusFlags(std::span<const std::byte> payload,
+		  uint_least32_t capabilities)
+{
+	PacketDeserializer d{payload};
+	d.ReadInt1(); // header
+	d.ReadLengthEncodedInteger(); // affected_rows
+	d.ReadLengthEncodedInteger(); // last_insert_id
+
+	if (capabilities & (CLIENT_PROTOCOL_41|CLIENT_TRANSACTIONS))
+		return d.ReadInt2();
+
+	return 0;
+}
+
+void
+ResponseTracker::OnCommand(Command cmd) noexcept
+{
+	if (state == State::UNKNOWN)
+		return;
+
+	switch (cmd) {
+	case Command::QUERY:
+	case Command::INIT_DB:
+	case Command::PING:
+	case Command::RESET_CONNECTION:
+	case Command::STMT_PREPARE:
+	case Command::STMT_EXECUTE:
+	case Command::STMT_RESET:
+		break;
+
+	case Command::STMT_SEND_LONG_DATA:
+	case Command::STMT_CLOSE:
+		/* the server does not respond to these */
+		return;
+
+	default:
+		/* we don't know the response format of this
+		   command */
+		OnUnknownCommand();
+		return;
+	}
+
+	const bool prepare = cmd == Command::STMT_PREPARE;
+
+	if (state != State::IDLE) {
+		/* the client has sent another command while the
+		   previous response was still pending; its response
+		   will follow after the current one */
+		if (n_queued >= MAX_QUEUED) {
+			OnUnknownCommand();
+			return;
+		}
+
+		if (prepare)
+			queued_prepare |= uint_least32_t{1} << n_queued;
+
+		++n_queued;
+		return;
+	}
+
+	preparing = prepare;
+	state = State::RESPONSE;
+}
+
+inline bool
+ResponseTracker::OnComplete() noexcept
+{
+	if (n_queued > 0) {
+		/* now wait for the response to the next pipelined
+		   command */
+		--n_queued;
+		preparing = (queued_prepare & 1) != 0;
+		queued_prepare >>= 1;
+		state = State::RESPONSE;
+	} else
+		state = State::IDLE;
+
+	return true;
+}
+
+inline bool
+ResponseTracker::OnEnd(uint_least16_t _status_flags) noexcept
+{
+	status_flags = _status_flags;
+
+	if (status_flags & SERVER_MORE_RESULTS_EXIST) {
+		state = State::RESPONSE;
+		return false;
+	}
+
+	return OnComplete();
+}
+
+inline bool
+ResponseTracker::OnPrepareMetadata() noexcept
+{
+	if (remaining_params > 0)
+		state = State::PARAM_DEFINITION;
+	else if (remaining_columns > 0)
+		state = State::COLUMN_DEFINITION;
+	else
+		return OnComplete();
+
+	return false;
+}
+
+inline bool
+ResponseTracker::OnFirstResponse(std::span<const std::byte> payload,
+				 uint_least32_t capabilities)
+{
+	if (preparing) {
+		switch (static_cast<Command>(payload.front())) {
+		case Command::OK:
+			{
+				const auto packet = ParsePrepareOk(payload);
+				remaining_params = packet.num_params;
+				remaining_columns = packet.num_columns;
+			}
+
+			return OnPrepareMetadata();
+
+		case Command::ERR:
+			return OnComplete();
+
+		default:
+			throw MalformedPacket{};
+		}
+	}
+
+	switch (static_cast<Command>(payload.front())) {
+	case Command::OK:
+		return OnEnd(ReadOkStatusFlags(payload, capabilities));
+
+	case Command::ERR:
+		/* an ERR packet doesn't have status flags; keep the
+		   old ones */
+		return OnComplete();
+
+	default:
+		break;
+	}
+
+	if (payload.front() == std::byte{0xfb}) {
+		/* LOCAL INFILE request - not supported */
+		state = State::UNKNOWN;
+		return false;
+	}
+
+	remaining_columns = ParseQueryMetadata(payload).column_count;
+	if (remaining_columns == 0)
+		throw MalformedPacket{};
+
+	state = State::COLUMN_DEFINITION;
+	return false;
+}
+
+bool
+ResponseTracker::OnResponse(std::span<const std::byte> payload, bool complete,
+			    uint_least32_t capabilities)
+{
+	assert(!payload.empty());
+
+	if (!complete) {
+		/* OK, ERR, EOF and the column count are small;
+		   only column definitions and rows can be larger
+		   than the input buffer */
+		switch (state) {
+		case State::PARAM_DEFINITION:
+		case State::COLUMN_DEFINITION:
+		case State::ROW:
+		case State::UNKNOWN:
+			break;
+
+		case State::IDLE:
+			return false;
+
+		case State::RESPONSE:
+		case State::PARAM_EOF:
+		case State::COLUMN_EOF:
+			throw MalformedPacket{};
+		}
+	}
+
+	switch (state) {
+	case State::IDLE:
+		/* unsolicited packet; the server may send an ERR
+		   packet before closing the connection */
+		return false;
+
+	case State::RESPONSE:
+		return OnFirstResponse(payload, capabilities);
+
+	case State::PARAM_DEFINITION:
+		assert(remaining_params > 0);
+
+		if (--remaining_params == 0) {
+			if ((capabilities & CLIENT_DEPRECATE_EOF) == 0) {
+				state = State::PARAM_EOF;
+				return false;
+			}
+
+			return OnPrepareMetadata();
+		}
+
+		return false;
+
+	case State::PARAM_EOF:
+		if (static_cast<Command>(payload.front()) != Command::EOF_)
+			throw MalformedPacket{};
+
+		return OnPrepareMetadata();
+
+	case State::COLUMN_DEFINITION:
+		assert(remaining_columns > 0);
+
+		if (--remaining_columns == 0) {
+			if ((capabilities & CLIENT_DEPRECATE_EOF) == 0)
+				state = State::COLUMN_EOF;
+			else if (preparing)
+				/* a COM_STMT_PREPARE response has
+				   no rows */
+				return OnComplete();
+			else
+				state = State::ROW;
+		}
+
+		return false;
+
+	case State::COLUMN_EOF:
+		if (static_cast<Command>(payload.front()) != Command::EOF_)
+			throw MalformedPacket{};
+
+		if (preparing)
+			return OnComplete();
+
+		state = State::ROW;
+		return false;
+
+	case State::ROW:
+		switch (static_cast<Command>(payload.front())) {
+		case Command::ERR:
+			return OnComplete();
+
+		case Command::EOF_:
+			/* a row may begin with 0xfe, too (a length
+			   encoded integer with 8 bytes), but then it
+			   is larger than the terminator packet */
+			if (!complete)
+				/* too large for a terminator */
+				break;
+
+			if (capabilities & CLIENT_DEPRECATE_EOF) {
+				if (payload.size() < MAX_PAYLOAD_LENGTH)
+					return OnEnd(ReadOkStatusFlags(payload, capabilities));
+			} else if (payload.size() < 9)
+				return OnEnd(ParseEof(payload, capabilities).status_flags);
+
+			break;
+
+		default:
+			break;
+		}
+
+		return false;
+
+	case State::UNKNOWN:
+		return false;
+	}
+
+	std::unreachable();
+}
+
+} // namespace Mysql
@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace Mysql {
+
+enum class Command : uint_least8_t;
+
+/**
+ * Follows the packets of a server connection in the command phase
+ * to find out when the response to a command is complete.  This
+ * allows determining whether the connection is idle (i.e. it could
+ * be used by somebody else).
+ *
+ * Commands whose response format is not understood by this class
+ * switch it to the "unknown" state which is never left again.
+ *
+ * The client may send more commands before the previous response is
+ * complete (pipelining); the server responds to them in order.
+ */
+class ResponseTracker {
+	enum class State : uint_least8_t {
+		/**
+		 * No command is pending.
+		 */
+		IDLE,
+
+		/**
+		 * Waiting for the first response packet (OK, ERR or
+		 * the column count of a resultset).
+		 */
+		RESPONSE,
+
+		/**
+		 * Receiving the parameter definitions of a
+		 * `COM_STMT_PREPARE` response.
+		 */
+		PARAM_DEFINITION,
+
+		/**
+		 * Waiting for the EOF packet after the parameter
+		 * definitions (only without #CLIENT_DEPRECATE_EOF).
+		 */
+		PARAM_EOF,
+
+		COLUMN_DEFINITION,
+
+		/**
+		 * Waiting for the EOF packet after the column
+		 * definitions (only without #CLIENT_DEPRECATE_EOF).
+		 */
+		COLUMN_EOF,
+
+		ROW,
+
+		/**
+		 * We lost track of the response; the connection
+		 * state is undefined.
+		 */
+		UNKNOWN,
+	} state = State::IDLE;
+
+	/**
+	 * The status flags of the most recent OK/EOF packet.
+	 */
+	uint_least16_t status_flags = 0;
+
+	/**
+	 * The number of column definitions still expected (in
+	 * #State::COLUMN_DEFINITION).
+	 */
+	uint_least64_t remaining_columns;
+
+	/**
+	 * The number of parameter definitions still expected (in
+	 * #State::PARAM_DEFINITION).
+	 */
+	uint_least16_t remaining_params;
+
+	/**
+	 * Is the current response the one to a `COM_STMT_PREPARE`?
+	 * Its format differs from all other responses.
+	 */
+	bool preparing = false;
+
+	/**
+	 * The maximum value of #n_queued.
+	 */
+	static constexpr std::size_t MAX_QUEUED = 32;
+
+	/**
+	 * The number of commands which have been sent after the one
+	 * whose response is currently being received.
+	 */
+	std::size_t n_queued = 0;
+
+	/**
+	 * A bit mask specifying which of the queued commands are
+	 * `COM_STMT_PREPARE`; bit 0 is the next one.
+	 */
+	uint_least32_t queued_prepare = 0;
+
+public:
+	bool IsIdle() const noexcept {
+		return state == State::IDLE;
+	}
+
+	bool IsUnknown() const noexcept {
+		return state == State::UNKNOWN;
+	}
+
+	uint_least16_t GetStatusFlags() const noexcept {
+		return status_flags;
+	}
+
+	/**
+	 * A command was sent to the server.
+	 */
+	void OnCommand(Command cmd) noexcept;
+
+	/**
+	 * A command was sent to the server whose response format is
+	 * not understood by this class (e.g. a `COM_STMT_EXECUTE`
+	 * which opens a cursor).
+	 */
+	void OnUnknownCommand() noexcept {
+		state = State::UNKNOWN;
+	}
+
+	/**
+	 * A packet was received from the server.  Throws
+	 * #MalformedPacket on error.
+	 *
+	 * @param payload a non-empty payload
+	 * @param complete false if the payload is only the beginning
+	 * of a larger packet (see MysqlHandler::OnMysqlPacket())
+	 * @param capabilities the negotiated capabilities
+	 * @return true if this packet has completed the response
+	 */
+	bool OnResponse(std::span<const std::byte> payload, bool complete,
+			uint_least32_t capabilities);
+
+private:
+	bool OnFirstResponse(std::span<const std::byte> payload,
+			     uint_least32_t capabilities);
+	bool OnEnd(uint_least16_t _status_flags) noexcept;
+
+	/**
+	 * Advance to the next part of a `COM_STMT_PREPARE` response
+	 * after the OK packet or after the parameter definitions.
+	 */
+	bool OnPrepareMetadata() noexcept;
+
+	/**
+	 * The response to the current command is complete.
+	 *
+	 * @return true
+	 */
+	bool OnComplete() noexcept;
+};
+
+} // namespace Mysql
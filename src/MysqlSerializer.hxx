@@ -10,14 +10,41 @@
 #include <algorithm> // for std::copy()
 #include <array>
 #include <cstddef>
+#include <memory>
 #include <span>
 
 namespace Mysql {
 
 struct PacketTooLarge {};
 
+/**
+ * Builds a packet.  Small packets are built in an internal buffer
+ * without allocating memory; larger ones are moved to a heap buffer
+ * which grows as needed.  Payloads of #MAX_PAYLOAD_LENGTH or more
+ * are split into multiple packets by Finish().
+ *
+ * Packets larger than the peer's output buffer rely on Peer::Send()
+ * queueing whatever the socket does not accept right away; it does
+ * not require the whole packet to be sent at once.
+ */
 class PacketSerializer {
-	std::array<std::byte, 1024> buffer;
+	static constexpr std::size_t INLINE_SIZE = 1024;
+
+	/**
+	 * The largest packet accepted by MySQL (the upper limit of
+	 * "max_allowed_packet").
+	 */
+	static constexpr std::size_t MAX_SIZE = 1024 * 1024 * 1024;
+
+	std::array<std::byte, INLINE_SIZE> inline_buffer;
+
+	/**
+	 * Replaces #inline_buffer as soon as the packet grows beyond
+	 * #INLINE_SIZE.
+	 */
+	std::unique_ptr<std::byte[]> heap_buffer;
+
+	std::size_t capacity = INLINE_SIZE;
 
 	std::size_t position = 0;
 
@@ -27,12 +54,16 @@ public:
 		header.number = sequence_id;
 	}
 
+	/**
+	 * Reserve space for the specified number of bytes.  The
+	 * returned span (and references returned by WriteT()) are
+	 * invalidated by the next write.
+	 */
 	std::span<std::byte> WriteN(std::size_t size) {
-		std::size_t max_size = buffer.size() - position;
-		if (size > max_size)
-			throw PacketTooLarge{};
+		if (size > capacity - position) [[unlikely]]
+			Grow(size);
 
-		const auto result = std::span{buffer}.subspan(position, size);
+		const auto result = GetBuffer().subspan(position, size);
 		position += size;
 		return result;
 	}
@@ -113,16 +144,86 @@ public:
 		WriteVariableLengthString(src);
 	}
 
+	/**
+	 * Fill in the packet header(s) and return the serialized
+	 * packet(s).
+	 */
 	std::span<const std::byte> Finish() {
-		auto &header = *reinterpret_cast<PacketHeader *>(buffer.data());
-		header.length = position - sizeof(header);
+		const std::size_t payload_size = position - sizeof(PacketHeader);
+		if (payload_size >= MAX_PAYLOAD_LENGTH) [[unlikely]]
+			Split(payload_size);
+		else
+			GetHeader().length = payload_size;
 
-		return std::span{buffer}.first(position);
+		return GetBuffer().first(position);
 	}
 
-	void WriteCommand(Command cmd) noexcept {
+	void WriteCommand(Command cmd) {
 		WriteInt1(static_cast<uint8_t>(cmd));
 	}
+
+private:
+	std::span<std::byte> GetBuffer() noexcept {
+		return {
+			heap_buffer ? heap_buffer.get() : inline_buffer.data(),
+			capacity,
+		};
+	}
+
+	PacketHeader &GetHeader() noexcept {
+		return *reinterpret_cast<PacketHeader *>(GetBuffer().data());
+	}
+
+	/**
+	 * Move the packet to a (larger) heap buffer with room for at
+	 * least the specified number of additional bytes.
+	 */
+	void Grow(std::size_t size) {
+		if (size > MAX_SIZE - position)
+			throw PacketTooLarge{};
+
+		const std::size_t new_capacity =
+			std::max(position + size, std::min(capacity * 2, MAX_SIZE));
+
+		auto new_buffer = std::make_unique_for_overwrite<std::byte[]>(new_capacity);
+		const auto old_data = GetBuffer().first(position);
+		std::copy(old_data.begin(), old_data.end(), new_buffer.get());
+
+		heap_buffer = std::move(new_buffer);
+		capacity = new_capacity;
+	}
+
+	/**
+	 * Split a large payload into packets of #MAX_PAYLOAD_LENGTH
+	 * bytes, followed by a shorter (possibly empty) packet.
+	 */
+	void Split(std::size_t payload_size) {
+		const std::size_t n_continuations = payload_size / MAX_PAYLOAD_LENGTH;
+		WriteN(n_continuations * sizeof(PacketHeader));
+
+		const auto buffer = GetBuffer();
+		auto *const first_header = reinterpret_cast<PacketHeader *>(buffer.data());
+		first_header->length = MAX_PAYLOAD_LENGTH;
+
+		/* move the chunks to their final positions, starting
+		   with the last one, and insert a header before each
+		   of them */
+		for (std::size_t i = n_continuations; i > 0; --i) {
+			const std::size_t src_offset = sizeof(PacketHeader) + i * MAX_PAYLOAD_LENGTH;
+			const std::size_t dest_offset = src_offset + i * sizeof(PacketHeader);
+			const std::size_t size = i == n_continuations
+				? payload_size - i * MAX_PAYLOAD_LENGTH
+				: MAX_PAYLOAD_LENGTH;
+
+			const auto src = buffer.subspan(src_offset, size);
+			std::copy_backward(src.begin(), src.end(),
+					   buffer.begin() + dest_offset + size);
+
+			auto &header = *reinterpret_cast<PacketHeader *>(buffer.data() + dest_offset - sizeof(PacketHeader));
+			header.length = size;
+			header.number = first_header->number + i;
+		}
+	}
 };
 
 } // namespace Mysql
@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "NodeQueue.hxx"
+#include "Stats.hxx"
+
+NodeQueue::NodeQueue(EventLoop &event_loop, NodeStats &_stats,
+		     std::size_t _max_running, Event::Duration _timeout) noexcept
+	:stats(_stats), max_running(_max_running), timeout(_timeout),
+	 timeout_timer(event_loop, BIND_THIS_METHOD(OnTimeout))
+{
+}
+
+NodeQueue::~NodeQueue() noexcept
+{
+	// all tickets must have been released
+	assert(n_running == 0);
+	assert(waiting.empty());
+}
+
+bool
+NodeQueue::Acquire(Ticket &ticket) noexcept
+{
+	assert(IsEnabled());
+	assert(ticket.queue == nullptr);
+	assert(!ticket.running);
+
+	ticket.queue = this;
+
+	if (n_running < max_running && waiting.empty()) {
+		ticket.running = true;
+		++n_running;
+		UpdateStats();
+		return true;
+	}
+
+	ticket.enqueue_time = timeout_timer.GetEventLoop().SteadyNow();
+	waiting.push_back(ticket);
+	++n_waiting;
+	++stats.n_queue_delayed;
+	UpdateStats();
+
+	if (!timeout_timer.IsPending())
+		timeout_timer.Schedule(timeout);
+
+	return false;
+}
+
+void
+NodeQueue::Release(Ticket &ticket) noexcept
+{
+	assert(ticket.queue == this);
+
+	ticket.queue = nullptr;
+
+	if (ticket.running) {
+		assert(n_running > 0);
+
+		ticket.running = false;
+		--n_running;
+		Admit();
+	} else {
+		assert(n_waiting > 0);
+
+		waiting.erase(waiting.iterator_to(ticket));
+		--n_waiting;
+	}
+
+	UpdateStats();
+}
+
+void
+NodeQueue::Admit() noexcept
+{
+	if (n_running >= max_running || waiting.empty())
+		return;
+
+	const auto now = timeout_timer.GetEventLoop().SteadyNow();
+
+	while (n_running < max_running && !waiting.empty()) {
+		auto &ticket = waiting.front();
+		waiting.pop_front();
+		--n_waiting;
+
+		ticket.running = true;
+		++n_running;
+
+		stats.queue_wait += now - ticket.enqueue_time;
+		ticket.handler.OnNodeQueueReady();
+	}
+
+	if (waiting.empty())
+		timeout_timer.Cancel();
+}
+
+inline void
+NodeQueue::UpdateStats() noexcept
+{
+	stats.n_queue_running = n_running;
+	stats.n_queue_waiting = n_waiting;
+}
+
+void
+NodeQueue::OnTimeout() noexcept
+{
+	const auto now = timeout_timer.GetEventLoop().SteadyNow();
+
+	while (!waiting.empty()) {
+		auto &ticket = waiting.front();
+		const auto wait = now - ticket.enqueue_time;
+		if (wait < timeout) {
+			timeout_timer.Schedule(timeout - wait);
+			break;
+		}
+
+		waiting.pop_front();
+		--n_waiting;
+		ticket.queue = nullptr;
+
+		++stats.n_queue_timeouts;
+		stats.queue_wait += wait;
+		ticket.handler.OnNodeQueueTimeout();
+	}
+
+	UpdateStats();
+}
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/CoarseTimerEvent.hxx"
+#include "event/Chrono.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <cassert>
+#include <cstddef>
+
+struct NodeStats;
+
+class NodeQueueHandler {
+public:
+	/**
+	 * The waiting #NodeQueue::Ticket is now running.
+	 */
+	virtual void OnNodeQueueReady() noexcept = 0;
+
+	/**
+	 * The #NodeQueue::Ticket has been waiting for too long and
+	 * has been removed from the queue.
+	 */
+	virtual void OnNodeQueueTimeout() noexcept = 0;
+};
+
+/**
+ * Admission control for one cluster node (#ClusterOptions::max_queries):
+ * limits the number of client connections which have commands
+ * running on the node.  The others wait in a FIFO queue until a
+ * running one finishes or until #ClusterOptions::queue_timeout
+ * expires.
+ *
+ * Each worker thread has its own #Cluster and thus its own
+ * instance, so the limit applies per thread.
+ */
+class NodeQueue {
+public:
+	class Ticket;
+
+private:
+	NodeStats &stats;
+
+	/**
+	 * The maximum number of running tickets; 0 means unlimited.
+	 */
+	const std::size_t max_running;
+
+	const Event::Duration timeout;
+
+	std::size_t n_running = 0, n_waiting = 0;
+
+	/**
+	 * The waiting tickets, the oldest one first.
+	 */
+	IntrusiveList<Ticket> waiting;
+
+	/**
+	 * Expires the oldest waiting ticket.
+	 */
+	CoarseTimerEvent timeout_timer;
+
+public:
+	NodeQueue(EventLoop &event_loop, NodeStats &_stats,
+		  std::size_t _max_running, Event::Duration _timeout) noexcept;
+	~NodeQueue() noexcept;
+
+	NodeQueue(const NodeQueue &) = delete;
+	NodeQueue &operator=(const NodeQueue &) = delete;
+
+	bool IsEnabled() const noexcept {
+		return max_running > 0;
+	}
+
+private:
+	bool Acquire(Ticket &ticket) noexcept;
+	void Release(Ticket &ticket) noexcept;
+
+	/**
+	 * Let waiting tickets run as long as the limit allows.
+	 */
+	void Admit() noexcept;
+
+	void UpdateStats() noexcept;
+
+	void OnTimeout() noexcept;
+};
+
+/**
+ * A client's claim for running a command on a node.
+ */
+class NodeQueue::Ticket final
+	: public IntrusiveListHook<IntrusiveHookMode::NORMAL>
+{
+	friend class NodeQueue;
+
+	NodeQueueHandler &handler;
+
+	/**
+	 * The queue this ticket is running on or waiting for;
+	 * nullptr if neither.
+	 */
+	NodeQueue *queue = nullptr;
+
+	Event::TimePoint enqueue_time;
+
+	bool running = false;
+
+public:
+	explicit Ticket(NodeQueueHandler &_handler) noexcept
+		:handler(_handler) {}
+
+	~Ticket() noexcept {
+		Release();
+	}
+
+	Ticket(const Ticket &) = delete;
+	Ticket &operator=(const Ticket &) = delete;
+
+	bool IsRunning() const noexcept {
+		return running;
+	}
+
+	bool IsWaiting() const noexcept {
+		return queue != nullptr && !running;
+	}
+
+	/**
+	 * Attempt to run a command on the node.
+	 *
+	 * @return true if the ticket is running now; false if it
+	 * has been queued and the #NodeQueueHandler will be invoked
+	 * later
+	 */
+	bool Acquire(NodeQueue &_queue) noexcept {
+		assert(queue == nullptr);
+
+		return _queue.Acquire(*this);
+	}
+
+	/**
+	 * Finish running or stop waiting.
+	 */
+	void Release() noexcept {
+		if (queue != nullptr)
+			queue->Release(*this);
+	}
+};
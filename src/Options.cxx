@@ -4,6 +4,7 @@
 
 #include "Options.hxx"
 #include "OptionsTable.hxx"
+#include "BackendPool.hxx"
 
 using std::string_view_literals::operator""sv;
 
@@ -26,10 +27,55 @@ ClusterOptions::ApplyLuaTable(lua_State *L, int table_idx)
 		else if (key == "disconnect_unavailable"sv)
 			disconnect_unavailable = Lua::CheckBool(L, value_idx,
 								"Bad `disconnect_unavailable` option");
+		else if (key == "warm"sv)
+			warm = Lua::CheckUnsigned(L, value_idx,
+						  "Bad 'warm' value");
+		else if (key == "warm_budget"sv)
+			warm_budget = Lua::CheckUnsigned(L, value_idx,
+							 "Bad 'warm_budget' value");
+		else if (key == "strategy"sv) {
+			const auto value = Lua::CheckStringView(L, value_idx,
+								"Bad 'strategy' value");
+			if (value == "rendezvous"sv)
+				strategy = Strategy::RENDEZVOUS;
+			else if (value == "least_loaded"sv)
+				strategy = Strategy::LEAST_LOADED;
+			else if (value == "bounded_load"sv)
+				strategy = Strategy::BOUNDED_LOAD;
+			else
+				throw Lua::ArgError{"Bad 'strategy' value"};
+		} else if (key == "load_bound"sv)
+			load_bound = Lua::CheckUnsigned(L, value_idx,
+							"Bad 'load_bound' value");
+		else if (key == "pick_cache"sv)
+			pick_cache = Lua::CheckUnsigned(L, value_idx,
+							"Bad 'pick_cache' value");
+		else if (key == "max_queries"sv)
+			max_queries = Lua::CheckUnsigned(L, value_idx,
+							 "Bad 'max_queries' value");
+		else if (key == "queue_timeout"sv)
+			queue_timeout = std::chrono::milliseconds{
+				Lua::CheckUnsigned(L, value_idx,
+						   "Bad 'queue_timeout' value")};
 		else
 			throw Lua::ArgError{"Unknown option"};
 	});
 
+	if (warm > BackendPool::MAX_IDLE_PER_KEY)
+		throw Lua::ArgError{"'warm' is too large"};
+
+	if (warm > 0 && warm_budget == 0)
+		throw Lua::ArgError{"'warm' without 'warm_budget'"};
+
+	if (load_bound > 1000)
+		throw Lua::ArgError{"'load_bound' is too large"};
+
+	if (pick_cache > 1024 * 1024)
+		throw Lua::ArgError{"'pick_cache' is too large"};
+
+	if (max_queries > 0 && queue_timeout <= Event::Duration{})
+		throw Lua::ArgError{"'max_queries' without 'queue_timeout'"};
+
 	if (monitoring) {
 		if (check.user.empty() && !check.password.empty())
 			throw Lua::ArgError{"'password' without 'user'"};
@@ -51,6 +97,24 @@ ClusterOptions::ApplyLuaTable(lua_State *L, int table_idx)
 	}
 }
 
+void
+ListenOptions::ApplyLuaTable(lua_State *L, int table_idx)
+{
+	Lua::ApplyOptionsTable(L, table_idx, [this, L](std::string_view key, auto value_idx){
+		if (key == "tls_cert"sv)
+			tls_cert = Lua::CheckStringView(L, value_idx,
+							"Bad 'tls_cert' value");
+		else if (key == "tls_key"sv)
+			tls_key = Lua::CheckStringView(L, value_idx,
+						       "Bad 'tls_key' value");
+		else
+			throw Lua::ArgError{"Unknown option"};
+	});
+
+	if (tls_cert.empty() != tls_key.empty())
+		throw Lua::ArgError{"'tls_cert' and 'tls_key' must be used together"};
+}
+
 void
 ConnectOptions::ApplyLuaTable(lua_State *L, int table_idx)
 {
@@ -58,7 +122,38 @@ ConnectOptions::ApplyLuaTable(lua_State *L, int table_idx)
 		if (key == "read_only"sv)
 			read_only = Lua::CheckBool(L, value_idx,
 						   "Bad 'read_only' value");
+		else if (key == "pool"sv)
+			pool = Lua::CheckBool(L, value_idx,
+					      "Bad 'pool' value");
+		else if (key == "multiplex"sv)
+			multiplex = Lua::CheckBool(L, value_idx,
+						   "Bad 'multiplex' value");
+		else if (key == "read_write_split"sv)
+			read_write_split = Lua::CheckBool(L, value_idx,
+							  "Bad 'read_write_split' value");
+		else if (key == "query_cache"sv)
+			query_cache = Lua::CheckUnsigned(L, value_idx,
+							 "Bad 'query_cache' value");
+		else if (key == "statement_cache"sv)
+			statement_cache = Lua::CheckUnsigned(L, value_idx,
+							     "Bad 'statement_cache' value");
+		else if (key == "compress"sv)
+			compress = Lua::CheckBool(L, value_idx,
+						  "Bad 'compress' value");
 		else
 			throw Lua::ArgError{"Unknown option"};
 	});
+
+	if (query_cache > 86400)
+		throw Lua::ArgError{"'query_cache' is too large"};
+
+	if (read_write_split) {
+		if (read_only)
+			throw Lua::ArgError{"'read_write_split' and 'read_only' are mutually exclusive"};
+
+		multiplex = true;
+	}
+
+	if (multiplex)
+		pool = true;
 }
@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include "event/Chrono.hxx"
+
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 struct lua_State;
@@ -20,6 +24,51 @@ struct CheckOptions {
 struct ClusterOptions {
 	CheckOptions check;
 
+	/**
+	 * How does Cluster::Pick() choose a node?
+	 */
+	enum class Strategy : uint_least8_t {
+		/**
+		 * Rendezvous hashing on the account: each account
+		 * always gets the same node (as long as its state
+		 * does not change).
+		 */
+		RENDEZVOUS,
+
+		/**
+		 * Of the two best nodes according to
+		 * #RENDEZVOUS, pick the one with less load (recent
+		 * query latency multiplied by the number of pending
+		 * commands).  Each account is spread over two
+		 * nodes, but degraded nodes receive less traffic.
+		 */
+		LEAST_LOADED,
+
+		/**
+		 * Like #RENDEZVOUS, but skip nodes which have more
+		 * clients than #load_bound allows ("consistent
+		 * hashing with bounded loads").  Most accounts keep
+		 * their node, but a few popular accounts cannot
+		 * overload a single node.
+		 */
+		BOUNDED_LOAD,
+	} strategy = Strategy::RENDEZVOUS;
+
+	/**
+	 * For Strategy::BOUNDED_LOAD: a node may have up to this
+	 * many percent more clients than the average of all
+	 * candidate nodes (per thread).
+	 */
+	unsigned load_bound = 25;
+
+	/**
+	 * Remember the best nodes of this many accounts (per
+	 * thread), so Cluster::Pick() does not need to look at all
+	 * nodes for each new client.  This is only useful for large
+	 * clusters.  0 disables the cache.
+	 */
+	std::size_t pick_cache = 0;
+
 	bool monitoring = false;
 
 	/**
@@ -28,6 +77,46 @@ struct ClusterOptions {
 	 */
 	bool disconnect_unavailable = false;
 
+	/**
+	 * Keep this many authenticated idle connections per node and
+	 * login (in the #BackendPool) ready for new clients which
+	 * connect with option "pool".  0 disables this feature.
+	 */
+	std::size_t warm = 0;
+
+	/**
+	 * The maximum total number of idle connections kept ready
+	 * by #warm (per thread).
+	 */
+	std::size_t warm_budget = 64;
+
+	/**
+	 * The maximum number of client connections with commands
+	 * running on each node at the same time (per thread); others
+	 * wait in the #NodeQueue.  0 means unlimited.
+	 */
+	std::size_t max_queries = 0;
+
+	/**
+	 * Commands which have waited in the #NodeQueue for this
+	 * long are rejected with an error.
+	 */
+	Event::Duration queue_timeout = std::chrono::seconds{10};
+
+	void ApplyLuaTable(lua_State *L, int table_idx);
+};
+
+/**
+ * Options for the Lua function `mysql_listen()`.
+ */
+struct ListenOptions {
+	/**
+	 * Paths of PEM files containing the certificate chain and
+	 * the private key.  If set, then TLS is offered to clients
+	 * connecting via TCP.
+	 */
+	std::string tls_cert, tls_key;
+
 	void ApplyLuaTable(lua_State *L, int table_idx);
 };
 
@@ -40,5 +129,48 @@ struct ConnectOptions {
 	 */
 	bool read_only = false;
 
+	/**
+	 * Reuse idle authenticated server connections from the
+	 * #BackendPool and put the server connection back into the
+	 * pool when the client disconnects?
+	 */
+	bool pool = false;
+
+	/**
+	 * Release the server connection to the #BackendPool after
+	 * each statement or transaction, unless the session has
+	 * state which must be preserved.  Implies #pool.
+	 */
+	bool multiplex = false;
+
+	/**
+	 * Send `SELECT` statements outside of transactions to a
+	 * read-only node of the cluster and everything else to the
+	 * writable node.  Implies #multiplex.
+	 */
+	bool read_write_split = false;
+
+	/**
+	 * Answer cacheable `SELECT` statements from the #QueryCache
+	 * and store their results there for this number of seconds.
+	 * 0 disables the cache for this connection.
+	 */
+	std::size_t query_cache = 0;
+
+	/**
+	 * Keep up to this number of prepared statements per server
+	 * connection prepared after the client has closed them, and
+	 * hand them to the next client which prepares the same
+	 * statement (#StatementCache).  0 disables the cache.
+	 */
+	std::size_t statement_cache = 0;
+
+	/**
+	 * Use the compressed protocol on the server connection if
+	 * the server supports it.  Has no effect if myproxy was built
+	 * without zlib.
+	 */
+	bool compress = false;
+
 	void ApplyLuaTable(lua_State *L, int table_idx);
 };
@@ -12,6 +12,7 @@ extern "C" {
 }
 
 #include <concepts>
+#include <cstddef>
 
 namespace Lua {
 
@@ -27,6 +28,20 @@ CheckBool(lua_State *L, auto _idx, const char *extramsg)
 	return lua_toboolean(L, idx);
 }
 
+inline std::size_t
+CheckUnsigned(lua_State *L, auto _idx, const char *extramsg)
+{
+	const int idx = GetStackIndex(_idx);
+	if (!lua_isnumber(L, idx))
+		throw ArgError{extramsg};
+
+	const lua_Integer value = lua_tointeger(L, idx);
+	if (value < 0)
+		throw ArgError{extramsg};
+
+	return static_cast<std::size_t>(value);
+}
+
 inline std::string_view
 CheckStringView(lua_State *L, auto _idx, const char *extramsg)
 {
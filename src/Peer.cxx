@@ -5,15 +5,535 @@
 #include "Peer.hxx"
 #include "MysqlSerializer.hxx"
 #include "MysqlMakePacket.hxx"
+#include "SplicePipe.hxx"
+#include "io/Iovec.hxx"
 #include "net/SocketError.hxx"
 #include "net/SocketProtocolError.hxx"
+#include "system/Error.hxx"
 
+#include <algorithm> // for std::copy(), std::min()
+#include <array>
+#include <cassert>
 #include <stdexcept>
+#include <tuple> // for std::tie()
 #include <utility> // for std::unreachable()
 
+#include <errno.h>
+#include <sys/socket.h> // for MSG_*
+
+#ifdef HAVE_URING
+
+inline ssize_t
+Peer::UringSendSome(std::span<const std::byte> src) noexcept
+{
+	assert(uring_queue != nullptr);
+
+	if (uring_send == nullptr)
+		uring_send = new UringSend(*uring_queue, socket.GetSocket(), *this);
+
+	return uring_send->Send(src);
+}
+
+bool
+Peer::HandOverUringSend() noexcept
+{
+	if (uring_send == nullptr)
+		return false;
+
+	if (uring_send->IsEmpty() || !socket.IsValid()) {
+		CloseUringSend();
+		return false;
+	}
+
+	/* data which did not fit into the io_uring buffers is sent
+	   after them */
+	if (!output.empty())
+		spilled.insert(spilled.end(),
+			       output.Read().begin(), output.Read().end());
+
+	UniqueSocketDescriptor fd{AdoptTag{}, socket.GetSocket()};
+	socket.Abandon();
+	std::exchange(uring_send, nullptr)->Close(std::move(fd),
+						   std::move(spilled));
+	spilled = {};
+	return true;
+}
+
+void
+Peer::OnUringSendReady() noexcept
+{
+	if (!spilled.empty()) {
+		/* move more of the data which did not fit into the
+		   io_uring buffers */
+		ConsumeOutput(uring_send->Send(spilled));
+		if (!spilled.empty())
+			return;
+	}
+
+	if (uring_want_write) {
+		uring_want_write = false;
+		socket.DeferWrite();
+	}
+}
+
+void
+Peer::OnUringSendError(int error) noexcept
+{
+	CloseUringSend();
+	handler.OnPeerError(std::make_exception_ptr(MakeErrno(error, "Send failed")));
+}
+
+#endif // HAVE_URING
+
+#ifdef HAVE_ZLIB
+
+void
+Peer::EnableCompression(NodeStats &stats) noexcept
+{
+	if (compression)
+		return;
+
+	/* splice() would bypass the decompressor */
+	reader.DisableDirect(socket);
+
+	compression = std::make_unique<MysqlCompression>(socket, stats);
+}
+
+inline ssize_t
+Peer::CompressSome(std::span<const std::byte> src)
+{
+	if (HasPendingOutput()) {
+		/* the pending compressed packets must be sent
+		   first */
+		if (!FlushOutput())
+			return WRITE_DESTROYED;
+
+		if (HasPendingOutput())
+			return 0;
+	}
+
+	output.AllocateIfNull();
+
+	std::size_t consumed = 0;
+	while (consumed < src.size()) {
+		const auto [nbytes, compressed] =
+			compression->Compress(src.subspan(consumed),
+					      output.Write());
+		if (nbytes == 0 && compressed == 0)
+			break;
+
+		consumed += nbytes;
+		output.Append(compressed);
+	}
+
+	if (output.empty())
+		output.Free();
+	else if (!FlushOutput())
+		return WRITE_DESTROYED;
+
+	return consumed;
+}
+
+inline bool
+Peer::CompressAll(std::span<const std::byte> src)
+{
+	output.AllocateIfNull();
+
+	while (!src.empty()) {
+		auto [nbytes, compressed] = compression->Compress(src, output.Write());
+		if (nbytes == 0 && compressed == 0) {
+			/* not enough room in the output buffer; flush
+			   it now */
+			if (!FlushOutput())
+				return false;
+
+			output.AllocateIfNull();
+			if (!output.empty())
+				/* the socket is not writable; move the
+				   pending data out of the way */
+				SpillOutput();
+
+			std::tie(nbytes, compressed) = compression->Compress(src, output.Write());
+			if (nbytes == 0 && compressed == 0)
+				throw SocketBufferFullError{};
+		}
+
+		src = src.subspan(nbytes);
+		output.Append(compressed);
+	}
+
+	if (output.empty())
+		output.Free();
+	else
+		defer_flush.Schedule();
+
+	return true;
+}
+
+BufferedResult
+Peer::OnDecompressedData()
+{
+	auto &input = compression->input;
+
+	while (true) {
+		const bool progress = compression->Decompress(socket);
+
+		switch (reader.Process(input)) {
+		case MysqlReader::ProcessResult::OK:
+			break;
+
+		case MysqlReader::ProcessResult::BLOCKING:
+			return BufferedResult::OK;
+
+		case MysqlReader::ProcessResult::MORE:
+			switch (reader.Flush(input)) {
+			case MysqlReader::FlushResult::DRAINED:
+			case MysqlReader::FlushResult::MORE:
+				break;
+
+			case MysqlReader::FlushResult::BLOCKING:
+				return BufferedResult::OK;
+
+			case MysqlReader::FlushResult::CLOSED:
+				return BufferedResult::DESTROYED;
+			}
+
+			break;
+
+		case MysqlReader::ProcessResult::CLOSED:
+			return BufferedResult::DESTROYED;
+		}
+
+		if (!progress)
+			/* need more data from the socket to continue
+			   decompressing */
+			return socket.IsEmpty()
+				? BufferedResult::OK
+				: BufferedResult::MORE;
+	}
+}
+
+BufferedReadResult
+Peer::ReadDecompressed() noexcept
+try {
+	if (OnDecompressedData() == BufferedResult::DESTROYED)
+		return BufferedReadResult::DESTROYED;
+
+	return socket.Read();
+} catch (...) {
+	handler.OnPeerError(std::current_exception());
+	return BufferedReadResult::DESTROYED;
+}
+
+void
+Peer::OnDeferredDecompressed() noexcept
+{
+	ReadDecompressed();
+}
+
+#endif // HAVE_ZLIB
+
+#ifdef HAVE_TLS
+
+void
+Peer::StartTls(TlsContext &context)
+{
+	assert(!tls);
+
+	/* splice() would bypass the decryption */
+	reader.DisableDirect(socket);
+
+	tls = std::make_unique<TlsSession>(context, socket);
+}
+
+inline bool
+Peer::SendTlsOutput()
+{
+	/* this bypasses Send() because the handshake must be sent
+	   before kernel TLS gets enabled, which rules out io_uring
+	   and the deferred flush */
+
+	output.AllocateIfNull();
+
+	while (true) {
+		auto w = output.Write();
+		if (w.empty()) {
+			if (!FlushOutput())
+				return false;
+
+			output.AllocateIfNull();
+			w = output.Write();
+			if (w.empty())
+				throw SocketBufferFullError{};
+		}
+
+		const std::size_t nbytes = tls->ReadOutput(w);
+		if (nbytes == 0)
+			break;
+
+		output.Append(nbytes);
+	}
+
+	if (output.empty()) {
+		output.Free();
+		return true;
+	}
+
+	return FlushOutput();
+}
+
+BufferedResult
+Peer::OnDecryptedData()
+{
+	auto &input = tls->input;
+
+	while (true) {
+		const bool was_handshaking = tls->IsHandshaking();
+		const bool progress = tls->Receive(socket);
+
+		if (!SendTlsOutput())
+			return BufferedResult::DESTROYED;
+
+		if (was_handshaking && !tls->IsHandshaking()) {
+			/* the kernel would encrypt the rest of the
+			   handshake again */
+			if (HasPendingOutput())
+				throw std::runtime_error{"TLS handshake not yet sent"};
+
+			tls->EnableKernelSend(socket.GetSocket());
+		}
+
+		switch (reader.Process(input)) {
+		case MysqlReader::ProcessResult::OK:
+			break;
+
+		case MysqlReader::ProcessResult::BLOCKING:
+			return BufferedResult::OK;
+
+		case MysqlReader::ProcessResult::MORE:
+			switch (reader.Flush(input)) {
+			case MysqlReader::FlushResult::DRAINED:
+			case MysqlReader::FlushResult::MORE:
+				break;
+
+			case MysqlReader::FlushResult::BLOCKING:
+				return BufferedResult::OK;
+
+			case MysqlReader::FlushResult::CLOSED:
+				return BufferedResult::DESTROYED;
+			}
+
+			break;
+
+		case MysqlReader::ProcessResult::CLOSED:
+			return BufferedResult::DESTROYED;
+		}
+
+		if (tls->CanEnableKernelReceive(socket)) {
+			/* everything received so far has been
+			   decrypted and consumed; from now on, the
+			   kernel decrypts and this is a plain socket
+			   again */
+			tls->EnableKernelReceive(socket.GetSocket());
+			defer_decrypted.Cancel();
+			tls.reset();
+			return BufferedResult::OK;
+		}
+
+		if (!progress)
+			/* need more data from the socket to continue
+			   decrypting */
+			return socket.IsEmpty()
+				? BufferedResult::OK
+				: BufferedResult::MORE;
+	}
+}
+
+BufferedReadResult
+Peer::ReadDecrypted() noexcept
+try {
+	if (OnDecryptedData() == BufferedResult::DESTROYED)
+		return BufferedReadResult::DESTROYED;
+
+	return socket.Read();
+} catch (...) {
+	handler.OnPeerError(std::current_exception());
+	return BufferedReadResult::DESTROYED;
+}
+
+void
+Peer::OnDeferredDecrypted() noexcept
+{
+	ReadDecrypted();
+}
+
+#endif // HAVE_TLS
+
+void
+Peer::ConsumeOutput(std::size_t nbytes) noexcept
+{
+	const std::size_t n_spilled = std::min(nbytes, spilled.size());
+	if (n_spilled > 0) {
+		spilled.erase(spilled.begin(), spilled.begin() + n_spilled);
+		if (spilled.empty())
+			/* release the memory */
+			spilled = {};
+
+		nbytes -= n_spilled;
+	}
+
+	if (nbytes > 0)
+		output.Consume(nbytes);
+
+	if (output.empty() && !output.IsNull())
+		output.Free();
+
+	if (!HasPendingOutput())
+		defer_flush.Cancel();
+}
+
+void
+Peer::SpillOutput()
+{
+	const auto r = output.Read();
+	spilled.insert(spilled.end(), r.begin(), r.end());
+	output.Clear();
+}
+
+bool
+Peer::FlushOutput()
+{
+	if (!HasPendingOutput())
+		return true;
+
+#ifdef HAVE_URING
+	if (uring_send != nullptr && !uring_send->IsEmpty()) {
+		/* #spilled must wait for the io_uring send to
+		   complete; see OnUringSendReady() */
+		uring_want_write = true;
+		return true;
+	}
+#endif
+
+	const std::span<const std::byte> s{spilled};
+	const std::array v{MakeIovec(s), MakeIovec(output.Read())};
+
+	const auto result = socket.WriteV(v);
+	if (result > 0) [[likely]] {
+		ConsumeOutput(static_cast<std::size_t>(result));
+		if (HasPendingOutput())
+			socket.ScheduleWrite();
+
+		return true;
+	}
+
+	switch (result) {
+	case WRITE_ERRNO:
+		throw MakeSocketError("Send failed");
+
+	case WRITE_BLOCKING:
+		socket.ScheduleWrite();
+		return true;
+
+	case WRITE_DESTROYED:
+		return false;
+	}
+
+	throw std::runtime_error{"Send error"};
+}
+
+void
+Peer::DiscardOutput(bool try_send) noexcept
+{
+	defer_flush.Cancel();
+
+	if (try_send && HasPendingOutput()) {
+		/* best effort; errors are ignored because the
+		   socket is going to be closed anyway */
+		const auto s = socket.GetSocket();
+		if (spilled.empty() ||
+		    s.Send(spilled, MSG_DONTWAIT|MSG_NOSIGNAL) == static_cast<ssize_t>(spilled.size()))
+			(void)s.Send(output.Read(), MSG_DONTWAIT|MSG_NOSIGNAL);
+	}
+
+	spilled = {};
+
+	if (!output.IsNull())
+		output.Free();
+}
+
+bool
+Peer::Uncork() noexcept
+try {
+	return FlushOutput();
+} catch (...) {
+	handler.OnPeerError(std::current_exception());
+	return false;
+}
+
+void
+Peer::OnDeferredFlush() noexcept
+{
+	Uncork();
+}
+
 ssize_t
 Peer::SendSome(std::span<const std::byte> src) noexcept
 try {
+#ifdef HAVE_ZLIB
+	if (compression)
+		return CompressSome(src);
+#endif
+
+#ifdef HAVE_URING
+	if (uring_queue != nullptr) {
+		if (!spilled.empty()) {
+			/* the spilled packets must be sent first; see
+			   OnUringSendReady() */
+			uring_want_write = true;
+			return 0;
+		}
+
+		return UringSendSome(src);
+	}
+#endif
+
+	if (HasPendingOutput()) {
+		/* send the pending packets together with the new
+		   data in one system call */
+		const std::span<const std::byte> s{spilled};
+		const auto pending = output.Read();
+		const std::array v{MakeIovec(s), MakeIovec(pending), MakeIovec(src)};
+
+		const auto result = socket.WriteV(v);
+		if (result > 0) [[likely]] {
+			const std::size_t nbytes = static_cast<std::size_t>(result);
+			const std::size_t n_pending = std::min(nbytes, s.size() + pending.size());
+			ConsumeOutput(n_pending);
+
+			if (nbytes == n_pending)
+				/* none of the new data was sent; try
+				   again when the socket is writable */
+				socket.ScheduleWrite();
+
+			return nbytes - n_pending;
+		}
+
+		switch (result) {
+		case WRITE_ERRNO:
+			throw MakeSocketError("Send failed");
+
+		case WRITE_BLOCKING:
+			socket.ScheduleWrite();
+			return 0;
+
+		case WRITE_DESTROYED:
+			return WRITE_DESTROYED;
+		}
+
+		throw std::runtime_error{"Send error"};
+	}
+
 	const auto result = socket.Write(src);
 	if (result > 0) [[likely]]
 		return static_cast<std::size_t>(result);
@@ -35,32 +555,124 @@ try {
 	return WRITE_DESTROYED;
 }
 
+ssize_t
+Peer::SpliceFrom(SplicePipe &pipe) noexcept
+try {
+#ifdef HAVE_URING
+	if (uring_send != nullptr && !uring_send->IsEmpty())
+		/* the data in the io_uring send buffer must be sent
+		   first */
+		return 0;
+#endif
+
+	if (HasPendingOutput()) {
+		/* the pending packets must be sent first */
+		if (!FlushOutput())
+			return WRITE_DESTROYED;
+
+		if (HasPendingOutput())
+			return 0;
+	}
+
+	const auto result = pipe.Drain(socket.GetSocket());
+	if (result >= 0) [[likely]]
+		return result;
+
+	if (errno == EAGAIN)
+		return 0;
+
+	throw MakeSocketError("Send failed");
+} catch (...) {
+	handler.OnPeerError(std::current_exception());
+	return WRITE_DESTROYED;
+}
+
 bool
 Peer::Send(std::span<const std::byte> src) noexcept
 try {
-	const auto result = socket.Write(src);
-	if (result > 0) [[likely]] {
-		if (static_cast<std::size_t>(result) != src.size()) [[unlikely]]
-			throw std::runtime_error{"Short send"};
+#ifdef HAVE_ZLIB
+	if (compression)
+		return CompressAll(src);
+#endif
+
+#ifdef HAVE_URING
+	if (uring_queue != nullptr) {
+		if (spilled.empty()) {
+			const auto nbytes = UringSendSome(src);
+			src = src.subspan(static_cast<std::size_t>(nbytes));
+		}
+
+		if (!src.empty()) [[unlikely]]
+			/* the io_uring buffers are full; queue the
+			   rest until the pending send completes */
+			spilled.insert(spilled.end(), src.begin(), src.end());
 
 		return true;
 	}
+#endif
+
+	output.AllocateIfNull();
+
+	if (output.Write().size() < src.size()) {
+		/* not enough room in the output buffer; flush it
+		   now */
+		if (!FlushOutput())
+			return false;
+
+		output.AllocateIfNull();
+		if (output.Write().size() < src.size()) {
+			if (!HasPendingOutput()) {
+				/* too large for the output buffer */
+				output.Free();
+				return SendNow(src);
+			}
+
+			/* the socket is not writable; move the
+			   pending data out of the way */
+			SpillOutput();
+
+			if (output.Write().size() < src.size()) {
+				/* too large for the output buffer */
+				spilled.insert(spilled.end(), src.begin(), src.end());
+				return true;
+			}
+		}
+	}
 
-	switch (result) {
-	case WRITE_ERRNO:
-		throw MakeSocketError("Send failed");
+	const auto w = output.Write();
+	std::copy(src.begin(), src.end(), w.begin());
+	output.Append(src.size());
 
-	case WRITE_BLOCKING:
-		throw SocketBufferFullError{};
+	defer_flush.Schedule();
+	return true;
+} catch (...) {
+	handler.OnPeerError(std::current_exception());
+	return false;
+}
 
-	case WRITE_DESTROYED:
+bool
+Peer::SendNow(std::span<const std::byte> src)
+{
+	assert(!HasPendingOutput());
+
+	const auto result = socket.Write(src);
+	if (result > 0) [[likely]]
+		src = src.subspan(static_cast<std::size_t>(result));
+	else if (result == WRITE_ERRNO)
+		throw MakeSocketError("Send failed");
+	else if (result == WRITE_DESTROYED)
 		return false;
+	else if (result != WRITE_BLOCKING)
+		throw std::runtime_error{"Send error"};
+
+	if (!src.empty()) {
+		/* the socket is not writable; send the rest as soon
+		   as it is */
+		spilled.assign(src.begin(), src.end());
+		socket.ScheduleWrite();
 	}
 
-	throw std::runtime_error{"Send error"};
-} catch (...) {
-	handler.OnPeerError(std::current_exception());
-	return false;
+	return true;
 }
 
 bool
@@ -86,7 +698,27 @@ Peer::SendErr(uint_least8_t sequence_id, Mysql::ErrorCode error_code,
 BufferedResult
 Peer::OnBufferedData()
 {
-	switch (reader.Process(socket)) {
+#ifdef HAVE_ZLIB
+	if (compression)
+		return OnDecompressedData();
+#endif
+
+#ifdef HAVE_TLS
+	if (tls)
+		return OnDecryptedData();
+#endif
+
+	const auto result = reader.Process(socket);
+
+#ifdef HAVE_TLS
+	if (tls && result != MysqlReader::ProcessResult::CLOSED)
+		/* StartTls() has been called by the handler; the
+		   rest of the input buffer belongs to the TLS
+		   handshake */
+		return OnDecryptedData();
+#endif
+
+	switch (result) {
 	case MysqlReader::ProcessResult::OK:
 		return BufferedResult::OK;
 
@@ -121,6 +753,32 @@ Peer::OnBufferedData()
 	std::unreachable();
 }
 
+DirectResult
+Peer::OnBufferedDirect(SocketDescriptor fd, FdType)
+{
+	switch (reader.Direct(socket, fd)) {
+	case MysqlHandler::DirectResult::OK:
+		return DirectResult::OK;
+
+	case MysqlHandler::DirectResult::BLOCKING:
+		return DirectResult::BLOCKING;
+
+	case MysqlHandler::DirectResult::EMPTY:
+		return DirectResult::EMPTY;
+
+	case MysqlHandler::DirectResult::END:
+		return DirectResult::END;
+
+	case MysqlHandler::DirectResult::CLOSED:
+		return DirectResult::CLOSED;
+
+	case MysqlHandler::DirectResult::ERRNO:
+		return DirectResult::ERRNO;
+	}
+
+	std::unreachable();
+}
+
 bool
 Peer::OnBufferedClosed() noexcept
 {
@@ -132,6 +790,15 @@ Peer::OnBufferedClosed() noexcept
 bool
 Peer::OnBufferedWrite()
 {
+	if (HasPendingOutput()) {
+		if (!FlushOutput())
+			return false;
+
+		if (HasPendingOutput())
+			/* FlushOutput() has scheduled another write */
+			return true;
+	}
+
 	switch (handler.OnPeerWrite()) {
 	case PeerHandler::WriteResult::DONE:
 		socket.UnscheduleWrite();
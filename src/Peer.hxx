@@ -5,17 +5,39 @@
 #pragma once
 
 #include "MysqlReader.hxx"
+#include "DefaultFifoBuffer.hxx"
+#include "event/DeferEvent.hxx"
 #include "event/net/BufferedSocket.hxx"
 #include "net/UniqueSocketDescriptor.hxx"
+#include "config.h"
+
+#ifdef HAVE_URING
+#include "UringSend.hxx"
+#endif
+
+#ifdef HAVE_ZLIB
+#include "MysqlCompression.hxx"
+#endif
+
+#ifdef HAVE_TLS
+#include "TlsSession.hxx"
+#endif
 
 #include <cstdint>
+#include <memory>
 #include <string_view>
+#include <utility> // for std::exchange()
+#include <vector>
 
 namespace Mysql {
 enum class ErrorCode : uint_least16_t;
 class PacketSerializer;
 }
 
+class SplicePipe;
+class TlsContext;
+struct NodeStats;
+
 class PeerHandler {
 public:
 	enum class WriteResult {
@@ -51,13 +73,84 @@ public:
 /**
  * A connection to one peer.
  */
-class Peer final : BufferedSocketHandler {
+class Peer final
+	: BufferedSocketHandler
+#ifdef HAVE_URING
+	, UringSendHandler
+#endif
+{
 	BufferedSocket socket;
 
+#ifdef HAVE_ZLIB
+	/**
+	 * If not nullptr, then the compressed protocol is used on
+	 * this connection (see EnableCompression()).
+	 */
+	std::unique_ptr<MysqlCompression> compression;
+
+	/**
+	 * Processes pending decompressed input (see DeferRead()).
+	 */
+	DeferEvent defer_decompressed;
+#endif
+
+#ifdef HAVE_TLS
+	/**
+	 * If not nullptr, then the TLS handshake is in progress or
+	 * the kernel has not yet taken over decryption (see
+	 * StartTls()).
+	 */
+	std::unique_ptr<TlsSession> tls;
+
+	/**
+	 * Processes pending decrypted input (see DeferRead()).
+	 */
+	DeferEvent defer_decrypted;
+#endif
+
 	MysqlReader reader;
 
 	PeerHandler &handler;
 
+	/**
+	 * Packets generated by Send() are collected here ("corked")
+	 * and sent together at the end of the current event loop
+	 * iteration (#defer_flush), or together with the next
+	 * SendSome() call in one writev().
+	 */
+	DefaultFifoBuffer output;
+
+	/**
+	 * Data which did not fit into #output (or into the io_uring
+	 * send buffers) because the socket was not writable, e.g. a
+	 * large cached resultset sent to a slow client.  It is older
+	 * than the contents of #output and is sent first.  Unlike
+	 * #output, this buffer grows as needed; it is empty most of
+	 * the time.
+	 */
+	std::vector<std::byte> spilled;
+
+	DeferEvent defer_flush;
+
+#ifdef HAVE_URING
+	/**
+	 * If not nullptr, then data is sent with io_uring instead of
+	 * send().
+	 */
+	Uring::Queue *const uring_queue;
+
+	/**
+	 * Created on demand if #uring_queue is set.
+	 */
+	UringSend *uring_send = nullptr;
+
+	/**
+	 * Shall PeerHandler::OnPeerWrite() be called after the
+	 * pending #uring_send operation completes?
+	 */
+	bool uring_want_write = false;
+#endif
+
 public:
 	uint_least32_t capabilities;
 
@@ -68,14 +161,55 @@ public:
 	     PeerHandler &_handler,
 	     MysqlHandler &_mysql_handler) noexcept
 		:socket(event_loop),
+#ifdef HAVE_ZLIB
+		 defer_decompressed(event_loop, BIND_THIS_METHOD(OnDeferredDecompressed)),
+#endif
+#ifdef HAVE_TLS
+		 defer_decrypted(event_loop, BIND_THIS_METHOD(OnDeferredDecrypted)),
+#endif
 		 reader(_mysql_handler),
-		 handler(_handler)
+		 handler(_handler),
+		 defer_flush(event_loop, BIND_THIS_METHOD(OnDeferredFlush))
+#ifdef HAVE_URING
+		, uring_queue(event_loop.GetUring())
+#endif
 	{
 		socket.Init(fd.Release(), FD_TCP, std::chrono::minutes{1}, *this);
 		socket.ScheduleRead();
 	}
 
+	~Peer() noexcept {
+#ifdef HAVE_URING
+		if (HandOverUringSend()) {
+			socket.Destroy();
+			return;
+		}
+#endif
+		DiscardOutput(true);
+	}
+
+	/**
+	 * Close the socket.  Pending data (e.g. an ERR packet sent
+	 * right before) is still sent if possible.  With io_uring,
+	 * the socket is handed to the #UringSend, which closes it
+	 * only after its pending operations have completed, so the
+	 * kernel never sends to a reused descriptor.
+	 */
 	void Close() noexcept {
+#ifdef HAVE_ZLIB
+		defer_decompressed.Cancel();
+#endif
+#ifdef HAVE_TLS
+		defer_decrypted.Cancel();
+#endif
+#ifdef HAVE_URING
+		if (HandOverUringSend()) {
+			DiscardOutput(false);
+			socket.Destroy();
+			return;
+		}
+#endif
+		DiscardOutput(true);
 		socket.Close();
 		socket.Destroy();
 	}
@@ -84,11 +218,127 @@ public:
 		return socket.GetSocket();
 	}
 
+	/**
+	 * Release the socket without closing it.  After returning,
+	 * this object is unusable.
+	 */
+	UniqueSocketDescriptor Release() noexcept {
+#ifdef HAVE_URING
+		CloseUringSend();
+#endif
+#ifdef HAVE_ZLIB
+		defer_decompressed.Cancel();
+#endif
+#ifdef HAVE_TLS
+		defer_decrypted.Cancel();
+#endif
+		DiscardOutput(false);
+
+		UniqueSocketDescriptor fd{AdoptTag{}, socket.GetSocket()};
+		socket.Abandon();
+		socket.Destroy();
+		return fd;
+	}
+
+	/**
+	 * Is this connection idle, i.e. is there no partially
+	 * forwarded packet and no pending input?
+	 */
+	bool IsIdle() const noexcept {
+#ifdef HAVE_URING
+		if (uring_send != nullptr && !uring_send->IsEmpty())
+			return false;
+#endif
+
+#ifdef HAVE_ZLIB
+		if (compression && !compression->IsIdle())
+			return false;
+#endif
+
+#ifdef HAVE_TLS
+		if (tls && !tls->IsIdle())
+			return false;
+#endif
+
+		return !HasPendingOutput() && !reader.IsForwarding() &&
+			socket.IsEmpty();
+	}
+
+#ifdef HAVE_ZLIB
+	/**
+	 * Switch to the compressed protocol (#Mysql::CLIENT_COMPRESS)
+	 * for all further data.  This disables "direct" mode.
+	 */
+	void EnableCompression(NodeStats &stats) noexcept;
+#endif
+
+#ifdef HAVE_TLS
+	/**
+	 * Begin the TLS handshake (after the client has sent
+	 * `SSLRequest`).  All further data (including data which has
+	 * already been received) is TLS.  After the handshake, the
+	 * kernel takes over encryption (kernel TLS) and the socket
+	 * carries plain data again.  Throws on error.
+	 */
+	void StartTls(TlsContext &context);
+
+	bool IsTlsHandshaking() const noexcept {
+		return tls && tls->IsHandshaking();
+	}
+#else
+	bool IsTlsHandshaking() const noexcept {
+		return false;
+	}
+#endif
+
+	bool IsForwarding() const noexcept {
+		return reader.IsForwarding();
+	}
+
+	/**
+	 * @see MysqlReader::EnableDirect()
+	 */
+	void EnableDirect(std::size_t threshold) noexcept {
+		reader.EnableDirect(threshold);
+	}
+
+	void DisableDirect() noexcept {
+		reader.DisableDirect(socket);
+	}
+
 	BufferedReadResult Read() noexcept {
+#ifdef HAVE_ZLIB
+		if (compression && !compression->input.IsEmpty())
+			return ReadDecompressed();
+#endif
+
+#ifdef HAVE_TLS
+		if (tls && !tls->input.IsEmpty())
+			return ReadDecrypted();
+#endif
+
 		return socket.Read();
 	}
 
 	void DeferRead() noexcept {
+#ifdef HAVE_ZLIB
+		if (compression && !compression->input.IsEmpty()) {
+			/* BufferedSocket doesn't know about the
+			   decompressed input */
+			defer_decompressed.Schedule();
+			return;
+		}
+#endif
+
+#ifdef HAVE_TLS
+		if (tls && !tls->input.IsEmpty()) {
+			/* BufferedSocket doesn't know about the
+			   decrypted input */
+			defer_decrypted.Schedule();
+			return;
+		}
+#endif
+
 		socket.DeferRead();
 	}
 
@@ -97,6 +347,15 @@ public:
 	}
 
 	void ScheduleWrite() noexcept {
+#ifdef HAVE_URING
+		if (uring_send != nullptr && !uring_send->IsEmpty()) {
+			/* wait for the io_uring send to complete
+			   instead of waiting for EPOLLOUT */
+			uring_want_write = true;
+			return;
+		}
+#endif
+
 		socket.ScheduleWrite();
 	}
 
@@ -114,14 +373,36 @@ public:
 	ssize_t SendSome(std::span<const std::byte> src) noexcept;
 
 	/**
-	 * Send data.  A partial write is considered an error that
-	 * will cause the #Peer instance to be destroyed.
+	 * Send data from a pipe (with splice()), allowing partial
+	 * writes.
+	 *
+	 * @return the number of bytes sent; 0 if nothing could be
+	 * sent; #WRITE_DESTROYED if there was an error and the #Peer
+	 * instance has been destroyed inside this method
+	 */
+	ssize_t SpliceFrom(SplicePipe &pipe) noexcept;
+
+	/**
+	 * Send data.  It is not sent immediately, but collected in
+	 * the output buffer until the end of the current event loop
+	 * iteration.  If the socket is not writable and the output
+	 * buffer is full, the data is queued in #spilled and sent as
+	 * soon as the socket becomes writable.
 	 *
 	 * @return true on success, false on error (the #Peer instance
 	 * has been destroyed inside this method)
 	 */
 	bool Send(std::span<const std::byte> src) noexcept;
 
+	/**
+	 * Send the data collected by Send() now instead of waiting
+	 * for the end of the current event loop iteration.
+	 *
+	 * @return false on error (the #Peer instance has been
+	 * destroyed inside this method)
+	 */
+	bool Uncork() noexcept;
+
 	/**
 	 * Finish the specified packet and send it.
 	 */
@@ -139,12 +420,142 @@ public:
 		     std::string_view sql_state, std::string_view msg) noexcept;
 
 	auto Flush() noexcept {
+#ifdef HAVE_ZLIB
+		if (compression)
+			return reader.Flush(compression->input);
+#endif
+
+#ifdef HAVE_TLS
+		if (tls)
+			return reader.Flush(tls->input);
+#endif
+
 		return reader.Flush(socket);
 	}
 
 private:
+	bool HasPendingOutput() const noexcept {
+		return !spilled.empty() || !output.empty();
+	}
+
+	/**
+	 * Remove the specified number of bytes (which have been
+	 * sent) from the front of #spilled and #output.
+	 */
+	void ConsumeOutput(std::size_t nbytes) noexcept;
+
+	/**
+	 * Move the contents of #output to the end of #spilled to make
+	 * room for more data.  Throws on allocation failure.
+	 */
+	void SpillOutput();
+
+	/**
+	 * Send as much of #spilled and #output as possible.  Throws
+	 * on error.
+	 *
+	 * @return false if the #Peer instance has been destroyed
+	 */
+	bool FlushOutput();
+
+	/**
+	 * Free the output buffer.
+	 *
+	 * @param try_send attempt to send the pending data (without
+	 * blocking) before the socket gets closed, e.g. an ERR
+	 * packet sent right before closing the connection
+	 */
+	void DiscardOutput(bool try_send) noexcept;
+
+	/**
+	 * Like Send(), but bypass #output: send as much as possible
+	 * right now and queue the rest in #spilled.  Must only be
+	 * called if there is no pending output.  Throws on error.
+	 *
+	 * @return false if the #Peer instance has been destroyed
+	 */
+	bool SendNow(std::span<const std::byte> src);
+
+	void OnDeferredFlush() noexcept;
+
+#ifdef HAVE_ZLIB
+	/**
+	 * Compress as much of the given data as fits into #output
+	 * and send it.  Throws on error.
+	 *
+	 * @return the number of bytes consumed or #WRITE_DESTROYED
+	 */
+	ssize_t CompressSome(std::span<const std::byte> src);
+
+	/**
+	 * Compress all of the given data into #output.  Throws on
+	 * error.
+	 *
+	 * @return false if the #Peer instance has been destroyed
+	 */
+	bool CompressAll(std::span<const std::byte> src);
+
+	/**
+	 * Decompress data from the socket's input buffer and pass it
+	 * to the #MysqlReader.  Throws on error.
+	 */
+	BufferedResult OnDecompressedData();
+
+	BufferedReadResult ReadDecompressed() noexcept;
+	void OnDeferredDecompressed() noexcept;
+#endif
+
+#ifdef HAVE_TLS
+	/**
+	 * Send the handshake data generated by OpenSSL.  This
+	 * always uses #output and FlushOutput() (i.e. `send()`, not
+	 * #uring_send), because the handshake must have left the
+	 * socket before kernel TLS is enabled; with io_uring, it
+	 * still waits for earlier io_uring sends.  Throws on error.
+	 *
+	 * @return false if the #Peer instance has been destroyed
+	 */
+	bool SendTlsOutput();
+
+	/**
+	 * Pass data from the socket's input buffer to the
+	 * #TlsSession and the decrypted data to the #MysqlReader.
+	 * Hands the connection to the kernel as soon as possible.
+	 * Throws on error.
+	 */
+	BufferedResult OnDecryptedData();
+
+	BufferedReadResult ReadDecrypted() noexcept;
+	void OnDeferredDecrypted() noexcept;
+#endif
+
+#ifdef HAVE_URING
+	void CloseUringSend() noexcept {
+		if (uring_send != nullptr)
+			std::exchange(uring_send, nullptr)->Close();
+	}
+
+	/**
+	 * Prepare for closing the socket: if #uring_send has pending
+	 * data, then hand the socket over to it, which sends the
+	 * data (followed by #spilled and #output) and closes the
+	 * socket afterwards.
+	 *
+	 * @return true if the socket has been handed over (and
+	 * abandoned), false if the caller shall close it
+	 */
+	bool HandOverUringSend() noexcept;
+
+	ssize_t UringSendSome(std::span<const std::byte> src) noexcept;
+
+	/* virtual methods from UringSendHandler */
+	void OnUringSendReady() noexcept override;
+	void OnUringSendError(int error) noexcept override;
+#endif
+
 	/* virtual methods from BufferedSocketHandler */
 	BufferedResult OnBufferedData() override;
+	DirectResult OnBufferedDirect(SocketDescriptor fd, FdType fd_type) override;
 	bool OnBufferedClosed() noexcept override;
 	bool OnBufferedWrite() override;
 	enum write_result OnBufferedBroken() override;
@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "MysqlProtocol.hxx"
+#include "event/Chrono.hxx"
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <string>
+
+/**
+ * A bounded FIFO of client commands which have been forwarded to the
+ * server, but whose response is not yet complete.  There is more
+ * than one if the client pipelines its commands.
+ */
+class PendingCommandQueue {
+public:
+	/**
+	 * The maximum number of pending commands.  If the queue is
+	 * full, no more commands are read from the client until
+	 * responses arrive.
+	 */
+	static constexpr std::size_t CAPACITY = 32;
+
+	struct Command {
+		/**
+		 * When was this command received from the client?
+		 * Only set for commands whose duration is measured
+		 * (i.e. `COM_QUERY` and `COM_STMT_EXECUTE`); zero
+		 * otherwise.
+		 */
+		Event::TimePoint start;
+
+		/**
+		 * The command code (the first byte of the first
+		 * packet).
+		 */
+		Mysql::Command command;
+
+		/**
+		 * The sequence_id the next response packet must use.
+		 */
+		uint_least8_t response_sequence_id;
+
+		/**
+		 * Has the server begun to respond to this command?
+		 */
+		bool responding;
+
+		/**
+		 * Is this command known to only read data?  Determined
+		 * from the query text of `COM_QUERY` and
+		 * `COM_STMT_PREPARE`; a `COM_STMT_EXECUTE` inherits it
+		 * from the prepared statement.  False if unknown.
+		 */
+		bool read_only;
+
+		/**
+		 * The digest of a `COM_QUERY` (see
+		 * MakeQueryDigest()); empty otherwise.  The string
+		 * is assigned in place (after push_back()), so its
+		 * buffer is reused by subsequent commands.
+		 */
+		std::string digest;
+
+		/**
+		 * Shall the #QueryCache be cleared when the response
+		 * to this command is complete?
+		 */
+		[[gnu::pure]]
+		bool MayModifyData() const noexcept {
+			return (command == Mysql::Command::QUERY ||
+				command == Mysql::Command::STMT_EXECUTE) &&
+				!read_only;
+		}
+	};
+
+private:
+	std::array<Command, CAPACITY> items;
+
+	std::size_t head = 0, n = 0;
+
+public:
+	bool empty() const noexcept {
+		return n == 0;
+	}
+
+	bool full() const noexcept {
+		return n == CAPACITY;
+	}
+
+	std::size_t size() const noexcept {
+		return n;
+	}
+
+	Command &front() noexcept {
+		assert(!empty());
+
+		return items[head];
+	}
+
+	const Command &front() const noexcept {
+		assert(!empty());
+
+		return items[head];
+	}
+
+	Command &back() noexcept {
+		assert(!empty());
+
+		return items[(head + n - 1) % CAPACITY];
+	}
+
+	void push_back(const Command &command) noexcept {
+		assert(!full());
+
+		items[(head + n) % CAPACITY] = command;
+		++n;
+	}
+
+	/**
+	 * Remove the oldest command.  Its object remains valid until
+	 * the next push_back() call.
+	 */
+	void pop_front() noexcept {
+		assert(!empty());
+
+		head = (head + 1) % CAPACITY;
+		--n;
+	}
+
+	void clear() noexcept {
+		head = n = 0;
+	}
+};
@@ -4,19 +4,82 @@
 
 #include "Policy.hxx"
 
+#include <algorithm> // for std::clamp()
+#include <chrono>
+
 void
-policy_init()
+Policy::Configure(Event::Duration _rate, Event::Duration _burst) noexcept
+{
+	rate = std::chrono::duration<double>{_rate}.count();
+	burst = _burst;
+
+	if (!IsEnabled())
+		users.clear();
+}
+
+inline Event::Duration
+Policy::GetBalance(const User &user, Event::TimePoint now) const noexcept
 {
+	if (user.balance >= burst)
+		return burst;
+
+	/* refilling the whole deficit takes this long; don't
+	   multiply larger durations, which may overflow */
+	const std::chrono::duration<double> deficit = burst - user.balance;
+	const std::chrono::duration<double> elapsed = now - user.last_update;
+	if (elapsed * rate >= deficit)
+		return burst;
+
+	return user.balance +
+		std::chrono::duration_cast<Event::Duration>(elapsed * rate);
+}
+
+inline Event::Duration
+Policy::ToDelay(Event::Duration balance) const noexcept
+{
+	if (balance >= Event::Duration{})
+		return Event::Duration{};
+
+	return std::chrono::duration_cast<Event::Duration>(std::chrono::duration<double>{-balance} / rate);
 }
 
 void
-policy_deinit()
+Policy::OnDuration(std::string_view user, Event::Duration duration,
+		   Event::TimePoint now) noexcept
 {
+	if (!IsEnabled())
+		return;
+
+	auto i = users.find(user);
+	if (i == users.end()) {
+		if (users.size() >= MAX_USERS)
+			Cleanup(now);
+
+		i = users.emplace(user, User{burst, now}).first;
+	}
+
+	auto &u = i->second;
+	u.balance = std::clamp(GetBalance(u, now) - duration, -burst, burst);
+	u.last_update = now;
+}
+
+Event::Duration
+Policy::GetDelay(std::string_view user, Event::TimePoint now) const noexcept
+{
+	if (!IsEnabled())
+		return Event::Duration{};
+
+	const auto i = users.find(user);
+	if (i == users.end())
+		return Event::Duration{};
+
+	return ToDelay(GetBalance(i->second, now));
 }
 
 void
-policy_duration(const char *user, Event::Duration duration)
+Policy::Cleanup(Event::TimePoint now) noexcept
 {
-	(void)user;
-	(void)duration;
+	std::erase_if(users, [this, now](const auto &i){
+		return GetBalance(i.second, now) >= burst;
+	});
 }
@@ -10,21 +10,101 @@
 
 #include "event/Chrono.hxx"
 
-/**
- * Global initialization.
- */
-void
-policy_init();
-
-void
-policy_deinit();
+#include <cstddef>
+#include <map>
+#include <string>
+#include <string_view>
 
 /**
- * Submit the time it took the MySQL server to execute a SQL
- * statement.
+ * Throttles users which occupy the MySQL servers for too long.
+ * Each user has a budget of server time (a token bucket) which is
+ * refilled at a constant rate; the duration of each query is
+ * subtracted from it.  While the budget is exhausted, the user's
+ * connections are delayed (see Connection::Delay()) until it has
+ * been refilled.
  *
- * @param duration_ms the duration between the submission of the SQL
- * statement to the server's response
+ * Each worker thread has its own instance (without locking), so the
+ * budget applies per thread.
  */
-void
-policy_duration(const char *user, Event::Duration duration);
+class Policy {
+	struct User {
+		/**
+		 * The remaining budget at #last_update.  Negative if
+		 * the budget has been overdrawn.
+		 */
+		Event::Duration balance;
+
+		Event::TimePoint last_update;
+	};
+
+	std::map<std::string, User, std::less<>> users;
+
+	/**
+	 * The server time refilled per second; zero disables the
+	 * policy.
+	 */
+	double rate = 0;
+
+	/**
+	 * The maximum budget.  The budget cannot be overdrawn by
+	 * more than this, either, so a single long query does not
+	 * block its user for longer than #burst / #rate.
+	 */
+	Event::Duration burst{};
+
+public:
+	/**
+	 * If there are more users than this, those whose budget is
+	 * full are discarded.
+	 */
+	static constexpr std::size_t MAX_USERS = 4096;
+
+	/**
+	 * @param _rate the server time each user may consume per
+	 * second; zero disables the policy
+	 * @param _burst the maximum budget
+	 */
+	void Configure(Event::Duration _rate, Event::Duration _burst) noexcept;
+
+	bool IsEnabled() const noexcept {
+		return rate > 0;
+	}
+
+	/**
+	 * Submit the time it took the MySQL server to execute a SQL
+	 * statement.
+	 *
+	 * @param duration the duration between the submission of
+	 * the SQL statement to the server's response
+	 */
+	void OnDuration(std::string_view user, Event::Duration duration,
+			Event::TimePoint now) noexcept;
+
+	/**
+	 * Shall the next command of this user be delayed?
+	 *
+	 * @return the delay (zero or negative if not)
+	 */
+	[[gnu::pure]]
+	Event::Duration GetDelay(std::string_view user,
+				 Event::TimePoint now) const noexcept;
+
+private:
+	/**
+	 * Calculate the budget of the given user at the given time.
+	 */
+	[[gnu::pure]]
+	Event::Duration GetBalance(const User &user,
+				   Event::TimePoint now) const noexcept;
+
+	/**
+	 * Calculate the delay for the given balance.
+	 */
+	[[gnu::pure]]
+	Event::Duration ToDelay(Event::Duration balance) const noexcept;
+
+	/**
+	 * Discard all users whose budget is full.
+	 */
+	void Cleanup(Event::TimePoint now) noexcept;
+};
@@ -17,6 +17,9 @@ Instance::OnPrometheusExporterRequest()
 {
 	constexpr auto process = "myproxy"sv;
 
+	const Stats total = CollectStats();
+	const auto now = event_loop.SteadyNow();
+
 	auto s = fmt::format(R"(
 {}
 
@@ -38,6 +41,9 @@ Instance::OnPrometheusExporterRequest()
 # HELP myproxy_client_handshake_responses Number of handshake responses received from clients
 # TYPE myproxy_client_handshake_responses counter
 
+# HELP myproxy_client_tls_connections Number of client connections which have switched to TLS
+# TYPE myproxy_client_tls_connections counter
+
 # HELP myproxy_client_auth_ok Number of successful authentications
 # TYPE myproxy_client_auth_ok counter
 
@@ -50,9 +56,66 @@ Instance::OnPrometheusExporterRequest()
 # HELP myproxy_lua_errors Number of Lua errors
 # TYPE myproxy_lua_errors counter
 
+# HELP myproxy_delayed_commands Number of client commands delayed because the user has exhausted the server time budget
+# TYPE myproxy_delayed_commands counter
+
+# HELP myproxy_delay_wait Total time client commands were delayed
+# TYPE myproxy_delay_wait counter
+
+# HELP myproxy_query_cache_hits Number of queries answered from the query cache
+# TYPE myproxy_query_cache_hits counter
+
+# HELP myproxy_query_cache_misses Number of cacheable queries which were not found in the query cache
+# TYPE myproxy_query_cache_misses counter
+
+# HELP myproxy_query_cache_stores Number of responses added to the query cache
+# TYPE myproxy_query_cache_stores counter
+
+# HELP myproxy_query_cache_items Number of responses in the query cache
+# TYPE myproxy_query_cache_items gauge
+
+# HELP myproxy_query_cache_bytes Total size of all responses in the query cache
+# TYPE myproxy_query_cache_bytes gauge
+
+# HELP myproxy_io_buffers Number of allocated I/O buffers
+# TYPE myproxy_io_buffers gauge
+
 # HELP myproxy_server_state Monitoring state of the server
 # TYPE myproxy_server_state gauge
 
+# HELP myproxy_account_queries Number of queries by this account (see myproxy_account_queries_error)
+# TYPE myproxy_account_queries counter
+
+# HELP myproxy_account_queries_error Maximum overestimation of myproxy_account_queries
+# TYPE myproxy_account_queries_error gauge
+
+# HELP myproxy_account_query_errors Number of queries by this account which failed
+# TYPE myproxy_account_query_errors counter
+
+# HELP myproxy_account_bytes_received Number of bytes received from servers for this account
+# TYPE myproxy_account_bytes_received counter
+
+# HELP myproxy_account_query_wait Total wait time for query results for this account
+# TYPE myproxy_account_query_wait counter
+
+# HELP myproxy_digest_query_wait Total wait time for results of queries with this digest (see myproxy_digest_query_wait_error)
+# TYPE myproxy_digest_query_wait counter
+
+# HELP myproxy_digest_query_wait_error Maximum overestimation of myproxy_digest_query_wait
+# TYPE myproxy_digest_query_wait_error gauge
+
+# HELP myproxy_digest_max_query_wait Longest wait time for the result of a query with this digest
+# TYPE myproxy_digest_max_query_wait gauge
+
+# HELP myproxy_digest_queries Number of queries with this digest
+# TYPE myproxy_digest_queries counter
+
+# HELP myproxy_digest_query_errors Number of queries with this digest which failed
+# TYPE myproxy_digest_query_errors counter
+
+# HELP myproxy_digest_affected_rows Number of rows affected by queries with this digest
+# TYPE myproxy_digest_affected_rows counter
+
 # HELP myproxy_server_connects Number of connection attempts to this server
 # TYPE myproxy_server_connects counter
 
@@ -62,6 +125,9 @@ Instance::OnPrometheusExporterRequest()
 # HELP myproxy_server_bytes_received Number of bytes received from this server
 # TYPE myproxy_server_bytes_received counter
 
+# HELP myproxy_server_bytes_spliced Number of bytes received from this server which were forwarded with splice()
+# TYPE myproxy_server_bytes_spliced counter
+
 # HELP myproxy_server_packets_received Number of packets received from this server
 # TYPE myproxy_server_packets_received counter
 
@@ -92,36 +158,150 @@ Instance::OnPrometheusExporterRequest()
 # HELP myproxy_server_query_wait Total wait time for query results
 # TYPE myproxy_server_query_wait counter
 
+# HELP myproxy_server_query_duration_seconds Distribution of the wait time for query results
+# TYPE myproxy_server_query_duration_seconds histogram
+
+# HELP myproxy_server_query_latency Moving average of recent query wait times
+# TYPE myproxy_server_query_latency gauge
+
+# HELP myproxy_server_pending_commands Number of commands sent to this server whose response is not yet complete
+# TYPE myproxy_server_pending_commands gauge
+
+# HELP myproxy_server_clients Number of client connections assigned to this server
+# TYPE myproxy_server_clients gauge
+
+# HELP myproxy_server_pool_hits Number of logins which reused a pooled connection to this server
+# TYPE myproxy_server_pool_hits counter
+
+# HELP myproxy_server_pool_misses Number of logins which found no pooled connection to this server
+# TYPE myproxy_server_pool_misses counter
+
+# HELP myproxy_server_pool_idle Number of idle pooled connections to this server
+# TYPE myproxy_server_pool_idle gauge
+
+# HELP myproxy_server_queue_running Number of client connections with a command running on this server (cluster option max_queries)
+# TYPE myproxy_server_queue_running gauge
+
+# HELP myproxy_server_queue_length Number of client connections waiting for their turn to send a command to this server
+# TYPE myproxy_server_queue_length gauge
+
+# HELP myproxy_server_queue_delayed Number of commands which had to wait for their turn
+# TYPE myproxy_server_queue_delayed counter
+
+# HELP myproxy_server_queue_timeouts Number of commands which were rejected after waiting for too long
+# TYPE myproxy_server_queue_timeouts counter
+
+# HELP myproxy_server_queue_wait Total time commands have waited for their turn
+# TYPE myproxy_server_queue_wait counter
+
+# HELP myproxy_server_statement_cache_hits Number of prepared statements reused from the statement cache
+# TYPE myproxy_server_statement_cache_hits counter
+
+# HELP myproxy_server_statement_cache_misses Number of prepared statements which were not found in the statement cache
+# TYPE myproxy_server_statement_cache_misses counter
+
+# HELP myproxy_server_compressed_bytes_received Number of compressed bytes received from this server
+# TYPE myproxy_server_compressed_bytes_received counter
+
+# HELP myproxy_server_decompressed_bytes_received Number of bytes decompressed from the data received from this server
+# TYPE myproxy_server_decompressed_bytes_received counter
+
+# HELP myproxy_server_compressed_bytes_sent Number of compressed bytes sent to this server
+# TYPE myproxy_server_compressed_bytes_sent counter
+
+# HELP myproxy_server_uncompressed_bytes_sent Number of bytes sent to this server before compression
+# TYPE myproxy_server_uncompressed_bytes_sent counter
+
+# HELP myproxy_server_compression_time Total time spent compressing and decompressing
+# TYPE myproxy_server_compression_time counter
+
 myproxy_connections_accepted {}
 myproxy_connections_rejected {}
 myproxy_client_bytes_received {}
 myproxy_client_packets_received {}
 myproxy_client_malformed_packets {}
 myproxy_client_handshake_responses {}
+myproxy_client_tls_connections {}
 myproxy_client_auth_ok {}
 myproxy_client_auth_err {}
 myproxy_client_queries {}
 myproxy_lua_errors {}
+myproxy_delayed_commands {}
+myproxy_delay_wait {}
+myproxy_query_cache_hits {}
+myproxy_query_cache_misses {}
+myproxy_query_cache_stores {}
+myproxy_query_cache_items {}
+myproxy_query_cache_bytes {}
 )",
 			   ToPrometheusString(event_loop.GetStats(), process),
-			   stats.n_accepted_connections,
-			   stats.n_rejected_connections,
-			   stats.n_client_bytes_received,
-			   stats.n_client_packets_received,
-			   stats.n_client_malformed_packets,
-			   stats.n_client_handshake_responses,
-			   stats.n_client_auth_ok,
-			   stats.n_client_auth_err,
-			   stats.n_client_queries,
-			   stats.n_lua_errors);
-
-	for (const auto &[address, node] : stats.nodes) {
+			   total.n_accepted_connections,
+			   total.n_rejected_connections,
+			   total.n_client_bytes_received,
+			   total.n_client_packets_received,
+			   total.n_client_malformed_packets,
+			   total.n_client_handshake_responses,
+			   total.n_client_tls_connections,
+			   total.n_client_auth_ok,
+			   total.n_client_auth_err,
+			   total.n_client_queries,
+			   total.n_lua_errors,
+			   total.n_delayed_commands,
+			   ToFloatSeconds(total.delay_wait),
+			   total.n_query_cache_hits,
+			   total.n_query_cache_misses,
+			   total.n_query_cache_stores,
+			   total.n_query_cache_items,
+			   total.query_cache_bytes);
+
+	for (unsigned i = 0; i < FB_N_CLASSES; ++i)
+		s += fmt::format("myproxy_io_buffers{{size=\"{}\"}} {}\n",
+				 fb_class_size(i), total.n_io_buffers[i]);
+
+	for (const auto *item : total.accounts.GetTop(AccountStats::REPORT_SIZE)) {
+		const std::string_view account = item->key;
+
+		s += fmt::format(R"(
+myproxy_account_queries{{account={:?}}} {}
+myproxy_account_queries_error{{account={:?}}} {}
+myproxy_account_query_errors{{account={:?}}} {}
+myproxy_account_bytes_received{{account={:?}}} {}
+myproxy_account_query_wait{{account={:?}}} {}
+)",
+				 account, item->weight,
+				 account, item->error,
+				 account, item->counters.n_query_errors,
+				 account, item->counters.n_bytes,
+				 account, ToFloatSeconds(item->counters.query_wait));
+	}
+
+	for (const auto *item : total.digests.GetTop(DigestStats::REPORT_SIZE)) {
+		const std::string_view digest = item->key;
+
+		s += fmt::format(R"(
+myproxy_digest_query_wait{{digest={:?}}} {}
+myproxy_digest_query_wait_error{{digest={:?}}} {}
+myproxy_digest_max_query_wait{{digest={:?}}} {}
+myproxy_digest_queries{{digest={:?}}} {}
+myproxy_digest_query_errors{{digest={:?}}} {}
+myproxy_digest_affected_rows{{digest={:?}}} {}
+)",
+				 digest, item->weight * 1e-9,
+				 digest, item->error * 1e-9,
+				 digest, ToFloatSeconds(item->counters.max_query_wait),
+				 digest, item->counters.n_queries,
+				 digest, item->counters.n_query_errors,
+				 digest, item->counters.n_affected_rows);
+	}
+
+	for (const auto &[address, node] : total.nodes) {
 		const auto server = ToString(address);
 
 		s += fmt::format(R"(
 myproxy_server_connects{{server={:?}}} {}
 myproxy_server_connect_errors{{server={:?}}} {}
 myproxy_server_bytes_received{{server={:?}}} {}
+myproxy_server_bytes_spliced{{server={:?}}} {}
 myproxy_server_packets_received{{server={:?}}} {}
 myproxy_server_malformed_packets{{server={:?}}} {}
 myproxy_server_queries{{server={:?}}} {}
@@ -132,10 +312,29 @@ myproxy_server_no_index_queries{{server={:?}}} {}
 myproxy_server_slow_queries{{server={:?}}} {}
 myproxy_server_affected_rows{{server={:?}}} {}
 myproxy_server_query_wait{{server={:?}}} {}
+myproxy_server_query_latency{{server={:?}}} {}
+myproxy_server_pending_commands{{server={:?}}} {}
+myproxy_server_clients{{server={:?}}} {}
+myproxy_server_pool_hits{{server={:?}}} {}
+myproxy_server_pool_misses{{server={:?}}} {}
+myproxy_server_pool_idle{{server={:?}}} {}
+myproxy_server_queue_running{{server={:?}}} {}
+myproxy_server_queue_length{{server={:?}}} {}
+myproxy_server_queue_delayed{{server={:?}}} {}
+myproxy_server_queue_timeouts{{server={:?}}} {}
+myproxy_server_queue_wait{{server={:?}}} {}
+myproxy_server_statement_cache_hits{{server={:?}}} {}
+myproxy_server_statement_cache_misses{{server={:?}}} {}
+myproxy_server_compressed_bytes_received{{server={:?}}} {}
+myproxy_server_decompressed_bytes_received{{server={:?}}} {}
+myproxy_server_compressed_bytes_sent{{server={:?}}} {}
+myproxy_server_uncompressed_bytes_sent{{server={:?}}} {}
+myproxy_server_compression_time{{server={:?}}} {}
 )",
 				 server, node.n_connects,
 				 server, node.n_connect_errors,
 				 server, node.n_bytes_received,
+				 server, node.n_bytes_spliced,
 				 server, node.n_packets_received,
 				 server, node.n_malformed_packets,
 				 server, node.n_queries,
@@ -145,7 +344,41 @@ myproxy_server_query_wait{{server={:?}}} {}
 				 server, node.n_no_index_queries,
 				 server, node.n_slow_queries,
 				 server, node.n_affected_rows,
-				 server, ToFloatSeconds(node.query_wait));
+				 server, ToFloatSeconds(node.query_wait),
+				 server, ToFloatSeconds(node.query_latency.Get(now)),
+				 server, node.n_pending_commands,
+				 server, node.n_clients,
+				 server, node.n_pool_hits,
+				 server, node.n_pool_misses,
+				 server, node.n_pool_idle,
+				 server, node.n_queue_running,
+				 server, node.n_queue_waiting,
+				 server, node.n_queue_delayed,
+				 server, node.n_queue_timeouts,
+				 server, ToFloatSeconds(node.queue_wait),
+				 server, node.n_statement_cache_hits,
+				 server, node.n_statement_cache_misses,
+				 server, node.n_compressed_bytes_received,
+				 server, node.n_decompressed_bytes_received,
+				 server, node.n_compressed_bytes_sent,
+				 server, node.n_uncompressed_bytes_sent,
+				 server, ToFloatSeconds(node.compression_time));
+
+		uint_least64_t n_durations = 0;
+		for (std::size_t i = 0; i < LatencyHistogram::BOUNDS.size(); ++i) {
+			n_durations += node.query_durations[i];
+			s += fmt::format("myproxy_server_query_duration_seconds_bucket{{server={:?},le=\"{}\"}} {}\n",
+					 server, ToFloatSeconds(LatencyHistogram::BOUNDS[i]),
+					 n_durations);
+		}
+
+		n_durations += node.query_durations[LatencyHistogram::BOUNDS.size()];
+		s += fmt::format("myproxy_server_query_duration_seconds_bucket{{server={:?},le=\"+Inf\"}} {}\n"
+				 "myproxy_server_query_duration_seconds_sum{{server={:?}}} {}\n"
+				 "myproxy_server_query_duration_seconds_count{{server={:?}}} {}\n",
+				 server, n_durations,
+				 server, ToFloatSeconds(node.query_wait),
+				 server, n_durations);
 
 		if (node.state != nullptr)
 			s += fmt::format("myproxy_server_state{{server={:?},state={:?}}} 1\n",
@@ -160,3 +393,15 @@ Instance::OnPrometheusExporterError(std::exception_ptr error) noexcept
 {
 	PrintException(std::move(error));
 }
+
+std::string
+Instance::SlowQueryExporter::OnPrometheusExporterRequest()
+{
+	return instance.CollectStats().slow_queries.Format();
+}
+
+void
+Instance::SlowQueryExporter::OnPrometheusExporterError(std::exception_ptr error) noexcept
+{
+	PrintException(std::move(error));
+}
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "QueryCache.hxx"
+#include "QueryClassifier.hxx"
+#include "MysqlMakePacket.hxx"
+#include "MysqlProtocol.hxx"
+#include "Stats.hxx"
+
+#include <cassert>
+
+struct QueryCache::Item final
+	: IntrusiveListHook<IntrusiveHookMode::NORMAL>
+{
+	/**
+	 * Points to the key of this item in #items.
+	 */
+	std::string_view key;
+
+	std::string database;
+
+	std::vector<std::byte> response;
+
+	Event::TimePoint expires;
+
+	Item(std::string_view _database, std::vector<std::byte> &&_response,
+	     Event::TimePoint _expires) noexcept
+		:database(_database), response(std::move(_response)),
+		 expires(_expires) {}
+
+	Item(const Item &) = delete;
+	Item &operator=(const Item &) = delete;
+};
+
+static void
+AppendKeyString(std::string &dest, std::string_view src) noexcept
+{
+	/* length-prefixed to avoid ambiguities */
+	const std::size_t size = src.size();
+	dest.append(reinterpret_cast<const char *>(&size), sizeof(size));
+	dest.append(src);
+}
+
+std::string
+QueryCache::MakeKey(const Key &key) noexcept
+{
+	const auto address = key.address.GetSteadyPart();
+
+	std::string result;
+	AppendKeyString(result, {reinterpret_cast<const char *>(address.data()), address.size()});
+	AppendKeyString(result, key.user);
+	AppendKeyString(result, key.database);
+	result.append(reinterpret_cast<const char *>(&key.capabilities),
+		      sizeof(key.capabilities));
+	result.append(NormalizeQuery(key.query));
+	return result;
+}
+
+QueryCache::QueryCache(Stats &_stats) noexcept
+	:stats(_stats) {}
+
+QueryCache::~QueryCache() noexcept
+{
+	Clear();
+}
+
+void
+QueryCache::SetMaxSize(std::size_t _max_size) noexcept
+{
+	max_size = _max_size;
+	Shrink(0);
+}
+
+inline void
+QueryCache::Remove(Item &item) noexcept
+{
+	assert(size >= item.response.size());
+	assert(stats.n_query_cache_items > 0);
+
+	size -= item.response.size();
+	stats.query_cache_bytes -= item.response.size();
+	--stats.n_query_cache_items;
+
+	lru.erase(lru.iterator_to(item));
+
+	const auto i = items.find(item.key);
+	assert(i != items.end());
+	items.erase(i);
+}
+
+void
+QueryCache::Shrink(std::size_t needed) noexcept
+{
+	while (!lru.empty() && size + needed > max_size)
+		Remove(lru.back());
+}
+
+void
+QueryCache::Clear() noexcept
+{
+	while (!lru.empty())
+		Remove(lru.front());
+}
+
+void
+QueryCache::Invalidate(std::string_view database) noexcept
+{
+	for (auto i = lru.begin(); i != lru.end();) {
+		auto &item = *i++;
+		if (item.database == database)
+			Remove(item);
+	}
+}
+
+std::span<const std::byte>
+QueryCache::Get(std::string_view key, Event::TimePoint now) noexcept
+{
+	const auto i = items.find(key);
+	if (i == items.end()) {
+		++stats.n_query_cache_misses;
+		return {};
+	}
+
+	auto &item = i->second;
+	if (now >= item.expires) {
+		Remove(item);
+		++stats.n_query_cache_misses;
+		return {};
+	}
+
+	/* move to the front of the LRU list */
+	lru.erase(lru.iterator_to(item));
+	lru.push_front(item);
+
+	++stats.n_query_cache_hits;
+	return item.response;
+}
+
+void
+QueryCache::Put(std::string &&key, std::string_view database,
+		std::vector<std::byte> &&response,
+		Event::TimePoint expires) noexcept
+{
+	assert(!response.empty());
+
+	if (response.size() > GetMaxItemSize())
+		return;
+
+	if (const auto i = items.find(key); i != items.end())
+		Remove(i->second);
+
+	Shrink(response.size());
+
+	const auto [i, inserted] = items.try_emplace(std::move(key), database,
+						     std::move(response),
+						     expires);
+	assert(inserted);
+
+	auto &item = i->second;
+	item.key = i->first;
+	lru.push_front(item);
+
+	size += item.response.size();
+	stats.query_cache_bytes += item.response.size();
+	++stats.n_query_cache_items;
+	++stats.n_query_cache_stores;
+}
+
+bool
+QueryCacheCapture::Append(uint_least8_t number,
+			  std::span<const std::byte> payload,
+			  std::size_t max_size) noexcept
+{
+	if (response.size() + sizeof(Mysql::PacketHeader) + payload.size() > max_size)
+		return false;
+
+	Mysql::AppendPacket(response, number, payload);
+	return true;
+}
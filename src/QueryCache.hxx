@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/Chrono.hxx"
+#include "net/SocketAddress.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Stats;
+
+/**
+ * A cache for the responses to `SELECT` statements (see
+ * QueryIsCacheable()).  The response packets are stored verbatim
+ * (including their headers); since the response to a `COM_QUERY`
+ * always begins with sequence_id 1, they can be replayed to any
+ * client which sent the same query.
+ *
+ * Items are identified by a key containing everything which may
+ * influence the response: the server, the user, the default
+ * database, the client capabilities and the (normalized) query.
+ *
+ * The cache is limited by the total size of all responses; if it
+ * is full, the least recently used items are discarded.  Expired
+ * items are discarded lazily.
+ */
+class QueryCache {
+	Stats &stats;
+
+	struct Item;
+
+	using ItemMap = std::map<std::string, Item, std::less<>>;
+
+	ItemMap items;
+
+	/**
+	 * All items; the front of this list is the most recently
+	 * used one.
+	 */
+	IntrusiveList<Item> lru;
+
+	/**
+	 * The total size of all responses in #items.
+	 */
+	std::size_t size = 0;
+
+	std::size_t max_size = 0;
+
+public:
+	/**
+	 * Responses larger than this are never stored.  A cached
+	 * response is sent to the client in one go (without flow
+	 * control), so it must fit into the socket buffer of an idle
+	 * connection.
+	 */
+	static constexpr std::size_t MAX_ITEM_SIZE = 16 * 1024;
+
+	struct Key {
+		SocketAddress address;
+
+		std::string_view user, database;
+
+		/**
+		 * The capabilities announced by the client (which
+		 * influence the response format).
+		 */
+		uint_least32_t capabilities;
+
+		std::string_view query;
+	};
+
+	explicit QueryCache(Stats &_stats) noexcept;
+	~QueryCache() noexcept;
+
+	QueryCache(const QueryCache &) = delete;
+	QueryCache &operator=(const QueryCache &) = delete;
+
+	void SetMaxSize(std::size_t _max_size) noexcept;
+
+	bool IsEnabled() const noexcept {
+		return max_size > 0;
+	}
+
+	/**
+	 * Responses larger than this will not be stored.
+	 */
+	std::size_t GetMaxItemSize() const noexcept {
+		return std::min(max_size / 16, MAX_ITEM_SIZE);
+	}
+
+	[[gnu::pure]]
+	static std::string MakeKey(const Key &key) noexcept;
+
+	/**
+	 * Look up a response.  Updates the hit/miss counters.
+	 *
+	 * @return the response packets or an empty span if there is
+	 * no (valid) item; the span is valid until the cache is
+	 * modified
+	 */
+	std::span<const std::byte> Get(std::string_view key,
+				       Event::TimePoint now) noexcept;
+
+	/**
+	 * Add a response to the cache (replacing an existing item
+	 * with the same key).
+	 *
+	 * @param database the default database (for Invalidate())
+	 */
+	void Put(std::string &&key, std::string_view database,
+		 std::vector<std::byte> &&response,
+		 Event::TimePoint expires) noexcept;
+
+	/**
+	 * Discard all items.
+	 */
+	void Clear() noexcept;
+
+	/**
+	 * Discard all items whose default database is the given one.
+	 */
+	void Invalidate(std::string_view database) noexcept;
+
+private:
+	void Remove(Item &item) noexcept;
+
+	/**
+	 * Discard least recently used items until there is room for
+	 * the specified number of bytes.
+	 */
+	void Shrink(std::size_t needed) noexcept;
+};
+
+/**
+ * Collects the response to a `COM_QUERY` for the #QueryCache.
+ */
+struct QueryCacheCapture {
+	std::string key;
+
+	std::vector<std::byte> response;
+
+	Event::Duration ttl;
+
+	/**
+	 * Append a response packet.
+	 *
+	 * @return false if the response has become too large
+	 */
+	bool Append(uint_least8_t number, std::span<const std::byte> payload,
+		    std::size_t max_size) noexcept;
+};
@@ -0,0 +1,386 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "QueryClassifier.hxx"
+#include "util/CharUtil.hxx"
+
+#include <algorithm> // for std::any_of()
+#include <array>
+#include <utility> // for std::exchange()
+
+using std::string_view_literals::operator""sv;
+
+namespace {
+
+/**
+ * Splits a SQL statement into words (keywords and identifiers),
+ * skipping whitespace, punctuation, literals and comments.  A user
+ * variable reference is returned as the pseudo-word "@", a system
+ * variable reference as "@@" and a statement separator as ";".
+ */
+class WordScanner {
+	const char *p;
+	const char *const end;
+
+	/**
+	 * Does a new statement begin at the next word?
+	 */
+	bool next_is_first = true;
+
+	/**
+	 * Was the word most recently returned by Next() the first
+	 * word of a statement?
+	 */
+	bool first = false;
+
+public:
+	explicit constexpr WordScanner(std::string_view s) noexcept
+		:p(s.data()), end(s.data() + s.size()) {}
+
+	/**
+	 * @return the next word or an empty string at the end of
+	 * the statement
+	 */
+	std::string_view Next() noexcept;
+
+	/**
+	 * Is the word most recently returned by Next() the first
+	 * word of a statement, i.e. at the beginning of the query,
+	 * after a `;` or at the beginning of an executable comment
+	 * (which may contain a complete statement)?
+	 */
+	constexpr bool IsFirst() const noexcept {
+		return first;
+	}
+
+private:
+	void SkipQuoted(char quote) noexcept {
+		while (p < end) {
+			const char ch = *p++;
+			if (ch == quote)
+				return;
+
+			if (ch == '\\' && quote != '`' && p < end)
+				++p;
+		}
+	}
+
+	void SkipLine() noexcept {
+		while (p < end && *p != '\n')
+			++p;
+	}
+
+	void SkipBlockComment() noexcept {
+		while (p < end) {
+			if (*p++ == '*' && p < end && *p == '/') {
+				++p;
+				return;
+			}
+		}
+	}
+
+	static constexpr bool IsWordChar(char ch) noexcept {
+		return IsAlphaNumericASCII(ch) || ch == '_' || ch == '$';
+	}
+
+	void SkipWord() noexcept {
+		while (p < end && (IsWordChar(*p) || *p == '.'))
+			++p;
+	}
+};
+
+std::string_view
+WordScanner::Next() noexcept
+{
+	first = std::exchange(next_is_first, false);
+
+	while (p < end) {
+		const char ch = *p;
+
+		if (ch == '\'' || ch == '"' || ch == '`') {
+			++p;
+			SkipQuoted(ch);
+		} else if (ch == '#' ||
+			   (ch == '-' && end - p >= 2 && p[1] == '-')) {
+			SkipLine();
+		} else if (ch == '/' && end - p >= 2 && p[1] == '*') {
+			p += 2;
+
+			if (p < end && *p == '!') {
+				/* MySQL-specific executable comment:
+				   the contents will be executed, so
+				   skip only the version number */
+				++p;
+				while (p < end && IsDigitASCII(*p))
+					++p;
+
+				first = true;
+			} else
+				SkipBlockComment();
+		} else if (ch == '@') {
+			++p;
+
+			if (p < end && *p == '@') {
+				/* system variable */
+				++p;
+				SkipWord();
+				return "@@"sv;
+			} else {
+				/* user variable */
+				SkipWord();
+				return "@"sv;
+			}
+		} else if (ch == ';') {
+			++p;
+			first = false;
+			next_is_first = true;
+			return ";"sv;
+		} else if (IsWordChar(ch)) {
+			const char *start = p++;
+			while (p < end && IsWordChar(*p))
+				++p;
+
+			return {start, p};
+		} else
+			++p;
+	}
+
+	return {};
+}
+
+[[gnu::pure]]
+bool
+EqualsIgnoreCase(std::string_view word, std::string_view upper) noexcept
+{
+	return word.size() == upper.size() &&
+		std::equal(word.begin(), word.end(), upper.begin(),
+			   [](char a, char b){ return ToUpperASCII(a) == b; });
+}
+
+[[gnu::pure]]
+bool
+IsOneOf(std::string_view word, const auto &list) noexcept
+{
+	return std::any_of(list.begin(), list.end(), [word](std::string_view i){
+		return EqualsIgnoreCase(word, i);
+	});
+}
+
+} // anonymous namespace
+
+/**
+ * Statements which modify the session state.
+ */
+static constexpr std::array pinning_statements{
+	"CALL"sv,
+	"DEALLOCATE"sv,
+	"DECLARE"sv,
+	"EXECUTE"sv,
+	"HANDLER"sv,
+	"LOCK"sv,
+	"PREPARE"sv,
+	"SET"sv,
+	"USE"sv,
+	"XA"sv,
+};
+
+/**
+ * Keywords and functions which create or depend on session state
+ * anywhere in a statement.
+ */
+static constexpr std::array pinning_words{
+	"FOUND_ROWS"sv,
+	"GET_LOCK"sv,
+	"LAST_INSERT_ID"sv,
+	"ROW_COUNT"sv,
+	"SQL_CALC_FOUND_ROWS"sv,
+	"TEMPORARY"sv,
+};
+
+/**
+ * Keywords and functions which make the result of a `SELECT`
+ * uncacheable because it locks or writes something or because it
+ * depends on the session, the time or randomness.  Functions like
+ * USER() and DATABASE() are fine because the user and the database
+ * are part of the #QueryCache key.
+ */
+static constexpr std::array uncacheable_words{
+	"BENCHMARK"sv,
+	"CONNECTION_ID"sv,
+	"CURDATE"sv,
+	"CURRENT_DATE"sv,
+	"CURRENT_ROLE"sv,
+	"CURRENT_TIME"sv,
+	"CURRENT_TIMESTAMP"sv,
+	"CURTIME"sv,
+	"FOR"sv,
+	"FOUND_ROWS"sv,
+	"GET_LOCK"sv,
+	"INTO"sv,
+	"IS_FREE_LOCK"sv,
+	"IS_USED_LOCK"sv,
+	"LAST_INSERT_ID"sv,
+	"LOCALTIME"sv,
+	"LOCALTIMESTAMP"sv,
+	"LOCK"sv,
+	"NEXTVAL"sv,
+	"NOW"sv,
+	"RAND"sv,
+	"RANDOM_BYTES"sv,
+	"RELEASE_LOCK"sv,
+	"ROW_COUNT"sv,
+	"SLEEP"sv,
+	"SQL_CALC_FOUND_ROWS"sv,
+	"SQL_NO_CACHE"sv,
+	"SYSDATE"sv,
+	"UNIX_TIMESTAMP"sv,
+	"UTC_DATE"sv,
+	"UTC_TIME"sv,
+	"UTC_TIMESTAMP"sv,
+	"UUID"sv,
+	"UUID_SHORT"sv,
+};
+
+/**
+ * Keywords and functions which make a `SELECT` lock or write
+ * something or depend on earlier statements in the same session.
+ */
+static constexpr std::array read_write_words{
+	"FOR"sv,
+	"FOUND_ROWS"sv,
+	"GET_LOCK"sv,
+	"INTO"sv,
+	"IS_FREE_LOCK"sv,
+	"IS_USED_LOCK"sv,
+	"LAST_INSERT_ID"sv,
+	"LOCK"sv,
+	"NEXTVAL"sv,
+	"RELEASE_LOCK"sv,
+	"ROW_COUNT"sv,
+	"SQL_CALC_FOUND_ROWS"sv,
+};
+
+QueryClassification
+ClassifyQuery(std::string_view query) noexcept
+{
+	WordScanner s{query};
+
+	auto word = s.Next();
+	const bool select = EqualsIgnoreCase(word, "SELECT"sv);
+
+	QueryClassification c{
+		.pins_session = IsOneOf(word, pinning_statements),
+		.changes_database = false,
+		.cacheable = select,
+		.read_only = select,
+	};
+
+	while (!word.empty()) {
+		/* "USE" can appear elsewhere in a statement (index
+		   hints like "USE INDEX"), so only the first word of
+		   a statement counts */
+		if (s.IsFirst() && EqualsIgnoreCase(word, "USE"sv))
+			c.changes_database = true;
+
+		if (word == ";"sv) {
+			word = s.Next();
+			if (!word.empty()) {
+				/* multiple statements in one
+				   `COM_QUERY`
+				   (Mysql::CLIENT_MULTI_STATEMENTS)
+				   can do anything (a trailing `;`
+				   is harmless) */
+				c.pins_session = true;
+				c.cacheable = c.read_only = false;
+			}
+
+			continue;
+		}
+
+		if (word == "@"sv) {
+			c.pins_session = true;
+			c.cacheable = c.read_only = false;
+		} else if (word == "@@"sv) {
+			c.cacheable = c.read_only = false;
+		} else {
+			if (!c.pins_session && IsOneOf(word, pinning_words))
+				c.pins_session = true;
+
+			if (c.cacheable && IsOneOf(word, uncacheable_words))
+				c.cacheable = false;
+
+			if (c.read_only && IsOneOf(word, read_write_words))
+				c.read_only = false;
+		}
+
+		word = s.Next();
+	}
+
+	return c;
+}
+
+bool
+QueryPinsSession(std::string_view query) noexcept
+{
+	return ClassifyQuery(query).pins_session;
+}
+
+bool
+QueryChangesDatabase(std::string_view query) noexcept
+{
+	return ClassifyQuery(query).changes_database;
+}
+
+bool
+QueryIsCacheable(std::string_view query) noexcept
+{
+	return ClassifyQuery(query).cacheable;
+}
+
+bool
+QueryIsReadOnly(std::string_view query) noexcept
+{
+	return ClassifyQuery(query).read_only;
+}
+
+std::string
+NormalizeQuery(std::string_view query) noexcept
+{
+	std::string result;
+	result.reserve(query.size());
+
+	bool space = false;
+	char quote = 0;
+
+	for (std::size_t i = 0; i < query.size(); ++i) {
+		const char ch = query[i];
+
+		if (quote != 0) {
+			result.push_back(ch);
+
+			if (ch == quote)
+				quote = 0;
+			else if (ch == '\\' && quote != '`' && i + 1 < query.size())
+				result.push_back(query[++i]);
+
+			continue;
+		}
+
+		if (IsWhitespaceOrNull(ch)) {
+			space = true;
+			continue;
+		}
+
+		if (space && !result.empty())
+			result.push_back(' ');
+		space = false;
+
+		result.push_back(ch);
+
+		if (ch == '\'' || ch == '"' || ch == '`')
+			quote = ch;
+	}
+
+	return result;
+}
@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Cheap heuristics which look at the text of a SQL statement.
+ * These do not parse SQL; they only look at keywords outside of
+ * string literals, quoted identifiers and comments.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+/**
+ * The properties of a statement which are looked at for each
+ * `COM_QUERY`, see ClassifyQuery().
+ */
+struct QueryClassification {
+	/**
+	 * See QueryPinsSession().
+	 */
+	bool pins_session;
+
+	/**
+	 * See QueryChangesDatabase().
+	 */
+	bool changes_database;
+
+	/**
+	 * See QueryIsCacheable().
+	 */
+	bool cacheable;
+
+	/**
+	 * See QueryIsReadOnly().
+	 */
+	bool read_only;
+
+	/**
+	 * The assumptions for a statement which cannot be
+	 * inspected (e.g. because only its beginning is available).
+	 */
+	static constexpr QueryClassification Unknown() noexcept {
+		return {
+			.pins_session = true,
+			.changes_database = true,
+			.cacheable = false,
+			.read_only = false,
+		};
+	}
+};
+
+/**
+ * Obtain all properties of a statement in a single pass.  This is
+ * cheaper than calling the functions below one after another.
+ */
+[[gnu::pure]]
+QueryClassification
+ClassifyQuery(std::string_view query) noexcept;
+
+/**
+ * Does this statement (possibly) create session state on the
+ * server which would get lost if subsequent statements were executed
+ * on another server connection?  Examples are user variables,
+ * temporary tables, named locks, server-side prepared statements and
+ * `SET` statements.  Multiple statements separated by `;` always
+ * pin the session.
+ *
+ * This errs on the side of caution, i.e. it may return true for
+ * statements which are harmless.
+ */
+[[gnu::pure]]
+bool
+QueryPinsSession(std::string_view query) noexcept;
+
+/**
+ * Does this statement (possibly) switch to another default database
+ * (i.e. does it contain a `USE` statement)?  Only `USE` at the
+ * beginning of a statement counts, not index hints like `USE
+ * INDEX`.
+ */
+[[gnu::pure]]
+bool
+QueryChangesDatabase(std::string_view query) noexcept;
+
+/**
+ * May the result of this statement be cached (#QueryCache)?  This
+ * accepts only single `SELECT` statements which neither lock nor
+ * write anything and do not depend on the session, the time or
+ * random numbers.
+ */
+[[gnu::pure]]
+bool
+QueryIsCacheable(std::string_view query) noexcept;
+
+/**
+ * May this statement be executed on a read-only replica
+ * (#ConnectOptions::read_write_split)?  This accepts only single
+ * `SELECT` statements which neither lock nor write anything and
+ * which do not refer to variables or to the results of earlier
+ * statements.
+ */
+[[gnu::pure]]
+bool
+QueryIsReadOnly(std::string_view query) noexcept;
+
+/**
+ * Normalize the text of a statement for use as a cache key:
+ * leading and trailing whitespace is removed and all other
+ * whitespace sequences (outside of literals) are collapsed to a
+ * single space.
+ */
+std::string
+NormalizeQuery(std::string_view query) noexcept;
@@ -0,0 +1,396 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "QueryDigest.hxx"
+#include "util/CharUtil.hxx"
+
+#include <algorithm> // for std::copy_n()
+#include <array>
+#include <cstring> // for memchr()
+
+using std::string_view_literals::operator""sv;
+
+namespace {
+
+enum class TokenType {
+	WORD,
+
+	/**
+	 * A literal (already replaced with `?`).
+	 */
+	VALUE,
+
+	OPEN,
+	CLOSE,
+	COMMA,
+	DOT,
+	OTHER,
+};
+
+/**
+ * Writes tokens to the digest buffer, inserting spaces and
+ * collapsing lists of literals.
+ */
+class DigestWriter {
+	char *const begin, *p, *const end;
+
+	/**
+	 * The most recent "(" (for collapsing lists of literals).
+	 */
+	char *list_start;
+
+	enum class ListState {
+		NONE,
+		EXPECT_VALUE,
+		AFTER_VALUE,
+	} list_state = ListState::NONE;
+
+	TokenType last = TokenType::OTHER;
+
+public:
+	explicit DigestWriter(std::span<char> buffer) noexcept
+		:begin(buffer.data()), p(begin), end(begin + buffer.size()) {}
+
+	bool IsFull() const noexcept {
+		return p == end;
+	}
+
+	std::string_view Finish() const noexcept {
+		return {begin, p};
+	}
+
+	/**
+	 * @param whitespace was there whitespace (or a comment)
+	 * before this token in the statement?
+	 */
+	void Append(TokenType type, std::string_view text,
+		    bool whitespace) noexcept;
+
+private:
+	void Write(std::string_view text) noexcept {
+		const std::size_t n = std::min(text.size(),
+					       static_cast<std::size_t>(end - p));
+		p = std::copy_n(text.data(), n, p);
+	}
+
+	[[gnu::pure]]
+	bool NeedSpace(TokenType type, bool whitespace) const noexcept {
+		if (p == begin || last == TokenType::OPEN ||
+		    last == TokenType::DOT)
+			return false;
+
+		switch (type) {
+		case TokenType::CLOSE:
+		case TokenType::COMMA:
+		case TokenType::DOT:
+			return false;
+
+		case TokenType::OPEN:
+			/* keep function calls together, but
+			   separate "IN (" */
+			return whitespace || last != TokenType::WORD;
+
+		case TokenType::WORD:
+		case TokenType::VALUE:
+		case TokenType::OTHER:
+			break;
+		}
+
+		return true;
+	}
+
+	void CollapseList() noexcept;
+};
+
+void
+DigestWriter::Append(TokenType type, std::string_view text,
+		     bool whitespace) noexcept
+{
+	if (NeedSpace(type, whitespace))
+		Write(" "sv);
+
+	char *const start = p;
+	Write(text);
+	last = type;
+
+	switch (type) {
+	case TokenType::OPEN:
+		list_start = start;
+		list_state = ListState::EXPECT_VALUE;
+		break;
+
+	case TokenType::VALUE:
+		list_state = list_state == ListState::EXPECT_VALUE
+			? ListState::AFTER_VALUE
+			: ListState::NONE;
+		break;
+
+	case TokenType::COMMA:
+		list_state = list_state == ListState::AFTER_VALUE
+			? ListState::EXPECT_VALUE
+			: ListState::NONE;
+		break;
+
+	case TokenType::CLOSE:
+		if (list_state == ListState::AFTER_VALUE && !IsFull())
+			CollapseList();
+		list_state = ListState::NONE;
+		break;
+
+	case TokenType::WORD:
+	case TokenType::DOT:
+	case TokenType::OTHER:
+		list_state = ListState::NONE;
+		break;
+	}
+}
+
+inline void
+DigestWriter::CollapseList() noexcept
+{
+	static constexpr auto collapsed = "(...)"sv;
+	static constexpr auto separator = ", "sv;
+
+	p = list_start;
+
+	/* rows of a multi-row INSERT: keep only the first one */
+	if (std::string_view{begin, p}.ends_with(separator) &&
+	    std::string_view{begin, p - separator.size()}.ends_with(collapsed)) {
+		p -= separator.size();
+		return;
+	}
+
+	Write(collapsed);
+}
+
+constexpr bool
+IsWordChar(char ch) noexcept
+{
+	return IsAlphaNumericASCII(ch) || ch == '_' || ch == '$' ||
+		static_cast<unsigned char>(ch) >= 0x80;
+}
+
+/**
+ * Operators consisting of more than one character; the longest
+ * ones first.
+ */
+constexpr std::array multi_char_operators{
+	"<=>"sv, "->>"sv,
+	"<="sv, ">="sv, "<>"sv, "!="sv, ":="sv, "||"sv, "&&"sv,
+	"<<"sv, ">>"sv, "->"sv,
+};
+
+[[gnu::pure]]
+std::size_t
+GetOperatorLength(std::string_view s) noexcept
+{
+	for (const auto i : multi_char_operators)
+		if (s.starts_with(i))
+			return i.size();
+
+	return 1;
+}
+
+/**
+ * Skip the rest of a quoted string or identifier.  memchr() is
+ * usually vectorized, so this is fast even for large literals.
+ *
+ * @param s the first character after the opening quote
+ * @return the first character after the closing quote
+ */
+const char *
+SkipQuoted(const char *s, const char *const end, const char quote) noexcept
+{
+	while (true) {
+		const char *q = static_cast<const char *>(memchr(s, quote, end - s));
+		if (q == nullptr)
+			return end;
+
+		if (quote != '`') {
+			/* is this quote escaped by an odd number of
+			   backslashes? */
+			std::size_t n_backslashes = 0;
+			for (const char *i = q; i > s && i[-1] == '\\'; --i)
+				++n_backslashes;
+
+			if (n_backslashes % 2 != 0) {
+				s = q + 1;
+				continue;
+			}
+		}
+
+		if (q + 1 < end && q[1] == quote) {
+			/* doubled quote */
+			s = q + 2;
+			continue;
+		}
+
+		return q + 1;
+	}
+}
+
+const char *
+SkipBlockComment(const char *s, const char *const end) noexcept
+{
+	while (true) {
+		const char *q = static_cast<const char *>(memchr(s, '*', end - s));
+		if (q == nullptr)
+			return end;
+
+		if (q + 1 < end && q[1] == '/')
+			return q + 2;
+
+		s = q + 1;
+	}
+}
+
+const char *
+SkipLine(const char *s, const char *const end) noexcept
+{
+	const char *q = static_cast<const char *>(memchr(s, '\n', end - s));
+	return q != nullptr ? q + 1 : end;
+}
+
+const char *
+SkipNumber(const char *s, const char *const end) noexcept
+{
+	while (s < end) {
+		if ((*s == 'e' || *s == 'E') && end - s >= 2 &&
+		    (s[1] == '+' || s[1] == '-'))
+			s += 2;
+		else if (IsWordChar(*s) || *s == '.')
+			++s;
+		else
+			break;
+	}
+
+	return s;
+}
+
+/**
+ * Is this word the prefix of a string literal, i.e. a hex/bit
+ * literal (`X'FF'`), a national string (`N'abc'`) or a character
+ * set introducer (`_utf8mb4'abc'`)?
+ */
+[[gnu::pure]]
+bool
+IsLiteralPrefix(std::string_view word) noexcept
+{
+	if (word.size() == 1) {
+		const char ch = ToUpperASCII(word.front());
+		return ch == 'X' || ch == 'B' || ch == 'N';
+	}
+
+	return word.front() == '_';
+}
+
+} // anonymous namespace
+
+std::string_view
+MakeQueryDigest(std::string_view query,
+		std::span<char, MAX_QUERY_DIGEST> buffer) noexcept
+{
+	DigestWriter w{buffer};
+
+	const char *s = query.data();
+	const char *const end = s + query.size();
+
+	/* was there whitespace or a comment before the current
+	   token? */
+	bool whitespace = false;
+
+	/* are we inside a MySQL-specific executable comment? */
+	bool executable_comment = false;
+
+	while (s < end && !w.IsFull()) {
+		const char ch = *s;
+
+		if (IsWhitespaceOrNull(ch)) {
+			++s;
+			whitespace = true;
+			continue;
+		}
+
+		if (ch == '#' ||
+		    (ch == '-' && end - s >= 2 && s[1] == '-' &&
+		     (end - s == 2 || IsWhitespaceOrNull(s[2])))) {
+			s = SkipLine(s, end);
+			whitespace = true;
+			continue;
+		}
+
+		if (ch == '/' && end - s >= 2 && s[1] == '*') {
+			s += 2;
+
+			if (s < end && *s == '!') {
+				/* the contents will be executed,
+				   so skip only the version number */
+				++s;
+				while (s < end && IsDigitASCII(*s))
+					++s;
+				executable_comment = true;
+			} else
+				s = SkipBlockComment(s, end);
+
+			whitespace = true;
+			continue;
+		}
+
+		if (executable_comment && ch == '*' &&
+		    end - s >= 2 && s[1] == '/') {
+			s += 2;
+			executable_comment = false;
+			whitespace = true;
+			continue;
+		}
+
+		const char *const start = s;
+
+		if (ch == '\'' || ch == '"') {
+			s = SkipQuoted(s + 1, end, ch);
+			w.Append(TokenType::VALUE, "?"sv, whitespace);
+		} else if (ch == '`') {
+			s = SkipQuoted(s + 1, end, ch);
+			w.Append(TokenType::WORD, {start, s}, whitespace);
+		} else if (IsDigitASCII(ch) ||
+			   (ch == '.' && end - s >= 2 && IsDigitASCII(s[1]))) {
+			s = SkipNumber(s, end);
+			w.Append(TokenType::VALUE, "?"sv, whitespace);
+		} else if (ch == '?') {
+			++s;
+			w.Append(TokenType::VALUE, "?"sv, whitespace);
+		} else if (IsWordChar(ch) || ch == '@') {
+			while (s < end && *s == '@')
+				++s;
+			while (s < end && IsWordChar(*s))
+				++s;
+
+			const std::string_view word{start, s};
+			if (s < end && *s == '\'' && IsLiteralPrefix(word)) {
+				s = SkipQuoted(s + 1, end, '\'');
+				w.Append(TokenType::VALUE, "?"sv, whitespace);
+			} else
+				w.Append(TokenType::WORD, word, whitespace);
+		} else if (ch == '(') {
+			++s;
+			w.Append(TokenType::OPEN, "("sv, whitespace);
+		} else if (ch == ')') {
+			++s;
+			w.Append(TokenType::CLOSE, ")"sv, whitespace);
+		} else if (ch == ',') {
+			++s;
+			w.Append(TokenType::COMMA, ","sv, whitespace);
+		} else if (ch == '.') {
+			++s;
+			w.Append(TokenType::DOT, "."sv, whitespace);
+		} else {
+			s += GetOperatorLength({s, end});
+			w.Append(TokenType::OTHER, {start, s}, whitespace);
+		}
+
+		whitespace = false;
+	}
+
+	return w.Finish();
+}
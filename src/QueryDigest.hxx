@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+/**
+ * The maximum length of a query digest (like MySQL's
+ * `performance_schema_max_digest_length`).  Longer digests are
+ * truncated.
+ */
+static constexpr std::size_t MAX_QUERY_DIGEST = 1024;
+
+/**
+ * Convert the text of a statement into its "digest": all literals
+ * (strings, numbers) are replaced with `?`, comments are removed,
+ * tokens are separated by a single space, and lists consisting only
+ * of literals (e.g. `IN (1, 2, 3)` or the rows of a multi-row
+ * `INSERT`) are collapsed to `(...)`.  Statements which differ only
+ * in their parameters have the same digest.
+ *
+ * This is a single pass over the statement and does not allocate
+ * memory; the input is consumed only until the buffer is full.
+ *
+ * @return the digest (pointing into #buffer)
+ */
+std::string_view
+MakeQueryDigest(std::string_view query,
+		std::span<char, MAX_QUERY_DIGEST> buffer) noexcept;
@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "SlowQueryLog.hxx"
+#include "net/SocketAddress.hxx"
+#include "net/ToString.hxx"
+#include "time/Cast.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::stable_sort()
+#include <vector>
+
+#include <time.h>
+
+void
+SlowQueryLog::Record(Event::Duration duration, std::string_view query,
+		     std::string_view account, SocketAddress server,
+		     uint_least16_t status_flags, bool error) noexcept
+{
+	Entry &entry = Push();
+	entry.time = std::chrono::system_clock::now();
+	entry.duration = duration;
+	entry.query = query.substr(0, MAX_QUERY_LENGTH);
+	entry.account = account;
+	entry.server = ToString(server);
+	entry.status_flags = status_flags;
+	entry.error = error;
+}
+
+void
+SlowQueryLog::Add(const SlowQueryLog &src) noexcept
+{
+	if (src.n == 0)
+		return;
+
+	std::vector<Entry> all;
+	all.reserve(n + src.n);
+	ForEach([&all](const Entry &entry){ all.push_back(entry); });
+	src.ForEach([&all](const Entry &entry){ all.push_back(entry); });
+
+	std::stable_sort(all.begin(), all.end(), [](const Entry &a, const Entry &b){
+		return a.time < b.time;
+	});
+
+	if (all.size() > CAPACITY)
+		all.erase(all.begin(), all.end() - CAPACITY);
+
+	next = n = 0;
+	for (auto &entry : all)
+		Push() = std::move(entry);
+}
+
+static std::string
+FormatTime(std::chrono::system_clock::time_point time) noexcept
+{
+	const time_t t = std::chrono::system_clock::to_time_t(time);
+	struct tm tm;
+	gmtime_r(&t, &tm);
+
+	return fmt::format("{:04}-{:02}-{:02}T{:02}:{:02}:{:02}Z",
+			   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			   tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+std::string
+SlowQueryLog::Format() const noexcept
+{
+	std::string s;
+
+	ForEach([&s](const Entry &entry){
+		s += fmt::format("{} duration={:.3f} server={:?} account={:?} status_flags={:#x}{} query={:?}\n",
+				 FormatTime(entry.time),
+				 ToFloatSeconds(entry.duration),
+				 entry.server, entry.account,
+				 entry.status_flags,
+				 entry.error ? " error" : "",
+				 entry.query);
+	});
+
+	return s;
+}
@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "MysqlProtocol.hxx"
+#include "event/Chrono.hxx"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+class SocketAddress;
+
+/**
+ * A ring buffer of the most recent slow queries.  Each worker
+ * thread has its own instance (without locking); the per-thread
+ * copies are merged with Add() when statistics are collected.
+ *
+ * Entries are overwritten in place, so their strings reuse their
+ * buffers and recording a query usually does not allocate memory.
+ */
+class SlowQueryLog {
+public:
+	static constexpr std::size_t CAPACITY = 64;
+
+	/**
+	 * Longer query texts are truncated.
+	 */
+	static constexpr std::size_t MAX_QUERY_LENGTH = 256;
+
+	struct Entry {
+		std::chrono::system_clock::time_point time;
+
+		Event::Duration duration;
+
+		/**
+		 * The query digest (see MakeQueryDigest()); empty
+		 * for commands other than `COM_QUERY`.
+		 */
+		std::string query;
+
+		std::string account, server;
+
+		/**
+		 * The status_flags of the OK packet (e.g.
+		 * SERVER_QUERY_WAS_SLOW).
+		 */
+		uint_least16_t status_flags;
+
+		bool error;
+	};
+
+private:
+	std::array<Entry, CAPACITY> entries;
+
+	/**
+	 * The index of the next entry to be written.
+	 */
+	std::size_t next = 0;
+
+	/**
+	 * The number of valid entries.
+	 */
+	std::size_t n = 0;
+
+	/**
+	 * Queries which take at least this long are recorded.  Zero
+	 * means only queries flagged by the server
+	 * (SERVER_QUERY_WAS_SLOW) are recorded.
+	 */
+	Event::Duration threshold{};
+
+public:
+	void SetThreshold(Event::Duration _threshold) noexcept {
+		threshold = _threshold;
+	}
+
+	/**
+	 * Shall this query be recorded?  This is cheap and should
+	 * be called before collecting the parameters of Record().
+	 */
+	[[gnu::pure]]
+	bool IsSlow(Event::Duration duration,
+		    uint_least16_t status_flags) const noexcept {
+		return (threshold > Event::Duration{} && duration >= threshold) ||
+			(status_flags & Mysql::SERVER_QUERY_WAS_SLOW) != 0;
+	}
+
+	void Record(Event::Duration duration, std::string_view query,
+		    std::string_view account, SocketAddress server,
+		    uint_least16_t status_flags, bool error) noexcept;
+
+	/**
+	 * Add the entries of another instance (e.g. from another
+	 * worker thread), keeping the most recent ones.
+	 */
+	void Add(const SlowQueryLog &src) noexcept;
+
+	/**
+	 * Format all entries as text, one per line, the oldest one
+	 * first.
+	 */
+	std::string Format() const noexcept;
+
+private:
+	Entry &Push() noexcept {
+		Entry &entry = entries[next];
+		next = (next + 1) % CAPACITY;
+		if (n < CAPACITY)
+			++n;
+		return entry;
+	}
+
+	/**
+	 * Call the given function for each entry, the oldest one
+	 * first.
+	 */
+	void ForEach(auto &&f) const {
+		for (std::size_t i = 0; i < n; ++i)
+			f(entries[(next + CAPACITY - n + i) % CAPACITY]);
+	}
+};
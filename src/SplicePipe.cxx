@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "SplicePipe.hxx"
+#include "net/SocketDescriptor.hxx"
+#include "system/Error.hxx"
+
+#include <cassert>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Try to enlarge the pipe to this size, to reduce the number of
+ * system calls.  The default is only 64 kB.
+ */
+static constexpr int pipe_size = 256 * 1024;
+
+void
+SplicePipe::Create()
+{
+	assert(!IsDefined());
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC|O_NONBLOCK) < 0)
+		throw MakeErrno("pipe2() failed");
+
+	r = UniqueFileDescriptor{AdoptTag{}, FileDescriptor{fds[0]}};
+	w = UniqueFileDescriptor{AdoptTag{}, FileDescriptor{fds[1]}};
+
+	/* ignore errors; this may exceed "/proc/sys/fs/pipe-max-size"
+	   and then we'll just use the default size */
+	fcntl(w.Get(), F_SETPIPE_SZ, pipe_size);
+}
+
+ssize_t
+SplicePipe::Fill(SocketDescriptor src, std::size_t max) noexcept
+{
+	assert(IsDefined());
+	assert(max > 0);
+
+	const auto nbytes = splice(src.Get(), nullptr, w.Get(), nullptr, max,
+				   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (nbytes > 0)
+		fill += static_cast<std::size_t>(nbytes);
+
+	return nbytes;
+}
+
+ssize_t
+SplicePipe::Drain(SocketDescriptor dest) noexcept
+{
+	assert(IsDefined());
+	assert(!IsEmpty());
+
+	const auto nbytes = splice(r.Get(), nullptr, dest.Get(), nullptr, fill,
+				   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (nbytes > 0) {
+		assert(static_cast<std::size_t>(nbytes) <= fill);
+		fill -= static_cast<std::size_t>(nbytes);
+	}
+
+	return nbytes;
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <cstddef>
+
+#include <sys/types.h> // for ssize_t
+
+class SocketDescriptor;
+
+/**
+ * A pipe which moves data from one socket to another with splice(),
+ * i.e. without copying it to userspace.
+ */
+class SplicePipe {
+	UniqueFileDescriptor r, w;
+
+	/**
+	 * The number of bytes currently in the pipe.
+	 */
+	std::size_t fill = 0;
+
+public:
+	bool IsDefined() const noexcept {
+		return r.IsDefined();
+	}
+
+	bool IsEmpty() const noexcept {
+		return fill == 0;
+	}
+
+	/**
+	 * Create the pipe.  Throws on error.
+	 */
+	void Create();
+
+	/**
+	 * Move data from the socket into the pipe.
+	 *
+	 * @return the number of bytes moved, 0 on end-of-file or -1
+	 * on error (with errno set; `EAGAIN` if the socket has no
+	 * data or the pipe is full)
+	 */
+	ssize_t Fill(SocketDescriptor src, std::size_t max) noexcept;
+
+	/**
+	 * Move data from the pipe to the socket.
+	 *
+	 * @return the number of bytes moved or -1 on error (with
+	 * errno set)
+	 */
+	ssize_t Drain(SocketDescriptor dest) noexcept;
+};
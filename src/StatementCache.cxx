@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "StatementCache.hxx"
+#include "MysqlMakePacket.hxx"
+#include "MysqlProtocol.hxx"
+
+#include <cassert>
+
+StatementCache::Statement
+StatementCache::Acquire(std::string_view query) noexcept
+{
+	const auto i = idle.find(query);
+	if (i == idle.end())
+		return {};
+
+	const uint_least32_t id = i->second;
+	idle.erase(i);
+
+	auto &item = items.find(id)->second;
+	assert(!item.in_use);
+	item.in_use = true;
+
+	return {id, item.response};
+}
+
+void
+StatementCache::Add(uint_least32_t id, std::string_view query,
+		    std::vector<std::byte> &&response) noexcept
+{
+	assert(id != 0);
+	assert(!response.empty());
+
+	/* the server never reuses the id of a statement which is
+	   still prepared */
+	[[maybe_unused]] const auto [i, inserted] =
+		items.try_emplace(id, Item{
+				.query = std::string{query},
+				.response = std::move(response),
+			});
+	assert(inserted);
+}
+
+bool
+StatementCache::Release(uint_least32_t id, std::size_t max_idle) noexcept
+{
+	const auto i = items.find(id);
+	assert(i != items.end());
+	assert(i->second.in_use);
+
+	if (idle.size() >= max_idle) {
+		items.erase(i);
+		return false;
+	}
+
+	i->second.in_use = false;
+	idle.emplace(i->second.query, id);
+	return true;
+}
+
+void
+StatementCache::Remove(uint_least32_t id) noexcept
+{
+	const auto i = items.find(id);
+	assert(i != items.end());
+	assert(i->second.in_use);
+
+	items.erase(i);
+}
+
+bool
+StatementCacheCapture::Append(uint_least8_t number,
+			      std::span<const std::byte> payload) noexcept
+{
+	if (response.size() + sizeof(Mysql::PacketHeader) + payload.size() > StatementCache::MAX_RESPONSE_SIZE)
+		return false;
+
+	Mysql::AppendPacket(response, number, payload);
+	return true;
+}
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * The prepared statements of one server connection which can be
+ * handed out to clients again (#ConnectOptions::statement_cache).
+ * A client which prepares a statement which is already prepared
+ * (and not in use) gets its statement id and the recorded response
+ * of the original `COM_STMT_PREPARE` without a server round trip.
+ * When the client closes the statement, the `COM_STMT_CLOSE` is not
+ * forwarded; the statement stays prepared on the server and becomes
+ * available again.
+ *
+ * Each statement is used by at most one client statement at a time,
+ * because the parameter types bound by `COM_STMT_EXECUTE` are part
+ * of the server-side statement state.
+ *
+ * This object moves with the server connection into the
+ * #BackendPool; it is discarded when the session gets reset
+ * (`COM_RESET_CONNECTION` deallocates all statements).
+ */
+class StatementCache {
+	struct Item {
+		std::string query;
+
+		/**
+		 * The response to `COM_STMT_PREPARE` (including the
+		 * packet headers).
+		 */
+		std::vector<std::byte> response;
+
+		bool in_use = true;
+	};
+
+	/**
+	 * All statements, indexed by their statement id.
+	 */
+	std::map<uint_least32_t, Item> items;
+
+	/**
+	 * Statements which are not in use, indexed by their query
+	 * string (which points into #items).
+	 */
+	std::multimap<std::string_view, uint_least32_t> idle;
+
+public:
+	/**
+	 * Responses larger than this are not stored; they are sent
+	 * to the client in one go (without flow control).
+	 */
+	static constexpr std::size_t MAX_RESPONSE_SIZE = 16 * 1024;
+
+	struct Statement {
+		uint_least32_t id;
+
+		std::span<const std::byte> response;
+	};
+
+	bool empty() const noexcept {
+		return items.empty();
+	}
+
+	std::size_t GetIdleCount() const noexcept {
+		return idle.size();
+	}
+
+	/**
+	 * Look up an idle statement with the given query and mark it
+	 * "in use".
+	 *
+	 * @return the statement; its id is 0 on a miss
+	 */
+	Statement Acquire(std::string_view query) noexcept;
+
+	/**
+	 * Add a statement which has just been prepared by a client
+	 * (and is therefore "in use").
+	 */
+	void Add(uint_least32_t id, std::string_view query,
+		 std::vector<std::byte> &&response) noexcept;
+
+	/**
+	 * The client has closed a statement.  Keep it prepared on the
+	 * server unless there are already too many idle statements.
+	 *
+	 * @param max_idle the maximum number of idle statements
+	 * @return true if the statement has been kept, false if the
+	 * caller shall close it on the server (it has been removed
+	 * from the cache)
+	 */
+	bool Release(uint_least32_t id, std::size_t max_idle) noexcept;
+
+	/**
+	 * Remove a statement (which is "in use") because it gets
+	 * closed on the server.
+	 */
+	void Remove(uint_least32_t id) noexcept;
+
+	/**
+	 * Forget all statements (e.g. after `COM_RESET_CONNECTION`).
+	 */
+	void Clear() noexcept {
+		idle.clear();
+		items.clear();
+	}
+};
+
+/**
+ * Collects the response to a `COM_STMT_PREPARE` for the
+ * #StatementCache.
+ */
+struct StatementCacheCapture {
+	std::string query;
+
+	std::vector<std::byte> response;
+
+	/**
+	 * The statement id assigned by the server (from the first
+	 * response packet); 0 if the server has not yet responded or
+	 * if preparing has failed.
+	 */
+	uint_least32_t statement_id = 0;
+
+	/**
+	 * Append a response packet.
+	 *
+	 * @return false if the response has become too large
+	 */
+	bool Append(uint_least8_t number,
+		    std::span<const std::byte> payload) noexcept;
+};
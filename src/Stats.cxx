@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Stats.hxx"
+
+void
+NodeStats::Add(const NodeStats &src) noexcept
+{
+	if (state == nullptr)
+		state = src.state;
+
+	n_connects += src.n_connects;
+	n_connect_errors += src.n_connect_errors;
+	n_packets_received += src.n_packets_received;
+	n_bytes_received += src.n_bytes_received;
+	n_bytes_spliced += src.n_bytes_spliced;
+	n_malformed_packets += src.n_malformed_packets;
+
+	n_queries += src.n_queries;
+	n_query_errors += src.n_query_errors;
+	n_query_warnings += src.n_query_warnings;
+	n_no_good_index_queries += src.n_no_good_index_queries;
+	n_no_index_queries += src.n_no_index_queries;
+	n_slow_queries += src.n_slow_queries;
+	n_affected_rows += src.n_affected_rows;
+
+	n_pool_hits += src.n_pool_hits;
+	n_pool_misses += src.n_pool_misses;
+	n_pool_idle += src.n_pool_idle;
+
+	n_queue_running += src.n_queue_running;
+	n_queue_waiting += src.n_queue_waiting;
+	n_queue_delayed += src.n_queue_delayed;
+	n_queue_timeouts += src.n_queue_timeouts;
+	queue_wait += src.queue_wait;
+
+	n_statement_cache_hits += src.n_statement_cache_hits;
+	n_statement_cache_misses += src.n_statement_cache_misses;
+
+	n_compressed_bytes_received += src.n_compressed_bytes_received;
+	n_decompressed_bytes_received += src.n_decompressed_bytes_received;
+	n_compressed_bytes_sent += src.n_compressed_bytes_sent;
+	n_uncompressed_bytes_sent += src.n_uncompressed_bytes_sent;
+
+	query_wait += src.query_wait;
+	query_durations.Add(src.query_durations);
+	query_latency.Add(src.query_latency);
+	n_pending_commands += src.n_pending_commands;
+	n_clients += src.n_clients;
+	compression_time += src.compression_time;
+}
+
+void
+Stats::Add(const Stats &src) noexcept
+{
+	n_accepted_connections += src.n_accepted_connections;
+	n_rejected_connections += src.n_rejected_connections;
+
+	n_client_packets_received += src.n_client_packets_received;
+	n_client_bytes_received += src.n_client_bytes_received;
+	n_client_malformed_packets += src.n_client_malformed_packets;
+	n_client_handshake_responses += src.n_client_handshake_responses;
+	n_client_tls_connections += src.n_client_tls_connections;
+	n_client_auth_ok += src.n_client_auth_ok;
+	n_client_auth_err += src.n_client_auth_err;
+	n_client_queries += src.n_client_queries;
+
+	n_lua_errors += src.n_lua_errors;
+
+	n_delayed_commands += src.n_delayed_commands;
+	delay_wait += src.delay_wait;
+
+	n_query_cache_hits += src.n_query_cache_hits;
+	n_query_cache_misses += src.n_query_cache_misses;
+	n_query_cache_stores += src.n_query_cache_stores;
+	n_query_cache_items += src.n_query_cache_items;
+	query_cache_bytes += src.query_cache_bytes;
+
+	for (unsigned i = 0; i < FB_N_CLASSES; ++i)
+		n_io_buffers[i] += src.n_io_buffers[i];
+
+	accounts.Add(src.accounts);
+	digests.Add(src.digests);
+	slow_queries.Add(src.slow_queries);
+
+	for (const auto &[address, node] : src.nodes)
+		GetNode(address).Add(node);
+}
+
+void
+Stats::CollectIoBuffers() noexcept
+{
+	for (unsigned i = 0; i < FB_N_CLASSES; ++i)
+		n_io_buffers[i] = fb_pool_get_allocated(i);
+}
@@ -4,10 +4,17 @@
 
 #pragma once
 
+#include "AccountStats.hxx"
+#include "DigestStats.hxx"
+#include "LatencyEwma.hxx"
+#include "LatencyHistogram.hxx"
+#include "SlowQueryLog.hxx"
 #include "event/Chrono.hxx"
 #include "net/AllocatedSocketAddress.hxx"
+#include "memory/fb_pool.hxx"
 
 #include <algorithm> // for std::lexicographical_compare()
+#include <array>
 #include <cstdint>
 #include <map>
 
@@ -18,6 +25,13 @@ struct NodeStats {
 	uint_least64_t n_connect_errors = 0;
 	uint_least64_t n_packets_received = 0;
 	uint_least64_t n_bytes_received = 0;
+
+	/**
+	 * The portion of #n_bytes_received which was forwarded to
+	 * the client with splice().
+	 */
+	uint_least64_t n_bytes_spliced = 0;
+
 	uint_least64_t n_malformed_packets = 0;
 
 	uint_least64_t n_queries = 0;
@@ -28,7 +42,91 @@ struct NodeStats {
 	uint_least64_t n_slow_queries = 0;
 	uint_least64_t n_affected_rows = 0;
 
+	uint_least64_t n_pool_hits = 0;
+	uint_least64_t n_pool_misses = 0;
+
+	/**
+	 * The number of idle connections in the #BackendPool.
+	 */
+	std::size_t n_pool_idle = 0;
+
+	/**
+	 * Admission control (#NodeQueue): the number of client
+	 * connections with a running command and of those waiting
+	 * for their turn.
+	 */
+	std::size_t n_queue_running = 0;
+	std::size_t n_queue_waiting = 0;
+
+	/**
+	 * The number of commands which had to wait in the
+	 * #NodeQueue and of those which have timed out.
+	 */
+	uint_least64_t n_queue_delayed = 0;
+	uint_least64_t n_queue_timeouts = 0;
+
+	/**
+	 * The total time commands have waited in the #NodeQueue.
+	 */
+	Event::Duration queue_wait{};
+
+	/**
+	 * `COM_STMT_PREPARE` packets answered from the
+	 * #StatementCache and those which had to be forwarded.
+	 */
+	uint_least64_t n_statement_cache_hits = 0;
+	uint_least64_t n_statement_cache_misses = 0;
+
+	/**
+	 * Traffic on connections which use the compressed protocol:
+	 * the size of the compressed packets (including their
+	 * headers) and of their (uncompressed) contents.
+	 */
+	uint_least64_t n_compressed_bytes_received = 0;
+	uint_least64_t n_decompressed_bytes_received = 0;
+	uint_least64_t n_compressed_bytes_sent = 0;
+	uint_least64_t n_uncompressed_bytes_sent = 0;
+
 	Event::Duration query_wait{};
+
+	/**
+	 * The distribution of query durations; #query_wait is their
+	 * sum.
+	 */
+	LatencyHistogram query_durations;
+
+	/**
+	 * The recent query durations (for
+	 * #ClusterOptions::Strategy::LEAST_LOADED).
+	 */
+	LatencyEwma query_latency;
+
+	/**
+	 * The number of commands which have been sent to this server
+	 * and whose response is not yet complete.  It is kept in sync
+	 * with Connection::pending_commands; commands must only be
+	 * removed from there with Connection::FinishCommand() (or
+	 * all at once with a matching subtraction).
+	 */
+	std::size_t n_pending_commands = 0;
+
+	/**
+	 * The number of client connections which have been assigned
+	 * to this node by Cluster::Pick() (for
+	 * #ClusterOptions::Strategy::BOUNDED_LOAD).
+	 */
+	std::size_t n_clients = 0;
+
+	/**
+	 * The time spent compressing and decompressing.
+	 */
+	Event::Duration compression_time{};
+
+	/**
+	 * Add the values of another instance (e.g. from another
+	 * worker thread).
+	 */
+	void Add(const NodeStats &src) noexcept;
 };
 
 struct Stats {
@@ -43,8 +141,54 @@ struct Stats {
 	uint_least64_t n_client_auth_err = 0;
 	uint_least64_t n_client_queries = 0;
 
+	/**
+	 * The number of client connections which have switched to
+	 * TLS.
+	 */
+	uint_least64_t n_client_tls_connections = 0;
+
 	uint_least64_t n_lua_errors = 0;
 
+	/**
+	 * The number of client commands which have been delayed
+	 * because the user has exhausted the #Policy budget, and the
+	 * sum of those delays.
+	 */
+	uint_least64_t n_delayed_commands = 0;
+	Event::Duration delay_wait{};
+
+	uint_least64_t n_query_cache_hits = 0;
+	uint_least64_t n_query_cache_misses = 0;
+	uint_least64_t n_query_cache_stores = 0;
+
+	/**
+	 * The number of items in the #QueryCache.
+	 */
+	std::size_t n_query_cache_items = 0;
+
+	/**
+	 * The total size of all responses in the #QueryCache.
+	 */
+	std::size_t query_cache_bytes = 0;
+
+	/**
+	 * The number of allocated I/O buffers per size class (see
+	 * fb_class_size()).  Updated by CollectIoBuffers().
+	 */
+	std::array<std::size_t, FB_N_CLASSES> n_io_buffers{};
+
+	/**
+	 * Counters for the accounts with the most queries.
+	 */
+	AccountStats accounts;
+
+	/**
+	 * Counters for the query digests which cost the most time.
+	 */
+	DigestStats digests;
+
+	SlowQueryLog slow_queries;
+
 	struct CompareSocketAddress {
 		using is_transparent = CompareSocketAddress;
 
@@ -67,4 +211,16 @@ struct Stats {
 
 		return nodes.emplace(address, NodeStats{}).first->second;
 	}
+
+	/**
+	 * Add the values of another instance (e.g. from another
+	 * worker thread).
+	 */
+	void Add(const Stats &src) noexcept;
+
+	/**
+	 * Copy the current I/O buffer occupancy of this thread's
+	 * fb_pool to #n_io_buffers.
+	 */
+	void CollectIoBuffers() noexcept;
 };
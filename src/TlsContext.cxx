@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "TlsContext.hxx"
+#include "TlsSession.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <new> // for std::bad_alloc
+
+/**
+ * Throw the most recent OpenSSL error.
+ */
+[[noreturn]]
+static void
+ThrowSslError(const char *msg)
+{
+	char buffer[256];
+	ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+	ERR_clear_error();
+
+	throw FmtRuntimeError("{}: {}", msg, buffer);
+}
+
+/**
+ * Receives the TLS 1.3 traffic secrets from OpenSSL; they are needed
+ * to configure kernel TLS.
+ */
+static void
+KeylogCallback(const SSL *ssl, const char *line) noexcept
+{
+	auto *session = static_cast<TlsSession *>(SSL_get_app_data(ssl));
+	if (session != nullptr)
+		session->OnKeylogLine(line);
+}
+
+static SSL_CTX *
+NewSslContext()
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == nullptr)
+		throw std::bad_alloc{};
+
+	return ctx;
+}
+
+TlsContext::TlsContext(const char *cert_path, const char *key_path)
+	:ctx(NewSslContext())
+{
+	try {
+		/* kernel TLS supports TLS 1.3 only with these cipher
+		   suites (see TlsSession::EnableKernel()) */
+		if (SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION) != 1 ||
+		    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:"
+					     "TLS_AES_256_GCM_SHA384:"
+					     "TLS_CHACHA20_POLY1305_SHA256") != 1)
+			ThrowSslError("Failed to configure TLS");
+
+		/* session tickets would be sent after the handshake,
+		   but at that point, the kernel already owns the
+		   connection */
+		SSL_CTX_set_num_tickets(ctx, 0);
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+		SSL_CTX_set_keylog_callback(ctx, KeylogCallback);
+
+		if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1)
+			ThrowSslError("Failed to load TLS certificate");
+
+		if (SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1)
+			ThrowSslError("Failed to load TLS key");
+
+		if (SSL_CTX_check_private_key(ctx) != 1)
+			ThrowSslError("TLS key does not match certificate");
+	} catch (...) {
+		SSL_CTX_free(ctx);
+		throw;
+	}
+}
+
+TlsContext::~TlsContext() noexcept
+{
+	SSL_CTX_free(ctx);
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <openssl/ossl_typ.h>
+
+/**
+ * The OpenSSL context for TLS on client connections (see
+ * #TlsSession).  It is configured for TLS 1.3 only with the cipher
+ * suites supported by kernel TLS, because the connection is handed
+ * to the kernel after the handshake.
+ */
+class TlsContext {
+	SSL_CTX *const ctx;
+
+public:
+	/**
+	 * Throws on error.
+	 *
+	 * @param cert_path a PEM file containing the certificate
+	 * chain
+	 * @param key_path a PEM file containing the private key
+	 */
+	TlsContext(const char *cert_path, const char *key_path);
+	~TlsContext() noexcept;
+
+	TlsContext(const TlsContext &) = delete;
+	TlsContext &operator=(const TlsContext &) = delete;
+
+	SSL_CTX *Get() const noexcept {
+		return ctx;
+	}
+};
@@ -0,0 +1,451 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "TlsSession.hxx"
+#include "TlsContext.hxx"
+#include "event/net/BufferedSocket.hxx"
+#include "net/SocketDescriptor.hxx"
+#include "net/SocketProtocolError.hxx"
+#include "system/Error.hxx"
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+
+#include <algorithm> // for std::copy_n(), std::min()
+#include <cassert>
+#include <new> // for std::bad_alloc
+#include <stdexcept>
+#include <string_view>
+
+#include <linux/tls.h>
+#include <netinet/in.h> // for IPPROTO_TCP
+#include <netinet/tcp.h> // for TCP_ULP
+#include <sys/socket.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+using std::string_view_literals::operator""sv;
+
+/**
+ * The TLS 1.3 cipher suites supported by kernel TLS (see
+ * TlsContext::TlsContext()).
+ */
+static constexpr uint_least16_t TLS_AES_128_GCM_SHA256 = 0x1301;
+static constexpr uint_least16_t TLS_AES_256_GCM_SHA384 = 0x1302;
+static constexpr uint_least16_t TLS_CHACHA20_POLY1305_SHA256 = 0x1303;
+
+static constexpr std::size_t TLS13_IV_SIZE = 12;
+
+[[noreturn]]
+static void
+ThrowSslError(const char *msg)
+{
+	char buffer[256];
+	ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+	ERR_clear_error();
+
+	throw SocketProtocolError{std::string{msg} + ": " + buffer};
+}
+
+static SSL *
+NewSsl(TlsContext &context)
+{
+	SSL *ssl = SSL_new(context.Get());
+	if (ssl == nullptr)
+		throw std::bad_alloc{};
+
+	return ssl;
+}
+
+static BIO *
+NewMemoryBio(SSL *ssl)
+{
+	BIO *bio = BIO_new(BIO_s_mem());
+	if (bio == nullptr) {
+		SSL_free(ssl);
+		throw std::bad_alloc{};
+	}
+
+	/* an empty buffer means "try again later", not "end of
+	   file" */
+	BIO_set_mem_eof_return(bio, -1);
+	return bio;
+}
+
+TlsSession::TlsSession(TlsContext &context, BufferedSocket &socket)
+	:ssl(NewSsl(context)),
+	 rbio(NewMemoryBio(ssl)),
+	 wbio(NewMemoryBio(ssl)),
+	 input(socket)
+{
+	/* the SSL object owns both BIOs */
+	SSL_set_bio(ssl, rbio, wbio);
+
+	SSL_set_app_data(ssl, this);
+	SSL_set_accept_state(ssl);
+}
+
+TlsSession::~TlsSession() noexcept
+{
+	SSL_free(ssl);
+}
+
+bool
+TlsSession::IsIdle() const noexcept
+{
+	return input.IsEmpty() && BIO_ctrl_pending(rbio) == 0 &&
+		record_remaining == 0 && record_header_size == 0;
+}
+
+static constexpr int
+ParseHexDigit(char ch) noexcept
+{
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	else if (ch >= 'a' && ch <= 'f')
+		return ch - 'a' + 0xa;
+	else if (ch >= 'A' && ch <= 'F')
+		return ch - 'A' + 0xa;
+	else
+		return -1;
+}
+
+/**
+ * @return the number of bytes written to #dest or 0 on error
+ */
+static std::size_t
+ParseHex(std::string_view src, std::span<std::byte> dest) noexcept
+{
+	if (src.size() % 2 != 0 || src.size() / 2 > dest.size())
+		return 0;
+
+	for (std::size_t i = 0; i < src.size() / 2; ++i) {
+		const int hi = ParseHexDigit(src[i * 2]);
+		const int lo = ParseHexDigit(src[i * 2 + 1]);
+		if (hi < 0 || lo < 0)
+			return 0;
+
+		dest[i] = static_cast<std::byte>((hi << 4) | lo);
+	}
+
+	return src.size() / 2;
+}
+
+void
+TlsSession::OnKeylogLine(const char *_line) noexcept
+{
+	/* format: "LABEL CLIENT_RANDOM SECRET" (NSS key log
+	   format) */
+
+	const std::string_view line{_line};
+	const auto s1 = line.find(' ');
+	if (s1 == line.npos)
+		return;
+
+	const auto label = line.substr(0, s1);
+	const auto s2 = line.find(' ', s1 + 1);
+	if (s2 == line.npos)
+		return;
+
+	const auto secret = line.substr(s2 + 1);
+
+	if (label == "CLIENT_TRAFFIC_SECRET_0"sv)
+		client_secret_size = ParseHex(secret, client_secret);
+	else if (label == "SERVER_TRAFFIC_SECRET_0"sv)
+		server_secret_size = ParseHex(secret, server_secret);
+}
+
+inline std::size_t
+TlsSession::Feed(BufferedSocket &socket)
+{
+	const auto src = socket.ReadBuffer();
+	if (src.empty())
+		return 0;
+
+	std::size_t n;
+
+	if (record_remaining == 0) {
+		/* collect the record header to find out where this
+		   record ends */
+		n = std::min(src.size(),
+			     record_header.size() - record_header_size);
+		std::copy_n(src.begin(), n,
+			    record_header.begin() + record_header_size);
+		record_header_size += n;
+
+		if (record_header_size == record_header.size()) {
+			record_header_size = 0;
+			record_remaining = (std::to_integer<std::size_t>(record_header[3]) << 8) |
+				std::to_integer<std::size_t>(record_header[4]);
+
+			if (handshake_done)
+				++n_records;
+		}
+	} else {
+		n = std::min(src.size(), record_remaining);
+		record_remaining -= n;
+	}
+
+	if (BIO_write(rbio, src.data(), static_cast<int>(n)) != static_cast<int>(n))
+		throw std::bad_alloc{};
+
+	socket.DisposeConsumed(n);
+	return n;
+}
+
+/**
+ * Check the result of SSL_do_handshake() or SSL_read_ex() which has
+ * failed.  Returns if OpenSSL needs more data; throws otherwise.
+ */
+static void
+CheckWantRead(SSL *ssl, int result)
+{
+	switch (SSL_get_error(ssl, result)) {
+	case SSL_ERROR_WANT_READ:
+		return;
+
+	case SSL_ERROR_ZERO_RETURN:
+		throw SocketClosedPrematurelyError{};
+
+	default:
+		ThrowSslError("TLS error");
+	}
+}
+
+bool
+TlsSession::Receive(BufferedSocket &socket)
+{
+	auto &buffer = input.GetBuffer();
+	buffer.AllocateIfNull();
+
+	bool progress = false;
+
+	while (true) {
+		if (BIO_ctrl_pending(rbio) == 0 && Feed(socket) > 0)
+			progress = true;
+
+		if (!handshake_done) {
+			const int result = SSL_do_handshake(ssl);
+			if (result == 1) {
+				if (client_secret_size == 0 ||
+				    server_secret_size == 0)
+					throw std::runtime_error{"No TLS traffic secrets"};
+
+				/* stop here so the caller can enable
+				   kernel TLS before anything else is
+				   sent */
+				handshake_done = true;
+				return true;
+			}
+
+			CheckWantRead(ssl, result);
+		} else {
+			const auto w = buffer.Write();
+			if (w.empty())
+				/* the decrypted input must be consumed
+				   first */
+				break;
+
+			std::size_t nbytes;
+			const int result = SSL_read_ex(ssl, w.data(), w.size(),
+						       &nbytes);
+			if (result == 1) {
+				buffer.Append(nbytes);
+				progress = true;
+				continue;
+			}
+
+			CheckWantRead(ssl, result);
+		}
+
+		if (socket.IsEmpty())
+			/* need more data from the socket */
+			break;
+	}
+
+	return progress;
+}
+
+std::size_t
+TlsSession::ReadOutput(std::span<std::byte> dest) noexcept
+{
+	std::size_t nbytes;
+	if (BIO_read_ex(wbio, dest.data(), dest.size(), &nbytes) != 1)
+		return 0;
+
+	return nbytes;
+}
+
+/**
+ * HKDF-Expand-Label() from RFC 8446 7.1 with an empty context.
+ */
+static void
+HkdfExpandLabel(const EVP_MD *md, std::span<const std::byte> secret,
+		std::string_view label, std::span<std::byte> dest)
+{
+	static constexpr std::string_view prefix = "tls13 "sv;
+
+	std::array<std::byte, 2 + 1 + prefix.size() + 16 + 1> info;
+	assert(label.size() <= 16);
+
+	std::size_t info_size = 0;
+	info[info_size++] = static_cast<std::byte>(dest.size() >> 8);
+	info[info_size++] = static_cast<std::byte>(dest.size());
+	info[info_size++] = static_cast<std::byte>(prefix.size() + label.size());
+	for (const char ch : prefix)
+		info[info_size++] = static_cast<std::byte>(ch);
+	for (const char ch : label)
+		info[info_size++] = static_cast<std::byte>(ch);
+	info[info_size++] = std::byte{0}; // context
+
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+	if (ctx == nullptr)
+		throw std::bad_alloc{};
+
+	std::size_t size = dest.size();
+	const bool success = EVP_PKEY_derive_init(ctx) > 0 &&
+		EVP_PKEY_CTX_set_hkdf_mode(ctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+		EVP_PKEY_CTX_set_hkdf_md(ctx, md) > 0 &&
+		EVP_PKEY_CTX_set1_hkdf_key(ctx,
+					   reinterpret_cast<const unsigned char *>(secret.data()),
+					   static_cast<int>(secret.size())) > 0 &&
+		EVP_PKEY_CTX_add1_hkdf_info(ctx,
+					    reinterpret_cast<const unsigned char *>(info.data()),
+					    static_cast<int>(info_size)) > 0 &&
+		EVP_PKEY_derive(ctx, reinterpret_cast<unsigned char *>(dest.data()),
+				&size) > 0 &&
+		size == dest.size();
+
+	EVP_PKEY_CTX_free(ctx);
+
+	if (!success)
+		ThrowSslError("HKDF failed");
+}
+
+/**
+ * Fill a kernel TLS "crypto_info" structure.
+ */
+template<typename T>
+static void
+MakeCryptoInfo(T &info, uint_least16_t cipher_type, const EVP_MD *md,
+	       std::span<const std::byte> secret,
+	       uint_least64_t sequence)
+{
+	static_assert(sizeof(info.salt) + sizeof(info.iv) == TLS13_IV_SIZE);
+
+	info.info.version = TLS_1_3_VERSION;
+	info.info.cipher_type = cipher_type;
+
+	HkdfExpandLabel(md, secret, "key"sv, std::as_writable_bytes(std::span{info.key}));
+
+	/* the kernel splits the TLS 1.3 IV into "salt" and "iv" */
+	std::array<std::byte, TLS13_IV_SIZE> iv;
+	HkdfExpandLabel(md, secret, "iv"sv, iv);
+	std::copy_n(iv.begin(), sizeof(info.salt),
+		    reinterpret_cast<std::byte *>(info.salt));
+	std::copy_n(iv.begin() + sizeof(info.salt), sizeof(info.iv),
+		    reinterpret_cast<std::byte *>(info.iv));
+
+	/* big-endian */
+	for (std::size_t i = sizeof(info.rec_seq); i-- > 0;) {
+		info.rec_seq[i] = static_cast<unsigned char>(sequence);
+		sequence >>= 8;
+	}
+}
+
+void
+TlsSession::SetCryptoInfo(SocketDescriptor s, int direction,
+			  std::span<const std::byte> secret,
+			  uint_least64_t sequence) const
+{
+	const SSL_CIPHER *cipher = SSL_get_current_cipher(ssl);
+	if (cipher == nullptr)
+		throw std::runtime_error{"No TLS cipher"};
+
+	const EVP_MD *md = SSL_CIPHER_get_handshake_digest(cipher);
+	if (md == nullptr)
+		throw std::runtime_error{"No TLS digest"};
+
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+		struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+		struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+	} info{};
+
+	std::size_t size;
+
+	switch (SSL_CIPHER_get_protocol_id(cipher)) {
+	case TLS_AES_128_GCM_SHA256:
+		MakeCryptoInfo(info.aes_gcm_128, TLS_CIPHER_AES_GCM_128,
+			       md, secret, sequence);
+		size = sizeof(info.aes_gcm_128);
+		break;
+
+	case TLS_AES_256_GCM_SHA384:
+		MakeCryptoInfo(info.aes_gcm_256, TLS_CIPHER_AES_GCM_256,
+			       md, secret, sequence);
+		size = sizeof(info.aes_gcm_256);
+		break;
+
+	case TLS_CHACHA20_POLY1305_SHA256:
+		MakeCryptoInfo(info.chacha20_poly1305,
+			       TLS_CIPHER_CHACHA20_POLY1305,
+			       md, secret, sequence);
+		size = sizeof(info.chacha20_poly1305);
+		break;
+
+	default:
+		throw std::runtime_error{"TLS cipher not supported by the kernel"};
+	}
+
+	const bool success = s.SetOption(SOL_TLS, direction, &info, size);
+
+	/* don't leave key material on the stack */
+	OPENSSL_cleanse(&info, sizeof(info));
+
+	if (!success)
+		throw MakeErrno("Failed to configure kernel TLS");
+}
+
+void
+TlsSession::EnableKernelSend(SocketDescriptor s)
+{
+	assert(handshake_done);
+	assert(BIO_ctrl_pending(wbio) == 0);
+
+	static constexpr char ulp[] = "tls";
+	if (!s.SetOption(IPPROTO_TCP, TCP_ULP, ulp, sizeof(ulp)))
+		throw MakeErrno("Failed to enable kernel TLS (is the \"tls\" kernel module loaded?)");
+
+	/* nothing has been sent with the application traffic keys
+	   yet */
+	SetCryptoInfo(s, TLS_TX,
+		      std::span{server_secret}.first(server_secret_size), 0);
+}
+
+bool
+TlsSession::CanEnableKernelReceive(const BufferedSocket &socket) const noexcept
+{
+	return handshake_done && IsIdle() && SSL_has_pending(ssl) == 0 &&
+		socket.IsEmpty();
+}
+
+void
+TlsSession::EnableKernelReceive(SocketDescriptor s)
+{
+	assert(handshake_done);
+	assert(IsIdle());
+
+	SetCryptoInfo(s, TLS_RX,
+		      std::span{client_secret}.first(client_secret_size),
+		      n_records);
+
+	OPENSSL_cleanse(client_secret.data(), client_secret.size());
+	OPENSSL_cleanse(server_secret.data(), server_secret.size());
+}
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "FilteredInput.hxx"
+
+#include <openssl/ossl_typ.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+class TlsContext;
+class SocketDescriptor;
+
+/**
+ * The TLS handshake on a client connection.  OpenSSL operates on
+ * memory buffers only: received data is copied from the socket's
+ * input buffer (which may already contain the beginning of the
+ * handshake after the `SSLRequest` packet), and handshake records
+ * generated by OpenSSL are sent by the #Peer.
+ *
+ * After the handshake, the traffic secrets are installed in the
+ * kernel (kernel TLS, `TCP_ULP "tls"`), and from then on the socket
+ * carries plain data just like an unencrypted connection.  Records
+ * which have been received before the kernel takes over reception
+ * are decrypted by OpenSSL into #input.
+ *
+ * This object is only needed until EnableKernelReceive() has been
+ * called.
+ */
+class TlsSession {
+	SSL *const ssl;
+
+	/**
+	 * Received records to be consumed by OpenSSL.  This never
+	 * contains data beyond the end of the current record, so
+	 * the kernel can take over at a record boundary.
+	 */
+	BIO *const rbio;
+
+	/**
+	 * Handshake records generated by OpenSSL to be sent to the
+	 * peer (see ReadOutput()).
+	 */
+	BIO *const wbio;
+
+	/**
+	 * The TLS 1.3 application traffic secrets (obtained from
+	 * OpenSSL's "keylog" callback).
+	 */
+	std::array<std::byte, 64> client_secret, server_secret;
+	std::size_t client_secret_size = 0, server_secret_size = 0;
+
+	/**
+	 * The number of bytes of the current record which have not
+	 * yet been passed to #rbio.
+	 */
+	std::size_t record_remaining = 0;
+
+	/**
+	 * The header of the next record; it may be split across
+	 * Receive() calls.
+	 */
+	std::array<std::byte, 5> record_header;
+	std::size_t record_header_size = 0;
+
+	/**
+	 * The number of records received after the handshake.  This
+	 * is the sequence number of the next record which will be
+	 * decrypted by the kernel.
+	 */
+	uint_least64_t n_records = 0;
+
+	bool handshake_done = false;
+
+public:
+	/**
+	 * Data decrypted by OpenSSL.
+	 */
+	FilteredInput input;
+
+	/**
+	 * Throws on error.
+	 */
+	TlsSession(TlsContext &context, BufferedSocket &socket);
+	~TlsSession() noexcept;
+
+	TlsSession(const TlsSession &) = delete;
+	TlsSession &operator=(const TlsSession &) = delete;
+
+	bool IsHandshaking() const noexcept {
+		return !handshake_done;
+	}
+
+	/**
+	 * Has all received data been decrypted and consumed from
+	 * #input?
+	 */
+	[[gnu::pure]]
+	bool IsIdle() const noexcept;
+
+	/**
+	 * Called by the keylog callback of the #TlsContext.
+	 */
+	void OnKeylogLine(const char *line) noexcept;
+
+	/**
+	 * Pass data from the socket's input buffer to OpenSSL and
+	 * continue the handshake or decrypt records into #input.
+	 * Returns after the handshake has completed, so the caller
+	 * can call EnableKernelSend() before anything else gets
+	 * sent.  Throws on error.
+	 *
+	 * @return true if data has been consumed from the socket's
+	 * input buffer or has been added to #input or if the
+	 * handshake has completed
+	 */
+	bool Receive(BufferedSocket &socket);
+
+	/**
+	 * Copy handshake data generated by OpenSSL to the given
+	 * buffer.
+	 *
+	 * @return the number of bytes copied to #dest
+	 */
+	std::size_t ReadOutput(std::span<std::byte> dest) noexcept;
+
+	/**
+	 * Attach the kernel TLS module to the socket and let the
+	 * kernel encrypt all further data sent on it.  This must be
+	 * called right after the handshake has completed, after all
+	 * of its output has been sent.  Throws on error.
+	 */
+	void EnableKernelSend(SocketDescriptor s);
+
+	/**
+	 * Can the kernel take over decryption, i.e. has all received
+	 * data been decrypted and consumed, and is the next byte on
+	 * the socket the beginning of a record?
+	 */
+	[[gnu::pure]]
+	bool CanEnableKernelReceive(const BufferedSocket &socket) const noexcept;
+
+	/**
+	 * Let the kernel decrypt all further data received on the
+	 * socket.  After returning, this object is not needed
+	 * anymore.  Throws on error.
+	 */
+	void EnableKernelReceive(SocketDescriptor s);
+
+private:
+	/**
+	 * Pass data from the socket's input buffer to #rbio, but not
+	 * beyond the end of the current record.
+	 *
+	 * @return the number of bytes consumed from the socket
+	 */
+	std::size_t Feed(BufferedSocket &socket);
+
+	/**
+	 * Configure kernel TLS for one direction.  Throws on error.
+	 */
+	void SetCryptoInfo(SocketDescriptor s, int direction,
+			   std::span<const std::byte> secret,
+			   uint_least64_t sequence) const;
+};
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <algorithm> // for std::partial_sort()
+#include <cstddef>
+#include <cstdint>
+#include <functional> // for std::hash, std::equal_to
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility> // for std::swap()
+#include <vector>
+
+/**
+ * Counters for the keys with the largest weight out of far more
+ * keys than we want to keep in memory.  This is a "Space-Saving"
+ * sketch (Metwally, Agrawal, El Abbadi 2005) with a fixed number of
+ * items: if it is full, the item with the smallest weight is
+ * replaced by the new key, which inherits its weight.  Thus, the
+ * weights are overestimated by at most Item::error, and every key
+ * with more than 1/capacity of the total weight is guaranteed to be
+ * present.
+ *
+ * The object is copyable; each worker thread has its own instance
+ * and Add() merges them.
+ *
+ * @param Counters a type with a method Add(const Counters &);
+ * these are exact since the item was (last) inserted
+ */
+template<typename Counters>
+class TopKSketch {
+public:
+	struct Item {
+		std::string key;
+
+		Counters counters;
+
+		/**
+		 * The (estimated) sum of all weights of this key,
+		 * including #error.
+		 */
+		uint_least64_t weight;
+
+		/**
+		 * The maximum overestimation of #weight, inherited
+		 * from the item which was replaced by this one.
+		 */
+		uint_least64_t error;
+
+		/**
+		 * The position of this item in #TopKSketch::heap.
+		 */
+		std::size_t heap_position;
+	};
+
+private:
+	std::size_t capacity;
+
+	std::vector<Item> items;
+
+	/**
+	 * Indexes into #items, arranged as a binary min-heap ordered
+	 * by weight.  The root is the item to be replaced next.
+	 */
+	std::vector<std::size_t> heap;
+
+	struct Hash {
+		using is_transparent = void;
+
+		[[gnu::pure]]
+		std::size_t operator()(std::string_view s) const noexcept {
+			return std::hash<std::string_view>{}(s);
+		}
+	};
+
+	/**
+	 * Maps keys to indexes into #items.
+	 */
+	std::unordered_map<std::string, std::size_t, Hash, std::equal_to<>> index;
+
+public:
+	explicit TopKSketch(std::size_t _capacity) noexcept
+		:capacity(_capacity) {}
+
+	bool empty() const noexcept {
+		return items.empty();
+	}
+
+	/**
+	 * Add values to the counters of the specified key.  If the
+	 * key is not yet known and the sketch is full, it replaces
+	 * the item with the smallest weight, unless #weight is zero.
+	 *
+	 * @param error the overestimation of #weight (when merging
+	 * another sketch)
+	 */
+	void Update(std::string_view key, const Counters &counters,
+		    uint_least64_t weight, uint_least64_t error=0) noexcept {
+		if (auto i = index.find(key); i != index.end()) {
+			Item &item = items[i->second];
+			item.counters.Add(counters);
+			item.weight += weight;
+			item.error += error;
+			SiftDown(item.heap_position);
+			return;
+		}
+
+		if (items.size() < capacity) {
+			const std::size_t i = items.size();
+			items.push_back({
+				.key = std::string{key},
+				.counters = counters,
+				.weight = weight,
+				.error = error,
+				.heap_position = heap.size(),
+			});
+			heap.push_back(i);
+			index.emplace(key, i);
+			SiftUp(heap.size() - 1);
+			return;
+		}
+
+		if (weight == 0)
+			/* this update cannot move the key into the
+			   top; don't let it replace one that has a
+			   weight */
+			return;
+
+		/* replace the item with the smallest weight */
+
+		Item &item = items[heap.front()];
+
+		auto node = index.extract(item.key);
+		node.key() = key;
+		index.insert(std::move(node));
+
+		item.key = key;
+		item.counters = counters;
+		item.error = item.weight + error;
+		item.weight += weight;
+
+		SiftDown(0);
+	}
+
+	/**
+	 * Add the values of another instance (e.g. from another
+	 * worker thread).
+	 */
+	void Add(const TopKSketch &src) noexcept {
+		for (const auto &i : src.items)
+			Update(i.key, i.counters, i.weight, i.error);
+	}
+
+	/**
+	 * Returns up to the specified number of items with the
+	 * largest weight, sorted in descending order.  The pointers
+	 * are valid until this object is modified.
+	 */
+	[[gnu::pure]]
+	std::vector<const Item *> GetTop(std::size_t n) const noexcept {
+		std::vector<const Item *> result;
+		result.reserve(items.size());
+		for (const auto &i : items)
+			result.push_back(&i);
+
+		n = std::min(n, result.size());
+		std::partial_sort(result.begin(), result.begin() + n, result.end(),
+				  [](const Item *a, const Item *b){
+					  return a->weight > b->weight;
+				  });
+		result.resize(n);
+		return result;
+	}
+
+private:
+	[[gnu::pure]]
+	uint_least64_t GetHeapWeight(std::size_t position) const noexcept {
+		return items[heap[position]].weight;
+	}
+
+	void SwapHeap(std::size_t a, std::size_t b) noexcept {
+		std::swap(heap[a], heap[b]);
+		items[heap[a]].heap_position = a;
+		items[heap[b]].heap_position = b;
+	}
+
+	/**
+	 * Restore the heap property after the weight of the item at
+	 * the given heap position has been increased.
+	 */
+	void SiftDown(std::size_t position) noexcept {
+		while (true) {
+			std::size_t smallest = position;
+
+			const std::size_t left = 2 * position + 1, right = left + 1;
+			if (left < heap.size() &&
+			    GetHeapWeight(left) < GetHeapWeight(smallest))
+				smallest = left;
+			if (right < heap.size() &&
+			    GetHeapWeight(right) < GetHeapWeight(smallest))
+				smallest = right;
+
+			if (smallest == position)
+				break;
+
+			SwapHeap(position, smallest);
+			position = smallest;
+		}
+	}
+
+	void SiftUp(std::size_t position) noexcept {
+		while (position > 0) {
+			const std::size_t parent = (position - 1) / 2;
+			if (GetHeapWeight(parent) <= GetHeapWeight(position))
+				break;
+
+			SwapHeap(position, parent);
+			position = parent;
+		}
+	}
+};
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "UringSend.hxx"
+#include "io/uring/Queue.hxx"
+
+#include <algorithm> // for std::copy()
+#include <cassert>
+
+#include <sys/socket.h>
+
+UringSend::~UringSend() noexcept
+{
+	assert(!IsUringPending());
+}
+
+void
+UringSend::Close() noexcept
+{
+	assert(handler != nullptr);
+
+	if (IsUringPending())
+		/* the kernel may still read from the buffer; delete
+		   this object in OnUringCompletion() */
+		handler = nullptr;
+	else
+		delete this;
+}
+
+void
+UringSend::Close(UniqueSocketDescriptor &&socket,
+		 std::vector<std::byte> &&_tail) noexcept
+{
+	assert(handler != nullptr);
+	assert(socket.Get() == fd.Get());
+
+	if (!IsUringPending()) {
+		/* nothing in flight; the socket is closed by the
+		   UniqueSocketDescriptor destructor */
+		delete this;
+		return;
+	}
+
+	/* keep the socket open and continue sending in
+	   OnUringCompletion() */
+	owned_socket = std::move(socket);
+	tail = std::move(_tail);
+	handler = nullptr;
+
+	MoveTail();
+}
+
+std::size_t
+UringSend::Send(std::span<const std::byte> src) noexcept
+{
+	assert(handler != nullptr);
+
+	auto &buffer = buffers[next];
+	buffer.AllocateIfNull();
+
+	const auto w = buffer.Write();
+	const std::size_t n = std::min(src.size(), w.size());
+	std::copy_n(src.begin(), n, w.begin());
+	buffer.Append(n);
+
+	if (!IsUringPending())
+		Submit();
+
+	return n;
+}
+
+void
+UringSend::MoveTail() noexcept
+{
+	if (tail.empty())
+		return;
+
+	auto &buffer = buffers[next];
+	buffer.AllocateIfNull();
+
+	const auto w = buffer.Write();
+	const std::size_t n = std::min(tail.size(), w.size());
+	std::copy_n(tail.begin(), n, w.begin());
+	buffer.Append(n);
+
+	tail.erase(tail.begin(), tail.begin() + n);
+	if (buffer.empty())
+		buffer.Free();
+}
+
+void
+UringSend::Submit() noexcept
+{
+	assert(!IsUringPending());
+	assert(!buffers[next].empty());
+
+	const auto r = buffers[next].Read();
+	next ^= 1;
+
+	auto &s = queue.RequireSubmitEntry();
+	io_uring_prep_send(&s, fd.Get(), r.data(), r.size(), MSG_NOSIGNAL);
+	queue.Push(s, *this);
+}
+
+void
+UringSend::OnUringCompletion(int res) noexcept
+{
+	auto &sending = buffers[next ^ 1];
+
+	if (handler == nullptr && (res < 0 || !owned_socket.IsDefined())) {
+		/* Close() has been called and there is nothing more
+		   we can (or may) send; this closes #owned_socket */
+		delete this;
+		return;
+	}
+
+	if (res < 0) {
+		handler->OnUringSendError(-res);
+		return;
+	}
+
+	sending.Consume(static_cast<std::size_t>(res));
+
+	if (!sending.empty()) {
+		/* partial send: submit the rest before the next
+		   buffer */
+		next ^= 1;
+		Submit();
+		return;
+	}
+
+	sending.Free();
+
+	if (handler == nullptr)
+		MoveTail();
+
+	if (!buffers[next].empty())
+		Submit();
+
+	if (handler == nullptr) {
+		/* Close(UniqueSocketDescriptor &&) has been called:
+		   delete this object (and close the socket) after
+		   everything has been sent */
+		if (!IsUringPending())
+			delete this;
+		return;
+	}
+
+	handler->OnUringSendReady();
+}
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "DefaultFifoBuffer.hxx"
+#include "io/uring/Operation.hxx"
+#include "net/SocketDescriptor.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+
+#include <array>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace Uring { class Queue; }
+
+class UringSendHandler {
+public:
+	/**
+	 * A send operation has completed and there is room for more
+	 * data.
+	 */
+	virtual void OnUringSendReady() noexcept = 0;
+
+	/**
+	 * A send operation has failed.  The handler may destroy the
+	 * #UringSend by calling UringSend::Close().
+	 *
+	 * @param error the errno value
+	 */
+	virtual void OnUringSendError(int error) noexcept = 0;
+};
+
+/**
+ * Sends data to a socket with io_uring.  Data is copied to a buffer
+ * and submitted with the next io_uring_enter() call, which means many
+ * sends (to many sockets) share one system call.  While a send is
+ * in flight, more data is collected in a second buffer.
+ *
+ * Instances must be allocated on the heap and freed with Close(),
+ * because the kernel may still access the buffer (and the socket)
+ * after the owner has lost interest.
+ */
+class UringSend final : Uring::Operation {
+	Uring::Queue &queue;
+
+	const SocketDescriptor fd;
+
+	/**
+	 * nullptr after Close() was called while a send was in
+	 * flight.
+	 */
+	UringSendHandler *handler;
+
+	/**
+	 * The socket passed to Close(UniqueSocketDescriptor &&); it
+	 * is closed after all data has been sent.
+	 */
+	UniqueSocketDescriptor owned_socket;
+
+	/**
+	 * Data passed to Close(UniqueSocketDescriptor &&,
+	 * std::vector<std::byte> &&) which did not fit into
+	 * #buffers; it is moved there as soon as they have room.
+	 */
+	std::vector<std::byte> tail;
+
+	std::array<DefaultFifoBuffer, 2> buffers;
+
+	/**
+	 * The index of the #buffers element which receives new data;
+	 * the other one is being sent (if IsUringPending()).
+	 */
+	unsigned next = 0;
+
+public:
+	UringSend(Uring::Queue &_queue, SocketDescriptor _fd,
+		  UringSendHandler &_handler) noexcept
+		:queue(_queue), fd(_fd), handler(&_handler) {}
+
+	~UringSend() noexcept;
+
+	UringSend(const UringSend &) = delete;
+	UringSend &operator=(const UringSend &) = delete;
+
+	/**
+	 * Destroy this object (or schedule its destruction after the
+	 * pending send operation completes).  Data which has not
+	 * been submitted yet is discarded.  The socket must remain
+	 * open until the pending operation completes; use this only
+	 * if the caller keeps the socket (or if IsEmpty()).
+	 */
+	void Close() noexcept;
+
+	/**
+	 * Like Close(), but take over the socket: all pending data
+	 * (including data which has not been submitted yet, e.g. a
+	 * final ERR packet) is still sent, and the socket is closed
+	 * only after the last operation has completed.  This keeps
+	 * the kernel from sending to a descriptor number which has
+	 * been reused in the meantime.
+	 *
+	 * @param _tail more data which the caller has queued because
+	 * it did not fit into the buffers; it is sent after them
+	 */
+	void Close(UniqueSocketDescriptor &&socket,
+		   std::vector<std::byte> &&_tail) noexcept;
+
+	/**
+	 * Is there no data waiting to be sent?
+	 */
+	bool IsEmpty() const noexcept {
+		return !IsUringPending() && buffers[next].empty();
+	}
+
+	/**
+	 * Copy data to the buffer and submit a send operation if
+	 * none is in flight.
+	 *
+	 * @return the number of bytes consumed (0 if the buffer is
+	 * full)
+	 */
+	std::size_t Send(std::span<const std::byte> src) noexcept;
+
+private:
+	/**
+	 * Copy as much of #tail as possible to the buffer which
+	 * receives new data.
+	 */
+	void MoveTail() noexcept;
+
+	void Submit() noexcept;
+
+	/* virtual methods from class Uring::Operation */
+	void OnUringCompletion(int res) noexcept override;
+};
@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WarmConnect.hxx"
+#include "Peer.hxx"
+#include "MysqlHandler.hxx"
+#include "MysqlMakePacket.hxx"
+#include "MysqlParser.hxx"
+#include "MysqlDeserializer.hxx" // for Mysql::MalformedPacket
+#include "MysqlProtocol.hxx"
+#include "MysqlSerializer.hxx"
+#include "auth/Handler.hxx"
+#include "auth/Factory.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+#include "event/net/ConnectSocket.hxx"
+#include "net/SocketProtocolError.hxx"
+#include "util/Cancellable.hxx"
+#include "util/SpanCast.hxx"
+
+#include <optional>
+
+class MysqlWarmConnect final
+	: Cancellable,
+	  PeerHandler, MysqlHandler,
+	  ConnectSocketHandler {
+	WarmConnectHandler &handler;
+
+	const BackendPool::Key key;
+
+	ConnectSocket connect;
+
+	std::optional<Peer> peer;
+
+	std::unique_ptr<Mysql::AuthHandler> auth_handler;
+
+	std::string server_version;
+
+public:
+	MysqlWarmConnect(EventLoop &event_loop, const BackendPool::Key &_key,
+			 WarmConnectHandler &_handler) noexcept
+		:handler(_handler), key(_key),
+		 connect(event_loop, *this) {}
+
+	void Start(CancellablePointer &cancel_ptr) noexcept {
+		cancel_ptr = *this;
+		connect.Connect(key.address, std::chrono::seconds{10});
+	}
+
+private:
+	void DestroyOk() noexcept {
+		auto &_handler = handler;
+		BackendPool::Lease lease{
+			.fd = peer->Release(),
+			.server_version = std::move(server_version),
+			.capabilities = peer->capabilities,
+
+			/* nobody has used this session yet */
+			.clean = true,
+		};
+
+		delete this;
+		_handler.OnWarmConnect(std::move(lease));
+	}
+
+	void DestroyError(std::exception_ptr e) noexcept {
+		auto &_handler = handler;
+		delete this;
+		_handler.OnWarmConnectError(std::move(e));
+	}
+
+	Result OnHandshake(uint_least8_t sequence_id,
+			   std::span<const std::byte> payload);
+	Result OnAuthSwitchRequest(uint_least8_t sequence_id,
+				   std::span<const std::byte> payload);
+
+	/* virtual methods from Cancellable */
+	void Cancel() noexcept override {
+		delete this;
+	}
+
+	/* virtual methods from PeerSocketHandler */
+	void OnPeerClosed() noexcept override {
+		DestroyError(std::make_exception_ptr(SocketProtocolError{"Server closed the connection"}));
+	}
+
+	WriteResult OnPeerWrite() override {
+		// should be unreachable
+		return WriteResult::DONE;
+	}
+
+	void OnPeerError(std::exception_ptr e) noexcept override {
+		DestroyError(std::move(e));
+	}
+
+	/* virtual methods from MysqlHandler */
+	Result OnMysqlPacket(unsigned number, std::span<const std::byte> payload,
+			     bool complete) noexcept override;
+
+	std::pair<RawResult, std::size_t> OnMysqlRaw(std::span<const std::byte> src) noexcept override {
+		// should be unreachable
+		return {RawResult::OK, src.size()};
+	}
+
+	/* virtual methods from ConnectSocketHandler */
+	void OnSocketConnectSuccess(UniqueSocketDescriptor fd) noexcept override {
+		/* disable Nagle's algorithm to reduce latency */
+		fd.SetNoDelay();
+
+		PeerHandler &peer_handler = *this;
+		MysqlHandler &mysql_handler = *this;
+		peer.emplace(connect.GetEventLoop(), std::move(fd),
+			     peer_handler, mysql_handler);
+	}
+
+	void OnSocketConnectError(std::exception_ptr e) noexcept override {
+		DestroyError(std::move(e));
+	}
+};
+
+inline MysqlHandler::Result
+MysqlWarmConnect::OnHandshake(uint_least8_t sequence_id,
+			      std::span<const std::byte> payload)
+{
+	if (!payload.empty() && static_cast<Mysql::Command>(payload.front()) == Mysql::Command::ERR) {
+		const auto err = Mysql::ParseErr(payload, peer->capabilities);
+		throw FmtRuntimeError("Connection rejected by server: {}",
+				      err.error_message);
+	}
+
+	const auto packet = Mysql::ParseHandshake(payload);
+
+	server_version = packet.server_version;
+
+	/* negotiate the same capabilities as Connection::Outgoing
+	   would */
+	uint_least32_t capabilities = key.capabilities;
+	if ((packet.capabilities & Mysql::CLIENT_COMPRESS) == 0)
+		capabilities &= ~Mysql::CLIENT_COMPRESS;
+
+	peer->capabilities = packet.capabilities & capabilities;
+
+	auth_handler = Mysql::MakeAuthHandler(packet.auth_plugin_name, false);
+	if (!auth_handler)
+		throw SocketProtocolError{"Unsupported auth_plugin"};
+
+	const auto response =
+		auth_handler->GenerateResponse(key.password,
+					       AsBytes(key.password_sha1),
+					       AsBytes(packet.auth_plugin_data1),
+					       AsBytes(packet.auth_plugin_data2));
+
+	auto s = Mysql::MakeHandshakeResponse41(sequence_id + 1,
+						capabilities,
+						key.user,
+						ToStringView(response),
+						key.database,
+						auth_handler->GetName());
+	if (!peer->Send(s.Finish()))
+		return Result::CLOSED;
+
+	peer->handshake_response = true;
+	return Result::IGNORE;
+}
+
+inline MysqlHandler::Result
+MysqlWarmConnect::OnAuthSwitchRequest(uint_least8_t sequence_id,
+				      std::span<const std::byte> payload)
+{
+	const auto packet = Mysql::ParseAuthSwitchRequest(payload);
+
+	auth_handler = Mysql::MakeAuthHandler(packet.auth_plugin_name, true);
+	if (!auth_handler)
+		throw SocketProtocolError{"Unsupported auth_plugin"};
+
+	const auto response =
+		auth_handler->GenerateResponse(key.password,
+					       AsBytes(key.password_sha1),
+					       AsBytes(packet.auth_plugin_data),
+					       {});
+
+	Mysql::PacketSerializer s(sequence_id + 1);
+	s.WriteN(response);
+	if (!peer->Send(s.Finish()))
+		return Result::CLOSED;
+
+	return Result::IGNORE;
+}
+
+MysqlHandler::Result
+MysqlWarmConnect::OnMysqlPacket(unsigned number,
+				std::span<const std::byte> payload,
+				bool complete) noexcept
+try {
+	if (!complete)
+		/* none of the packets we expect can be this
+		   large */
+		throw SocketProtocolError{"Packet from server too large"};
+
+	if (!peer->handshake) {
+		peer->handshake = true;
+		return OnHandshake(number, payload);
+	}
+
+	if (payload.empty())
+		throw Mysql::MalformedPacket{};
+
+	if (auth_handler) {
+		if (const auto new_payload = auth_handler->HandlePacket(payload);
+		    new_payload.data() != nullptr) {
+			if (!new_payload.empty()) {
+				Mysql::PacketSerializer s(number + 1);
+				s.WriteN(new_payload);
+				if (!peer->Send(s.Finish()))
+					return Result::CLOSED;
+			}
+
+			return Result::IGNORE;
+		}
+	}
+
+	switch (static_cast<Mysql::Command>(payload.front())) {
+	case Mysql::Command::OK:
+		peer->command_phase = true;
+		DestroyOk();
+		return Result::CLOSED;
+
+	case Mysql::Command::EOF_:
+		return OnAuthSwitchRequest(number, payload);
+
+	case Mysql::Command::ERR:
+		throw FmtRuntimeError("Authentication error: {}",
+				      Mysql::ParseErr(payload, peer->capabilities).error_message);
+
+	default:
+		throw SocketProtocolError{"Unexpected server reply to HandshakeResponse"};
+	}
+} catch (...) {
+	DestroyError(std::current_exception());
+	return Result::CLOSED;
+}
+
+void
+WarmConnect(EventLoop &event_loop, const BackendPool::Key &key,
+	    WarmConnectHandler &handler, CancellablePointer &cancel_ptr) noexcept
+{
+	auto *c = new MysqlWarmConnect(event_loop, key, handler);
+	c->Start(cancel_ptr);
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "BackendPool.hxx"
+
+#include <exception>
+
+class EventLoop;
+class CancellablePointer;
+
+class WarmConnectHandler {
+public:
+	virtual void OnWarmConnect(BackendPool::Lease &&lease) noexcept = 0;
+	virtual void OnWarmConnectError(std::exception_ptr e) noexcept = 0;
+};
+
+/**
+ * Establish a new connection to a MySQL server and log in with the
+ * credentials in the given #BackendPool::Key, exactly like
+ * #Connection would do it for a client which sends these
+ * credentials.  On success, the connection is passed to the handler
+ * as a #BackendPool::Lease which can be put into the #BackendPool.
+ *
+ * The strings referenced by the key must remain valid until the
+ * handler is invoked or the operation is canceled.
+ */
+void
+WarmConnect(EventLoop &event_loop, const BackendPool::Key &key,
+	    WarmConnectHandler &handler, CancellablePointer &cancel_ptr) noexcept;
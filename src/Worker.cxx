@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Worker.hxx"
+#include "Instance.hxx"
+#include "DefaultFifoBuffer.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "event/SocketEvent.hxx"
+#include "system/Error.hxx"
+
+#include <array>
+#include <optional>
+
+#include <sys/socket.h>
+
+/**
+ * How often does each worker publish a copy of its #Stats?
+ */
+static constexpr Event::Duration stats_interval = std::chrono::seconds{1};
+
+/**
+ * The part of the #Worker which lives inside the worker thread.
+ */
+class Worker::Thread final {
+	Worker &worker;
+
+	Instance instance;
+
+	SocketEvent wake_event;
+
+	CoarseTimerEvent stats_timer;
+
+public:
+	Thread(Worker &_worker, const Instance &main)
+		:worker(_worker),
+		 instance(&main),
+		 wake_event(instance.GetEventLoop(), BIND_THIS_METHOD(OnWake),
+			    worker.wake_read),
+		 stats_timer(instance.GetEventLoop(),
+			     BIND_THIS_METHOD(OnStatsTimer))
+	{
+		wake_event.ScheduleRead();
+		stats_timer.Schedule(stats_interval);
+	}
+
+	auto &GetInstance() noexcept {
+		return instance;
+	}
+
+	void Run() noexcept {
+		instance.GetEventLoop().Run();
+	}
+
+private:
+	void OnWake(unsigned) noexcept {
+		std::array<std::byte, 64> buffer;
+		while (recv(worker.wake_read.Get(), buffer.data(), buffer.size(),
+			    MSG_DONTWAIT) > 0) {}
+
+		decltype(worker.queue) queue;
+
+		{
+			const std::scoped_lock lock{worker.mutex};
+			queue.swap(worker.queue);
+		}
+
+		for (auto &f : queue)
+			f(instance);
+	}
+
+	void OnStatsTimer() noexcept {
+		{
+			const std::scoped_lock lock{worker.mutex};
+			worker.stats = instance.GetStats();
+			worker.stats.CollectIoBuffers();
+		}
+
+		stats_timer.Schedule(stats_interval);
+	}
+};
+
+Worker::Worker(const Instance &main, const SetupFunction &setup)
+{
+	int fds[2];
+	if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, fds) < 0)
+		throw MakeErrno("Failed to create socket pair");
+
+	wake_read = UniqueSocketDescriptor{AdoptTag{}, fds[0]};
+	wake_write = UniqueSocketDescriptor{AdoptTag{}, fds[1]};
+
+	std::promise<void> ready;
+	auto ready_future = ready.get_future();
+
+	thread = std::thread{&Worker::Run, this,
+		std::cref(main), std::cref(setup), std::ref(ready)};
+
+	try {
+		ready_future.get();
+	} catch (...) {
+		thread.join();
+		throw;
+	}
+}
+
+Worker::~Worker() noexcept
+{
+	Post([](Instance &instance){
+		instance.Shutdown();
+	});
+
+	thread.join();
+}
+
+void
+Worker::Post(Function &&f) noexcept
+{
+	{
+		const std::scoped_lock lock{mutex};
+		queue.emplace_back(std::move(f));
+	}
+
+	/* if the socket buffer is full, the worker has not yet
+	   consumed the previous wakeup, so we can ignore EAGAIN */
+	static constexpr std::byte dummy{};
+	send(wake_write.Get(), &dummy, sizeof(dummy), MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+void
+Worker::AddStats(Stats &dest) const noexcept
+{
+	const std::scoped_lock lock{mutex};
+	dest.Add(stats);
+}
+
+void
+Worker::Run(const Instance &main, const SetupFunction &setup,
+	    std::promise<void> &ready) noexcept
+{
+	/* each thread has its own I/O buffer pool */
+	const ScopeInitDefaultFifoBuffer init_default_fifo_buffer;
+
+	std::optional<Thread> t;
+
+	try {
+		t.emplace(*this, main);
+		setup(t->GetInstance());
+	} catch (...) {
+		ready.set_exception(std::current_exception());
+		return;
+	}
+
+	/* after this call, "ready" and "setup" are dangling
+	   references */
+	ready.set_value();
+
+	t->Run();
+}
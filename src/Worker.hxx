@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "Stats.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Instance;
+
+/**
+ * A thread which runs its own #EventLoop with its own #Instance and
+ * Lua state (see global variable "workers").  It loads the same
+ * configuration file as the main #Instance and accepts connections
+ * on the same listener sockets.
+ *
+ * Signals, the control listener and the Prometheus exporter are only
+ * handled by the main thread, which passes them on to the workers
+ * with Post().
+ */
+class Worker final {
+public:
+	/**
+	 * A function which loads the configuration into the new
+	 * #Instance (inside the worker thread).  It may throw.
+	 */
+	using SetupFunction = std::function<void(Instance &instance)>;
+
+	/**
+	 * A function to be called inside the worker thread.
+	 */
+	using Function = std::function<void(Instance &instance)>;
+
+private:
+	class Thread;
+
+	mutable std::mutex mutex;
+
+	/**
+	 * Functions to be called inside the worker thread.
+	 * Protected by #mutex.
+	 */
+	std::vector<Function> queue;
+
+	/**
+	 * A recent copy of the worker's #Stats.  Protected by
+	 * #mutex.
+	 */
+	Stats stats;
+
+	/**
+	 * A socket pair which wakes up the worker thread after
+	 * something was added to #queue.
+	 */
+	UniqueSocketDescriptor wake_read, wake_write;
+
+	std::thread thread;
+
+public:
+	/**
+	 * Start the thread and wait until the configuration has been
+	 * loaded.  Throws if the thread could not be started or if
+	 * #SetupFunction has thrown.
+	 */
+	Worker(const Instance &main, const SetupFunction &setup);
+
+	/**
+	 * Shut down the worker's #Instance and wait for the thread
+	 * to exit.
+	 */
+	~Worker() noexcept;
+
+	Worker(const Worker &) = delete;
+	Worker &operator=(const Worker &) = delete;
+
+	/**
+	 * Schedule a call inside the worker thread.  This method is
+	 * thread-safe.
+	 */
+	void Post(Function &&f) noexcept;
+
+	/**
+	 * Add a recent copy of the worker's #Stats to the given
+	 * object.  This method is thread-safe.
+	 */
+	void AddStats(Stats &dest) const noexcept;
+
+private:
+	void Run(const Instance &main, const SetupFunction &setup,
+		 std::promise<void> &ready) noexcept;
+};
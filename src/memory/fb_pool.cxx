@@ -5,47 +5,75 @@
 #include "fb_pool.hxx"
 #include "memory/SlicePool.hxx"
 
+#include <array>
 #include <cassert>
 
-static SlicePool *fb_pool;
+/* each thread has its own pools (see class Worker) */
+static thread_local std::array<SlicePool *, FB_N_CLASSES> fb_pools;
+
+/**
+ * The number of slices per area for each size class; larger buffers
+ * are rare, so their areas are smaller.
+ */
+static constexpr std::array<unsigned, FB_N_CLASSES> fb_slices_per_area{
+	256, 64, 16,
+};
 
 void
 fb_pool_init() noexcept
 {
-	assert(fb_pool == nullptr);
+	for (unsigned i = 0; i < FB_N_CLASSES; ++i) {
+		assert(fb_pools[i] == nullptr);
 
-	fb_pool = new SlicePool(FB_SIZE, 256, "io_buffers");
+		fb_pools[i] = new SlicePool(fb_class_size(i),
+					    fb_slices_per_area[i],
+					    "io_buffers");
+	}
 }
 
 void
 fb_pool_deinit() noexcept
 {
-	assert(fb_pool != nullptr);
+	for (auto &i : fb_pools) {
+		assert(i != nullptr);
 
-	delete fb_pool;
-	fb_pool = nullptr;
+		delete i;
+		i = nullptr;
+	}
 }
 
 void
 fb_pool_fork_cow(bool inherit) noexcept
 {
-	assert(fb_pool != nullptr);
+	for (auto *i : fb_pools) {
+		assert(i != nullptr);
 
-	fb_pool->ForkCow(inherit);
+		i->ForkCow(inherit);
+	}
 }
 
 SlicePool &
-fb_pool_get() noexcept
+fb_pool_get(unsigned size_class) noexcept
 {
-	assert(fb_pool != nullptr);
+	assert(size_class < FB_N_CLASSES);
+	assert(fb_pools[size_class] != nullptr);
+
+	return *fb_pools[size_class];
+}
 
-	return *fb_pool;
+std::size_t
+fb_pool_get_allocated(unsigned size_class) noexcept
+{
+	return fb_pool_get(size_class).GetStats().netto_size /
+		fb_class_size(size_class);
 }
 
 void
 fb_pool_compress() noexcept
 {
-	assert(fb_pool != nullptr);
+	for (auto *i : fb_pools) {
+		assert(i != nullptr);
 
-	fb_pool->Compress();
+		i->Compress();
+	}
 }
@@ -16,7 +16,19 @@ class SlicePool;
 static constexpr std::size_t FB_SIZE = 8192;
 
 /**
- * Global initialization.
+ * The number of buffer size classes.  Class 0 has #FB_SIZE bytes,
+ * and each class is four times as large as the previous one.
+ */
+static constexpr unsigned FB_N_CLASSES = 3;
+
+static constexpr std::size_t
+fb_class_size(unsigned size_class) noexcept
+{
+	return FB_SIZE << (2 * size_class);
+}
+
+/**
+ * Global initialization (per thread).
  */
 void
 fb_pool_init() noexcept;
@@ -30,9 +42,21 @@ fb_pool_deinit() noexcept;
 void
 fb_pool_fork_cow(bool inherit) noexcept;
 
+/**
+ * Returns the pool for the specified size class (0 is the default
+ * with #FB_SIZE bytes).
+ */
 [[gnu::const]]
 SlicePool &
-fb_pool_get() noexcept;
+fb_pool_get(unsigned size_class=0) noexcept;
+
+/**
+ * Returns the number of buffers of the specified size class which
+ * are currently allocated (by this thread).
+ */
+[[gnu::pure]]
+std::size_t
+fb_pool_get_allocated(unsigned size_class) noexcept;
 
 /**
  * Give free memory back to the kernel.  The library will
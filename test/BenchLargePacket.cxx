@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Feed a very large COM_QUERY (split into packets of
+ * Mysql::MAX_PAYLOAD_LENGTH) followed by a COM_PING through #Peer /
+ * #MysqlReader and verify that the continuation packets are
+ * forwarded as raw data without being mistaken for commands.  Prints
+ * the throughput and exits with a failure status if the packets were
+ * not forwarded correctly.
+ */
+
+#include "Peer.hxx"
+#include "MysqlProtocol.hxx"
+#include "DefaultFifoBuffer.hxx"
+#include "event/Loop.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "system/Error.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::min()
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static constexpr std::size_t MB = 1024 * 1024;
+
+static void
+AppendPacket(std::vector<std::byte> &dest, uint_least8_t number,
+	     std::span<const std::byte> payload) noexcept
+{
+	const Mysql::PacketHeader header{
+		.length = static_cast<uint_least32_t>(payload.size()),
+		.number = number,
+	};
+
+	const auto *h = reinterpret_cast<const std::byte *>(&header);
+	dest.insert(dest.end(), h, h + sizeof(header));
+	dest.insert(dest.end(), payload.begin(), payload.end());
+}
+
+/**
+ * Generate a COM_QUERY of the given payload size (split into as many
+ * packets as necessary), followed by a COM_PING.
+ */
+static std::vector<std::byte>
+MakeInput(std::size_t query_size) noexcept
+{
+	std::vector<std::byte> query(query_size, std::byte{'x'});
+	query.front() = static_cast<std::byte>(Mysql::Command::QUERY);
+
+	/* fill the query with bytes which look like commands at
+	   the beginning of each continuation packet */
+	for (std::size_t i = Mysql::MAX_PAYLOAD_LENGTH; i < query.size();
+	     i += Mysql::MAX_PAYLOAD_LENGTH)
+		query[i] = static_cast<std::byte>(Mysql::Command::QUIT);
+
+	std::vector<std::byte> result;
+	result.reserve(query_size + query_size / Mysql::MAX_PAYLOAD_LENGTH * 4 + 64);
+
+	std::span<const std::byte> rest{query};
+	uint_least8_t number = 0;
+	while (true) {
+		const auto chunk = rest.first(std::min(rest.size(),
+						       Mysql::MAX_PAYLOAD_LENGTH));
+		AppendPacket(result, number++, chunk);
+		rest = rest.subspan(chunk.size());
+
+		/* a payload which is a multiple of the maximum
+		   length is terminated with an empty packet */
+		if (chunk.size() < Mysql::MAX_PAYLOAD_LENGTH)
+			break;
+	}
+
+	static constexpr std::byte ping[]{static_cast<std::byte>(Mysql::Command::PING)};
+	AppendPacket(result, 0, ping);
+
+	return result;
+}
+
+static void
+Produce(int fd, std::span<const std::byte> src) noexcept
+{
+	while (!src.empty()) {
+		const auto nbytes = write(fd, src.data(), src.size());
+		if (nbytes <= 0)
+			break;
+
+		src = src.subspan(static_cast<std::size_t>(nbytes));
+	}
+}
+
+class Sink final : PeerHandler, MysqlHandler {
+	EventLoop &event_loop;
+
+	Peer peer;
+
+	/**
+	 * Stop the #EventLoop after this number of bytes has been
+	 * forwarded.
+	 */
+	const std::size_t expected_size;
+
+public:
+	std::vector<Mysql::Command> commands;
+	std::size_t n_raw_bytes = 0;
+	bool failed = false;
+
+	Sink(EventLoop &_event_loop, UniqueSocketDescriptor &&fd,
+	     std::size_t _expected_size) noexcept
+		:event_loop(_event_loop),
+		 peer(event_loop, std::move(fd), *this, *this),
+		 expected_size(_expected_size) {}
+
+	~Sink() noexcept {
+		peer.Close();
+	}
+
+private:
+	/* virtual methods from PeerHandler */
+	void OnPeerClosed() noexcept override {
+		/* premature end of the stream */
+		failed = true;
+		event_loop.Break();
+	}
+
+	WriteResult OnPeerWrite() override {
+		return WriteResult::DONE;
+	}
+
+	void OnPeerError(std::exception_ptr e) noexcept override {
+		PrintException(std::move(e));
+		failed = true;
+		event_loop.Break();
+	}
+
+	/* virtual methods from MysqlHandler */
+	Result OnMysqlPacket([[maybe_unused]] unsigned number,
+			     std::span<const std::byte> payload,
+			     [[maybe_unused]] bool complete) noexcept override {
+		if (payload.empty()) {
+			failed = true;
+			return Result::IGNORE;
+		}
+
+		commands.push_back(static_cast<Mysql::Command>(payload.front()));
+		return Result::FORWARD;
+	}
+
+	std::pair<RawResult, std::size_t> OnMysqlRaw(std::span<const std::byte> src) noexcept override {
+		n_raw_bytes += src.size();
+		if (n_raw_bytes >= expected_size)
+			event_loop.Break();
+
+		return {RawResult::OK, src.size()};
+	}
+};
+
+static std::chrono::duration<double>
+GetThreadCpuTime() noexcept
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+
+	return std::chrono::seconds{ru.ru_utime.tv_sec + ru.ru_stime.tv_sec} +
+		std::chrono::microseconds{ru.ru_utime.tv_usec + ru.ru_stime.tv_usec};
+}
+
+static bool
+Run(std::size_t query_size)
+{
+	const auto input = MakeInput(query_size);
+
+	int fds[2];
+	if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) < 0)
+		throw MakeErrno("socketpair() failed");
+
+	std::thread produce_thread{Produce, fds[0], std::span<const std::byte>{input}};
+
+	EventLoop event_loop;
+	Sink sink{event_loop, UniqueSocketDescriptor{AdoptTag{}, fds[1]}, input.size()};
+
+	const auto start_cpu = GetThreadCpuTime();
+	const auto start_time = std::chrono::steady_clock::now();
+
+	event_loop.Run();
+
+	const auto cpu = GetThreadCpuTime() - start_cpu;
+	const std::chrono::duration<double> wall =
+		std::chrono::steady_clock::now() - start_time;
+
+	produce_thread.join();
+	close(fds[0]);
+
+	const double mb = static_cast<double>(input.size()) / MB;
+	fmt::print("{} MB statement: {:.0f} MB/s, {:.3f} s CPU per GB\n",
+		   query_size / MB, mb / wall.count(), cpu.count() * 1024 / mb);
+
+	const std::vector<Mysql::Command> expected_commands{
+		Mysql::Command::QUERY,
+		Mysql::Command::PING,
+	};
+
+	if (sink.failed || sink.commands != expected_commands ||
+	    sink.n_raw_bytes != input.size()) {
+		fmt::print(stderr, "Wrong result: {} commands, {} of {} bytes\n",
+			   sink.commands.size(), sink.n_raw_bytes, input.size());
+		return false;
+	}
+
+	return true;
+}
+
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc > 2) {
+		fmt::print(stderr, "Usage: {} [MEGABYTES]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const std::size_t size = (argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64) * MB;
+
+	const ScopeInitDefaultFifoBuffer init_default_fifo_buffer;
+
+	bool success = Run(size);
+
+	/* exactly one maximum-sized packet, terminated with an
+	   empty packet */
+	success = Run(Mysql::MAX_PAYLOAD_LENGTH) && success;
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Measure the CPU time of Cluster::Pick() for clusters of various
+ * sizes, with and without #ClusterOptions::pick_cache.
+ */
+
+#include "Cluster.hxx"
+#include "BackendPool.hxx"
+#include "Options.hxx"
+#include "Stats.hxx"
+#include "event/Loop.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+#include "net/IPv4Address.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <forward_list>
+#include <string>
+#include <vector>
+
+using std::string_view_literals::operator""sv;
+
+static constexpr std::size_t N_ACCOUNTS = 10000;
+static constexpr std::size_t N_PICKS = 1000000;
+
+static std::forward_list<AllocatedSocketAddress>
+MakeAddresses(std::size_t n) noexcept
+{
+	std::forward_list<AllocatedSocketAddress> addresses;
+	for (std::size_t i = 0; i < n; ++i)
+		addresses.emplace_front(IPv4Address{10, 0,
+						    static_cast<uint8_t>(i >> 8),
+						    static_cast<uint8_t>(i),
+						    3306});
+	return addresses;
+}
+
+static void
+Bench(std::size_t n_nodes, std::string_view name,
+      ClusterOptions::Strategy strategy, std::size_t pick_cache,
+      const std::vector<std::string> &accounts) noexcept
+{
+	EventLoop event_loop;
+	Stats stats;
+	BackendPool backend_pool{event_loop};
+
+	ClusterOptions options;
+	options.strategy = strategy;
+	options.pick_cache = pick_cache;
+
+	Cluster cluster{event_loop, stats, backend_pool,
+			MakeAddresses(n_nodes), std::move(options)};
+
+	static constexpr ConnectOptions connect_options{};
+
+	/* prevent the compiler from optimizing the calls away */
+	std::size_t sink = 0;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (std::size_t i = 0; i < N_PICKS; ++i) {
+		const auto p = cluster.Pick(accounts[i % accounts.size()],
+					    connect_options);
+		sink += reinterpret_cast<std::uintptr_t>(&p.stats);
+	}
+
+	const std::chrono::duration<double, std::nano> duration =
+		std::chrono::steady_clock::now() - start;
+
+	fmt::print("nodes={:4} {:12} pick_cache={:5}: {:8.1f} ns/pick (sink={})\n",
+		   n_nodes, name, pick_cache,
+		   duration.count() / N_PICKS, sink % 10);
+}
+
+int
+main(int, char **) noexcept
+try {
+	std::vector<std::string> accounts;
+	accounts.reserve(N_ACCOUNTS);
+	for (std::size_t i = 0; i < N_ACCOUNTS; ++i)
+		accounts.emplace_back(fmt::format("account{}", i));
+
+	for (const std::size_t n_nodes : {8, 128, 1024}) {
+		Bench(n_nodes, "rendezvous"sv,
+		      ClusterOptions::Strategy::RENDEZVOUS, 0, accounts);
+		Bench(n_nodes, "rendezvous"sv,
+		      ClusterOptions::Strategy::RENDEZVOUS, 16384, accounts);
+		Bench(n_nodes, "least_loaded"sv,
+		      ClusterOptions::Strategy::LEAST_LOADED, 0, accounts);
+		Bench(n_nodes, "bounded_load"sv,
+		      ClusterOptions::Strategy::BOUNDED_LOAD, 0, accounts);
+	}
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
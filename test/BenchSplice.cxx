@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Measure the CPU time needed to forward data from one TCP
+ * connection to another, comparing read()/write() through a
+ * userspace buffer (like MysqlReader's input buffer) with splice()
+ * through a #SplicePipe.
+ */
+
+#include "SplicePipe.hxx"
+#include "net/SocketDescriptor.hxx"
+#include "system/Error.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::min()
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static constexpr std::size_t GB = 1024 * 1024 * 1024;
+
+/**
+ * The size of the userspace buffer; this is the size of a
+ * #DefaultFifoBuffer.
+ */
+static constexpr std::size_t copy_buffer_size = 8192;
+
+/**
+ * Create a connected pair of TCP sockets on the loopback interface.
+ */
+static std::pair<int, int>
+CreateTcpPair()
+{
+	const int listener = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		throw MakeErrno("Failed to create socket");
+
+	struct sockaddr_in sin{};
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	socklen_t sin_size = sizeof(sin);
+	if (bind(listener, (const struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(listener, 1) < 0 ||
+	    getsockname(listener, (struct sockaddr *)&sin, &sin_size) < 0)
+		throw MakeErrno("Failed to listen");
+
+	const int a = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (a < 0 || connect(a, (const struct sockaddr *)&sin, sizeof(sin)) < 0)
+		throw MakeErrno("Failed to connect");
+
+	const int b = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+	if (b < 0)
+		throw MakeErrno("Failed to accept");
+
+	close(listener);
+	return {a, b};
+}
+
+static void
+Produce(int fd, std::size_t size) noexcept
+{
+	static std::array<std::byte, 1024 * 1024> buffer{};
+
+	while (size > 0) {
+		const auto nbytes = write(fd, buffer.data(),
+					  std::min(size, buffer.size()));
+		if (nbytes <= 0)
+			break;
+
+		size -= static_cast<std::size_t>(nbytes);
+	}
+
+	close(fd);
+}
+
+static void
+Consume(int fd) noexcept
+{
+	static std::array<std::byte, 1024 * 1024> buffer;
+
+	while (read(fd, buffer.data(), buffer.size()) > 0) {}
+
+	close(fd);
+}
+
+static void
+ForwardCopy(int src, int dest)
+{
+	std::array<std::byte, copy_buffer_size> buffer;
+
+	while (true) {
+		const auto nbytes = read(src, buffer.data(), buffer.size());
+		if (nbytes < 0)
+			throw MakeErrno("Failed to receive");
+
+		if (nbytes == 0)
+			break;
+
+		for (std::size_t position = 0; position < static_cast<std::size_t>(nbytes);) {
+			const auto nwritten = write(dest, buffer.data() + position,
+						    nbytes - position);
+			if (nwritten < 0)
+				throw MakeErrno("Failed to send");
+
+			position += static_cast<std::size_t>(nwritten);
+		}
+	}
+}
+
+static void
+ForwardSplice(int src, int dest)
+{
+	SplicePipe pipe;
+	pipe.Create();
+
+	while (true) {
+		const auto nbytes = pipe.Fill(SocketDescriptor{src}, GB);
+		if (nbytes < 0)
+			throw MakeErrno("Failed to receive");
+
+		if (nbytes == 0)
+			break;
+
+		while (!pipe.IsEmpty())
+			if (pipe.Drain(SocketDescriptor{dest}) < 0)
+				throw MakeErrno("Failed to send");
+	}
+}
+
+static std::chrono::duration<double>
+GetThreadCpuTime() noexcept
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+
+	return std::chrono::seconds{ru.ru_utime.tv_sec + ru.ru_stime.tv_sec} +
+		std::chrono::microseconds{ru.ru_utime.tv_usec + ru.ru_stime.tv_usec};
+}
+
+static void
+Run(const char *name, void (*forward)(int src, int dest), std::size_t size)
+{
+	const auto [producer, forward_src] = CreateTcpPair();
+	const auto [forward_dest, consumer] = CreateTcpPair();
+
+	std::thread produce_thread{Produce, producer, size};
+	std::thread consume_thread{Consume, consumer};
+
+	const auto start_cpu = GetThreadCpuTime();
+	const auto start_time = std::chrono::steady_clock::now();
+
+	forward(forward_src, forward_dest);
+
+	const auto cpu = GetThreadCpuTime() - start_cpu;
+	const std::chrono::duration<double> wall =
+		std::chrono::steady_clock::now() - start_time;
+
+	close(forward_src);
+	close(forward_dest);
+
+	produce_thread.join();
+	consume_thread.join();
+
+	const double gb = static_cast<double>(size) / GB;
+	fmt::print("{:6}: {:.3f} s CPU per GB, {:.3f} GB/s\n",
+		   name, cpu.count() / gb, gb / wall.count());
+}
+
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc > 2) {
+		fmt::print(stderr, "Usage: {} [GIGABYTES]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const std::size_t size = (argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4) * GB;
+
+	Run("copy", ForwardCopy, size);
+	Run("splice", ForwardSplice, size);
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Measure the CPU time needed to transfer data over a TCP
+ * connection, comparing plain data, TLS 1.3 records encrypted and
+ * decrypted in userspace (with OpenSSL's libcrypto, like a TLS
+ * library would do) and kernel TLS (like #TlsSession configures it
+ * after the handshake).  All modes use AES-128-GCM with a dummy key.
+ *
+ * Kernel TLS requires the "tls" kernel module.
+ */
+
+#include "system/Error.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <openssl/evp.h>
+
+#include <algorithm> // for std::min()
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // for TCP_ULP
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+static constexpr std::size_t GB = 1024 * 1024 * 1024;
+
+/**
+ * The maximum payload of a TLS record.
+ */
+static constexpr std::size_t record_size = 16384;
+
+static constexpr std::size_t header_size = 5, tag_size = 16;
+
+static constexpr std::array<unsigned char, 16> dummy_key{};
+static constexpr std::array<unsigned char, 12> dummy_iv{};
+
+/**
+ * Create a connected pair of TCP sockets on the loopback interface.
+ */
+static std::pair<int, int>
+CreateTcpPair()
+{
+	const int listener = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		throw MakeErrno("Failed to create socket");
+
+	struct sockaddr_in sin{};
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	socklen_t sin_size = sizeof(sin);
+	if (bind(listener, (const struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(listener, 1) < 0 ||
+	    getsockname(listener, (struct sockaddr *)&sin, &sin_size) < 0)
+		throw MakeErrno("Failed to listen");
+
+	const int a = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (a < 0 || connect(a, (const struct sockaddr *)&sin, sizeof(sin)) < 0)
+		throw MakeErrno("Failed to connect");
+
+	const int b = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+	if (b < 0)
+		throw MakeErrno("Failed to accept");
+
+	close(listener);
+	return {a, b};
+}
+
+static bool
+WriteFull(int fd, const void *_src, std::size_t size) noexcept
+{
+	const auto *src = static_cast<const std::byte *>(_src);
+
+	while (size > 0) {
+		const auto nbytes = write(fd, src, size);
+		if (nbytes <= 0)
+			return false;
+
+		src += nbytes;
+		size -= static_cast<std::size_t>(nbytes);
+	}
+
+	return true;
+}
+
+static bool
+ReadFull(int fd, void *_dest, std::size_t size) noexcept
+{
+	auto *dest = static_cast<std::byte *>(_dest);
+
+	while (size > 0) {
+		const auto nbytes = read(fd, dest, size);
+		if (nbytes <= 0)
+			return false;
+
+		dest += nbytes;
+		size -= static_cast<std::size_t>(nbytes);
+	}
+
+	return true;
+}
+
+static void
+ProducePlain(int fd, std::size_t size) noexcept
+{
+	static std::array<std::byte, 1024 * 1024> buffer{};
+
+	while (size > 0) {
+		const std::size_t n = std::min(size, buffer.size());
+		if (!WriteFull(fd, buffer.data(), n))
+			break;
+
+		size -= n;
+	}
+
+	close(fd);
+}
+
+static std::size_t
+ConsumePlain(int fd) noexcept
+{
+	static std::array<std::byte, 1024 * 1024> buffer;
+
+	std::size_t total = 0;
+	ssize_t nbytes;
+	while ((nbytes = read(fd, buffer.data(), buffer.size())) > 0)
+		total += static_cast<std::size_t>(nbytes);
+
+	return total;
+}
+
+/**
+ * Calculate the nonce of a TLS 1.3 record (RFC 8446 5.3).
+ */
+static std::array<unsigned char, 12>
+MakeNonce(uint_least64_t sequence) noexcept
+{
+	auto nonce = dummy_iv;
+	for (std::size_t i = nonce.size(); i-- > nonce.size() - 8;) {
+		nonce[i] ^= static_cast<unsigned char>(sequence);
+		sequence >>= 8;
+	}
+
+	return nonce;
+}
+
+static void
+ProduceUserspace(int fd, std::size_t size) noexcept
+{
+	static std::array<unsigned char, header_size + record_size + 1 + tag_size> record;
+	static std::array<unsigned char, record_size + 1> plain{};
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+	for (uint_least64_t sequence = 0; size > 0; ++sequence) {
+		const std::size_t n = std::min(size, record_size);
+		plain[n] = 0x17; // content type "application_data"
+
+		const std::size_t length = n + 1 + tag_size;
+		record[0] = 0x17;
+		record[1] = 0x03;
+		record[2] = 0x03;
+		record[3] = static_cast<unsigned char>(length >> 8);
+		record[4] = static_cast<unsigned char>(length);
+
+		const auto nonce = MakeNonce(sequence);
+		int outl;
+		EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), nullptr,
+				   dummy_key.data(), nonce.data());
+		EVP_EncryptUpdate(ctx, nullptr, &outl, record.data(), header_size);
+		EVP_EncryptUpdate(ctx, record.data() + header_size, &outl,
+				  plain.data(), n + 1);
+		EVP_EncryptFinal_ex(ctx, record.data() + header_size + n + 1, &outl);
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_size,
+				    record.data() + header_size + n + 1);
+
+		if (!WriteFull(fd, record.data(), header_size + length))
+			break;
+
+		size -= n;
+	}
+
+	EVP_CIPHER_CTX_free(ctx);
+	close(fd);
+}
+
+static std::size_t
+ConsumeUserspace(int fd) noexcept
+{
+	static std::array<unsigned char, header_size + record_size + 1 + tag_size> record;
+	static std::array<unsigned char, record_size + 1> plain;
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+	std::size_t total = 0;
+
+	for (uint_least64_t sequence = 0;; ++sequence) {
+		if (!ReadFull(fd, record.data(), header_size))
+			break;
+
+		const std::size_t length = (std::size_t{record[3]} << 8) | record[4];
+		if (length < 1 + tag_size || length > record_size + 1 + tag_size ||
+		    !ReadFull(fd, record.data() + header_size, length))
+			break;
+
+		const std::size_t n = length - tag_size;
+		const auto nonce = MakeNonce(sequence);
+		int outl;
+		EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), nullptr,
+				   dummy_key.data(), nonce.data());
+		EVP_DecryptUpdate(ctx, nullptr, &outl, record.data(), header_size);
+		EVP_DecryptUpdate(ctx, plain.data(), &outl,
+				  record.data() + header_size, n);
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag_size,
+				    record.data() + header_size + n);
+		if (EVP_DecryptFinal_ex(ctx, plain.data() + n, &outl) != 1)
+			/* this will be reported as "short transfer" */
+			break;
+
+		total += n - 1;
+	}
+
+	EVP_CIPHER_CTX_free(ctx);
+	return total;
+}
+
+/**
+ * Configure kernel TLS with the dummy key.
+ *
+ * @return false if kernel TLS is not available
+ */
+static bool
+EnableKernelTls(int fd, int direction)
+{
+	static constexpr char ulp[] = "tls";
+	if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, ulp, sizeof(ulp)) < 0)
+		return false;
+
+	struct tls12_crypto_info_aes_gcm_128 info{};
+	info.info.version = TLS_1_3_VERSION;
+	info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+	memcpy(info.key, dummy_key.data(), sizeof(info.key));
+	memcpy(info.salt, dummy_iv.data(), sizeof(info.salt));
+	memcpy(info.iv, dummy_iv.data() + sizeof(info.salt), sizeof(info.iv));
+
+	if (setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) < 0)
+		throw MakeErrno("Failed to configure kernel TLS");
+
+	return true;
+}
+
+static std::chrono::duration<double>
+GetProcessCpuTime() noexcept
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	return std::chrono::seconds{ru.ru_utime.tv_sec + ru.ru_stime.tv_sec} +
+		std::chrono::microseconds{ru.ru_utime.tv_usec + ru.ru_stime.tv_usec};
+}
+
+enum class Mode {
+	PLAIN,
+	USERSPACE,
+	KERNEL,
+};
+
+static void
+Run(const char *name, Mode mode, std::size_t size)
+{
+	const auto [producer, consumer] = CreateTcpPair();
+
+	if (mode == Mode::KERNEL) {
+		if (!EnableKernelTls(producer, TLS_TX) ||
+		    !EnableKernelTls(consumer, TLS_RX)) {
+			fmt::print("{:9}: not available (is the \"tls\" kernel module loaded?)\n",
+				   name);
+			close(producer);
+			close(consumer);
+			return;
+		}
+	}
+
+	const auto start_cpu = GetProcessCpuTime();
+	const auto start_time = std::chrono::steady_clock::now();
+
+	std::thread produce_thread{mode == Mode::USERSPACE ? ProduceUserspace : ProducePlain,
+				   producer, size};
+
+	const std::size_t received = mode == Mode::USERSPACE
+		? ConsumeUserspace(consumer)
+		: ConsumePlain(consumer);
+
+	produce_thread.join();
+
+	const auto cpu = GetProcessCpuTime() - start_cpu;
+	const std::chrono::duration<double> wall =
+		std::chrono::steady_clock::now() - start_time;
+
+	close(consumer);
+
+	if (received != size)
+		throw std::runtime_error{"Short transfer"};
+
+	const double gb = static_cast<double>(size) / GB;
+	fmt::print("{:9}: {:.3f} s CPU per GB, {:.3f} GB/s\n",
+		   name, cpu.count() / gb, gb / wall.count());
+}
+
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc > 2) {
+		fmt::print(stderr, "Usage: {} [GIGABYTES]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const std::size_t size = (argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2) * GB;
+
+	Run("plain", Mode::PLAIN, size);
+	Run("userspace", Mode::USERSPACE, size);
+	Run("ktls", Mode::KERNEL, size);
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
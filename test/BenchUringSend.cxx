@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Compare the throughput of sending small packets to many sockets
+ * with one send() per packet (like Peer::SendSome() with epoll)
+ * with io_uring, where all sends of one event loop iteration share
+ * one io_uring_enter() call (like #UringSend).
+ */
+
+#include "system/Error.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <liburing.h>
+
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static constexpr std::size_t n_sockets = 64;
+static constexpr std::size_t packet_size = 1024;
+
+static std::array<std::byte, packet_size> packet{};
+
+struct SocketPairs {
+	std::vector<int> senders, receivers;
+
+	SocketPairs() {
+		for (std::size_t i = 0; i < n_sockets; ++i) {
+			int fds[2];
+			if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) < 0)
+				throw MakeErrno("socketpair() failed");
+
+			senders.push_back(fds[0]);
+			receivers.push_back(fds[1]);
+		}
+	}
+
+	~SocketPairs() noexcept {
+		for (int fd : senders)
+			close(fd);
+		for (int fd : receivers)
+			close(fd);
+	}
+};
+
+/**
+ * Read and discard everything until all sockets are closed.
+ */
+static void
+Consume(const std::vector<int> &fds) noexcept
+{
+	std::vector<struct pollfd> pfds;
+	for (int fd : fds)
+		pfds.push_back({.fd = fd, .events = POLLIN, .revents = 0});
+
+	static std::array<std::byte, 65536> buffer;
+
+	std::size_t n_open = fds.size();
+	while (n_open > 0 && poll(pfds.data(), pfds.size(), -1) > 0) {
+		for (auto &i : pfds) {
+			if (i.revents == 0)
+				continue;
+
+			if (read(i.fd, buffer.data(), buffer.size()) <= 0) {
+				i.fd = -1;
+				--n_open;
+			}
+		}
+	}
+}
+
+static void
+SendEpoll(const std::vector<int> &fds, std::size_t n_rounds)
+{
+	for (std::size_t round = 0; round < n_rounds; ++round)
+		for (int fd : fds)
+			if (send(fd, packet.data(), packet.size(), MSG_NOSIGNAL) < 0)
+				throw MakeErrno("send() failed");
+}
+
+static void
+SendUring(const std::vector<int> &fds, std::size_t n_rounds)
+{
+	struct io_uring ring;
+	if (int error = io_uring_queue_init(n_sockets * 2, &ring, 0); error < 0)
+		throw MakeErrno(-error, "io_uring_queue_init() failed");
+
+	for (std::size_t round = 0; round < n_rounds; ++round) {
+		/* one "event loop iteration": queue one send per
+		   socket, submit all of them at once */
+		for (int fd : fds) {
+			auto *sqe = io_uring_get_sqe(&ring);
+			io_uring_prep_send(sqe, fd, packet.data(), packet.size(),
+					   MSG_NOSIGNAL);
+		}
+
+		if (int error = io_uring_submit_and_wait(&ring, fds.size()); error < 0)
+			throw MakeErrno(-error, "io_uring_submit_and_wait() failed");
+
+		struct io_uring_cqe *cqe;
+		unsigned head, n = 0;
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			if (cqe->res < 0)
+				throw MakeErrno(-cqe->res, "send failed");
+			++n;
+		}
+
+		io_uring_cq_advance(&ring, n);
+	}
+
+	io_uring_queue_exit(&ring);
+}
+
+static std::chrono::duration<double>
+GetThreadCpuTime() noexcept
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+
+	return std::chrono::seconds{ru.ru_utime.tv_sec + ru.ru_stime.tv_sec} +
+		std::chrono::microseconds{ru.ru_utime.tv_usec + ru.ru_stime.tv_usec};
+}
+
+static void
+Run(const char *name, void (*send_all)(const std::vector<int> &fds, std::size_t n_rounds),
+    std::size_t n_rounds, std::size_t syscalls_per_round)
+{
+	SocketPairs pairs;
+	std::thread consume_thread{Consume, std::cref(pairs.receivers)};
+
+	const auto start_cpu = GetThreadCpuTime();
+	const auto start_time = std::chrono::steady_clock::now();
+
+	send_all(pairs.senders, n_rounds);
+
+	const auto cpu = GetThreadCpuTime() - start_cpu;
+	const std::chrono::duration<double> wall =
+		std::chrono::steady_clock::now() - start_time;
+
+	for (int fd : pairs.senders)
+		shutdown(fd, SHUT_WR);
+
+	consume_thread.join();
+
+	const double n_packets = static_cast<double>(n_rounds * n_sockets);
+	fmt::print("{:6}: {:.0f} packets/s, {:.3f} us CPU per packet, {:.3f} syscalls per packet\n",
+		   name, n_packets / wall.count(),
+		   cpu.count() * 1e6 / n_packets,
+		   static_cast<double>(syscalls_per_round) / n_sockets);
+}
+
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc > 2) {
+		fmt::print(stderr, "Usage: {} [ROUNDS]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const std::size_t n_rounds = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+
+	Run("epoll", SendEpoll, n_rounds, n_sockets);
+	Run("uring", SendUring, n_rounds, 1);
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,322 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Simulate clients sending queries to a cluster and compare the
+ * strategies of Cluster::Pick() (#ClusterOptions::Strategy) in two
+ * scenarios: one node is slow, or few accounts have most of the
+ * connections.  Each client connects (i.e. picks a node for a
+ * random account), sends a number of queries one after another and
+ * reconnects.  The simulated servers execute a limited number of
+ * queries in parallel; more pending queries make each one slower.
+ * Prints the latency seen by the clients and the share of queries
+ * and the number of clients per node.
+ */
+
+#include "Cluster.hxx"
+#include "BackendPool.hxx"
+#include "Options.hxx"
+#include "Stats.hxx"
+#include "event/Loop.hxx"
+#include "event/FineTimerEvent.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+#include "net/IPv4Address.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::sort()
+#include <chrono>
+#include <cmath> // for std::pow()
+#include <cstdlib>
+#include <forward_list>
+#include <list>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::string_view_literals::operator""sv;
+
+static constexpr std::size_t N_NODES = 8;
+static constexpr std::size_t N_ACCOUNTS = 1000;
+static constexpr std::size_t N_CLIENTS = 256;
+
+/**
+ * The number of queries per client connection.
+ */
+static constexpr unsigned QUERIES_PER_CONNECTION = 20;
+
+/**
+ * The number of queries a node executes in parallel without slowing
+ * down.
+ */
+static constexpr std::size_t NODE_CONCURRENCY = 8;
+
+static constexpr Event::Duration NODE_LATENCY = std::chrono::milliseconds{1};
+
+/**
+ * In the "slow node" scenario, the last node is this much slower
+ * than the others.
+ */
+static constexpr unsigned SLOW_FACTOR = 10;
+
+/**
+ * In the "skewed accounts" scenario, account popularity follows a
+ * Zipf distribution with this exponent.
+ */
+static constexpr double ZIPF_EXPONENT = 1.0;
+
+static constexpr Event::Duration SIMULATION_DURATION = std::chrono::seconds{2};
+
+struct Scenario {
+	std::string_view name;
+
+	/**
+	 * Is the last node slow (#SLOW_FACTOR)?
+	 */
+	bool slow_node;
+
+	/**
+	 * Is account popularity skewed (#ZIPF_EXPONENT)?  If not,
+	 * accounts are chosen uniformly.
+	 */
+	bool skewed_accounts;
+};
+
+struct SimNode {
+	NodeStats &stats;
+
+	Event::Duration latency;
+
+	uint_least64_t n_queries = 0;
+
+	SimNode(NodeStats &_stats, Event::Duration _latency) noexcept
+		:stats(_stats), latency(_latency) {}
+
+	/**
+	 * Calculate the duration of a new query (which has already
+	 * been added to NodeStats::n_pending_commands).
+	 */
+	Event::Duration GetQueryDuration() const noexcept {
+		const std::size_t n = stats.n_pending_commands;
+		if (n <= NODE_CONCURRENCY)
+			return latency;
+
+		return latency * n / NODE_CONCURRENCY;
+	}
+};
+
+class Simulation {
+	EventLoop &event_loop;
+
+	Stats stats;
+	BackendPool backend_pool{event_loop};
+	Cluster cluster;
+
+	std::map<const NodeStats *, SimNode> nodes;
+
+	std::vector<Event::Duration> durations;
+
+	std::mt19937 random;
+	std::discrete_distribution<std::size_t> account_distribution;
+
+	FineTimerEvent stop_timer;
+
+public:
+	Simulation(EventLoop &_event_loop, const Scenario &scenario,
+		   const std::forward_list<AllocatedSocketAddress> &addresses,
+		   ClusterOptions &&options) noexcept;
+
+	EventLoop &GetEventLoop() const noexcept {
+		return event_loop;
+	}
+
+	std::string NextAccount() noexcept {
+		return fmt::format("account{}", account_distribution(random));
+	}
+
+	SimNode &Pick(std::string_view account) noexcept {
+		static constexpr ConnectOptions connect_options{};
+		const auto p = cluster.Pick(account, connect_options);
+		return nodes.at(&p.stats);
+	}
+
+	void AddDuration(Event::Duration duration) noexcept {
+		durations.push_back(duration);
+	}
+
+	void Run() noexcept {
+		stop_timer.Schedule(SIMULATION_DURATION);
+		event_loop.Run();
+	}
+
+	void PrintResults() noexcept;
+
+private:
+	void OnStopTimer() noexcept {
+		event_loop.Break();
+	}
+};
+
+/**
+ * Create the distribution of accounts over client connections.
+ */
+static std::discrete_distribution<std::size_t>
+MakeAccountDistribution(bool skewed) noexcept
+{
+	std::vector<double> weights;
+	weights.reserve(N_ACCOUNTS);
+
+	for (std::size_t i = 0; i < N_ACCOUNTS; ++i)
+		weights.push_back(skewed
+				  ? 1.0 / std::pow(static_cast<double>(i + 1), ZIPF_EXPONENT)
+				  : 1.0);
+
+	return {weights.begin(), weights.end()};
+}
+
+Simulation::Simulation(EventLoop &_event_loop, const Scenario &scenario,
+		       const std::forward_list<AllocatedSocketAddress> &addresses,
+		       ClusterOptions &&options) noexcept
+	:event_loop(_event_loop),
+	 cluster(event_loop, stats, backend_pool,
+		 std::forward_list<AllocatedSocketAddress>{addresses},
+		 std::move(options)),
+	 account_distribution(MakeAccountDistribution(scenario.skewed_accounts)),
+	 stop_timer(event_loop, BIND_THIS_METHOD(OnStopTimer))
+{
+	std::size_t i = 0;
+	for (const auto &address : addresses) {
+		const bool slow = scenario.slow_node && ++i == N_NODES;
+		nodes.try_emplace(&stats.GetNode(address), stats.GetNode(address),
+				  slow ? NODE_LATENCY * SLOW_FACTOR : NODE_LATENCY);
+	}
+}
+
+void
+Simulation::PrintResults() noexcept
+{
+	std::sort(durations.begin(), durations.end());
+
+	Event::Duration sum{};
+	for (const auto i : durations)
+		sum += i;
+
+	const auto Percentile = [this](double p){
+		return durations[static_cast<std::size_t>(static_cast<double>(durations.size() - 1) * p)];
+	};
+
+	const auto ToMs = [](Event::Duration d){
+		return std::chrono::duration<double, std::milli>{d}.count();
+	};
+
+	fmt::print("  queries={} mean={:.2f}ms p50={:.2f}ms p99={:.2f}ms\n",
+		   durations.size(),
+		   ToMs(sum / static_cast<long>(durations.size())),
+		   ToMs(Percentile(0.5)), ToMs(Percentile(0.99)));
+
+	fmt::print("  share per node:");
+	for (const auto &[stats, node] : nodes)
+		fmt::print(" {:.1f}%{}",
+			   100.0 * static_cast<double>(node.n_queries) / static_cast<double>(durations.size()),
+			   node.latency > NODE_LATENCY ? " (slow)"sv : ""sv);
+	fmt::print("\n");
+
+	fmt::print("  clients per node:");
+	for (const auto &[stats, node] : nodes)
+		fmt::print(" {}", stats->n_clients);
+	fmt::print("\n");
+}
+
+class SimClient {
+	Simulation &simulation;
+
+	FineTimerEvent timer;
+
+	SimNode *node = nullptr;
+
+	Event::TimePoint start;
+
+	unsigned remaining = 0;
+
+public:
+	explicit SimClient(Simulation &_simulation) noexcept
+		:simulation(_simulation),
+		 timer(simulation.GetEventLoop(), BIND_THIS_METHOD(OnTimer)) {}
+
+	void SendQuery() noexcept {
+		if (remaining == 0) {
+			/* reconnect */
+			if (node != nullptr)
+				--node->stats.n_clients;
+
+			node = &simulation.Pick(simulation.NextAccount());
+			++node->stats.n_clients;
+			remaining = QUERIES_PER_CONNECTION;
+		}
+
+		--remaining;
+		++node->stats.n_pending_commands;
+		start = simulation.GetEventLoop().SteadyNow();
+		timer.Schedule(node->GetQueryDuration());
+	}
+
+private:
+	void OnTimer() noexcept {
+		const auto now = simulation.GetEventLoop().SteadyNow();
+		const auto duration = now - start;
+
+		--node->stats.n_pending_commands;
+		node->stats.query_latency.Record(duration, now);
+		++node->n_queries;
+		simulation.AddDuration(duration);
+
+		SendQuery();
+	}
+};
+
+static void
+Run(const Scenario &scenario,
+    std::string_view name, ClusterOptions::Strategy strategy)
+{
+	EventLoop event_loop;
+
+	std::forward_list<AllocatedSocketAddress> addresses;
+	for (std::size_t i = N_NODES; i > 0; --i)
+		addresses.emplace_front(IPv4Address{10, 0, 0, static_cast<uint8_t>(i), 3306});
+
+	ClusterOptions options;
+	options.strategy = strategy;
+
+	Simulation simulation{event_loop, scenario, addresses, std::move(options)};
+
+	std::list<SimClient> clients;
+	for (std::size_t i = 0; i < N_CLIENTS; ++i)
+		clients.emplace_back(simulation).SendQuery();
+
+	simulation.Run();
+
+	fmt::print("{} / {}:\n", scenario.name, name);
+	simulation.PrintResults();
+}
+
+static void
+Run(const Scenario &scenario)
+{
+	Run(scenario, "rendezvous"sv, ClusterOptions::Strategy::RENDEZVOUS);
+	Run(scenario, "least_loaded"sv, ClusterOptions::Strategy::LEAST_LOADED);
+	Run(scenario, "bounded_load"sv, ClusterOptions::Strategy::BOUNDED_LOAD);
+}
+
+int
+main(int, char **) noexcept
+try {
+	Run({.name = "slow node"sv, .slow_node = true, .skewed_accounts = false});
+	Run({.name = "skewed accounts"sv, .slow_node = false, .skewed_accounts = true});
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "PendingCommandQueue.hxx"
+
+#include <gtest/gtest.h>
+
+static PendingCommandQueue::Command
+MakeCommand(Mysql::Command command, bool read_only) noexcept
+{
+	return {
+		.start = {},
+		.command = command,
+		.response_sequence_id = 1,
+		.responding = false,
+		.read_only = read_only,
+		.digest = {},
+	};
+}
+
+TEST(PendingCommandQueue, MayModifyData)
+{
+	EXPECT_FALSE(MakeCommand(Mysql::Command::QUERY, true).MayModifyData());
+	EXPECT_TRUE(MakeCommand(Mysql::Command::QUERY, false).MayModifyData());
+
+	/* a statement which is not known to be read-only */
+	EXPECT_FALSE(MakeCommand(Mysql::Command::STMT_EXECUTE, true).MayModifyData());
+	EXPECT_TRUE(MakeCommand(Mysql::Command::STMT_EXECUTE, false).MayModifyData());
+
+	/* preparing a statement does not execute it */
+	EXPECT_FALSE(MakeCommand(Mysql::Command::STMT_PREPARE, false).MayModifyData());
+
+	EXPECT_FALSE(MakeCommand(Mysql::Command::PING, false).MayModifyData());
+	EXPECT_FALSE(MakeCommand(Mysql::Command::INIT_DB, false).MayModifyData());
+}
+
+TEST(PendingCommandQueue, Fifo)
+{
+	PendingCommandQueue queue;
+	EXPECT_TRUE(queue.empty());
+
+	queue.push_back(MakeCommand(Mysql::Command::QUERY, true));
+	queue.push_back(MakeCommand(Mysql::Command::STMT_EXECUTE, false));
+	EXPECT_EQ(queue.size(), 2U);
+	EXPECT_EQ(queue.back().command, Mysql::Command::STMT_EXECUTE);
+
+	EXPECT_FALSE(queue.front().MayModifyData());
+	queue.pop_front();
+	EXPECT_TRUE(queue.front().MayModifyData());
+	queue.pop_front();
+	EXPECT_TRUE(queue.empty());
+}
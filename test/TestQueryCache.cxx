@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "QueryCache.hxx"
+#include "MysqlProtocol.hxx"
+#include "Stats.hxx"
+#include "net/IPv4Address.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+using std::string_view_literals::operator""sv;
+
+static const IPv4Address address{127, 0, 0, 1, 3306};
+
+static constexpr Event::TimePoint now{std::chrono::seconds{1000}};
+static constexpr Event::TimePoint later = now + std::chrono::seconds{10};
+
+static std::string
+MakeKey(std::string_view query, std::string_view database="db"sv) noexcept
+{
+	return QueryCache::MakeKey({
+		.address = address,
+		.user = "user"sv,
+		.database = database,
+		.capabilities = Mysql::CLIENT_PROTOCOL_41,
+		.query = query,
+	});
+}
+
+static std::vector<std::byte>
+MakeResponse(std::size_t size, std::byte value=std::byte{0x42}) noexcept
+{
+	return std::vector<std::byte>(size, value);
+}
+
+TEST(QueryCache, Key)
+{
+	/* whitespace is normalized */
+	EXPECT_EQ(MakeKey("SELECT * FROM t"), MakeKey("  SELECT  *\nFROM t "));
+	EXPECT_NE(MakeKey("SELECT * FROM t"), MakeKey("SELECT * FROM u"));
+	EXPECT_NE(MakeKey("SELECT 'a  b'"), MakeKey("SELECT 'a b'"));
+
+	/* everything else is part of the key */
+	EXPECT_NE(MakeKey("SELECT 1", "a"), MakeKey("SELECT 1", "b"));
+
+	const QueryCache::Key key{
+		.address = address,
+		.user = "user"sv,
+		.database = "db"sv,
+		.capabilities = Mysql::CLIENT_PROTOCOL_41,
+		.query = "SELECT 1"sv,
+	};
+
+	auto other = key;
+	other.user = "other"sv;
+	EXPECT_NE(QueryCache::MakeKey(key), QueryCache::MakeKey(other));
+
+	other = key;
+	other.capabilities |= Mysql::CLIENT_DEPRECATE_EOF;
+	EXPECT_NE(QueryCache::MakeKey(key), QueryCache::MakeKey(other));
+
+	const IPv4Address other_address{127, 0, 0, 2, 3306};
+	other = key;
+	other.address = other_address;
+	EXPECT_NE(QueryCache::MakeKey(key), QueryCache::MakeKey(other));
+
+	/* no ambiguity between the user and the database */
+	other = key;
+	other.user = "userd"sv;
+	other.database = "b"sv;
+	EXPECT_NE(QueryCache::MakeKey(key), QueryCache::MakeKey(other));
+}
+
+TEST(QueryCache, Disabled)
+{
+	Stats stats;
+	QueryCache cache{stats};
+	EXPECT_FALSE(cache.IsEnabled());
+	EXPECT_EQ(cache.GetMaxItemSize(), 0U);
+
+	cache.Put(MakeKey("SELECT 1"), "db"sv, MakeResponse(10), later);
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT 1"), now).empty());
+	EXPECT_EQ(stats.n_query_cache_items, 0U);
+}
+
+TEST(QueryCache, PutGet)
+{
+	Stats stats;
+	QueryCache cache{stats};
+	cache.SetMaxSize(1024 * 1024);
+	EXPECT_TRUE(cache.IsEnabled());
+
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT 1"), now).empty());
+	EXPECT_EQ(stats.n_query_cache_misses, 1U);
+
+	cache.Put(MakeKey("SELECT 1"), "db"sv, MakeResponse(10), later);
+	EXPECT_EQ(stats.n_query_cache_items, 1U);
+	EXPECT_EQ(stats.n_query_cache_stores, 1U);
+	EXPECT_EQ(stats.query_cache_bytes, 10U);
+
+	const auto response = cache.Get(MakeKey("SELECT  1"), now);
+	ASSERT_EQ(response.size(), 10U);
+	EXPECT_EQ(response.front(), std::byte{0x42});
+	EXPECT_EQ(stats.n_query_cache_hits, 1U);
+
+	/* replace the item */
+	cache.Put(MakeKey("SELECT 1"), "db"sv, MakeResponse(20, std::byte{0x43}), later);
+	EXPECT_EQ(stats.n_query_cache_items, 1U);
+	EXPECT_EQ(stats.query_cache_bytes, 20U);
+	EXPECT_EQ(cache.Get(MakeKey("SELECT 1"), now).front(), std::byte{0x43});
+}
+
+TEST(QueryCache, Expire)
+{
+	Stats stats;
+	QueryCache cache{stats};
+	cache.SetMaxSize(1024 * 1024);
+
+	cache.Put(MakeKey("SELECT 1"), "db"sv, MakeResponse(10), later);
+	EXPECT_FALSE(cache.Get(MakeKey("SELECT 1"), later - std::chrono::seconds{1}).empty());
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT 1"), later).empty());
+	EXPECT_EQ(stats.n_query_cache_items, 0U);
+	EXPECT_EQ(stats.query_cache_bytes, 0U);
+}
+
+TEST(QueryCache, MaxItemSize)
+{
+	Stats stats;
+	QueryCache cache{stats};
+	cache.SetMaxSize(1600);
+	EXPECT_EQ(cache.GetMaxItemSize(), 100U);
+
+	cache.Put(MakeKey("SELECT 1"), "db"sv, MakeResponse(101), later);
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT 1"), now).empty());
+
+	cache.Put(MakeKey("SELECT 1"), "db"sv, MakeResponse(100), later);
+	EXPECT_FALSE(cache.Get(MakeKey("SELECT 1"), now).empty());
+
+	cache.SetMaxSize(1024 * 1024 * 1024);
+	EXPECT_EQ(cache.GetMaxItemSize(), QueryCache::MAX_ITEM_SIZE);
+}
+
+TEST(QueryCache, LRU)
+{
+	Stats stats;
+	QueryCache cache{stats};
+	cache.SetMaxSize(1600);
+
+	for (unsigned i = 0; i < 16; ++i)
+		cache.Put(MakeKey("SELECT " + std::to_string(i)), "db"sv,
+			  MakeResponse(100), later);
+
+	EXPECT_EQ(stats.n_query_cache_items, 16U);
+	EXPECT_EQ(stats.query_cache_bytes, 1600U);
+
+	/* mark item 0 as recently used */
+	EXPECT_FALSE(cache.Get(MakeKey("SELECT 0"), now).empty());
+
+	/* this discards item 1, the least recently used one */
+	cache.Put(MakeKey("SELECT 16"), "db"sv, MakeResponse(100), later);
+	EXPECT_EQ(stats.n_query_cache_items, 16U);
+	EXPECT_FALSE(cache.Get(MakeKey("SELECT 0"), now).empty());
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT 1"), now).empty());
+	EXPECT_FALSE(cache.Get(MakeKey("SELECT 2"), now).empty());
+	EXPECT_FALSE(cache.Get(MakeKey("SELECT 16"), now).empty());
+
+	/* shrinking discards more items */
+	cache.SetMaxSize(800);
+	EXPECT_EQ(stats.n_query_cache_items, 8U);
+	EXPECT_EQ(stats.query_cache_bytes, 800U);
+}
+
+TEST(QueryCache, Invalidate)
+{
+	Stats stats;
+	QueryCache cache{stats};
+	cache.SetMaxSize(1024 * 1024);
+
+	cache.Put(MakeKey("SELECT 1", "a"), "a"sv, MakeResponse(10), later);
+	cache.Put(MakeKey("SELECT 2", "a"), "a"sv, MakeResponse(10), later);
+	cache.Put(MakeKey("SELECT 1", "b"), "b"sv, MakeResponse(10), later);
+
+	cache.Invalidate("a"sv);
+	EXPECT_EQ(stats.n_query_cache_items, 1U);
+	EXPECT_EQ(stats.query_cache_bytes, 10U);
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT 1", "a"), now).empty());
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT 2", "a"), now).empty());
+	EXPECT_FALSE(cache.Get(MakeKey("SELECT 1", "b"), now).empty());
+
+	cache.Invalidate("nonexistent"sv);
+	EXPECT_EQ(stats.n_query_cache_items, 1U);
+
+	cache.Clear();
+	EXPECT_EQ(stats.n_query_cache_items, 0U);
+	EXPECT_EQ(stats.query_cache_bytes, 0U);
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT 1", "b"), now).empty());
+}
+
+TEST(QueryCache, ClearOtherDatabases)
+{
+	Stats stats;
+	QueryCache cache{stats};
+	cache.SetMaxSize(1024 * 1024);
+
+	/* a result is stored under the client's database, but
+	   may have been read from another one */
+	cache.Put(MakeKey("SELECT * FROM b.t", "a"), "a"sv, MakeResponse(10), later);
+	cache.Put(MakeKey("SELECT * FROM t", "b"), "b"sv, MakeResponse(10), later);
+
+	/* a write to "b.t" by a client of database "c" */
+	cache.Clear();
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT * FROM b.t", "a"), now).empty());
+	EXPECT_TRUE(cache.Get(MakeKey("SELECT * FROM t", "b"), now).empty());
+	EXPECT_EQ(stats.n_query_cache_items, 0U);
+}
+
+TEST(QueryCache, Capture)
+{
+	QueryCacheCapture capture{
+		.key = MakeKey("SELECT 1"),
+		.ttl = std::chrono::seconds{10},
+	};
+
+	const auto payload = MakeResponse(10);
+	EXPECT_TRUE(capture.Append(1, payload, 100));
+	ASSERT_EQ(capture.response.size(), sizeof(Mysql::PacketHeader) + 10);
+
+	/* the header contains the sequence_id */
+	EXPECT_EQ(capture.response[3], std::byte{1});
+
+	EXPECT_TRUE(capture.Append(2, payload, 100));
+	EXPECT_EQ(capture.response.size(), 2 * (sizeof(Mysql::PacketHeader) + 10));
+
+	/* too large */
+	EXPECT_FALSE(capture.Append(3, MakeResponse(100), 100));
+}
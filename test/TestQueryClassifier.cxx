@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "QueryClassifier.hxx"
+
+#include <gtest/gtest.h>
+
+TEST(QueryClassifier, PinsSession)
+{
+	EXPECT_FALSE(QueryPinsSession("SELECT * FROM t"));
+	EXPECT_FALSE(QueryPinsSession("INSERT INTO t VALUES (1)"));
+	EXPECT_FALSE(QueryPinsSession("SELECT 'SET @x = 1' FROM t"));
+	EXPECT_FALSE(QueryPinsSession("SELECT 1 /* LOCK TABLES */"));
+
+	EXPECT_TRUE(QueryPinsSession("SET NAMES utf8mb4"));
+	EXPECT_TRUE(QueryPinsSession("set autocommit=0"));
+	EXPECT_TRUE(QueryPinsSession("USE foo"));
+	EXPECT_TRUE(QueryPinsSession("LOCK TABLES t WRITE"));
+	EXPECT_TRUE(QueryPinsSession("SELECT @x := 1"));
+	EXPECT_TRUE(QueryPinsSession("SELECT LAST_INSERT_ID()"));
+	EXPECT_TRUE(QueryPinsSession("CREATE TEMPORARY TABLE t (a INT)"));
+}
+
+TEST(QueryClassifier, PinsSessionMultiStatement)
+{
+	/* a trailing semicolon is not a statement separator */
+	EXPECT_FALSE(QueryPinsSession("SELECT * FROM t;"));
+	EXPECT_FALSE(QueryPinsSession("SELECT * FROM t ; "));
+
+	/* semicolons inside literals and comments */
+	EXPECT_FALSE(QueryPinsSession("SELECT ';' FROM t"));
+	EXPECT_FALSE(QueryPinsSession("SELECT \"a;b\" FROM t"));
+	EXPECT_FALSE(QueryPinsSession("SELECT `a;b` FROM t"));
+	EXPECT_FALSE(QueryPinsSession("SELECT 1 /* ; SET x=1 */"));
+	EXPECT_FALSE(QueryPinsSession("SELECT 1 -- ; SET x=1"));
+	EXPECT_FALSE(QueryPinsSession("SELECT 1 # ; SET x=1"));
+
+	EXPECT_TRUE(QueryPinsSession("SELECT 1; SELECT 2"));
+	EXPECT_TRUE(QueryPinsSession("SELECT 1;SET autocommit=0"));
+	EXPECT_TRUE(QueryPinsSession("UPDATE t SET a=1; SELECT 1;"));
+}
+
+TEST(QueryClassifier, ChangesDatabase)
+{
+	EXPECT_FALSE(QueryChangesDatabase("SELECT * FROM t"));
+	EXPECT_FALSE(QueryChangesDatabase("SELECT 'USE foo'"));
+	EXPECT_FALSE(QueryChangesDatabase("SELECT * FROM user"));
+
+	EXPECT_TRUE(QueryChangesDatabase("USE foo"));
+	EXPECT_TRUE(QueryChangesDatabase("use `foo`"));
+	EXPECT_TRUE(QueryChangesDatabase("SELECT 1; USE foo"));
+	EXPECT_TRUE(QueryChangesDatabase("SELECT 1;use foo;"));
+	EXPECT_TRUE(QueryChangesDatabase("/* comment */ USE foo"));
+	EXPECT_TRUE(QueryChangesDatabase("/*!32312 USE foo*/"));
+}
+
+TEST(QueryClassifier, ChangesDatabaseIndexHint)
+{
+	EXPECT_FALSE(QueryChangesDatabase("SELECT * FROM t USE INDEX (i)"));
+	EXPECT_FALSE(QueryChangesDatabase("SELECT * FROM t use index (i) WHERE a=1"));
+	EXPECT_FALSE(QueryChangesDatabase("SELECT * FROM t FORCE INDEX (i)"));
+	EXPECT_FALSE(QueryChangesDatabase("SELECT * FROM t IGNORE INDEX (i)"));
+	EXPECT_FALSE(QueryChangesDatabase("UPDATE t USE INDEX (i) SET a=1"));
+	EXPECT_FALSE(QueryChangesDatabase("SELECT * FROM t USE INDEX (i);"));
+
+	EXPECT_TRUE(QueryChangesDatabase("SELECT * FROM t USE INDEX (i); USE foo"));
+}
+
+TEST(QueryClassifier, Cacheable)
+{
+	EXPECT_TRUE(QueryIsCacheable("SELECT * FROM t"));
+	EXPECT_TRUE(QueryIsCacheable("select a, b from t where c = 'now()'"));
+	EXPECT_TRUE(QueryIsCacheable("SELECT USER(), DATABASE()"));
+
+	EXPECT_FALSE(QueryIsCacheable("INSERT INTO t VALUES (1)"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT NOW()"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT RAND()"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT * FROM t FOR UPDATE"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT * FROM t LOCK IN SHARE MODE"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT a INTO @x FROM t"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT @@version"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT SQL_NO_CACHE * FROM t"));
+}
+
+TEST(QueryClassifier, CacheableMultiStatement)
+{
+	EXPECT_TRUE(QueryIsCacheable("SELECT * FROM t;"));
+	EXPECT_TRUE(QueryIsCacheable("SELECT ';' FROM t"));
+	EXPECT_TRUE(QueryIsCacheable("SELECT * FROM t /* ; DELETE FROM t */"));
+
+	EXPECT_FALSE(QueryIsCacheable("SELECT * FROM t; DELETE FROM t"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT 1;SELECT 2"));
+	EXPECT_FALSE(QueryIsCacheable("SELECT 1; SELECT 2;"));
+}
+
+TEST(QueryClassifier, ReadOnly)
+{
+	EXPECT_TRUE(QueryIsReadOnly("SELECT * FROM t"));
+	EXPECT_TRUE(QueryIsReadOnly("SELECT NOW()"));
+	EXPECT_TRUE(QueryIsReadOnly("  select count(*) from t"));
+
+	EXPECT_FALSE(QueryIsReadOnly("UPDATE t SET a=1"));
+	EXPECT_FALSE(QueryIsReadOnly("SELECT * FROM t FOR UPDATE"));
+	EXPECT_FALSE(QueryIsReadOnly("SELECT a INTO OUTFILE '/tmp/x' FROM t"));
+	EXPECT_FALSE(QueryIsReadOnly("SELECT GET_LOCK('x', 1)"));
+	EXPECT_FALSE(QueryIsReadOnly("SELECT LAST_INSERT_ID()"));
+	EXPECT_FALSE(QueryIsReadOnly("SELECT @x"));
+
+	/* writes to other databases */
+	EXPECT_FALSE(QueryIsReadOnly("UPDATE other.t SET a=1"));
+	EXPECT_FALSE(QueryIsReadOnly("INSERT INTO `other`.`t` VALUES (1)"));
+
+	/* prepared statements */
+	EXPECT_TRUE(QueryIsReadOnly("SELECT * FROM t WHERE a=?"));
+	EXPECT_FALSE(QueryIsReadOnly("DELETE FROM t WHERE a=?"));
+}
+
+TEST(QueryClassifier, ReadOnlyMultiStatement)
+{
+	EXPECT_TRUE(QueryIsReadOnly("SELECT * FROM t;"));
+	EXPECT_TRUE(QueryIsReadOnly("SELECT 'a;b' FROM t -- ; UPDATE t"));
+
+	EXPECT_FALSE(QueryIsReadOnly("SELECT 1; UPDATE t SET a=1"));
+	EXPECT_FALSE(QueryIsReadOnly("select 1;insert into t values (1)"));
+	EXPECT_FALSE(QueryIsReadOnly("SELECT 1; SELECT 2"));
+
+	/* a write after switching to another database */
+	EXPECT_FALSE(QueryIsReadOnly("USE other; UPDATE t SET a=1"));
+	EXPECT_FALSE(QueryIsReadOnly("USE other"));
+}
+
+TEST(QueryClassifier, Normalize)
+{
+	EXPECT_EQ(NormalizeQuery("SELECT  *\n FROM\tt "), "SELECT * FROM t");
+	EXPECT_EQ(NormalizeQuery("  SELECT 'a  b'"), "SELECT 'a  b'");
+	EXPECT_EQ(NormalizeQuery("SELECT 1"), NormalizeQuery("SELECT\t1\n"));
+}
+
+TEST(QueryClassifier, Classify)
+{
+	auto c = ClassifyQuery("SELECT * FROM t USE INDEX (i)");
+	EXPECT_FALSE(c.pins_session);
+	EXPECT_FALSE(c.changes_database);
+	EXPECT_TRUE(c.cacheable);
+	EXPECT_TRUE(c.read_only);
+
+	c = ClassifyQuery("SELECT NOW()");
+	EXPECT_FALSE(c.pins_session);
+	EXPECT_FALSE(c.cacheable);
+	EXPECT_TRUE(c.read_only);
+
+	c = ClassifyQuery("SELECT LAST_INSERT_ID()");
+	EXPECT_TRUE(c.pins_session);
+	EXPECT_FALSE(c.cacheable);
+	EXPECT_FALSE(c.read_only);
+
+	/* everything after the separator is still inspected */
+	c = ClassifyQuery("SELECT 1; USE foo");
+	EXPECT_TRUE(c.pins_session);
+	EXPECT_TRUE(c.changes_database);
+	EXPECT_FALSE(c.cacheable);
+	EXPECT_FALSE(c.read_only);
+
+	c = QueryClassification::Unknown();
+	EXPECT_TRUE(c.pins_session);
+	EXPECT_TRUE(c.changes_database);
+	EXPECT_FALSE(c.cacheable);
+	EXPECT_FALSE(c.read_only);
+}
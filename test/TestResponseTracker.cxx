@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "MysqlResponseTracker.hxx"
+#include "MysqlDeserializer.hxx" // for MalformedPacket
+#include "MysqlProtocol.hxx"
+
+#include <gtest/gtest.h>
+
+#include <initializer_list>
+#include <vector>
+
+using namespace Mysql;
+
+static constexpr uint_least32_t CAPABILITIES = CLIENT_PROTOCOL_41;
+static constexpr uint_least32_t CAPABILITIES_DEPRECATE_EOF =
+	CLIENT_PROTOCOL_41|CLIENT_DEPRECATE_EOF;
+
+static std::vector<std::byte>
+MakePayload(std::initializer_list<unsigned> l) noexcept
+{
+	std::vector<std::byte> result;
+	for (unsigned i : l)
+		result.push_back(static_cast<std::byte>(i));
+	return result;
+}
+
+static std::vector<std::byte>
+MakeOk(unsigned status_flags=SERVER_STATUS_AUTOCOMMIT) noexcept
+{
+	return MakePayload({
+		0x00, // header
+		0x00, // affected_rows
+		0x00, // last_insert_id
+		status_flags & 0xffU, status_flags >> 8,
+		0x00, 0x00, // warnings
+	});
+}
+
+static std::vector<std::byte>
+MakeEof(unsigned status_flags=SERVER_STATUS_AUTOCOMMIT) noexcept
+{
+	return MakePayload({
+		0xfe, // header
+		0x00, 0x00, // warnings
+		status_flags & 0xffU, status_flags >> 8,
+	});
+}
+
+/**
+ * The OK packet which replaces the EOF packet at the end of a
+ * resultset with #CLIENT_DEPRECATE_EOF.
+ */
+static std::vector<std::byte>
+MakeOkEof(unsigned status_flags=SERVER_STATUS_AUTOCOMMIT) noexcept
+{
+	return MakePayload({
+		0xfe, // header
+		0x00, // affected_rows
+		0x00, // last_insert_id
+		status_flags & 0xffU, status_flags >> 8,
+		0x00, 0x00, // warnings
+	});
+}
+
+static std::vector<std::byte>
+MakeErr() noexcept
+{
+	return MakePayload({
+		0xff, // header
+		0x28, 0x04, // error_code
+		'#', '4', '2', '0', '0', '0',
+		'x',
+	});
+}
+
+static std::vector<std::byte>
+MakeColumnCount(unsigned n) noexcept
+{
+	return MakePayload({n});
+}
+
+static std::vector<std::byte>
+MakeColumnDefinition() noexcept
+{
+	/* the tracker does not parse column definitions */
+	return MakePayload({0x03, 'd', 'e', 'f'});
+}
+
+static std::vector<std::byte>
+MakeRow() noexcept
+{
+	return MakePayload({0x01, '1'});
+}
+
+static std::vector<std::byte>
+MakePrepareOk(unsigned num_columns, unsigned num_params) noexcept
+{
+	return MakePayload({
+		0x00, // status
+		0x01, 0x00, 0x00, 0x00, // statement_id
+		num_columns & 0xffU, num_columns >> 8,
+		num_params & 0xffU, num_params >> 8,
+		0x00, // reserved_1
+		0x00, 0x00, // warnings
+	});
+}
+
+TEST(ResponseTracker, Ok)
+{
+	ResponseTracker t;
+	EXPECT_TRUE(t.IsIdle());
+
+	t.OnCommand(Command::QUERY);
+	EXPECT_FALSE(t.IsIdle());
+
+	EXPECT_TRUE(t.OnResponse(MakeOk(SERVER_STATUS_IN_TRANS), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsIdle());
+	EXPECT_EQ(t.GetStatusFlags(), SERVER_STATUS_IN_TRANS);
+}
+
+TEST(ResponseTracker, Err)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+	EXPECT_TRUE(t.OnResponse(MakeErr(), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, Resultset)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+
+	EXPECT_FALSE(t.OnResponse(MakeColumnCount(2), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeRow(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeRow(), true, CAPABILITIES));
+	EXPECT_FALSE(t.IsIdle());
+	EXPECT_TRUE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, ResultsetDeprecateEof)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+
+	EXPECT_FALSE(t.OnResponse(MakeColumnCount(1), true, CAPABILITIES_DEPRECATE_EOF));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES_DEPRECATE_EOF));
+	EXPECT_FALSE(t.OnResponse(MakeRow(), true, CAPABILITIES_DEPRECATE_EOF));
+	EXPECT_TRUE(t.OnResponse(MakeOkEof(), true, CAPABILITIES_DEPRECATE_EOF));
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, ResultsetError)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+
+	EXPECT_FALSE(t.OnResponse(MakeColumnCount(1), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeRow(), true, CAPABILITIES));
+	EXPECT_TRUE(t.OnResponse(MakeErr(), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, LargeRow)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+
+	EXPECT_FALSE(t.OnResponse(MakeColumnCount(1), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+
+	/* the beginning of a large row which starts with 0xfe (a
+	   length encoded integer with 8 bytes) must not be mistaken
+	   for the terminator */
+	EXPECT_FALSE(t.OnResponse(MakeEof(), false, CAPABILITIES));
+	EXPECT_FALSE(t.IsIdle());
+
+	EXPECT_TRUE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, MultipleResultsets)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+
+	EXPECT_FALSE(t.OnResponse(MakeColumnCount(1), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeRow(), true, CAPABILITIES));
+
+	/* another resultset follows */
+	EXPECT_FALSE(t.OnResponse(MakeEof(SERVER_MORE_RESULTS_EXIST), true, CAPABILITIES));
+	EXPECT_FALSE(t.IsIdle());
+	EXPECT_NE(t.GetStatusFlags() & SERVER_MORE_RESULTS_EXIST, 0);
+
+	EXPECT_FALSE(t.OnResponse(MakeColumnCount(1), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeRow(), true, CAPABILITIES));
+
+	/* the OK packet of a multi-statement query ends the
+	   response */
+	EXPECT_FALSE(t.OnResponse(MakeEof(SERVER_MORE_RESULTS_EXIST), true, CAPABILITIES));
+	EXPECT_TRUE(t.OnResponse(MakeOk(), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsIdle());
+	EXPECT_EQ(t.GetStatusFlags() & SERVER_MORE_RESULTS_EXIST, 0);
+}
+
+TEST(ResponseTracker, Pipelining)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+	t.OnCommand(Command::PING);
+	t.OnCommand(Command::QUERY);
+
+	EXPECT_FALSE(t.OnResponse(MakeColumnCount(1), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_TRUE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_FALSE(t.IsIdle());
+
+	EXPECT_TRUE(t.OnResponse(MakeOk(), true, CAPABILITIES));
+	EXPECT_FALSE(t.IsIdle());
+
+	EXPECT_TRUE(t.OnResponse(MakeErr(), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, Prepare)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::STMT_PREPARE);
+
+	EXPECT_FALSE(t.OnResponse(MakePrepareOk(1, 2), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_FALSE(t.OnResponse(MakeColumnDefinition(), true, CAPABILITIES));
+	EXPECT_TRUE(t.OnResponse(MakeEof(), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, PreparePipelined)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+	t.OnCommand(Command::STMT_PREPARE);
+
+	EXPECT_TRUE(t.OnResponse(MakeOk(), true, CAPABILITIES_DEPRECATE_EOF));
+	EXPECT_FALSE(t.IsIdle());
+
+	/* the second response must be parsed as a COM_STMT_PREPARE
+	   response */
+	EXPECT_TRUE(t.OnResponse(MakePrepareOk(0, 0), true, CAPABILITIES_DEPRECATE_EOF));
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, NoResponse)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::STMT_SEND_LONG_DATA);
+	t.OnCommand(Command::STMT_CLOSE);
+	EXPECT_TRUE(t.IsIdle());
+}
+
+TEST(ResponseTracker, Unknown)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::CHANGE_USER);
+	EXPECT_TRUE(t.IsUnknown());
+
+	/* never left again */
+	t.OnCommand(Command::QUERY);
+	EXPECT_FALSE(t.OnResponse(MakeOk(), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsUnknown());
+}
+
+TEST(ResponseTracker, LocalInfile)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+	EXPECT_FALSE(t.OnResponse(MakePayload({0xfb, 'x'}), true, CAPABILITIES));
+	EXPECT_TRUE(t.IsUnknown());
+}
+
+TEST(ResponseTracker, Malformed)
+{
+	ResponseTracker t;
+	t.OnCommand(Command::QUERY);
+	EXPECT_THROW(t.OnResponse(MakeColumnCount(0), true, CAPABILITIES),
+		     MalformedPacket);
+}